@@ -0,0 +1,332 @@
+/*
+ * Builder of the synthetic pool bench-pool and test-pool walk.
+ */
+
+#include "bench_build.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/dmu.h>
+#include <sys/dmu_objset.h>
+#include <sys/dsl_prop.h>
+#include <sys/fs/zfs.h>
+#include <sys/spa.h>
+#include <sys/txg.h>
+#include <sys/zfs_context.h>
+#include <sys/zio.h>
+
+#ifndef ZIO_COMPLEVEL_ZSTD
+#define ZIO_COMPLEVEL_ZSTD(level)	\
+	(((uint64_t)(level) << SPA_COMPRESSBITS) | ZIO_COMPRESS_ZSTD)
+#endif
+
+/* Owner of every object in a "userused" dataset. */
+#define BENCH_UID	1000
+#define BENCH_GID	1000
+
+static uint64_t
+bench_rand(uint64_t *state)
+{
+	/* splitmix64 */
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Fill a block whose first compressible% is text-like and whose remainder is
+ * random, so each algorithm gets a predictable share of savings.
+ */
+static void
+bench_fill(char *buf, uint64_t len, int compressible, uint64_t *state)
+{
+	static const char words[] = "the quick brown fox jumps over the lazy "
+	    "dog while the zfs compression histogram counts every block ";
+	uint64_t text = len * (uint64_t)compressible / 100;
+	uint64_t off;
+
+	for (off = 0; off < text; off++)
+		buf[off] = words[(off + bench_rand(state) % 4) %
+		    (sizeof(words) - 1)];
+	for (; off + sizeof(uint64_t) <= len; off += sizeof(uint64_t)) {
+		uint64_t r = bench_rand(state);
+
+		memcpy(buf + off, &r, sizeof(r));
+	}
+	for (; off < len; off++)
+		buf[off] = (char)bench_rand(state);
+}
+
+int
+bench_parse_algs(struct bench_config *cfg, const char *arg)
+{
+	char buf[256];
+	char *tok, *save = NULL;
+
+	if (strlen(arg) >= sizeof(buf))
+		return (-1);
+	strcpy(buf, arg);
+
+	cfg->nalgs = 0;
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+	    tok = strtok_r(NULL, ",", &save)) {
+		uint64_t value = ZIO_COMPRESS_FUNCTIONS;
+
+		if (cfg->nalgs == BENCH_MAX_ALGS ||
+		    strlen(tok) >= sizeof(cfg->alg_names[0]))
+			return (-1);
+
+		if (strncmp(tok, "zstd-", 5) == 0) {
+			char *end;
+			long level = strtol(tok + 5, &end, 10);
+
+			if (*end != '\0' || level < 1 || level > 19)
+				return (-1);
+			value = ZIO_COMPLEVEL_ZSTD(level);
+		} else {
+			for (int i = ZIO_COMPRESS_OFF;
+			    i < ZIO_COMPRESS_FUNCTIONS; i++) {
+				if (strcmp(tok, comphist_comp_name(i)) == 0)
+					value = (uint64_t)i;
+			}
+			if (value == ZIO_COMPRESS_FUNCTIONS ||
+			    value == ZIO_COMPRESS_EMPTY)
+				return (-1);
+		}
+
+		cfg->algs[cfg->nalgs] = value;
+		strcpy(cfg->alg_names[cfg->nalgs], tok);
+		cfg->nalgs++;
+	}
+
+	return (cfg->nalgs == 0 ? -1 : 0);
+}
+
+int
+bench_parse_sizes(struct bench_config *cfg, const char *arg)
+{
+	const char *p = arg;
+
+	cfg->nrecordsizes = 0;
+	while (*p != '\0') {
+		char *end;
+		uint64_t size = strtoull(p, &end, 10);
+
+		if (end == p)
+			return (-1);
+		if (*end == 'K' || *end == 'k') {
+			size <<= 10;
+			end++;
+		} else if (*end == 'M' || *end == 'm') {
+			size <<= 20;
+			end++;
+		}
+		if (size < SPA_MINBLOCKSIZE || size > SPA_MAXBLOCKSIZE ||
+		    !ISP2(size) || cfg->nrecordsizes == BENCH_MAX_RECORDSIZES)
+			return (-1);
+		cfg->recordsizes[cfg->nrecordsizes++] = size;
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return (-1);
+		p = end;
+	}
+
+	return (cfg->nrecordsizes == 0 ? -1 : 0);
+}
+
+void
+bench_name(struct bench_config *cfg, const char *prefix)
+{
+	snprintf(cfg->pool, sizeof(cfg->pool), "%s_%ld", prefix,
+	    (long)getpid());
+	snprintf(cfg->vdev_path, sizeof(cfg->vdev_path), "%s/%s.vdev",
+	    cfg->dir, cfg->pool);
+	snprintf(cfg->cache_path, sizeof(cfg->cache_path), "%s/%s.cache",
+	    cfg->dir, cfg->pool);
+	spa_config_path = cfg->cache_path;
+}
+
+/*
+ * User accounting callback for "userused" datasets.  Their objects have no
+ * znode, so every one is charged to the same user and group; that is
+ * enough for the accounting objects to get blocks.
+ */
+static int
+bench_file_info(dmu_object_type_t bonustype, const void *data,
+    struct zfs_file_info *zfi)
+{
+	(void)bonustype;
+	(void)data;
+
+	zfi->zfi_user = BENCH_UID;
+	zfi->zfi_group = BENCH_GID;
+	zfi->zfi_project = 0;
+	zfi->zfi_generation = 0;
+	return (0);
+}
+
+static nvlist_t *
+bench_vdev_root(const char *path)
+{
+	nvlist_t *file = fnvlist_alloc();
+	nvlist_t *root = fnvlist_alloc();
+
+	fnvlist_add_string(file, ZPOOL_CONFIG_TYPE, VDEV_TYPE_FILE);
+	fnvlist_add_string(file, ZPOOL_CONFIG_PATH, path);
+	fnvlist_add_uint64(file, ZPOOL_CONFIG_IS_LOG, 0);
+
+	fnvlist_add_string(root, ZPOOL_CONFIG_TYPE, VDEV_TYPE_ROOT);
+	fnvlist_add_nvlist_array(root, ZPOOL_CONFIG_CHILDREN,
+	    (const nvlist_t **)&file, 1);
+	fnvlist_free(file);
+
+	return (root);
+}
+
+/*
+ * Write (or rewrite) every object in a dataset.  On the first generation the
+ * objects are allocated; later generations rewrite the first block of every
+ * object so consecutive snapshots share most of their blocks.
+ */
+static int
+bench_fill_dataset(const struct bench_config *cfg, objset_t *os,
+    uint64_t *objs, int generation, uint64_t *state)
+{
+	uint64_t maxrs = 0;
+	char *buf;
+	int err = 0;
+
+	for (int i = 0; i < cfg->nrecordsizes; i++)
+		maxrs = MAX(maxrs, cfg->recordsizes[i]);
+	buf = malloc(maxrs * cfg->blocks);
+	if (buf == NULL)
+		return (ENOMEM);
+
+	for (uint64_t o = 0; o < cfg->objects && err == 0; o++) {
+		uint64_t rs = cfg->recordsizes[o % cfg->nrecordsizes];
+		uint64_t len = generation == 0 ? rs * cfg->blocks : rs;
+		dmu_tx_t *tx = dmu_tx_create(os);
+
+		for (uint64_t off = 0; off < len; off += rs)
+			bench_fill(buf + off, rs, cfg->compressible, state);
+		if (generation == 0) {
+			dmu_tx_hold_bonus(tx, DMU_NEW_OBJECT);
+			dmu_tx_hold_write(tx, DMU_NEW_OBJECT, 0, len);
+		} else {
+			dmu_tx_hold_write(tx, objs[o], 0, len);
+		}
+		err = dmu_tx_assign(tx, TXG_WAIT);
+		if (err != 0) {
+			dmu_tx_abort(tx);
+			break;
+		}
+
+		if (generation == 0) {
+			/* User accounting reads the owner from the bonus. */
+			objs[o] = cfg->userused ?
+			    dmu_object_alloc(os, DMU_OT_UINT64_OTHER, 0,
+			    DMU_OT_UINT64_OTHER, sizeof(uint64_t), tx) :
+			    dmu_object_alloc(os, DMU_OT_UINT64_OTHER, 0,
+			    DMU_OT_NONE, 0, tx);
+			err = dmu_object_set_blocksize(os, objs[o], rs, 0, tx);
+		}
+		if (err == 0)
+			dmu_write(os, objs[o], 0, len, buf, tx);
+		dmu_tx_commit(tx);
+	}
+
+	free(buf);
+	return (err);
+}
+
+static int
+bench_build_dataset(const struct bench_config *cfg, int a)
+{
+	char name[ZFS_MAX_DATASET_NAME_LEN];
+	dmu_objset_type_t type = cfg->userused ? DMU_OST_ZFS : DMU_OST_OTHER;
+	uint64_t state = cfg->seed + (uint64_t)a;
+	uint64_t *objs;
+	objset_t *os;
+	int err;
+
+	snprintf(name, sizeof(name), "%s/%s", cfg->pool, cfg->alg_names[a]);
+	err = dmu_objset_create(name, type, 0, NULL, NULL, NULL);
+	if (err == 0)
+		err = dsl_prop_set_int(name, "compression", ZPROP_SRC_LOCAL,
+		    cfg->algs[a]);
+	if (err != 0)
+		return (err);
+
+	objs = calloc(cfg->objects, sizeof(*objs));
+	if (objs == NULL)
+		return (ENOMEM);
+
+	for (int g = 0; g <= cfg->snapshots && err == 0; g++) {
+		char snap[32];
+
+		err = dmu_objset_own(name, type, B_FALSE, B_TRUE, FTAG, &os);
+		if (err != 0)
+			break;
+		err = bench_fill_dataset(cfg, os, objs, g, &state);
+		txg_wait_synced(dmu_objset_pool(os), 0);
+		dmu_objset_disown(os, B_TRUE, FTAG);
+
+		/* The last generation stays live. */
+		if (err == 0 && g < cfg->snapshots) {
+			snprintf(snap, sizeof(snap), "gen%d", g);
+			err = dmu_objset_snapshot_one(name, snap);
+		}
+	}
+
+	free(objs);
+	return (err);
+}
+
+int
+bench_build(const struct bench_config *cfg)
+{
+	nvlist_t *root;
+	int fd, err;
+
+	fd = open(cfg->vdev_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return (errno);
+	err = ftruncate(fd, (off_t)cfg->vdev_size) != 0 ? errno : 0;
+	(void)close(fd);
+	if (err != 0)
+		return (err);
+
+	kernel_init(SPA_MODE_READ | SPA_MODE_WRITE);
+	if (cfg->userused)
+		dmu_objset_register_type(DMU_OST_ZFS, bench_file_info);
+	root = bench_vdev_root(cfg->vdev_path);
+	err = spa_create(cfg->pool, root, NULL, NULL, NULL);
+	fnvlist_free(root);
+
+	for (int a = 0; a < cfg->nalgs && err == 0; a++)
+		err = bench_build_dataset(cfg, a);
+
+	kernel_fini();
+	return (err);
+}
+
+void
+bench_destroy(const struct bench_config *cfg)
+{
+	kernel_init(SPA_MODE_READ | SPA_MODE_WRITE);
+	(void)spa_destroy(cfg->pool);
+	kernel_fini();
+
+	(void)unlink(cfg->vdev_path);
+	(void)unlink(cfg->cache_path);
+}
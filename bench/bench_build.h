@@ -0,0 +1,57 @@
+#ifndef COMPHIST_BENCH_BUILD_H
+#define COMPHIST_BENCH_BUILD_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A synthetic pool on a sparse file, shared by bench-pool and test-pool.
+ *
+ * The pool has one dataset per compression algorithm, named after it, each
+ * filled with objects of the configured record sizes and with a chain of
+ * snapshots "gen0", "gen1", ... taken between rewrites of part of the data.
+ * Data is generated from the seed, so the same configuration builds the
+ * same pool.  With "userused" the datasets are ZPL-type objsets whose
+ * objects are all charged to one user, so each has user and group
+ * accounting objects to walk; otherwise they are plain DMU objsets.
+ */
+
+#define BENCH_MAX_ALGS		16
+#define BENCH_MAX_RECORDSIZES	8
+
+struct bench_config {
+	const char *dir;
+	uint64_t vdev_size;
+	int nalgs;
+	uint64_t algs[BENCH_MAX_ALGS];
+	char alg_names[BENCH_MAX_ALGS][16];
+	int nrecordsizes;
+	uint64_t recordsizes[BENCH_MAX_RECORDSIZES];
+	uint64_t objects;
+	uint64_t blocks;
+	int snapshots;
+	int compressible;
+	int iterations;
+	uint64_t seed;
+	bool userused;
+	bool keep;
+	char pool[64];
+	char vdev_path[PATH_MAX];
+	char cache_path[PATH_MAX];
+};
+
+int bench_parse_algs(struct bench_config *cfg, const char *arg);
+int bench_parse_sizes(struct bench_config *cfg, const char *arg);
+
+/*
+ * Name the pool "<prefix>_<pid>" and place its vdev and cache file in
+ * cfg->dir.  Both the build and later walks find the pool through the
+ * cache file, so this also points spa_config_path at it.
+ */
+void bench_name(struct bench_config *cfg, const char *prefix);
+
+int bench_build(const struct bench_config *cfg);
+void bench_destroy(const struct bench_config *cfg);
+
+#endif
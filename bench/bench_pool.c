@@ -0,0 +1,274 @@
+/*
+ * Scan benchmark on a synthetic file-backed pool.
+ *
+ * Builds a pool on a sparse file with one dataset per compression
+ * algorithm, fills each with objects of the configured record sizes and
+ * takes a chain of snapshots, rewriting part of the data between them.  The
+ * pool is then scanned with comphist_walk() and comphist_walk_datasets() and
+ * each run is reported as one NDJSON line on stdout:
+ *
+ *	{"bench":"walk","target":...,"run":N,"seconds":...,
+ *	 "blocks":...,"blocks_per_second":...,"max_rss_kb":...}
+ *
+ * Data is generated from --seed, so the same options build the same pool.
+ * max_rss_kb is the process peak so far (getrusage), which includes the
+ * pool build; compare it across runs of the same configuration only.
+ */
+
+#include "bench_build.h"
+#include "output.h"
+#include "stats.h"
+#include "walker.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+bench_parse_u64(const char *arg, uint64_t max, uint64_t *val)
+{
+	char *end = NULL;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || v < 1 || v > max)
+		return (-1);
+
+	*val = v;
+	return (0);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static long
+bench_max_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return (0);
+	return (ru.ru_maxrss);
+}
+
+static void
+bench_report(struct comphist_out *out, const char *bench,
+    const struct bench_config *cfg, int run, double secs, uint64_t blocks)
+{
+	comphist_out_printf(out, "{\"bench\":\"%s\",\"target\":", bench);
+	comphist_out_json_string(out, cfg->pool);
+	comphist_out_printf(out, ",\"run\":%d,\"seconds\":%.6f,\"blocks\":%"
+	    PRIu64 ",\"blocks_per_second\":%.0f,\"max_rss_kb\":%ld}\n", run,
+	    secs, blocks, secs > 0.0 ? (double)blocks / secs : 0.0,
+	    bench_max_rss());
+	(void)comphist_out_flush(out);
+}
+
+static int
+bench_count_cb(const char *dsname, const struct comphist_stats *stats,
+    void *arg)
+{
+	uint64_t *blocks = arg;
+
+	(void)dsname;
+	*blocks += stats->total_blocks;
+	return (0);
+}
+
+static int
+bench_run(const struct bench_config *cfg, struct comphist_out *out)
+{
+	struct comphist_options opts = {
+		.allow_live = true,
+	};
+
+	for (int run = 0; run < cfg->iterations; run++) {
+		struct comphist_stats stats;
+		uint64_t blocks = 0;
+		double start;
+
+		comphist_stats_init(&stats);
+		start = bench_now();
+		if (comphist_walk(cfg->pool, &opts, &stats) != 0)
+			return (errno);
+		bench_report(out, "walk", cfg, run, bench_now() - start,
+		    stats.total_blocks);
+
+		start = bench_now();
+		if (comphist_walk_datasets(cfg->pool, &opts, bench_count_cb,
+		    &blocks) != 0)
+			return (errno);
+		bench_report(out, "walk_datasets", cfg, run,
+		    bench_now() - start, blocks);
+	}
+
+	return (0);
+}
+
+static void
+usage(FILE *out, const char *prog)
+{
+	fprintf(out, "Usage: %s [options]\n", prog);
+	fprintf(out, "\n");
+	fprintf(out, "  --dir=DIR          vdev and cache file location "
+	    "(default /tmp)\n");
+	fprintf(out, "  --size=MB          sparse vdev size (default 4096)\n");
+	fprintf(out, "  --algorithms=ALGS  one dataset per algorithm "
+	    "(default off,lz4,gzip-6,zstd-3)\n");
+	fprintf(out, "  --recordsizes=SZ   object block sizes, used in turn "
+	    "(default 4K,16K,128K)\n");
+	fprintf(out, "  --objects=N        objects per dataset "
+	    "(default 256)\n");
+	fprintf(out, "  --blocks=N         blocks per object (default 8)\n");
+	fprintf(out, "  --snapshots=N      snapshots per dataset "
+	    "(default 4)\n");
+	fprintf(out, "  --compressible=PCT text share of each block "
+	    "(default 50)\n");
+	fprintf(out, "  --iterations=N     timed runs of each walk "
+	    "(default 3)\n");
+	fprintf(out, "  --seed=N           data generator seed (default 1)\n");
+	fprintf(out, "  --keep             leave the pool and its files in "
+	    "place\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.dir = "/tmp",
+		.vdev_size = 4096ULL << 20,
+		.objects = 256,
+		.blocks = 8,
+		.snapshots = 4,
+		.compressible = 50,
+		.iterations = 3,
+		.seed = 1,
+	};
+	static const struct option long_opts[] = {
+		{"dir", required_argument, NULL, 'd'},
+		{"size", required_argument, NULL, 's'},
+		{"algorithms", required_argument, NULL, 'a'},
+		{"recordsizes", required_argument, NULL, 'r'},
+		{"objects", required_argument, NULL, 'o'},
+		{"blocks", required_argument, NULL, 'b'},
+		{"snapshots", required_argument, NULL, 'n'},
+		{"compressible", required_argument, NULL, 'c'},
+		{"iterations", required_argument, NULL, 'i'},
+		{"seed", required_argument, NULL, 'S'},
+		{"keep", no_argument, NULL, 'k'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	struct comphist_out *out;
+	uint64_t val;
+	int c, err;
+	int long_index = 0;
+
+	(void)bench_parse_algs(&cfg, "off,lz4,gzip-6,zstd-3");
+	(void)bench_parse_sizes(&cfg, "4K,16K,128K");
+
+	while ((c = getopt_long(argc, argv, "h", long_opts,
+	    &long_index)) != -1) {
+		switch (c) {
+		case 'd':
+			cfg.dir = optarg;
+			break;
+		case 's':
+			if (bench_parse_u64(optarg, 1 << 20, &val) != 0)
+				goto bad;
+			cfg.vdev_size = val << 20;
+			break;
+		case 'a':
+			if (bench_parse_algs(&cfg, optarg) != 0)
+				goto bad;
+			break;
+		case 'r':
+			if (bench_parse_sizes(&cfg, optarg) != 0)
+				goto bad;
+			break;
+		case 'o':
+			if (bench_parse_u64(optarg, 1 << 24, &cfg.objects) != 0)
+				goto bad;
+			break;
+		case 'b':
+			if (bench_parse_u64(optarg, 1 << 16, &cfg.blocks) != 0)
+				goto bad;
+			break;
+		case 'n':
+			if (bench_parse_u64(optarg, 1024, &val) != 0)
+				goto bad;
+			cfg.snapshots = (int)val;
+			break;
+		case 'c':
+			if (bench_parse_u64(optarg, 100, &val) != 0)
+				goto bad;
+			cfg.compressible = (int)val;
+			break;
+		case 'i':
+			if (bench_parse_u64(optarg, 1000, &val) != 0)
+				goto bad;
+			cfg.iterations = (int)val;
+			break;
+		case 'S':
+			if (bench_parse_u64(optarg, UINT64_MAX, &cfg.seed) != 0)
+				goto bad;
+			break;
+		case 'k':
+			cfg.keep = true;
+			break;
+		case 'h':
+			usage(stdout, argv[0]);
+			return (0);
+		default:
+			usage(stderr, argv[0]);
+			return (2);
+		}
+	}
+
+	bench_name(&cfg, "comphist_bench");
+
+	out = comphist_out_open(STDOUT_FILENO);
+	if (out == NULL) {
+		fprintf(stderr, "bench-pool: %s\n", strerror(ENOMEM));
+		return (1);
+	}
+
+	err = bench_build(&cfg);
+	if (err != 0) {
+		fprintf(stderr, "bench-pool: failed to build %s: %s\n",
+		    cfg.pool, strerror(err));
+	} else {
+		err = bench_run(&cfg, out);
+		if (err != 0)
+			fprintf(stderr, "bench-pool: walk failed: %s\n",
+			    strerror(err));
+	}
+
+	if (!cfg.keep)
+		bench_destroy(&cfg);
+	else
+		fprintf(stderr, "bench-pool: kept %s (cache file %s)\n",
+		    cfg.pool, cfg.cache_path);
+
+	if (comphist_out_close(out) != 0 && err == 0)
+		err = EIO;
+	return (err != 0 ? 1 : 0);
+
+bad:
+	fprintf(stderr, "bench-pool: invalid --%s: %s\n",
+	    long_opts[long_index].name, optarg);
+	return (2);
+}
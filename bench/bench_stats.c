@@ -0,0 +1,192 @@
+/*
+ * Accounting microbenchmark.
+ *
+ * Generates a deterministic stream of blocks with a pool-like mix of
+ * algorithms, sizes, object types and levels, then replays it through
+ * comphist_stats_add_block() and comphist_stats_account() and reports the
+ * cost per block as NDJSON on stdout:
+ *
+ *	{"bench":"add_block","run":N,"blocks":...,"seconds":...,
+ *	 "ns_per_block":...,"check":...}
+ *
+ * No pool is involved, so this isolates the per-block accounting cost from
+ * traversal and I/O.  "check" is the accounted physical byte total; it is
+ * the same for every run of a stream and keeps the loop from being elided.
+ */
+
+#include "output.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/dmu.h>
+
+static uint64_t
+bench_rand(uint64_t *state)
+{
+	/* splitmix64 */
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Roughly the shape of a general-purpose pool: mostly lz4 and zstd data
+ * blocks of 4K-1M, some uncompressed blocks, a few percent of metadata at
+ * higher levels and the occasional hole or embedded block.
+ */
+static void
+bench_stream(struct comphist_block *blks, size_t n, uint64_t seed)
+{
+	static const uint8_t comps[] = {
+		ZIO_COMPRESS_LZ4, ZIO_COMPRESS_LZ4, ZIO_COMPRESS_LZ4,
+		ZIO_COMPRESS_ZSTD, ZIO_COMPRESS_ZSTD, ZIO_COMPRESS_OFF,
+		ZIO_COMPRESS_GZIP_6, ZIO_COMPRESS_LZJB,
+	};
+	static const uint8_t types[] = {
+		DMU_OT_PLAIN_FILE_CONTENTS, DMU_OT_PLAIN_FILE_CONTENTS,
+		DMU_OT_PLAIN_FILE_CONTENTS, DMU_OT_DIRECTORY_CONTENTS,
+		DMU_OT_DNODE, DMU_OT_SA, DMU_OT_ZVOL, DMU_OT_OBJSET,
+	};
+	uint64_t state = seed;
+	uint64_t birth = 1;
+
+	for (size_t i = 0; i < n; i++) {
+		struct comphist_block *blk = &blks[i];
+		uint64_t r = bench_rand(&state);
+		int shift = 12 + (int)(r % 9);
+
+		memset(blk, 0, sizeof(*blk));
+		blk->comp = comps[(r >> 8) % sizeof(comps)];
+		blk->type = types[(r >> 16) % sizeof(types)];
+		if ((r >> 24) % 32 == 0)
+			blk->level = (uint8_t)(1 + (r >> 29) % 4);
+		blk->lsize = 1ULL << shift;
+		blk->psize = blk->comp == ZIO_COMPRESS_OFF ? blk->lsize :
+		    MAX(512, (blk->lsize * (1 + (r >> 32) % 8) / 8) &
+		    ~511ULL);
+		blk->asize = P2ROUNDUP(blk->psize, 4096);
+		if ((r >> 40) % 64 == 0) {
+			blk->flags = COMPHIST_BLK_HOLE;
+		} else if ((r >> 46) % 128 == 0) {
+			blk->flags = COMPHIST_BLK_EMBEDDED;
+			blk->psize = 112;
+			blk->asize = 0;
+		}
+		birth += (r >> 53) % 3;
+		blk->birth = birth;
+		blk->era = (uint8_t)MIN(birth >> 12, COMPHIST_ERAS - 1);
+	}
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static void
+bench_report(struct comphist_out *out, const char *bench, int run,
+    size_t blocks, double secs, uint64_t check)
+{
+	comphist_out_printf(out, "{\"bench\":\"%s\",\"run\":%d,\"blocks\":%zu"
+	    ",\"seconds\":%.6f,\"ns_per_block\":%.2f,\"check\":%" PRIu64
+	    "}\n", bench, run, blocks, secs,
+	    blocks == 0 ? 0.0 : secs * 1e9 / (double)blocks, check);
+	(void)comphist_out_flush(out);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{"blocks", required_argument, NULL, 'b'},
+		{"iterations", required_argument, NULL, 'i'},
+		{"seed", required_argument, NULL, 'S'},
+		{0, 0, 0, 0}
+	};
+	struct comphist_block *blks;
+	struct comphist_stats *stats;
+	struct comphist_out *out;
+	size_t n = 1 << 22;
+	int iterations = 5;
+	uint64_t seed = 1;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			n = strtoull(optarg, NULL, 10);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--blocks=N] "
+			    "[--iterations=N] [--seed=N]\n", argv[0]);
+			return (2);
+		}
+	}
+	if (n == 0 || iterations < 1) {
+		fprintf(stderr, "bench-stats: invalid block or iteration "
+		    "count\n");
+		return (2);
+	}
+
+	blks = malloc(n * sizeof(*blks));
+	stats = malloc(sizeof(*stats));
+	out = comphist_out_open(STDOUT_FILENO);
+	if (blks == NULL || stats == NULL || out == NULL) {
+		fprintf(stderr, "bench-stats: %s\n", strerror(ENOMEM));
+		return (1);
+	}
+	bench_stream(blks, n, seed);
+
+	for (int run = 0; run < iterations; run++) {
+		double start;
+
+		/* The path taken by callers that only have a blkptr. */
+		comphist_stats_init(stats);
+		start = bench_now();
+		for (size_t i = 0; i < n; i++) {
+			const struct comphist_block *blk = &blks[i];
+
+			if (blk->flags & COMPHIST_BLK_HOLE) {
+				comphist_stats_note_hole(stats);
+				continue;
+			}
+			comphist_stats_add_block(stats, blk->comp, blk->lsize,
+			    blk->psize, blk->asize,
+			    (blk->flags & COMPHIST_BLK_EMBEDDED) != 0);
+		}
+		bench_report(out, "add_block", run, n, bench_now() - start,
+		    stats->total_psize);
+
+		/* The traversal and pipeline path, with all breakdowns. */
+		comphist_stats_init(stats);
+		start = bench_now();
+		for (size_t i = 0; i < n; i++)
+			comphist_stats_account(stats, &blks[i]);
+		bench_report(out, "account", run, n, bench_now() - start,
+		    stats->total_psize);
+	}
+
+	free(stats);
+	free(blks);
+	return (comphist_out_close(out) != 0 ? 1 : 0);
+}
@@ -0,0 +1,158 @@
+#ifndef LIBCOMPHIST_H
+#define LIBCOMPHIST_H
+
+#include <stddef.h>
+
+#include "zfs-comphist.h"
+
+/*
+ * libcomphist: the zfs-comphist walker as a library.
+ *
+ * A session keeps libzpool initialized and the pools it has walked
+ * imported, so repeated walks skip the startup and import cost.  Sessions
+ * may be shared between threads and walks may run concurrently.  Calls
+ * return 0 on success and -1 with errno set on failure.
+ *
+ * The library is built with hidden visibility; only the functions declared
+ * here are exported.
+ */
+#define COMPHIST_EXPORT	__attribute__((visibility("default")))
+
+struct comphist_session;
+struct comphist_stats;
+
+/* A nonzero return stops the walk, which fails with that errno value. */
+typedef int (*comphist_dataset_cb_t)(const char *dsname,
+    const struct comphist_stats *stats, void *arg);
+
+COMPHIST_EXPORT int comphist_session_open(struct comphist_session **sessp);
+COMPHIST_EXPORT void comphist_session_close(struct comphist_session *sess);
+
+/*
+ * Forget every imported pool; the next walk sees the pool's current state.
+ * Waits for walks in progress to finish.
+ */
+COMPHIST_EXPORT int comphist_session_refresh(struct comphist_session *sess);
+
+/*
+ * Identity of a dataset's current contents: a snapshot's never changes, a
+ * live dataset's changes with every txg that writes to it (as seen since
+ * the last refresh).
+ */
+struct comphist_dataset_info {
+	uint64_t guid;
+	uint64_t txg;
+	bool snapshot;
+};
+
+COMPHIST_EXPORT int comphist_session_dataset_info(
+    struct comphist_session *sess, const char *dsname,
+    struct comphist_dataset_info *info);
+
+COMPHIST_EXPORT int comphist_session_walk(struct comphist_session *sess,
+    const char *target, const struct comphist_options *opts,
+    struct comphist_stats *stats);
+COMPHIST_EXPORT int comphist_session_walk_datasets(
+    struct comphist_session *sess, const char *target,
+    const struct comphist_options *opts, comphist_dataset_cb_t cb, void *arg);
+
+/* Single walks in a session of their own. */
+COMPHIST_EXPORT int comphist_walk(const char *target,
+    const struct comphist_options *opts, struct comphist_stats *stats);
+COMPHIST_EXPORT int comphist_walk_datasets(const char *target,
+    const struct comphist_options *opts, comphist_dataset_cb_t cb, void *arg);
+
+/*
+ * Results.  struct comphist_stats is opaque: walks add to one allocated
+ * with comphist_stats_alloc().  The compression table is read with
+ * comphist_stats_get(), one row per algorithm index below
+ * comphist_stats_algorithms() or COMPHIST_ALL for the total row; the
+ * breakdowns selected in the options are available through a report
+ * writer, in any output format.
+ */
+#define COMPHIST_ALL	(-1)
+
+struct comphist_totals {
+	uint64_t blocks;
+	uint64_t lsize;
+	uint64_t psize;
+	uint64_t asize;
+	uint64_t embedded_blocks;
+	uint64_t embedded_lsize;
+};
+
+struct comphist_counts {
+	uint64_t holes;
+	uint64_t redacted;
+	uint64_t unknown;
+	uint64_t traversal_errors;
+};
+
+COMPHIST_EXPORT struct comphist_stats *comphist_stats_alloc(void);
+COMPHIST_EXPORT void comphist_stats_free(struct comphist_stats *stats);
+COMPHIST_EXPORT int comphist_stats_algorithms(void);
+/* Algorithm name ("off", "lz4", ...), or NULL for an invalid index. */
+COMPHIST_EXPORT const char *comphist_stats_algorithm(int comp);
+COMPHIST_EXPORT int comphist_stats_get(const struct comphist_stats *stats,
+    int comp, struct comphist_totals *totals);
+COMPHIST_EXPORT void comphist_stats_counts(const struct comphist_stats *stats,
+    struct comphist_counts *counts);
+
+/*
+ * For callers that keep results: the size of one stats struct, to budget
+ * memory by, and a copy of one into another allocated stats.
+ */
+COMPHIST_EXPORT size_t comphist_stats_size(void);
+COMPHIST_EXPORT void comphist_stats_copy(struct comphist_stats *dst,
+    const struct comphist_stats *src);
+
+/*
+ * Report writer: the zfs-comphist report in opts->format, written to fd.
+ * A report is either one comphist_writer_total() or, with per_dataset, a
+ * comphist_writer_dataset() per dataset; comphist_writer_close() finishes
+ * it and fails with the first write error.  snapshot_mode tells the text
+ * report that the target is a snapshot.
+ */
+struct comphist_writer;
+
+COMPHIST_EXPORT struct comphist_writer *comphist_writer_open(int fd,
+    const struct comphist_options *opts, const char *target,
+    bool snapshot_mode);
+COMPHIST_EXPORT int comphist_writer_dataset(struct comphist_writer *w,
+    const char *dsname, const struct comphist_stats *stats);
+COMPHIST_EXPORT int comphist_writer_total(struct comphist_writer *w,
+    const struct comphist_stats *stats);
+COMPHIST_EXPORT int comphist_writer_close(struct comphist_writer *w);
+
+/*
+ * Single NDJSON lines for servers answering one dataset at a time:
+ * comphist_ndjson_record() writes the dataset's record exactly as a
+ * per-dataset NDJSON report does, with the sections opts selects, and
+ * comphist_ndjson_error() writes {"name":dsname,"error":msg}.  dsname may
+ * be NULL for an error not tied to a dataset.
+ */
+COMPHIST_EXPORT int comphist_ndjson_record(int fd,
+    const struct comphist_options *opts, const char *dsname,
+    const struct comphist_stats *stats);
+COMPHIST_EXPORT int comphist_ndjson_error(int fd, const char *dsname,
+    const char *msg);
+
+/*
+ * Option helpers.  comphist_format_parse() and comphist_sim_spec_valid()
+ * check --format and --simulate arguments.  An aggregate walk fills
+ * opts->top, created with comphist_top_create() for the "limit" objects
+ * (at most COMPHIST_TOP_MAX) with the most legacy bytes; the report writer
+ * prints it.  comphist_trace_target() reads the target a --record trace
+ * was taken of, for --replay, and returns 0 or an errno value.
+ */
+#define COMPHIST_TOP_MAX	100000
+
+COMPHIST_EXPORT int comphist_format_parse(const char *arg,
+    enum comphist_format *format);
+COMPHIST_EXPORT bool comphist_sim_spec_valid(const char *spec);
+COMPHIST_EXPORT struct comphist_top *comphist_top_create(size_t limit);
+COMPHIST_EXPORT void comphist_top_destroy(struct comphist_top *top);
+COMPHIST_EXPORT int comphist_trace_target(const char *path, char *target,
+    size_t len);
+
+#endif
@@ -2,15 +2,50 @@
 #define ZFS_COMPHIST_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define COMPHIST_VERSION "0.1.0-dev"
 
+enum comphist_format {
+	COMPHIST_FMT_TEXT,
+	COMPHIST_FMT_JSON,
+	COMPHIST_FMT_NDJSON,
+	COMPHIST_FMT_CSV
+};
+
+struct comphist_top;
+
 struct comphist_options {
 	bool recursive;
+	bool single_pass;
 	bool allow_live;
 	bool best_effort;
-	bool json;
 	bool per_dataset;
+	enum comphist_format format;
+	int jobs;
+	int shards;
+	int pipeline;
+	int progress;		/* ticker interval in seconds; 0 for none */
+	const char *cache_path;
+	const char *checkpoint_path;
+	const char *resume_path;
+	const char *record_path;
+	const char *replay_path;
+	const char *path;	/* --path: directory tree within the target */
+	bool unique;
+	uint64_t unique_mem;
+	bool histogram;
+	bool objtypes;
+	bool eras;
+	bool vdevs;
+	bool metrics;
+	const char *simulate;
+	uint64_t sim_samples;
+	bool dedup;
+	uint32_t entropy;	/* bitmask of enum zio_compress values */
+	bool zstd_levels;
+	double sample;		/* fraction of objects traversed; 0 for all */
+	struct comphist_top *top;	/* filled by an aggregate walk */
 };
 
 #endif
@@ -0,0 +1,452 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/zfs_context.h>
+
+/*
+ * Persistent per-snapshot result cache.
+ *
+ * Snapshots are immutable, so the stats of a snapshot identified by its
+ * dataset GUID and creation txg never change.  The cache file is a header,
+ * the records packed with comphist_stats_pack(), and a table locating
+ * them:
+ *
+ *	header:	magic[8] version:u32 record_size:u32 features:u64 count:u64
+ *		table_off:u64
+ *	records: packed stats, back to back
+ *	table:	count x (guid:u64 txg:u64 off:u64 len:u64)
+ *
+ * Only the table is loaded; a lookup reads and unpacks the one record it
+ * needs.  Records inserted by this run are kept packed in memory until the
+ * file is rewritten on close.
+ *
+ * Integers are stored in host byte order.  record_size is the size of
+ * struct comphist_stats, whose layout the packed words follow.  A file
+ * with a different version, stats layout or accounting feature set is
+ * ignored and rewritten, and so is a record that does not unpack, so a
+ * stale cache can cost a rescan but never produce wrong numbers.
+ */
+
+#define COMPHIST_CACHE_MAGIC	"ZCHCACHE"
+#define COMPHIST_CACHE_VERSION	3
+
+/* A record that failed to unpack; it is dropped when the file is saved. */
+#define COMPHIST_CACHE_DEAD	UINT64_MAX
+
+struct comphist_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t features;
+	uint64_t count;
+	uint64_t table_off;
+};
+
+struct comphist_cache_entry {
+	uint64_t guid;
+	uint64_t txg;
+	uint64_t off;
+	uint64_t len;
+};
+
+struct comphist_cache {
+	char *path;
+	uint64_t features;
+	kmutex_t lock;
+	/* The file loaded from, holding the first nloaded records. */
+	int fd;
+	size_t nloaded;
+	/* Records inserted since, packed back to back in pending. */
+	uint8_t *pending;
+	size_t pending_len;
+	size_t pending_cap;
+	/* One packed record, and the stats an insert packs. */
+	uint8_t *buf;
+	struct comphist_stats *scratch;
+	struct comphist_cache_entry *entries;
+	size_t count;
+	size_t cap;
+	/* Open-addressing index into entries, keyed by guid. */
+	size_t *index;
+	size_t index_size;
+	bool dirty;
+};
+
+#define COMPHIST_CACHE_EMPTY	SIZE_MAX
+
+static size_t
+comphist_cache_slot(const struct comphist_cache *cache, uint64_t guid)
+{
+	/* Dataset GUIDs are random, so the low bits hash well enough. */
+	return ((size_t)guid & (cache->index_size - 1));
+}
+
+static int
+comphist_cache_reindex(struct comphist_cache *cache, size_t size)
+{
+	size_t *index = malloc(size * sizeof(*index));
+
+	if (index == NULL)
+		return (ENOMEM);
+
+	for (size_t i = 0; i < size; i++)
+		index[i] = COMPHIST_CACHE_EMPTY;
+
+	free(cache->index);
+	cache->index = index;
+	cache->index_size = size;
+
+	for (size_t i = 0; i < cache->count; i++) {
+		size_t slot = comphist_cache_slot(cache,
+		    cache->entries[i].guid);
+
+		while (index[slot] != COMPHIST_CACHE_EMPTY)
+			slot = (slot + 1) & (size - 1);
+		index[slot] = i;
+	}
+
+	return (0);
+}
+
+static int
+comphist_cache_reserve(struct comphist_cache *cache, size_t count)
+{
+	if (count > cache->cap) {
+		size_t cap = cache->cap == 0 ? 64 : cache->cap;
+		struct comphist_cache_entry *entries;
+
+		while (cap < count)
+			cap *= 2;
+		entries = realloc(cache->entries, cap * sizeof(*entries));
+		if (entries == NULL)
+			return (ENOMEM);
+		cache->entries = entries;
+		cache->cap = cap;
+	}
+
+	if (count * 2 > cache->index_size) {
+		size_t size = cache->index_size == 0 ? 128 :
+		    cache->index_size;
+
+		while (count * 2 > size)
+			size *= 2;
+		return (comphist_cache_reindex(cache, size));
+	}
+
+	return (0);
+}
+
+static int
+comphist_cache_load(struct comphist_cache *cache)
+{
+	struct comphist_cache_header hdr;
+	struct stat st;
+	size_t table;
+	int fd;
+	int err = 0;
+
+	fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (errno == ENOENT ? 0 : errno);
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+	    memcmp(hdr.magic, COMPHIST_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != COMPHIST_CACHE_VERSION ||
+	    hdr.record_size != sizeof(struct comphist_stats) ||
+	    hdr.features != cache->features ||
+	    fstat(fd, &st) != 0 ||
+	    hdr.table_off < sizeof(hdr) ||
+	    hdr.table_off > (uint64_t)st.st_size ||
+	    hdr.count > ((uint64_t)st.st_size - hdr.table_off) /
+	    sizeof(struct comphist_cache_entry) ||
+	    (uint64_t)st.st_size != hdr.table_off +
+	    hdr.count * sizeof(struct comphist_cache_entry)) {
+		/*
+		 * Unusable cache, including a count that does not match the
+		 * file size; it is rewritten on close.
+		 */
+		cache->dirty = true;
+		goto out;
+	}
+
+	err = comphist_cache_reserve(cache, hdr.count);
+	if (err != 0)
+		goto out;
+
+	table = hdr.count * sizeof(struct comphist_cache_entry);
+	if (pread(fd, cache->entries, table, (off_t)hdr.table_off) !=
+	    (ssize_t)table) {
+		cache->dirty = true;
+		goto out;
+	}
+	for (size_t i = 0; i < hdr.count; i++) {
+		const struct comphist_cache_entry *e = &cache->entries[i];
+
+		if (e->off < sizeof(hdr) || e->off > hdr.table_off ||
+		    e->len > hdr.table_off - e->off ||
+		    e->len > COMPHIST_STATS_PACKED_MAX) {
+			cache->dirty = true;
+			goto out;
+		}
+	}
+
+	cache->count = hdr.count;
+	cache->nloaded = hdr.count;
+	err = comphist_cache_reindex(cache, cache->index_size);
+	if (err == 0) {
+		cache->fd = fd;
+		return (0);
+	}
+	cache->count = 0;
+	cache->nloaded = 0;
+
+out:
+	(void)close(fd);
+	return (err);
+}
+
+/*
+ * Read an entry's packed record into cache->buf.
+ */
+static int
+comphist_cache_read(struct comphist_cache *cache,
+    const struct comphist_cache_entry *e, size_t i)
+{
+	if (i >= cache->nloaded) {
+		memcpy(cache->buf, cache->pending + e->off, e->len);
+		return (0);
+	}
+	if (pread(cache->fd, cache->buf, e->len, (off_t)e->off) !=
+	    (ssize_t)e->len)
+		return (errno != 0 ? errno : EIO);
+	return (0);
+}
+
+static int
+comphist_cache_save(struct comphist_cache *cache)
+{
+	struct comphist_cache_header hdr = {
+		.version = COMPHIST_CACHE_VERSION,
+		.record_size = sizeof(struct comphist_stats),
+		.features = cache->features,
+		.table_off = sizeof(hdr),
+	};
+	size_t len = strlen(cache->path) + sizeof(".tmp");
+	char *tmp = malloc(len);
+	FILE *fp;
+	int err = 0;
+
+	if (tmp == NULL)
+		return (ENOMEM);
+	snprintf(tmp, len, "%s.tmp", cache->path);
+	memcpy(hdr.magic, COMPHIST_CACHE_MAGIC, sizeof(hdr.magic));
+
+	fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		err = errno;
+		free(tmp);
+		return (err);
+	}
+
+	/* Records first, compacting the table in place as they move. */
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		err = errno != 0 ? errno : EIO;
+	for (size_t i = 0; i < cache->count && err == 0; i++) {
+		struct comphist_cache_entry *e = &cache->entries[i];
+
+		if (e->len == COMPHIST_CACHE_DEAD)
+			continue;
+		err = comphist_cache_read(cache, e, i);
+		if (err == 0 && fwrite(cache->buf, 1, e->len, fp) != e->len)
+			err = errno != 0 ? errno : EIO;
+		if (err != 0)
+			break;
+		cache->entries[hdr.count] = *e;
+		cache->entries[hdr.count].off = hdr.table_off;
+		hdr.table_off += e->len;
+		hdr.count++;
+	}
+	if (err == 0 && (fwrite(cache->entries, sizeof(*cache->entries),
+	    hdr.count, fp) != hdr.count || fseeko(fp, 0, SEEK_SET) != 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, fp) != 1))
+		err = errno != 0 ? errno : EIO;
+	if (fclose(fp) != 0 && err == 0)
+		err = errno;
+	if (err == 0 && rename(tmp, cache->path) != 0)
+		err = errno;
+	if (err != 0)
+		(void)remove(tmp);
+
+	free(tmp);
+	return (err);
+}
+
+int
+comphist_cache_open(const char *path, uint64_t features,
+    struct comphist_cache **cachep)
+{
+	struct comphist_cache *cache;
+	int err;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return (ENOMEM);
+
+	cache->fd = -1;
+	cache->path = strdup(path);
+	cache->buf = malloc(COMPHIST_STATS_PACKED_MAX);
+	cache->scratch = malloc(sizeof(*cache->scratch));
+	if (cache->path == NULL || cache->buf == NULL ||
+	    cache->scratch == NULL) {
+		free(cache->scratch);
+		free(cache->buf);
+		free(cache->path);
+		free(cache);
+		return (ENOMEM);
+	}
+	cache->features = features;
+	mutex_init(&cache->lock, NULL, MUTEX_DEFAULT, NULL);
+
+	err = comphist_cache_reserve(cache, 1);
+	if (err == 0)
+		err = comphist_cache_load(cache);
+	if (err != 0) {
+		cache->dirty = false;
+		(void)comphist_cache_close(cache);
+		return (err);
+	}
+
+	*cachep = cache;
+	return (0);
+}
+
+bool
+comphist_cache_lookup(struct comphist_cache *cache, uint64_t guid,
+    uint64_t txg, struct comphist_stats *stats)
+{
+	bool found = false;
+	size_t slot;
+
+	mutex_enter(&cache->lock);
+	slot = comphist_cache_slot(cache, guid);
+	while (cache->index[slot] != COMPHIST_CACHE_EMPTY) {
+		size_t i = cache->index[slot];
+		struct comphist_cache_entry *e = &cache->entries[i];
+
+		if (e->guid == guid && e->txg == txg &&
+		    e->len != COMPHIST_CACHE_DEAD) {
+			if (comphist_cache_read(cache, e, i) == 0 &&
+			    comphist_stats_unpack(cache->buf, e->len,
+			    stats) == 0) {
+				found = true;
+				break;
+			}
+			/*
+			 * Unreadable: a miss, so the snapshot is scanned
+			 * again, and the record is dropped on save.
+			 */
+			e->len = COMPHIST_CACHE_DEAD;
+			cache->dirty = true;
+		}
+		slot = (slot + 1) & (cache->index_size - 1);
+	}
+	mutex_exit(&cache->lock);
+
+	return (found);
+}
+
+int
+comphist_cache_insert(struct comphist_cache *cache, uint64_t guid,
+    uint64_t txg, const struct comphist_stats *stats)
+{
+	struct comphist_cache_entry *e;
+	struct comphist_stats *rec = cache->scratch;
+	size_t slot, len;
+	int err;
+
+	mutex_enter(&cache->lock);
+	err = comphist_cache_reserve(cache, cache->count + 1);
+	if (err == 0 && cache->pending_cap - cache->pending_len <
+	    COMPHIST_STATS_PACKED_MAX) {
+		size_t cap = cache->pending_cap == 0 ?
+		    4 * COMPHIST_STATS_PACKED_MAX : cache->pending_cap * 2;
+		uint8_t *pending = realloc(cache->pending, cap);
+
+		if (pending == NULL) {
+			err = ENOMEM;
+		} else {
+			cache->pending = pending;
+			cache->pending_cap = cap;
+		}
+	}
+	if (err != 0) {
+		mutex_exit(&cache->lock);
+		return (err);
+	}
+
+	memcpy(rec, stats, sizeof(*stats));
+
+	/* Run-specific counters are not part of the snapshot's result. */
+	rec->pipeline_batches = 0;
+	rec->pipeline_depth_sum = 0;
+	rec->pipeline_depth_max = 0;
+	rec->pipeline_stall_ns = 0;
+	rec->pipeline_idle_ns = 0;
+	rec->scan_ns = 0;
+	rec->scan_cpu_ns = 0;
+	rec->scan_meta_blocks = 0;
+	rec->scan_meta_bytes = 0;
+	rec->scan_meta_reads = 0;
+	rec->scan_arc_hits = 0;
+	rec->scan_arc_misses = 0;
+	rec->scan_retries = 0;
+
+	len = comphist_stats_pack(rec, cache->pending + cache->pending_len);
+	e = &cache->entries[cache->count];
+	e->guid = guid;
+	e->txg = txg;
+	e->off = cache->pending_len;
+	e->len = len;
+	cache->pending_len += len;
+
+	slot = comphist_cache_slot(cache, guid);
+	while (cache->index[slot] != COMPHIST_CACHE_EMPTY)
+		slot = (slot + 1) & (cache->index_size - 1);
+	cache->index[slot] = cache->count++;
+	cache->dirty = true;
+	mutex_exit(&cache->lock);
+
+	return (0);
+}
+
+/*
+ * Write the cache back if anything changed and free it.
+ */
+int
+comphist_cache_close(struct comphist_cache *cache)
+{
+	int err = 0;
+
+	if (cache->dirty)
+		err = comphist_cache_save(cache);
+
+	if (cache->fd >= 0)
+		(void)close(cache->fd);
+	mutex_destroy(&cache->lock);
+	free(cache->index);
+	free(cache->entries);
+	free(cache->pending);
+	free(cache->scratch);
+	free(cache->buf);
+	free(cache->path);
+	free(cache);
+
+	return (err);
+}
@@ -0,0 +1,19 @@
+#ifndef COMPHIST_CACHE_H
+#define COMPHIST_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+struct comphist_cache;
+
+int comphist_cache_open(const char *path, uint64_t features,
+    struct comphist_cache **cachep);
+bool comphist_cache_lookup(struct comphist_cache *cache, uint64_t guid,
+    uint64_t txg, struct comphist_stats *stats);
+int comphist_cache_insert(struct comphist_cache *cache, uint64_t guid,
+    uint64_t txg, const struct comphist_stats *stats);
+int comphist_cache_close(struct comphist_cache *cache);
+
+#endif
@@ -0,0 +1,562 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/fs/zfs.h>
+#include <sys/zfs_context.h>
+
+/*
+ * Scan checkpoints.
+ *
+ * A checkpoint records which datasets are finished, identified by GUID,
+ * and how far the dataset in progress got.  Finished datasets are kept as
+ * one merged total, or one stats record each for per-dataset output so the
+ * results can be emitted again in order.  The dataset in progress is
+ * recorded as the next object to traverse and the stats of every object
+ * before it; resuming restarts its traversal at that object.
+ *
+ * Stats are stored packed with comphist_stats_pack(), in the file and, for
+ * the per-dataset records, in memory too, so a scan of many datasets keeps
+ * a few hundred bytes per finished dataset rather than a whole struct.
+ *
+ *	header:	magic[8] version:u32 record_size:u32 features:u64
+ *		sample:double seed:u64 count:u64 partial_guid:u64
+ *		partial_next:u64 per_dataset:u32 target_len:u32
+ *		target[target_len]
+ *	total:	len:u64 packed[len]
+ *	partial: len:u64 packed[len]
+ *	guids:	u64[count]
+ *	lens:	u64[count]			(per-dataset output only)
+ *	stats:	packed records, back to back	(per-dataset output only)
+ *
+ * Integers are stored in host byte order; record_size is the size of
+ * struct comphist_stats, whose layout the packed words follow.  The file is
+ * rewritten through a temporary file and rename(), so an interrupted save
+ * leaves the previous checkpoint intact.
+ */
+
+#define COMPHIST_CKPT_MAGIC	"ZCHCKPT\0"
+#define COMPHIST_CKPT_VERSION	3
+
+/* Minimum time between checkpoint writes. */
+#define COMPHIST_CKPT_INTERVAL	SEC2NSEC(60)
+
+struct comphist_ckpt_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t features;
+	double sample;
+	uint64_t seed;
+	uint64_t count;
+	uint64_t partial_guid;
+	uint64_t partial_next;
+	uint32_t per_dataset;
+	uint32_t target_len;
+};
+
+struct comphist_ckpt {
+	char *path;
+	char *target;
+	uint64_t features;
+	double sample;
+	bool per_dataset;
+	uint64_t seed;
+	kmutex_t lock;
+	hrtime_t last_save;
+	struct comphist_stats total;
+	uint64_t *guids;
+	/* Per-dataset records, packed back to back in records. */
+	uint64_t *offs;
+	uint64_t *lens;
+	uint8_t *records;
+	size_t records_len;
+	size_t records_cap;
+	size_t count;
+	size_t cap;
+	uint64_t partial_guid;
+	uint64_t partial_next;
+	struct comphist_stats partial;
+	/* One packed record. */
+	uint8_t *buf;
+};
+
+static int
+comphist_ckpt_reserve(struct comphist_ckpt *ckpt, size_t count)
+{
+	size_t cap = ckpt->cap == 0 ? 64 : ckpt->cap;
+	uint64_t *guids;
+
+	if (count <= ckpt->cap)
+		return (0);
+
+	while (cap < count)
+		cap *= 2;
+	guids = realloc(ckpt->guids, cap * sizeof(*guids));
+	if (guids == NULL)
+		return (ENOMEM);
+	ckpt->guids = guids;
+
+	if (ckpt->per_dataset) {
+		uint64_t *offs, *lens;
+
+		offs = realloc(ckpt->offs, cap * sizeof(*offs));
+		if (offs == NULL)
+			return (ENOMEM);
+		ckpt->offs = offs;
+		lens = realloc(ckpt->lens, cap * sizeof(*lens));
+		if (lens == NULL)
+			return (ENOMEM);
+		ckpt->lens = lens;
+	}
+	ckpt->cap = cap;
+
+	return (0);
+}
+
+/*
+ * Make room for len more bytes of packed records.
+ */
+static int
+comphist_ckpt_reserve_records(struct comphist_ckpt *ckpt, size_t len)
+{
+	size_t cap = ckpt->records_cap == 0 ? 4 * COMPHIST_STATS_PACKED_MAX :
+	    ckpt->records_cap;
+	uint8_t *records;
+
+	if (len <= ckpt->records_cap - ckpt->records_len)
+		return (0);
+
+	while (len > cap - ckpt->records_len)
+		cap *= 2;
+	records = realloc(ckpt->records, cap);
+	if (records == NULL)
+		return (ENOMEM);
+	ckpt->records = records;
+	ckpt->records_cap = cap;
+
+	return (0);
+}
+
+/*
+ * Read one length-prefixed packed record into stats.
+ */
+static int
+comphist_ckpt_read_stats(struct comphist_ckpt *ckpt, FILE *fp,
+    struct comphist_stats *stats)
+{
+	uint64_t len;
+
+	if (fread(&len, sizeof(len), 1, fp) != 1 ||
+	    len > COMPHIST_STATS_PACKED_MAX ||
+	    fread(ckpt->buf, 1, len, fp) != len)
+		return (EINVAL);
+
+	return (comphist_stats_unpack(ckpt->buf, len, stats));
+}
+
+static int
+comphist_ckpt_write_stats(struct comphist_ckpt *ckpt, FILE *fp,
+    const struct comphist_stats *stats)
+{
+	uint64_t len = comphist_stats_pack(stats, ckpt->buf);
+
+	if (fwrite(&len, sizeof(len), 1, fp) != 1 ||
+	    fwrite(ckpt->buf, 1, len, fp) != len)
+		return (errno != 0 ? errno : EIO);
+
+	return (0);
+}
+
+static int
+comphist_ckpt_load(struct comphist_ckpt *ckpt, const char *path)
+{
+	struct comphist_ckpt_header hdr;
+	char target[ZFS_MAX_DATASET_NAME_LEN];
+	struct comphist_stats *check = NULL;
+	struct stat st;
+	off_t left;
+	uint64_t len = 0;
+	size_t record;
+	FILE *fp;
+	int err = 0;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return (errno);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, COMPHIST_CKPT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != COMPHIST_CKPT_VERSION ||
+	    hdr.record_size != sizeof(struct comphist_stats) ||
+	    hdr.target_len >= sizeof(target) ||
+	    fread(target, 1, hdr.target_len, fp) != hdr.target_len) {
+		fprintf(stderr, "comphist: %s is not a checkpoint of this "
+		    "version\n", path);
+		err = EINVAL;
+		goto out;
+	}
+	target[hdr.target_len] = '\0';
+
+	/*
+	 * After the total and the partial stats, the rest of the file must
+	 * hold exactly count records; anything else is a truncated or corrupt
+	 * checkpoint, and its count cannot be trusted to size the tables.
+	 */
+	record = sizeof(*ckpt->guids) +
+	    (hdr.per_dataset != 0 ? sizeof(*ckpt->lens) : 0);
+	if (comphist_ckpt_read_stats(ckpt, fp, &ckpt->total) != 0 ||
+	    comphist_ckpt_read_stats(ckpt, fp, &ckpt->partial) != 0 ||
+	    fstat(fileno(fp), &st) != 0 ||
+	    (left = st.st_size - ftello(fp)) < 0 ||
+	    hdr.count > (uint64_t)left / record ||
+	    (hdr.per_dataset == 0 && hdr.count * record != (uint64_t)left)) {
+		err = EINVAL;
+		goto corrupt;
+	}
+
+	/* A checkpoint of a different scan would silently skew the result. */
+	if (strcmp(target, ckpt->target) != 0 ||
+	    hdr.features != ckpt->features || hdr.sample != ckpt->sample ||
+	    (hdr.per_dataset != 0) != ckpt->per_dataset) {
+		fprintf(stderr, "comphist: checkpoint %s was written by a "
+		    "different scan\n", path);
+		err = EINVAL;
+		goto out;
+	}
+
+	err = comphist_ckpt_reserve(ckpt, hdr.count);
+	if (err != 0)
+		goto out;
+
+	if (fread(ckpt->guids, sizeof(*ckpt->guids), hdr.count, fp) !=
+	    hdr.count ||
+	    (ckpt->per_dataset && fread(ckpt->lens, sizeof(*ckpt->lens),
+	    hdr.count, fp) != hdr.count)) {
+		err = EINVAL;
+		goto corrupt;
+	}
+
+	if (ckpt->per_dataset) {
+		for (size_t i = 0; i < hdr.count; i++) {
+			if (ckpt->lens[i] > COMPHIST_STATS_PACKED_MAX) {
+				err = EINVAL;
+				goto corrupt;
+			}
+			ckpt->offs[i] = len;
+			len += ckpt->lens[i];
+		}
+		if (len != (uint64_t)left - hdr.count * record) {
+			err = EINVAL;
+			goto corrupt;
+		}
+
+		check = malloc(sizeof(*check));
+		err = check == NULL ? ENOMEM :
+		    comphist_ckpt_reserve_records(ckpt, len);
+		if (err != 0)
+			goto out;
+		if (fread(ckpt->records, 1, len, fp) != len) {
+			err = EINVAL;
+			goto corrupt;
+		}
+		ckpt->records_len = len;
+		for (size_t i = 0; i < hdr.count; i++) {
+			if (comphist_stats_unpack(ckpt->records + ckpt->offs[i],
+			    ckpt->lens[i], check) != 0) {
+				err = EINVAL;
+				goto corrupt;
+			}
+		}
+	}
+
+	ckpt->count = hdr.count;
+	ckpt->seed = hdr.seed;
+	ckpt->partial_guid = hdr.partial_guid;
+	ckpt->partial_next = hdr.partial_next;
+	goto out;
+
+corrupt:
+	fprintf(stderr, "comphist: checkpoint %s is truncated or corrupt\n",
+	    path);
+out:
+	free(check);
+	fclose(fp);
+	return (err);
+}
+
+static int
+comphist_ckpt_save(struct comphist_ckpt *ckpt)
+{
+	struct comphist_ckpt_header hdr = {
+		.version = COMPHIST_CKPT_VERSION,
+		.record_size = sizeof(struct comphist_stats),
+		.features = ckpt->features,
+		.sample = ckpt->sample,
+		.seed = ckpt->seed,
+		.count = ckpt->count,
+		.partial_guid = ckpt->partial_guid,
+		.partial_next = ckpt->partial_next,
+		.per_dataset = ckpt->per_dataset,
+		.target_len = strlen(ckpt->target),
+	};
+	size_t len = strlen(ckpt->path) + sizeof(".tmp");
+	char *tmp = malloc(len);
+	FILE *fp;
+	int err = 0;
+
+	if (tmp == NULL)
+		return (ENOMEM);
+	snprintf(tmp, len, "%s.tmp", ckpt->path);
+	memcpy(hdr.magic, COMPHIST_CKPT_MAGIC, sizeof(hdr.magic));
+
+	fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		err = errno;
+		free(tmp);
+		return (err);
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(ckpt->target, 1, hdr.target_len, fp) != hdr.target_len)
+		err = errno != 0 ? errno : EIO;
+	if (err == 0)
+		err = comphist_ckpt_write_stats(ckpt, fp, &ckpt->total);
+	if (err == 0)
+		err = comphist_ckpt_write_stats(ckpt, fp, &ckpt->partial);
+	if (err == 0 && (fwrite(ckpt->guids, sizeof(*ckpt->guids),
+	    ckpt->count, fp) != ckpt->count ||
+	    (ckpt->per_dataset && (fwrite(ckpt->lens, sizeof(*ckpt->lens),
+	    ckpt->count, fp) != ckpt->count ||
+	    fwrite(ckpt->records, 1, ckpt->records_len, fp) !=
+	    ckpt->records_len))))
+		err = errno != 0 ? errno : EIO;
+	if (fflush(fp) != 0 && err == 0)
+		err = errno;
+	if (err == 0 && fsync(fileno(fp)) != 0)
+		err = errno;
+	if (fclose(fp) != 0 && err == 0)
+		err = errno;
+	if (err == 0 && rename(tmp, ckpt->path) != 0)
+		err = errno;
+	if (err != 0)
+		(void)remove(tmp);
+
+	free(tmp);
+	ckpt->last_save = gethrtime();
+	return (err);
+}
+
+/*
+ * Open a checkpoint written to path.  With resume_path, the scan continues
+ * from the checkpoint stored there; it must have been written by a scan
+ * with the same identity.
+ */
+int
+comphist_ckpt_open(const char *path, const char *resume_path,
+    const struct comphist_ckpt_id *id, struct comphist_ckpt **ckptp)
+{
+	struct comphist_ckpt *ckpt;
+	int err = 0;
+
+	ckpt = calloc(1, sizeof(*ckpt));
+	if (ckpt == NULL)
+		return (ENOMEM);
+
+	ckpt->path = strdup(path);
+	ckpt->target = strdup(id->target);
+	ckpt->buf = malloc(COMPHIST_STATS_PACKED_MAX);
+	ckpt->features = id->features;
+	ckpt->sample = id->sample;
+	ckpt->per_dataset = id->per_dataset;
+	ckpt->last_save = gethrtime();
+	mutex_init(&ckpt->lock, NULL, MUTEX_DEFAULT, NULL);
+	comphist_stats_init(&ckpt->total);
+	comphist_stats_init(&ckpt->partial);
+
+	if (ckpt->path == NULL || ckpt->target == NULL || ckpt->buf == NULL)
+		err = ENOMEM;
+	if (err == 0 && resume_path != NULL)
+		err = comphist_ckpt_load(ckpt, resume_path);
+	if (err != 0) {
+		(void)comphist_ckpt_close(ckpt, false);
+		return (err);
+	}
+
+	*ckptp = ckpt;
+	return (0);
+}
+
+/*
+ * Return the sampling seed to use: the resumed scan's, or seed for a new
+ * one, which is then recorded.
+ */
+uint64_t
+comphist_ckpt_seed(struct comphist_ckpt *ckpt, uint64_t seed)
+{
+	if (ckpt->seed == 0)
+		ckpt->seed = seed;
+
+	return (ckpt->seed);
+}
+
+/*
+ * Merge the aggregate of already finished datasets into total.
+ */
+void
+comphist_ckpt_restore_total(struct comphist_ckpt *ckpt,
+    struct comphist_stats *total)
+{
+	comphist_stats_merge(total, &ckpt->total);
+}
+
+/*
+ * Return whether the dataset was finished before.  For per-dataset output
+ * its stats are copied to stats; otherwise they are already part of the
+ * restored total and stats is left alone.
+ */
+bool
+comphist_ckpt_lookup(struct comphist_ckpt *ckpt, uint64_t guid,
+    struct comphist_stats *stats)
+{
+	bool found = false;
+
+	mutex_enter(&ckpt->lock);
+	for (size_t i = 0; i < ckpt->count; i++) {
+		if (ckpt->guids[i] != guid)
+			continue;
+		/* Records were checked when they were loaded or packed. */
+		if (ckpt->per_dataset)
+			(void)comphist_stats_unpack(ckpt->records +
+			    ckpt->offs[i], ckpt->lens[i], stats);
+		found = true;
+		break;
+	}
+	mutex_exit(&ckpt->lock);
+
+	return (found);
+}
+
+/*
+ * Return whether the dataset was interrupted part way, along with the
+ * object to continue from and the stats of everything before it.
+ */
+bool
+comphist_ckpt_partial(struct comphist_ckpt *ckpt, uint64_t guid,
+    uint64_t *next_obj, struct comphist_stats *stats)
+{
+	bool found = false;
+
+	mutex_enter(&ckpt->lock);
+	if (ckpt->partial_guid != 0 && ckpt->partial_guid == guid) {
+		*next_obj = ckpt->partial_next;
+		memcpy(stats, &ckpt->partial, sizeof(*stats));
+		found = true;
+	}
+	mutex_exit(&ckpt->lock);
+
+	return (found);
+}
+
+bool
+comphist_ckpt_due(struct comphist_ckpt *ckpt)
+{
+	return (gethrtime() - ckpt->last_save >= COMPHIST_CKPT_INTERVAL);
+}
+
+/*
+ * Record that every object of the dataset before next_obj is accounted in
+ * stats, and write the checkpoint.
+ */
+int
+comphist_ckpt_progress(struct comphist_ckpt *ckpt, uint64_t guid,
+    uint64_t next_obj, const struct comphist_stats *stats)
+{
+	int err;
+
+	mutex_enter(&ckpt->lock);
+	ckpt->partial_guid = guid;
+	ckpt->partial_next = next_obj;
+	memcpy(&ckpt->partial, stats, sizeof(ckpt->partial));
+	err = comphist_ckpt_save(ckpt);
+	mutex_exit(&ckpt->lock);
+
+	return (err);
+}
+
+/*
+ * Record a finished dataset, writing the checkpoint if the last write is
+ * old enough.
+ */
+int
+comphist_ckpt_done(struct comphist_ckpt *ckpt, uint64_t guid,
+    const struct comphist_stats *stats)
+{
+	int err = 0;
+
+	mutex_enter(&ckpt->lock);
+	err = comphist_ckpt_reserve(ckpt, ckpt->count + 1);
+	if (err == 0 && ckpt->per_dataset)
+		err = comphist_ckpt_reserve_records(ckpt,
+		    COMPHIST_STATS_PACKED_MAX);
+	if (err == 0) {
+		if (ckpt->per_dataset) {
+			size_t len = comphist_stats_pack(stats,
+			    ckpt->records + ckpt->records_len);
+
+			ckpt->offs[ckpt->count] = ckpt->records_len;
+			ckpt->lens[ckpt->count] = len;
+			ckpt->records_len += len;
+		} else {
+			comphist_stats_merge(&ckpt->total, stats);
+		}
+		ckpt->guids[ckpt->count++] = guid;
+
+		if (ckpt->partial_guid == guid) {
+			ckpt->partial_guid = 0;
+			ckpt->partial_next = 0;
+			comphist_stats_init(&ckpt->partial);
+		}
+		if (comphist_ckpt_due(ckpt))
+			err = comphist_ckpt_save(ckpt);
+	}
+	mutex_exit(&ckpt->lock);
+
+	return (err);
+}
+
+/*
+ * A complete scan no longer needs its checkpoint and removes it; otherwise
+ * the latest state is written so the scan can be resumed.
+ */
+int
+comphist_ckpt_close(struct comphist_ckpt *ckpt, bool complete)
+{
+	int err = 0;
+
+	if (ckpt->path != NULL && ckpt->target != NULL) {
+		if (complete) {
+			if (remove(ckpt->path) != 0 && errno != ENOENT)
+				err = errno;
+		} else if (ckpt->count > 0 || ckpt->partial_guid != 0) {
+			err = comphist_ckpt_save(ckpt);
+		}
+	}
+
+	mutex_destroy(&ckpt->lock);
+	free(ckpt->records);
+	free(ckpt->lens);
+	free(ckpt->offs);
+	free(ckpt->guids);
+	free(ckpt->buf);
+	free(ckpt->target);
+	free(ckpt->path);
+	free(ckpt);
+
+	return (err);
+}
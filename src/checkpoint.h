@@ -0,0 +1,38 @@
+#ifndef COMPHIST_CHECKPOINT_H
+#define COMPHIST_CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+struct comphist_ckpt;
+
+/*
+ * Identity of a scan.  A checkpoint is only resumed by a scan with the
+ * same target and accounting options.
+ */
+struct comphist_ckpt_id {
+	const char *target;
+	uint64_t features;
+	double sample;
+	bool per_dataset;
+};
+
+int comphist_ckpt_open(const char *path, const char *resume_path,
+    const struct comphist_ckpt_id *id, struct comphist_ckpt **ckptp);
+uint64_t comphist_ckpt_seed(struct comphist_ckpt *ckpt, uint64_t seed);
+void comphist_ckpt_restore_total(struct comphist_ckpt *ckpt,
+    struct comphist_stats *total);
+bool comphist_ckpt_lookup(struct comphist_ckpt *ckpt, uint64_t guid,
+    struct comphist_stats *stats);
+bool comphist_ckpt_partial(struct comphist_ckpt *ckpt, uint64_t guid,
+    uint64_t *next_obj, struct comphist_stats *stats);
+bool comphist_ckpt_due(struct comphist_ckpt *ckpt);
+int comphist_ckpt_progress(struct comphist_ckpt *ckpt, uint64_t guid,
+    uint64_t next_obj, const struct comphist_stats *stats);
+int comphist_ckpt_done(struct comphist_ckpt *ckpt, uint64_t guid,
+    const struct comphist_stats *stats);
+int comphist_ckpt_close(struct comphist_ckpt *ckpt, bool complete);
+
+#endif
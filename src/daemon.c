@@ -0,0 +1,731 @@
+/*
+ * zfs-comphistd: serve compression stats over a local Unix socket.
+ *
+ * Clients send one JSON object per line and get one JSON line back:
+ *
+ *	{"dataset":"tank/home@daily","histogram":true}
+ *	{"name":"tank/home@daily","mode":"snapshot","entries":[...],...}
+ *
+ * Replies are the records `zfs-comphist -p --format=ndjson` prints;
+ * failures are {"name":...,"error":"..."}.  "histogram", "types" and
+ * "eras" select the optional sections.
+ *
+ * Pools stay imported in one libcomphist session.  Stats are cached per
+ * dataset under the dataset's guid and root block birth txg, so snapshot
+ * results are kept for good and live results until the dataset changes.
+ * Queries for a dataset already being scanned wait for that scan, and
+ * scans run on a fixed number of workers however many clients there are.
+ * A read-only import does not see later writes, so when live datasets have
+ * been queried the session is refreshed every --refresh seconds.
+ */
+
+#include "libcomphist.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/fs/zfs.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define COMPHISTD_SOCKET	"/run/zfs-comphistd.sock"
+#define COMPHISTD_LINE_MAX	4096
+#define COMPHISTD_BUCKETS	1024
+
+enum comphistd_state {
+	COMPHISTD_PENDING,
+	COMPHISTD_READY,
+	COMPHISTD_FAILED
+};
+
+/*
+ * A cached or in-flight scan.  Entries are reference counted: the table
+ * holds one reference while the entry is linked, the scan queue one until
+ * the scan is done, and every query waiting on or replying from it another,
+ * so a stale or evicted entry lives until its last reader is done.
+ */
+struct comphistd_entry {
+	struct comphistd_entry *next;		/* hash chain */
+	struct comphistd_entry *qnext;		/* scan queue */
+	char name[ZFS_MAX_DATASET_NAME_LEN];
+	uint64_t guid;
+	uint64_t txg;
+	bool snapshot;
+	enum comphistd_state state;
+	int error;
+	unsigned int refs;
+	uint64_t last_used;
+	struct comphist_stats *stats;
+};
+
+struct comphistd {
+	struct comphist_session *sess;
+	bool allow_live;
+	bool best_effort;
+	int workers;
+	int refresh;
+	size_t max_entries;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct comphistd_entry *buckets[COMPHISTD_BUCKETS];
+	size_t entries;
+	struct comphistd_entry *qhead;
+	struct comphistd_entry *qtail;
+	uint64_t clock;
+	bool live_seen;
+};
+
+struct comphistd_query {
+	char dataset[ZFS_MAX_DATASET_NAME_LEN];
+	bool histogram;
+	bool types;
+	bool eras;
+};
+
+struct comphistd_client {
+	struct comphistd *d;
+	int fd;
+};
+
+static size_t
+comphistd_hash(const char *name)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	/* FNV-1a */
+	for (; *name != '\0'; name++) {
+		h ^= (unsigned char)*name;
+		h *= 0x100000001b3ULL;
+	}
+	return ((size_t)(h % COMPHISTD_BUCKETS));
+}
+
+static struct comphistd_entry *
+comphistd_lookup(struct comphistd *d, const char *name)
+{
+	struct comphistd_entry *e = d->buckets[comphistd_hash(name)];
+
+	while (e != NULL && strcmp(e->name, name) != 0)
+		e = e->next;
+	return (e);
+}
+
+static void
+comphistd_release(struct comphistd_entry *e)
+{
+	if (--e->refs == 0) {
+		comphist_stats_free(e->stats);
+		free(e);
+	}
+}
+
+static void
+comphistd_unlink(struct comphistd *d, struct comphistd_entry *e)
+{
+	struct comphistd_entry **ep = &d->buckets[comphistd_hash(e->name)];
+
+	while (*ep != e)
+		ep = &(*ep)->next;
+	*ep = e->next;
+	d->entries--;
+	comphistd_release(e);
+}
+
+/*
+ * Drop the least recently used finished entry once the table is full.
+ * Pending entries are never evicted.
+ */
+static void
+comphistd_evict(struct comphistd *d)
+{
+	struct comphistd_entry *lru = NULL;
+
+	if (d->entries < d->max_entries)
+		return;
+
+	for (size_t b = 0; b < COMPHISTD_BUCKETS; b++) {
+		for (struct comphistd_entry *e = d->buckets[b]; e != NULL;
+		    e = e->next) {
+			if (e->state != COMPHISTD_PENDING &&
+			    (lru == NULL || e->last_used < lru->last_used))
+				lru = e;
+		}
+	}
+	if (lru != NULL)
+		comphistd_unlink(d, lru);
+}
+
+/*
+ * Return a referenced entry for the dataset's current contents, queueing a
+ * scan unless one is cached or already running.  Called with d->lock held.
+ */
+static struct comphistd_entry *
+comphistd_get(struct comphistd *d, const char *name,
+    const struct comphist_dataset_info *info)
+{
+	struct comphistd_entry *e = comphistd_lookup(d, name);
+
+	if (e != NULL && (e->guid != info->guid || e->txg != info->txg)) {
+		comphistd_unlink(d, e);
+		e = NULL;
+	}
+
+	if (e == NULL) {
+		e = calloc(1, sizeof(*e));
+		if (e == NULL)
+			return (NULL);
+		e->stats = comphist_stats_alloc();
+		if (e->stats == NULL) {
+			free(e);
+			return (NULL);
+		}
+		(void)snprintf(e->name, sizeof(e->name), "%s", name);
+		e->guid = info->guid;
+		e->txg = info->txg;
+		e->snapshot = info->snapshot;
+		e->state = COMPHISTD_PENDING;
+		e->refs = 2;
+
+		comphistd_evict(d);
+		e->next = d->buckets[comphistd_hash(name)];
+		d->buckets[comphistd_hash(name)] = e;
+		d->entries++;
+
+		if (d->qtail != NULL)
+			d->qtail->qnext = e;
+		else
+			d->qhead = e;
+		d->qtail = e;
+		pthread_cond_signal(&d->work);
+	}
+
+	e->refs++;
+	e->last_used = ++d->clock;
+	return (e);
+}
+
+static void *
+comphistd_worker(void *arg)
+{
+	struct comphistd *d = arg;
+	struct comphist_options opts = {
+		.allow_live = d->allow_live,
+		.best_effort = d->best_effort,
+		.eras = true,
+	};
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		struct comphistd_entry *e;
+		int err;
+
+		while (d->qhead == NULL)
+			pthread_cond_wait(&d->work, &d->lock);
+		e = d->qhead;
+		d->qhead = e->qnext;
+		if (d->qhead == NULL)
+			d->qtail = NULL;
+
+		/* Replaced before it started, and nobody is waiting. */
+		if (e->refs == 1) {
+			comphistd_release(e);
+			continue;
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		err = comphist_session_walk(d->sess, e->name, &opts, e->stats)
+		    != 0 ? errno : 0;
+
+		pthread_mutex_lock(&d->lock);
+		e->error = err;
+		e->state = err == 0 ? COMPHISTD_READY : COMPHISTD_FAILED;
+		/* Failures are not cached; the next query retries. */
+		if (err != 0 && comphistd_lookup(d, e->name) == e)
+			comphistd_unlink(d, e);
+		comphistd_release(e);
+		pthread_cond_broadcast(&d->done);
+	}
+
+	return (NULL);
+}
+
+static void *
+comphistd_refresher(void *arg)
+{
+	struct comphistd *d = arg;
+
+	for (;;) {
+		bool live;
+
+		(void)sleep((unsigned int)d->refresh);
+
+		pthread_mutex_lock(&d->lock);
+		live = d->live_seen;
+		d->live_seen = false;
+		pthread_mutex_unlock(&d->lock);
+
+		if (live)
+			(void)comphist_session_refresh(d->sess);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Minimal JSON for requests: one flat object of string and boolean
+ * members.  Unknown members are rejected so typos do not go unnoticed.
+ */
+static const char *
+comphistd_json_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return (p);
+}
+
+static const char *
+comphistd_json_string(const char *p, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	if (*p++ != '"')
+		return (NULL);
+
+	for (; *p != '"'; p++) {
+		char c = *p;
+
+		if (c == '\0' || (unsigned char)c < 0x20)
+			return (NULL);
+		if (c == '\\') {
+			switch (*++p) {
+			case '"':
+			case '\\':
+			case '/':
+				c = *p;
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			default:
+				/* Dataset names never need the others. */
+				return (NULL);
+			}
+		}
+		if (n + 1 >= len)
+			return (NULL);
+		buf[n++] = c;
+	}
+	buf[n] = '\0';
+
+	return (p + 1);
+}
+
+static const char *
+comphistd_json_bool(const char *p, bool *val)
+{
+	if (strncmp(p, "true", 4) == 0) {
+		*val = true;
+		return (p + 4);
+	}
+	if (strncmp(p, "false", 5) == 0) {
+		*val = false;
+		return (p + 5);
+	}
+	return (NULL);
+}
+
+static int
+comphistd_parse(const char *p, struct comphistd_query *q)
+{
+	memset(q, 0, sizeof(*q));
+
+	p = comphistd_json_ws(p);
+	if (*p++ != '{')
+		return (-1);
+	p = comphistd_json_ws(p);
+	if (*p == '}')
+		return (-1);
+
+	for (;;) {
+		char key[32];
+
+		p = comphistd_json_string(p, key, sizeof(key));
+		if (p == NULL)
+			return (-1);
+		p = comphistd_json_ws(p);
+		if (*p++ != ':')
+			return (-1);
+		p = comphistd_json_ws(p);
+
+		if (strcmp(key, "dataset") == 0)
+			p = comphistd_json_string(p, q->dataset,
+			    sizeof(q->dataset));
+		else if (strcmp(key, "histogram") == 0)
+			p = comphistd_json_bool(p, &q->histogram);
+		else if (strcmp(key, "types") == 0)
+			p = comphistd_json_bool(p, &q->types);
+		else if (strcmp(key, "eras") == 0)
+			p = comphistd_json_bool(p, &q->eras);
+		else
+			return (-1);
+		if (p == NULL)
+			return (-1);
+
+		p = comphistd_json_ws(p);
+		if (*p == '}')
+			break;
+		if (*p++ != ',')
+			return (-1);
+		p = comphistd_json_ws(p);
+	}
+
+	p = comphistd_json_ws(p + 1);
+	return (*p == '\0' && q->dataset[0] != '\0' ? 0 : -1);
+}
+
+static int
+comphistd_answer(struct comphistd *d, int fd, const struct comphistd_query *q)
+{
+	struct comphist_options opts = {
+		.format = COMPHIST_FMT_NDJSON,
+		.per_dataset = true,
+		.allow_live = d->allow_live,
+		.best_effort = d->best_effort,
+		.histogram = q->histogram,
+		.objtypes = q->types,
+		.eras = q->eras,
+	};
+	struct comphist_dataset_info info;
+	struct comphistd_entry *e;
+	int err;
+
+	/* Pools are served through the per-dataset walk only. */
+	if (strpbrk(q->dataset, "/@") == NULL ||
+	    strchr(q->dataset, '#') != NULL)
+		return (comphist_ndjson_error(fd, q->dataset,
+		    "not a dataset or snapshot"));
+
+	if (comphist_session_dataset_info(d->sess, q->dataset, &info) != 0)
+		return (comphist_ndjson_error(fd, q->dataset,
+		    strerror(errno)));
+	if (!info.snapshot && !d->allow_live)
+		return (comphist_ndjson_error(fd, q->dataset,
+		    "live datasets require --allow-live"));
+
+	pthread_mutex_lock(&d->lock);
+	if (!info.snapshot)
+		d->live_seen = true;
+	e = comphistd_get(d, q->dataset, &info);
+	if (e == NULL) {
+		pthread_mutex_unlock(&d->lock);
+		return (comphist_ndjson_error(fd, q->dataset,
+		    strerror(ENOMEM)));
+	}
+	while (e->state == COMPHISTD_PENDING)
+		pthread_cond_wait(&d->done, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+
+	/* Finished entries are never written again. */
+	if (e->state == COMPHISTD_FAILED)
+		err = comphist_ndjson_error(fd, q->dataset,
+		    strerror(e->error));
+	else
+		err = comphist_ndjson_record(fd, &opts, q->dataset, e->stats);
+
+	pthread_mutex_lock(&d->lock);
+	comphistd_release(e);
+	pthread_mutex_unlock(&d->lock);
+
+	return (err);
+}
+
+static void *
+comphistd_client(void *arg)
+{
+	struct comphistd_client *client = arg;
+	char *line = malloc(COMPHISTD_LINE_MAX);
+	size_t len = 0;
+
+	while (line != NULL) {
+		char *nl;
+		ssize_t n;
+
+		nl = memchr(line, '\n', len);
+		if (nl == NULL) {
+			if (len == COMPHISTD_LINE_MAX) {
+				(void)comphist_ndjson_error(client->fd, NULL,
+				    "request too long");
+				break;
+			}
+			n = read(client->fd, line + len,
+			    COMPHISTD_LINE_MAX - len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			len += (size_t)n;
+			continue;
+		}
+
+		*nl = '\0';
+		if (nl != line) {
+			struct comphistd_query q;
+
+			if (comphistd_parse(line, &q) != 0) {
+				if (comphist_ndjson_error(client->fd, NULL,
+				    "malformed request") != 0)
+					break;
+			} else if (comphistd_answer(client->d, client->fd,
+			    &q) != 0) {
+				break;
+			}
+		}
+		len -= (size_t)(nl + 1 - line);
+		memmove(line, nl + 1, len);
+	}
+
+	free(line);
+	(void)close(client->fd);
+	free(client);
+	return (NULL);
+}
+
+static void *
+comphistd_acceptor(void *arg)
+{
+	struct comphistd_client *listener = arg;
+
+	for (;;) {
+		struct comphistd_client *client;
+		pthread_t tid;
+		int fd;
+
+		fd = accept(listener->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("zfs-comphistd: accept");
+			(void)sleep(1);
+			continue;
+		}
+
+		client = malloc(sizeof(*client));
+		if (client == NULL) {
+			(void)close(fd);
+			continue;
+		}
+		client->d = listener->d;
+		client->fd = fd;
+		if (pthread_create(&tid, NULL, comphistd_client, client) != 0) {
+			free(client);
+			(void)close(fd);
+			continue;
+		}
+		(void)pthread_detach(tid);
+	}
+
+	return (NULL);
+}
+
+static int
+comphistd_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	(void)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return (-1);
+
+	/* A socket left behind by a previous instance. */
+	(void)unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    chmod(path, 0660) != 0 || listen(fd, 64) != 0) {
+		int err = errno;
+
+		(void)close(fd);
+		errno = err;
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+parse_count(const char *arg, long max, int *count)
+{
+	char *end = NULL;
+	long val;
+
+	errno = 0;
+	val = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || val < 1 || val > max)
+		return (-1);
+
+	*count = (int)val;
+	return (0);
+}
+
+static void
+usage(FILE *out, const char *prog)
+{
+	fprintf(out, "Usage: %s [options]\n", prog);
+	fprintf(out, "\n");
+	fprintf(out, "Options:\n");
+	fprintf(out, "  --socket=PATH  listen on PATH (default %s)\n",
+	    COMPHISTD_SOCKET);
+	fprintf(out, "  --workers=N    run at most N scans at once\n");
+	fprintf(out, "                 (default 2)\n");
+	fprintf(out, "  --cache-mb=MB  memory for cached stats (default 64);\n");
+	fprintf(out, "                 each dataset takes %zu KB\n",
+	    (sizeof(struct comphistd_entry) + comphist_stats_size()) >> 10);
+	fprintf(out, "  --refresh=SECS  re-read pools every SECS seconds\n");
+	fprintf(out, "                 while live datasets are queried\n");
+	fprintf(out, "                 (default 60)\n");
+	fprintf(out, "  --allow-live   serve live (non-snapshot) datasets\n");
+	fprintf(out, "  --best-effort  continue on I/O/checksum errors\n");
+	fprintf(out, "  -h             show this help\n");
+	fprintf(out, "\n");
+	fprintf(out, "Version: %s\n", COMPHIST_VERSION);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{"socket", required_argument, NULL, 's'},
+		{"workers", required_argument, NULL, 'w'},
+		{"cache-mb", required_argument, NULL, 'e'},
+		{"refresh", required_argument, NULL, 'R'},
+		{"allow-live", no_argument, NULL, 'L'},
+		{"best-effort", no_argument, NULL, 'B'},
+		{0, 0, 0, 0}
+	};
+	static struct comphistd d = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.work = PTHREAD_COND_INITIALIZER,
+		.done = PTHREAD_COND_INITIALIZER,
+		.workers = 2,
+		.refresh = 60,
+	};
+	struct comphistd_client listener = { .d = &d };
+	const char *path = COMPHISTD_SOCKET;
+	sigset_t sigs;
+	pthread_t tid;
+	int cache_mb = 64;
+	int c, sig;
+
+	while ((c = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			path = optarg;
+			break;
+		case 'w':
+			if (parse_count(optarg, 256, &d.workers) != 0) {
+				fprintf(stderr, "zfs-comphistd: invalid worker "
+				    "count: %s\n", optarg);
+				return (2);
+			}
+			break;
+		case 'e':
+			if (parse_count(optarg, 1 << 20, &cache_mb) != 0) {
+				fprintf(stderr, "zfs-comphistd: invalid cache "
+				    "size: %s\n", optarg);
+				return (2);
+			}
+			break;
+		case 'R':
+			if (parse_count(optarg, 86400, &d.refresh) != 0) {
+				fprintf(stderr, "zfs-comphistd: invalid "
+				    "refresh interval: %s\n", optarg);
+				return (2);
+			}
+			break;
+		case 'L':
+			d.allow_live = true;
+			break;
+		case 'B':
+			d.best_effort = true;
+			break;
+		case 'h':
+			usage(stdout, argv[0]);
+			return (0);
+		default:
+			usage(stderr, argv[0]);
+			return (2);
+		}
+	}
+	if (optind < argc) {
+		usage(stderr, argv[0]);
+		return (2);
+	}
+	/* Entries hold a full stats struct; bound them by memory, not count. */
+	d.max_entries = ((size_t)cache_mb << 20) /
+	    (sizeof(struct comphistd_entry) + comphist_stats_size());
+	if (d.max_entries == 0)
+		d.max_entries = 1;
+
+	/* Signals are taken by sigwait() below; clients may hang up. */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	if (comphist_session_open(&d.sess) != 0) {
+		fprintf(stderr, "zfs-comphistd: %s\n", strerror(errno));
+		return (1);
+	}
+
+	listener.fd = comphistd_listen(path);
+	if (listener.fd < 0) {
+		fprintf(stderr, "zfs-comphistd: cannot listen on %s: %s\n",
+		    path, strerror(errno));
+		comphist_session_close(d.sess);
+		return (1);
+	}
+
+	for (int i = 0; i < d.workers; i++) {
+		if (pthread_create(&tid, NULL, comphistd_worker, &d) != 0 ||
+		    pthread_detach(tid) != 0) {
+			fprintf(stderr, "zfs-comphistd: cannot start "
+			    "workers\n");
+			return (1);
+		}
+	}
+	if (pthread_create(&tid, NULL, comphistd_refresher, &d) != 0 ||
+	    pthread_detach(tid) != 0 ||
+	    pthread_create(&tid, NULL, comphistd_acceptor, &listener) != 0 ||
+	    pthread_detach(tid) != 0) {
+		fprintf(stderr, "zfs-comphistd: cannot start threads\n");
+		return (1);
+	}
+
+	/*
+	 * Scans may still be running; a read-only import needs no teardown,
+	 * so exit without waiting for them.
+	 */
+	(void)sigwait(&sigs, &sig);
+	(void)unlink(path);
+	return (0);
+}
@@ -0,0 +1,244 @@
+#include "dedup.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ddt.h>
+#include <sys/zfs_context.h>
+
+/*
+ * One visited reference, or after sorting and collapsing, one DDT entry
+ * with the number of references the walk visited.  DVAs are compared by
+ * vdev and offset, which is what every reference to the entry shares.
+ */
+struct comphist_dedup_ref {
+	uint64_t offset;
+	uint64_t vdev;
+	uint64_t lsize;
+	uint64_t psize;
+	uint64_t asize;
+	uint64_t refs;
+	uint64_t refcnt;
+	enum zio_compress comp;
+};
+
+struct comphist_dedup_set {
+	struct comphist_dedup_ref *refs;
+	size_t count;
+	size_t cap;
+};
+
+struct comphist_dedup_set *
+comphist_dedup_set_create(void)
+{
+	return (calloc(1, sizeof(struct comphist_dedup_set)));
+}
+
+void
+comphist_dedup_set_destroy(struct comphist_dedup_set *set)
+{
+	if (set == NULL)
+		return;
+
+	free(set->refs);
+	free(set);
+}
+
+static int
+comphist_dedup_compare(const void *a, const void *b)
+{
+	const struct comphist_dedup_ref *ra = a;
+	const struct comphist_dedup_ref *rb = b;
+
+	if (ra->vdev != rb->vdev)
+		return (ra->vdev < rb->vdev ? -1 : 1);
+	if (ra->offset != rb->offset)
+		return (ra->offset < rb->offset ? -1 : 1);
+	return (0);
+}
+
+/* Sort the references and collapse those of each entry into one. */
+static void
+comphist_dedup_collapse(struct comphist_dedup_set *set)
+{
+	size_t n = 0;
+
+	if (set->count == 0)
+		return;
+
+	qsort(set->refs, set->count, sizeof(*set->refs),
+	    comphist_dedup_compare);
+	for (size_t i = 1; i < set->count; i++) {
+		if (comphist_dedup_compare(&set->refs[n], &set->refs[i]) == 0)
+			set->refs[n].refs += set->refs[i].refs;
+		else
+			set->refs[++n] = set->refs[i];
+	}
+	set->count = n + 1;
+}
+
+/*
+ * Make room for "more" references.  A full array is sorted and collapsed
+ * first and only grown if it is still more than half full, so memory
+ * follows the number of distinct entries visited rather than references.
+ */
+static int
+comphist_dedup_reserve(struct comphist_dedup_set *set, size_t more)
+{
+	struct comphist_dedup_ref *refs;
+	size_t cap = set->cap;
+	size_t want;
+
+	if (set->count + more <= cap)
+		return (0);
+
+	comphist_dedup_collapse(set);
+	want = set->count + more;
+	if (want <= cap && set->count <= cap / 2)
+		return (0);
+	if (set->count > cap / 2 && want < cap * 2)
+		want = cap * 2;
+
+	while (cap < want)
+		cap = cap == 0 ? 1024 : cap * 2;
+	refs = realloc(set->refs, cap * sizeof(*refs));
+	if (refs == NULL)
+		return (ENOMEM);
+
+	set->refs = refs;
+	set->cap = cap;
+	return (0);
+}
+
+int
+comphist_dedup_set_add(struct comphist_dedup_set *set, const blkptr_t *bp)
+{
+	const dva_t *dva = &bp->blk_dva[0];
+	struct comphist_dedup_ref *ref;
+
+	if (comphist_dedup_reserve(set, 1) != 0)
+		return (ENOMEM);
+
+	ref = &set->refs[set->count++];
+	ref->offset = DVA_GET_OFFSET(dva);
+	ref->vdev = DVA_GET_VDEV(dva);
+	ref->lsize = BP_GET_LSIZE(bp);
+	ref->psize = BP_GET_PSIZE(bp);
+	ref->asize = BP_GET_ASIZE(bp);
+	ref->refs = 1;
+	ref->refcnt = 0;
+	ref->comp = BP_GET_COMPRESS(bp);
+	return (0);
+}
+
+/* Moves the references out of src, which is left empty. */
+int
+comphist_dedup_set_merge(struct comphist_dedup_set *dst,
+    struct comphist_dedup_set *src)
+{
+	comphist_dedup_collapse(src);
+	if (comphist_dedup_reserve(dst, src->count) != 0)
+		return (ENOMEM);
+
+	memcpy(&dst->refs[dst->count], src->refs,
+	    src->count * sizeof(*src->refs));
+	dst->count += src->count;
+	src->count = 0;
+	return (0);
+}
+
+/*
+ * Walk the whole DDT once.  Every entry is counted by algorithm; entries
+ * the walk referenced get their reference count.  A trad entry holds one
+ * phys per copies= setting, each with its own DVAs and reference count.
+ */
+static int
+comphist_dedup_walk(struct comphist_dedup_set *set, spa_t *spa,
+    struct comphist_dedup_result *result)
+{
+	ddt_bookmark_t ddb = {0};
+	ddt_lightweight_entry_t ddlwe;
+	int err;
+
+	while ((err = ddt_walk(spa, &ddb, &ddlwe)) == 0) {
+		enum zio_compress comp = DDK_GET_COMPRESS(&ddlwe.ddlwe_key);
+
+		if (comp >= ZIO_COMPRESS_FUNCTIONS)
+			comp = ZIO_COMPRESS_INHERIT;
+		result->cells[comp].ddt_entries++;
+
+		for (int p = 0; p < ddlwe.ddlwe_nphys; p++) {
+			ddt_phys_variant_t v = ddlwe.ddlwe_nphys == 1 ?
+			    DDT_PHYS_FLAT : (ddt_phys_variant_t)p;
+			uint64_t refcnt = ddt_phys_refcnt(&ddlwe.ddlwe_phys, v);
+			struct comphist_dedup_ref key, *ref;
+			blkptr_t bp = {0};
+
+			if (refcnt == 0)
+				continue;
+
+			ddt_bp_fill(&ddlwe.ddlwe_phys, v, &bp,
+			    ddt_phys_birth(&ddlwe.ddlwe_phys, v));
+			key.vdev = DVA_GET_VDEV(&bp.blk_dva[0]);
+			key.offset = DVA_GET_OFFSET(&bp.blk_dva[0]);
+			ref = bsearch(&key, set->refs, set->count,
+			    sizeof(*set->refs), comphist_dedup_compare);
+			if (ref != NULL)
+				ref->refcnt = refcnt;
+		}
+	}
+
+	return (err == ENOENT ? 0 : err);
+}
+
+int
+comphist_dedup_resolve(struct comphist_dedup_set *set, spa_t *spa,
+    struct comphist_dedup_result *result)
+{
+	ddt_object_t ddo = {0};
+	int err;
+
+	memset(result, 0, sizeof(*result));
+	comphist_dedup_collapse(set);
+
+	err = comphist_dedup_walk(set, spa, result);
+	if (err != 0)
+		return (err);
+
+	ddt_get_dedup_object_stats(spa, &ddo);
+	if (ddo.ddo_count != 0) {
+		result->ddt_entry_dspace = ddo.ddo_dspace / ddo.ddo_count;
+		result->ddt_entry_mspace = ddo.ddo_mspace / ddo.ddo_count;
+	}
+
+	for (size_t i = 0; i < set->count; i++) {
+		const struct comphist_dedup_ref *ref = &set->refs[i];
+		struct comphist_dedup_cell *cell;
+		uint64_t refcnt = ref->refcnt;
+
+		cell = &result->cells[ref->comp < ZIO_COMPRESS_FUNCTIONS ?
+		    ref->comp : ZIO_COMPRESS_INHERIT];
+		/*
+		 * A block shared by a snapshot and a later snapshot or head
+		 * is visited once by each but referenced once in the DDT.
+		 */
+		if (refcnt < ref->refs) {
+			if (refcnt == 0)
+				result->unresolved++;
+			refcnt = ref->refs;
+		}
+
+		cell->refs += ref->refs;
+		cell->ref_lsize += ref->lsize * ref->refs;
+		cell->ref_psize += ref->psize * ref->refs;
+		cell->ref_asize += ref->asize * ref->refs;
+		cell->blocks++;
+		cell->psize += ref->psize;
+		cell->asize += ref->asize;
+		cell->charged_asize += (uint64_t)((double)ref->asize *
+		    (double)ref->refs / (double)refcnt + 0.5);
+	}
+
+	return (0);
+}
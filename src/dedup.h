@@ -0,0 +1,25 @@
+#ifndef COMPHIST_DEDUP_H
+#define COMPHIST_DEDUP_H
+
+#include <sys/spa.h>
+
+#include "stats.h"
+
+/*
+ * --dedup.  Traversals collect the dedup blocks they visit, keyed by their
+ * first DVA; once the walk is complete the set is sorted and joined with
+ * one sequential walk of the pool's dedup table, rather than looking up
+ * each block in the DDT ZAPs on its own.
+ */
+struct comphist_dedup_set;
+
+struct comphist_dedup_set *comphist_dedup_set_create(void);
+void comphist_dedup_set_destroy(struct comphist_dedup_set *set);
+int comphist_dedup_set_add(struct comphist_dedup_set *set,
+    const blkptr_t *bp);
+int comphist_dedup_set_merge(struct comphist_dedup_set *dst,
+    struct comphist_dedup_set *src);
+int comphist_dedup_resolve(struct comphist_dedup_set *set, spa_t *spa,
+    struct comphist_dedup_result *result);
+
+#endif
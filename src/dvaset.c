@@ -0,0 +1,158 @@
+#include "dvaset.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/zfs_context.h>
+
+/*
+ * Fixed-capacity set of block addresses used for --unique accounting.
+ *
+ * A DVA is packed into a single 64-bit key: the top-level vdev in the high
+ * 10 bits and the allocation offset in 512-byte sectors in the low 54 bits.
+ * Keys live in open-addressing tables split into lock stripes so parallel
+ * traversals rarely contend.  The set never grows; once a stripe passes
+ * its load limit the set reports overflow and the caller retries with the
+ * address space split over more passes.
+ */
+
+#define COMPHIST_DVASET_STRIPES		256
+#define COMPHIST_DVASET_VDEV_BITS	10
+#define COMPHIST_DVASET_SECTOR_BITS	54
+#define COMPHIST_DVASET_EMPTY		UINT64_MAX
+
+struct comphist_dvaset_stripe {
+	kmutex_t lock;
+	uint64_t *keys;
+	uint64_t mask;
+	uint64_t count;
+	uint64_t limit;
+};
+
+struct comphist_dvaset {
+	atomic_bool overflow;
+	struct comphist_dvaset_stripe stripes[COMPHIST_DVASET_STRIPES];
+};
+
+static uint64_t
+comphist_dvaset_key(const dva_t *dva)
+{
+	uint64_t vdev = DVA_GET_VDEV(dva);
+	uint64_t sector = DVA_GET_OFFSET(dva) >> SPA_MINBLOCKSHIFT;
+
+	if (vdev >= (1ULL << COMPHIST_DVASET_VDEV_BITS) ||
+	    sector >= (1ULL << COMPHIST_DVASET_SECTOR_BITS))
+		return (COMPHIST_DVASET_EMPTY);
+
+	return ((vdev << COMPHIST_DVASET_SECTOR_BITS) | sector);
+}
+
+/*
+ * 64-bit finalizer from MurmurHash3.  The high byte selects the stripe, the
+ * low bits the slot, and callers partition passes on the middle bits.
+ */
+uint64_t
+comphist_dvaset_hash(const dva_t *dva)
+{
+	uint64_t h = comphist_dvaset_key(dva);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+struct comphist_dvaset *
+comphist_dvaset_create(uint64_t max_bytes)
+{
+	struct comphist_dvaset *set;
+	uint64_t slots = 1;
+
+	while (slots * 2 * COMPHIST_DVASET_STRIPES * sizeof(uint64_t) <=
+	    max_bytes)
+		slots *= 2;
+
+	set = calloc(1, sizeof(*set));
+	if (set == NULL)
+		return (NULL);
+	atomic_init(&set->overflow, false);
+
+	for (int i = 0; i < COMPHIST_DVASET_STRIPES; i++) {
+		struct comphist_dvaset_stripe *stripe = &set->stripes[i];
+
+		stripe->keys = malloc(slots * sizeof(uint64_t));
+		if (stripe->keys == NULL) {
+			comphist_dvaset_destroy(set);
+			return (NULL);
+		}
+		memset(stripe->keys, 0xff, slots * sizeof(uint64_t));
+		stripe->mask = slots - 1;
+		stripe->limit = slots - slots / 4;
+		mutex_init(&stripe->lock, NULL, MUTEX_DEFAULT, NULL);
+	}
+
+	return (set);
+}
+
+void
+comphist_dvaset_destroy(struct comphist_dvaset *set)
+{
+	for (int i = 0; i < COMPHIST_DVASET_STRIPES; i++) {
+		struct comphist_dvaset_stripe *stripe = &set->stripes[i];
+
+		if (stripe->keys == NULL)
+			break;
+		mutex_destroy(&stripe->lock);
+		free(stripe->keys);
+	}
+	free(set);
+}
+
+/*
+ * Insert a DVA.  Returns 1 if it was not in the set, 0 if it was, and
+ * -ENOSPC once the set is full.  Addresses that do not fit the packed key
+ * return -ENOTSUP.
+ */
+int
+comphist_dvaset_insert(struct comphist_dvaset *set, uint64_t hash,
+    const dva_t *dva)
+{
+	uint64_t key = comphist_dvaset_key(dva);
+	struct comphist_dvaset_stripe *stripe = &set->stripes[hash >> 56];
+	uint64_t slot;
+	int ret = 1;
+
+	if (key == COMPHIST_DVASET_EMPTY)
+		return (-ENOTSUP);
+
+	mutex_enter(&stripe->lock);
+	slot = hash & stripe->mask;
+	while (stripe->keys[slot] != COMPHIST_DVASET_EMPTY) {
+		if (stripe->keys[slot] == key) {
+			ret = 0;
+			goto out;
+		}
+		slot = (slot + 1) & stripe->mask;
+	}
+
+	if (stripe->count >= stripe->limit) {
+		atomic_store(&set->overflow, true);
+		ret = -ENOSPC;
+		goto out;
+	}
+	stripe->keys[slot] = key;
+	stripe->count++;
+out:
+	mutex_exit(&stripe->lock);
+	return (ret);
+}
+
+bool
+comphist_dvaset_overflowed(struct comphist_dvaset *set)
+{
+	return (atomic_load(&set->overflow));
+}
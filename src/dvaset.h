@@ -0,0 +1,18 @@
+#ifndef COMPHIST_DVASET_H
+#define COMPHIST_DVASET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/spa.h>
+
+struct comphist_dvaset;
+
+struct comphist_dvaset *comphist_dvaset_create(uint64_t max_bytes);
+void comphist_dvaset_destroy(struct comphist_dvaset *set);
+uint64_t comphist_dvaset_hash(const dva_t *dva);
+int comphist_dvaset_insert(struct comphist_dvaset *set, uint64_t hash,
+    const dva_t *dva);
+bool comphist_dvaset_overflowed(struct comphist_dvaset *set);
+
+#endif
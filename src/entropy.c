@@ -0,0 +1,162 @@
+#include "entropy.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define COMPHIST_ENTROPY_X86	1
+#endif
+
+/*
+ * Byte histograms are accumulated into eight interleaved tables, one per
+ * byte lane of a 64-bit word, so that consecutive bytes with the same value
+ * do not serialise on one counter.  The vector kernels load a vector at a
+ * time, count all-zero vectors (common in partially filled records and
+ * sparse images stored with compression=off) without touching the tables,
+ * and scatter the rest a word at a time from registers.
+ */
+
+#define COMPHIST_HIST_LANES	8
+
+struct comphist_bytehist {
+	uint32_t h[COMPHIST_HIST_LANES][256];
+	uint64_t zeros;
+};
+
+static inline void
+comphist_hist_word(struct comphist_bytehist *bh, uint64_t w)
+{
+	bh->h[0][w & 0xff]++;
+	bh->h[1][(w >> 8) & 0xff]++;
+	bh->h[2][(w >> 16) & 0xff]++;
+	bh->h[3][(w >> 24) & 0xff]++;
+	bh->h[4][(w >> 32) & 0xff]++;
+	bh->h[5][(w >> 40) & 0xff]++;
+	bh->h[6][(w >> 48) & 0xff]++;
+	bh->h[7][w >> 56]++;
+}
+
+static inline void
+comphist_hist_tail(struct comphist_bytehist *bh, const uint8_t *p,
+    size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		bh->h[i % COMPHIST_HIST_LANES][p[i]]++;
+}
+
+static void
+comphist_hist_scalar(struct comphist_bytehist *bh, const uint8_t *p,
+    size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		uint64_t w[2];
+
+		memcpy(w, p + i, sizeof(w));
+		comphist_hist_word(bh, w[0]);
+		comphist_hist_word(bh, w[1]);
+	}
+	comphist_hist_tail(bh, p + i, len - i);
+}
+
+#ifdef COMPHIST_ENTROPY_X86
+__attribute__((target("sse2")))
+static void
+comphist_hist_sse2(struct comphist_bytehist *bh, const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i z = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+
+		if (_mm_movemask_epi8(z) == 0xffff) {
+			bh->zeros += 16;
+		} else {
+			comphist_hist_word(bh,
+			    (uint64_t)_mm_cvtsi128_si64(v));
+			comphist_hist_word(bh,
+			    (uint64_t)_mm_cvtsi128_si64(_mm_srli_si128(v, 8)));
+		}
+	}
+	comphist_hist_tail(bh, p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void
+comphist_hist_avx2(struct comphist_bytehist *bh, const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m128i lo, hi;
+
+		if (_mm256_testz_si256(v, v)) {
+			bh->zeros += 32;
+			continue;
+		}
+		lo = _mm256_castsi256_si128(v);
+		hi = _mm256_extracti128_si256(v, 1);
+		comphist_hist_word(bh, (uint64_t)_mm_cvtsi128_si64(lo));
+		comphist_hist_word(bh, (uint64_t)_mm_extract_epi64(lo, 1));
+		comphist_hist_word(bh, (uint64_t)_mm_cvtsi128_si64(hi));
+		comphist_hist_word(bh, (uint64_t)_mm_extract_epi64(hi, 1));
+	}
+	comphist_hist_tail(bh, p + i, len - i);
+}
+#endif
+
+typedef void (*comphist_hist_fn_t)(struct comphist_bytehist *,
+    const uint8_t *, size_t);
+
+static comphist_hist_fn_t comphist_hist_fn;
+static pthread_once_t comphist_hist_once = PTHREAD_ONCE_INIT;
+
+static void
+comphist_hist_select(void)
+{
+	comphist_hist_fn = comphist_hist_scalar;
+#ifdef COMPHIST_ENTROPY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		comphist_hist_fn = comphist_hist_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		comphist_hist_fn = comphist_hist_sse2;
+#endif
+}
+
+/*
+ * Shannon entropy of buf in bits per byte (0.0 to 8.0).
+ */
+double
+comphist_entropy(const void *buf, size_t len)
+{
+	struct comphist_bytehist bh;
+	double n, sum = 0.0;
+	int c;
+
+	if (len == 0)
+		return (0.0);
+
+	(void)pthread_once(&comphist_hist_once, comphist_hist_select);
+
+	memset(&bh, 0, sizeof(bh));
+	comphist_hist_fn(&bh, buf, len);
+
+	n = (double)len;
+	for (c = 0; c < 256; c++) {
+		uint64_t count = bh.zeros * (c == 0);
+
+		for (int l = 0; l < COMPHIST_HIST_LANES; l++)
+			count += bh.h[l][c];
+		if (count != 0)
+			sum += (double)count * log2((double)count);
+	}
+
+	return (log2(n) - sum / n);
+}
@@ -0,0 +1,15 @@
+#ifndef COMPHIST_ENTROPY_H
+#define COMPHIST_ENTROPY_H
+
+#include <stddef.h>
+
+/*
+ * Order-0 entropy below this many bits per byte means an entropy coder alone
+ * would save at least 12.5%, the minimum saving ZFS requires to keep a block
+ * compressed.
+ */
+#define COMPHIST_ENTROPY_THRESHOLD	7.0
+
+double comphist_entropy(const void *buf, size_t len);
+
+#endif
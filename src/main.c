@@ -1,182 +1,127 @@
-#include "stats.h"
-#include "walker.h"
+#include "libcomphist.h"
 
 #include <errno.h>
 #include <getopt.h>
-#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-static double
-block_percent(uint64_t blocks, uint64_t total)
-{
-	if (total == 0)
-		return 0.0;
+#include <sys/fs/zfs.h>
+#include <sys/zio_compress.h>
 
-	return (double)blocks * 100.0 / (double)total;
+static int
+report_dataset_cb(const char *dsname, const struct comphist_stats *stats,
+    void *arg)
+{
+	return comphist_writer_dataset(arg, dsname, stats) != 0 ? errno : 0;
 }
 
-static void
-print_json(const struct comphist_stats *stats, const char *target,
-    bool snapshot_mode, const struct comphist_options *opts)
+static int
+parse_count(const char *arg, long max, int *count)
 {
-	fprintf(stdout, "{\n");
-	fprintf(stdout, "  \"target\": \"%s\",\n", target);
-	fprintf(stdout, "  \"mode\": \"%s\",\n",
-	    snapshot_mode ? "snapshot" : "live");
-	fprintf(stdout, "  \"best_effort\": %s,\n",
-	    opts->best_effort ? "true" : "false");
-	fprintf(stdout, "  \"entries\": [\n");
-
-	bool first = true;
-	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
-		const struct comphist_entry *entry = &stats->entries[i];
-
-		if (entry->blocks == 0)
-			continue;
-
-		if (!first)
-			fprintf(stdout, ",\n");
-		first = false;
-
-		double ratio = entry->psize == 0 ? 0.0 :
-		    (double)entry->lsize / (double)entry->psize;
-
-		fprintf(stdout,
-		    "    {\"name\":\"%s\",\"blocks\":%" PRIu64
-		    ",\"block_percent\":%.4f,\"logical_bytes\":%" PRIu64
-		    ",\"physical_bytes\":%" PRIu64 ",\"allocated_bytes\":%"
-		    PRIu64 ",\"ratio\":%.6f}",
-		    comphist_comp_name(i), entry->blocks,
-		    block_percent(entry->blocks, stats->total_blocks),
-		    entry->lsize, entry->psize, entry->asize, ratio);
-	}
+	char *end = NULL;
+	long val;
 
-	fprintf(stdout, "\n  ],\n");
-	fprintf(stdout, "  \"total\": {\"blocks\":%" PRIu64
-	    ",\"logical_bytes\":%" PRIu64 ",\"physical_bytes\":%" PRIu64
-	    ",\"allocated_bytes\":%" PRIu64 ",\"ratio\":%.6f},\n",
-	    stats->total_blocks, stats->total_lsize, stats->total_psize,
-	    stats->total_asize,
-	    stats->total_psize == 0 ? 0.0 :
-	    (double)stats->total_lsize / (double)stats->total_psize);
-	fprintf(stdout, "  \"holes\": %" PRIu64 ",\n", stats->total_holes);
-	fprintf(stdout, "  \"embedded_blocks\": %" PRIu64 ",\n",
-	    stats->total_embedded_blocks);
-	fprintf(stdout, "  \"embedded_logical_bytes\": %" PRIu64 ",\n",
-	    stats->total_embedded_lsize);
-	fprintf(stdout, "  \"redacted_blocks\": %" PRIu64 ",\n",
-	    stats->total_redacted);
-	fprintf(stdout, "  \"unknown_compression_blocks\": %" PRIu64 ",\n",
-	    stats->total_unknown);
-	fprintf(stdout, "  \"traversal_errors\": %" PRIu64 "\n",
-	    stats->traversal_errors);
-	fprintf(stdout, "}\n");
-}
+	errno = 0;
+	val = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || val < 1 || val > max)
+		return -1;
 
-static bool
-dataset_is_snapshot(const char *dsname)
-{
-	return (strchr(dsname, '@') != NULL);
+	*count = (int)val;
+	return 0;
 }
 
-static void
-print_dataset_stats(const char *dsname, const struct comphist_stats *stats,
-    bool first)
+/*
+ * Parse the --entropy algorithm list.  Only blocks ZFS stored without
+ * compression and legacy lzjb blocks are worth reading back.
+ */
+static int
+parse_entropy(const char *arg, uint32_t *mask)
 {
-	if (!first)
-		fprintf(stdout, "\n");
-
-	fprintf(stdout, "Dataset: %s\n", dsname);
-	comphist_stats_print(stats, stdout);
-	if (stats->traversal_errors > 0) {
-		fprintf(stdout, "traversal errors: %" PRIu64 "\n",
-		    stats->traversal_errors);
-	}
-}
-
-struct json_per_dataset_ctx {
-	const struct comphist_options *opts;
-	bool first;
-};
+	char buf[64];
+	char *tok, *save = NULL;
 
-static void
-print_json_dataset_entry(const char *dsname, const struct comphist_stats *stats)
-{
-	bool snapshot_mode = dataset_is_snapshot(dsname);
-
-	fprintf(stdout, "    {\"name\":\"%s\",\"mode\":\"%s\","
-	    "\"entries\":[", dsname, snapshot_mode ? "snapshot" : "live");
-
-	bool first = true;
-	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
-		const struct comphist_entry *entry = &stats->entries[i];
-		double ratio;
-
-		if (entry->blocks == 0)
-			continue;
-
-		if (!first)
-			fprintf(stdout, ",");
-		first = false;
-
-		ratio = entry->psize == 0 ? 0.0 :
-		    (double)entry->lsize / (double)entry->psize;
-
-		fprintf(stdout,
-		    "{\"name\":\"%s\",\"blocks\":%" PRIu64
-		    ",\"block_percent\":%.4f,\"logical_bytes\":%" PRIu64
-		    ",\"physical_bytes\":%" PRIu64 ",\"allocated_bytes\":%"
-		    PRIu64 ",\"ratio\":%.6f}",
-		    comphist_comp_name(i), entry->blocks,
-		    block_percent(entry->blocks, stats->total_blocks),
-		    entry->lsize, entry->psize, entry->asize, ratio);
+	*mask = 0;
+	if (arg == NULL) {
+		*mask = 1U << ZIO_COMPRESS_OFF;
+		return 0;
+	}
+	if (strlen(arg) >= sizeof(buf))
+		return -1;
+	strcpy(buf, arg);
+
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+	    tok = strtok_r(NULL, ",", &save)) {
+		if (strcmp(tok, "off") == 0)
+			*mask |= 1U << ZIO_COMPRESS_OFF;
+		else if (strcmp(tok, "lzjb") == 0)
+			*mask |= 1U << ZIO_COMPRESS_LZJB;
+		else
+			return -1;
 	}
 
-	fprintf(stdout, "],\"total\":{\"blocks\":%" PRIu64
-	    ",\"logical_bytes\":%" PRIu64 ",\"physical_bytes\":%" PRIu64
-	    ",\"allocated_bytes\":%" PRIu64 ",\"ratio\":%.6f},"
-	    "\"holes\":%" PRIu64 ",\"embedded_blocks\":%" PRIu64
-	    ",\"embedded_logical_bytes\":%" PRIu64 ",\"redacted_blocks\":%"
-	    PRIu64 ",\"unknown_compression_blocks\":%" PRIu64
-	    ",\"traversal_errors\":%" PRIu64 "}",
-	    stats->total_blocks, stats->total_lsize, stats->total_psize,
-	    stats->total_asize,
-	    stats->total_psize == 0 ? 0.0 :
-	    (double)stats->total_lsize / (double)stats->total_psize,
-	    stats->total_holes, stats->total_embedded_blocks,
-	    stats->total_embedded_lsize, stats->total_redacted,
-	    stats->total_unknown, stats->traversal_errors);
+	return *mask == 0 ? -1 : 0;
 }
 
+/*
+ * Parse a --sample percentage such as "1", "0.5" or "2.5%".
+ */
 static int
-print_json_dataset_cb(const char *dsname, const struct comphist_stats *stats,
-    void *arg)
+parse_percent(const char *arg, double *fraction)
 {
-	struct json_per_dataset_ctx *ctx = arg;
-
-	if (!ctx->first)
-		fprintf(stdout, ",\n");
-	ctx->first = false;
-
-	print_json_dataset_entry(dsname, stats);
+	char *end = NULL;
+	double val;
+
+	errno = 0;
+	val = strtod(arg, &end);
+	if (end != arg && *end == '%')
+		end++;
+	if (errno != 0 || end == arg || *end != '\0' || !(val > 0.0) ||
+	    val > 100.0)
+		return -1;
+
+	*fraction = val / 100.0;
 	return 0;
 }
 
-struct text_per_dataset_ctx {
-	bool first;
-};
-
+/*
+ * Targets walked live need --allow-live; snapshots are consistent on their
+ * own.
+ */
 static int
-print_text_dataset_cb(const char *dsname, const struct comphist_stats *stats,
-    void *arg)
+check_target(const char *target, const struct comphist_options *opts)
 {
-	struct text_per_dataset_ctx *ctx = arg;
+	bool has_snap = (strchr(target, '@') != NULL);
+	bool has_bookmark = (strchr(target, '#') != NULL);
+	bool is_pool = (strpbrk(target, "/@#") == NULL);
+
+	if (has_bookmark) {
+		fprintf(stderr, "comphist: bookmarks are not supported: %s\n",
+		    target);
+		return -1;
+	}
+
+	if (is_pool) {
+		if (!opts->allow_live) {
+			fprintf(stderr, "comphist: pool traversal requires "
+			    "--allow-live\n");
+			return -1;
+		}
+	} else {
+		if (opts->recursive && has_snap) {
+			fprintf(stderr, "comphist: -r does not apply to "
+			    "dataset snapshots\n");
+			return -1;
+		}
+		if (!has_snap && !opts->allow_live) {
+			fprintf(stderr, "comphist: dataset traversal requires "
+			    "@snapshot or --allow-live\n");
+			return -1;
+		}
+	}
 
-	print_dataset_stats(dsname, stats, ctx->first);
-	ctx->first = false;
 	return 0;
 }
 
@@ -184,13 +129,68 @@ static void
 usage(FILE *out, const char *prog)
 {
 	fprintf(out, "Usage: %s [options] <pool|dataset>\n", prog);
+	fprintf(out, "       %s --replay=FILE [options]\n", prog);
 	fprintf(out, "\n");
 	fprintf(out, "Options:\n");
 	fprintf(out, "  -r        recurse datasets (dataset targets only)\n");
 	fprintf(out, "  -p, --per-dataset  print a table per dataset\n");
+	fprintf(out, "  -j N      traverse up to N datasets in parallel\n");
+	fprintf(out, "  --single-pass  pool targets: visit every block once with\n");
+	fprintf(out, "                 traverse_pool(); -p reports blocks under the\n");
+	fprintf(out, "                 dataset or snapshot they were born in\n");
+	fprintf(out, "  --path=DIR     traverse only the objects under DIR, a path\n");
+	fprintf(out, "                 from the root of a filesystem target\n");
+	fprintf(out, "  --shards=N     split each dataset into N object ranges\n");
+	fprintf(out, "                 traversed in parallel\n");
+	fprintf(out, "  --pipeline=N   account blocks on N aggregator threads\n");
+	fprintf(out, "                 fed from the traversal thread\n");
+	fprintf(out, "  --cache=FILE   reuse and record snapshot results in FILE\n");
+	fprintf(out, "  --checkpoint=FILE  save scan state to FILE every minute;\n");
+	fprintf(out, "                 removed when the scan completes\n");
+	fprintf(out, "  --resume=FILE  continue the scan checkpointed in FILE\n");
+	fprintf(out, "  --record=FILE  also write every block visited to the\n");
+	fprintf(out, "                 trace FILE\n");
+	fprintf(out, "  --replay=FILE  report from the trace FILE instead of the\n");
+	fprintf(out, "                 pool; takes no target\n");
+	fprintf(out, "  --unique       count each allocated block once across\n");
+	fprintf(out, "                 snapshots, clones and cloned blocks\n");
+	fprintf(out, "  --unique-mem=MB  memory for --unique (default 1024);\n");
+	fprintf(out, "                 larger pools take several passes\n");
+	fprintf(out, "  --sample=PCT   traverse a random PCT%% of objects and scale\n");
+	fprintf(out, "                 the results up, with 95%% confidence\n");
+	fprintf(out, "                 intervals\n");
+	fprintf(out, "  --histogram    show power-of-two block size histograms\n");
+	fprintf(out, "                 per algorithm\n");
+	fprintf(out, "  --types        break down by object type and indirection\n");
+	fprintf(out, "                 level\n");
+	fprintf(out, "  --eras         break down by block birth txg, with dates\n");
+	fprintf(out, "                 estimated from dataset creation times\n");
+	fprintf(out, "  --vdevs        break down allocations by allocation class\n");
+	fprintf(out, "                 and top-level vdev, with padding, copies\n");
+	fprintf(out, "                 and gang blocks\n");
+	fprintf(out, "  --entropy[=ALGS]  read back blocks stored with ALGS\n");
+	fprintf(out, "                 (off, lzjb; default off) and split them\n");
+	fprintf(out, "                 by content entropy\n");
+	fprintf(out, "  --zstd-levels  read zstd block headers and break zstd\n");
+	fprintf(out, "                 down by the level it was written with\n");
+	fprintf(out, "  --simulate=ALGS  estimate sizes if sampled data blocks\n");
+	fprintf(out, "                 were rewritten with each of ALGS, e.g.\n");
+	fprintf(out, "                 zstd-3,zstd-9,lz4\n");
+	fprintf(out, "  --simulate-samples=N  blocks to sample (default 4096)\n");
+	fprintf(out, "  --dedup        resolve dedup blocks against the dedup table\n");
+	fprintf(out, "                 and report allocated beside referenced bytes\n");
+	fprintf(out, "  --top=N        list the N objects with the most bytes in\n");
+	fprintf(out, "                 uncompressed and lzjb blocks, with paths\n");
+	fprintf(out, "  --progress=SECS  print progress and ETA to stderr every\n");
+	fprintf(out, "                 SECS seconds (also on SIGUSR1)\n");
+	fprintf(out, "  --metrics      report scan time, metadata reads and ARC\n");
+	fprintf(out, "                 hit rate\n");
 	fprintf(out, "  --allow-live   allow live (non-snapshot) traversal\n");
 	fprintf(out, "  --best-effort  continue on I/O/checksum errors\n");
-	fprintf(out, "  --json         emit JSON output\n");
+	fprintf(out, "  --format=FMT   text (default), json, ndjson or csv; with\n");
+	fprintf(out, "                 -p, ndjson and csv stream one record per\n");
+	fprintf(out, "                 dataset as it completes\n");
+	fprintf(out, "  --json         same as --format=json\n");
 	fprintf(out, "  -h        show this help\n");
 	fprintf(out, "\n");
 	fprintf(out, "Notes:\n");
@@ -205,24 +205,181 @@ int
 main(int argc, char **argv)
 {
 	struct comphist_options opts = {0};
-	struct comphist_stats stats;
+	struct comphist_session *sess;
+	struct comphist_stats *stats = NULL;
+	struct comphist_writer *w;
 	const char *target = NULL;
+	int top = 0;
+	char replay_target[ZFS_MAX_DATASET_NAME_LEN];
 	bool has_snap = false;
-	bool has_bookmark = false;
 	bool is_pool = false;
-	int c;
+	int c, err;
 	int long_index = 0;
 	static const struct option long_opts[] = {
 		{"allow-live", no_argument, NULL, 'L'},
 		{"best-effort", no_argument, NULL, 'B'},
 		{"json", no_argument, NULL, 'J'},
+		{"format", required_argument, NULL, 'F'},
 		{"per-dataset", no_argument, NULL, 'p'},
+		{"single-pass", no_argument, NULL, '1'},
+		{"path", required_argument, NULL, 'A'},
+		{"shards", required_argument, NULL, 'S'},
+		{"pipeline", required_argument, NULL, 'P'},
+		{"cache", required_argument, NULL, 'C'},
+		{"checkpoint", required_argument, NULL, 'K'},
+		{"resume", required_argument, NULL, 'Q'},
+		{"record", required_argument, NULL, 'W'},
+		{"replay", required_argument, NULL, 'Z'},
+		{"unique", no_argument, NULL, 'U'},
+		{"histogram", no_argument, NULL, 'H'},
+		{"types", no_argument, NULL, 'T'},
+		{"eras", no_argument, NULL, 'E'},
+		{"vdevs", no_argument, NULL, 'V'},
+		{"metrics", no_argument, NULL, 'I'},
+		{"progress", required_argument, NULL, 'G'},
+		{"sample", required_argument, NULL, 'R'},
+		{"entropy", optional_argument, NULL, 'Y'},
+		{"zstd-levels", no_argument, NULL, 'z'},
+		{"simulate", required_argument, NULL, 'X'},
+		{"simulate-samples", required_argument, NULL, 'N'},
+		{"dedup", no_argument, NULL, 'D'},
+		{"top", required_argument, NULL, 'O'},
+		{"unique-mem", required_argument, NULL, 'M'},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "rhp", long_opts,
+	while ((c = getopt_long(argc, argv, "rhpj:", long_opts,
 	    &long_index)) != -1) {
 		switch (c) {
+		case 'j':
+			if (parse_count(optarg, 1024, &opts.jobs) != 0) {
+				fprintf(stderr, "comphist: invalid job count: "
+				    "%s\n", optarg);
+				return 2;
+			}
+			break;
+		case '1':
+			opts.single_pass = true;
+			break;
+		case 'A':
+			if (optarg[0] != '/') {
+				fprintf(stderr, "comphist: --path must be "
+				    "absolute: %s\n", optarg);
+				return 2;
+			}
+			opts.path = optarg;
+			break;
+		case 'S':
+			if (parse_count(optarg, 1024, &opts.shards) != 0) {
+				fprintf(stderr, "comphist: invalid shard count: "
+				    "%s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'P':
+			if (parse_count(optarg, 1024, &opts.pipeline) != 0) {
+				fprintf(stderr, "comphist: invalid aggregator "
+				    "count: %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'C':
+			opts.cache_path = optarg;
+			break;
+		case 'K':
+			opts.checkpoint_path = optarg;
+			break;
+		case 'Q':
+			opts.resume_path = optarg;
+			break;
+		case 'W':
+			opts.record_path = optarg;
+			break;
+		case 'Z':
+			opts.replay_path = optarg;
+			break;
+		case 'U':
+			opts.unique = true;
+			break;
+		case 'H':
+			opts.histogram = true;
+			break;
+		case 'T':
+			opts.objtypes = true;
+			break;
+		case 'E':
+			opts.eras = true;
+			break;
+		case 'V':
+			opts.vdevs = true;
+			break;
+		case 'I':
+			opts.metrics = true;
+			break;
+		case 'G':
+			if (parse_count(optarg, 86400, &opts.progress) != 0) {
+				fprintf(stderr, "comphist: invalid progress "
+				    "interval: %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'R':
+			if (parse_percent(optarg, &opts.sample) != 0) {
+				fprintf(stderr, "comphist: invalid sample "
+				    "percentage: %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'Y':
+			if (parse_entropy(optarg, &opts.entropy) != 0) {
+				fprintf(stderr, "comphist: invalid --entropy "
+				    "list: %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'z':
+			opts.zstd_levels = true;
+			break;
+		case 'X':
+			if (!comphist_sim_spec_valid(optarg)) {
+				fprintf(stderr, "comphist: invalid --simulate "
+				    "list: %s\n", optarg);
+				return 2;
+			}
+			opts.simulate = optarg;
+			break;
+		case 'N': {
+			int samples;
+
+			if (parse_count(optarg, 1 << 24, &samples) != 0) {
+				fprintf(stderr, "comphist: invalid sample "
+				    "count: %s\n", optarg);
+				return 2;
+			}
+			opts.sim_samples = (uint64_t)samples;
+			break;
+		}
+		case 'D':
+			opts.dedup = true;
+			break;
+		case 'O':
+			if (parse_count(optarg, COMPHIST_TOP_MAX, &top) != 0) {
+				fprintf(stderr, "comphist: invalid --top "
+				    "count: %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'M': {
+			int mb;
+
+			if (parse_count(optarg, 1 << 24, &mb) != 0) {
+				fprintf(stderr, "comphist: invalid memory size: "
+				    "%s\n", optarg);
+				return 2;
+			}
+			opts.unique_mem = (uint64_t)mb << 20;
+			break;
+		}
 		case 'B':
 			opts.best_effort = true;
 			break;
@@ -230,7 +387,14 @@ main(int argc, char **argv)
 			opts.allow_live = true;
 			break;
 		case 'J':
-			opts.json = true;
+			opts.format = COMPHIST_FMT_JSON;
+			break;
+		case 'F':
+			if (comphist_format_parse(optarg, &opts.format) != 0) {
+				fprintf(stderr, "comphist: invalid output format: "
+				    "%s\n", optarg);
+				return 2;
+			}
 			break;
 		case 'p':
 			opts.per_dataset = true;
@@ -247,107 +411,184 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (optind >= argc) {
-		usage(stderr, argv[0]);
-		return 2;
-	}
+	if (opts.replay_path != NULL) {
+		if (optind < argc) {
+			fprintf(stderr, "comphist: --replay takes no target\n");
+			return 2;
+		}
+		if (opts.record_path != NULL || opts.jobs > 1 ||
+		    opts.shards > 1 || opts.pipeline > 0 || opts.single_pass ||
+		    opts.cache_path != NULL || opts.checkpoint_path != NULL ||
+		    opts.resume_path != NULL || opts.unique ||
+		    opts.sample > 0.0 || opts.entropy != 0 ||
+		    opts.zstd_levels || opts.simulate != NULL ||
+		    opts.metrics || top > 0 ||
+		    opts.vdevs || opts.dedup || opts.path != NULL ||
+		    opts.progress > 0 || opts.recursive) {
+			fprintf(stderr, "comphist: --replay only takes report "
+			    "options: -p, --format, --json, --histogram, "
+			    "--types and --eras\n");
+			return 2;
+		}
 
-	target = argv[optind];
+		/* The target was checked when the trace was recorded. */
+		err = comphist_trace_target(opts.replay_path, replay_target,
+		    sizeof(replay_target));
+		if (err != 0) {
+			fprintf(stderr, "comphist: cannot read trace '%s': %s\n",
+			    opts.replay_path, strerror(err));
+			return 1;
+		}
+		target = replay_target;
+	} else {
+		if (optind >= argc) {
+			usage(stderr, argv[0]);
+			return 2;
+		}
+		target = argv[optind];
+		if (check_target(target, &opts) != 0)
+			return 2;
+	}
 	has_snap = (strchr(target, '@') != NULL);
-	has_bookmark = (strchr(target, '#') != NULL);
 	is_pool = (strpbrk(target, "/@#") == NULL);
 
-	if (has_bookmark) {
-		fprintf(stderr, "comphist: bookmarks are not supported: %s\n",
-		    target);
+	/* A resumed scan keeps checkpointing to the file it resumed from. */
+	if (opts.resume_path != NULL && opts.checkpoint_path == NULL)
+		opts.checkpoint_path = opts.resume_path;
+
+	if (opts.checkpoint_path != NULL && (opts.unique ||
+	    opts.simulate != NULL || opts.single_pass)) {
+		fprintf(stderr, "comphist: --checkpoint and --resume cannot be "
+		    "combined with --unique, --simulate or --single-pass\n");
 		return 2;
 	}
 
-	if (is_pool) {
-		if (!opts.allow_live) {
-			fprintf(stderr, "comphist: pool traversal requires "
-			    "--allow-live\n");
+	if (opts.record_path != NULL && (opts.unique || opts.sample > 0.0 ||
+	    opts.cache_path != NULL || opts.checkpoint_path != NULL ||
+	    opts.single_pass)) {
+		fprintf(stderr, "comphist: --record cannot be combined with "
+		    "--unique, --sample, --cache, --checkpoint, --resume or "
+		    "--single-pass\n");
+		return 2;
+	}
+
+	if (opts.single_pass) {
+		if (!is_pool) {
+			fprintf(stderr, "comphist: --single-pass requires a "
+			    "pool target\n");
 			return 2;
 		}
-	} else {
-		if (opts.recursive && has_snap) {
-			fprintf(stderr, "comphist: -r does not apply to "
-			    "dataset snapshots\n");
+		if (opts.jobs > 1 || opts.shards > 1 || opts.unique ||
+		    opts.sample > 0.0 || opts.entropy != 0 ||
+		    opts.zstd_levels || opts.cache_path != NULL) {
+			fprintf(stderr, "comphist: --single-pass cannot be "
+			    "combined with -j, --shards, --unique, --sample, "
+			    "--entropy, --zstd-levels or --cache\n");
 			return 2;
 		}
-		if (!has_snap && !opts.allow_live) {
-			fprintf(stderr, "comphist: dataset traversal requires "
-			    "@snapshot or --allow-live\n");
+	}
+
+	if (opts.path != NULL) {
+		if (is_pool || opts.recursive) {
+			fprintf(stderr, "comphist: --path requires a single "
+			    "filesystem target\n");
+			return 2;
+		}
+		if (opts.pipeline > 0 || opts.sample > 0.0 ||
+		    opts.cache_path != NULL || opts.checkpoint_path != NULL) {
+			fprintf(stderr, "comphist: --path cannot be combined "
+			    "with --pipeline, --sample, --cache, --checkpoint "
+			    "or --resume\n");
 			return 2;
 		}
 	}
 
-	if (opts.per_dataset) {
-		if (opts.json) {
-			struct json_per_dataset_ctx ctx = {
-				.opts = &opts,
-				.first = true,
-			};
-
-			fprintf(stdout, "{\n");
-			fprintf(stdout, "  \"target\": \"%s\",\n", target);
-			fprintf(stdout, "  \"allow_live\": %s,\n",
-			    opts.allow_live ? "true" : "false");
-			fprintf(stdout, "  \"best_effort\": %s,\n",
-			    opts.best_effort ? "true" : "false");
-			fprintf(stdout, "  \"datasets\": [\n");
-
-			if (comphist_walk_datasets(target, &opts,
-			    print_json_dataset_cb, &ctx) != 0) {
-				fprintf(stderr, "comphist: failed to walk '%s': %s\n",
-				    target, strerror(errno));
-				return 1;
-			}
+	if (opts.unique && opts.per_dataset) {
+		fprintf(stderr, "comphist: --unique does not apply to "
+		    "per-dataset output\n");
+		return 2;
+	}
 
-			fprintf(stdout, "\n  ]\n");
-			fprintf(stdout, "}\n");
-		} else {
-			struct text_per_dataset_ctx ctx = {
-				.first = true,
-			};
-
-			if (comphist_walk_datasets(target, &opts,
-			    print_text_dataset_cb, &ctx) != 0) {
-				fprintf(stderr, "comphist: failed to walk '%s': %s\n",
-				    target, strerror(errno));
-				return 1;
-			}
+	if (opts.simulate != NULL && opts.per_dataset) {
+		fprintf(stderr, "comphist: --simulate does not apply to "
+		    "per-dataset output\n");
+		return 2;
+	}
 
-			if (has_snap) {
-				fprintf(stdout, "\nsnapshot mode\n");
-			} else if (opts.allow_live) {
-				fprintf(stdout, "\nlive mode enabled\n");
-			}
-		}
-		return 0;
+	if (top > 0 && (opts.per_dataset || opts.single_pass ||
+	    opts.unique || opts.sample > 0.0 || opts.cache_path != NULL ||
+	    opts.checkpoint_path != NULL)) {
+		fprintf(stderr, "comphist: --top cannot be combined with -p, "
+		    "--single-pass, --unique, --sample, --cache, --checkpoint "
+		    "or --resume\n");
+		return 2;
+	}
+
+	if (opts.dedup && (opts.per_dataset || opts.single_pass ||
+	    opts.unique || opts.sample > 0.0 || opts.cache_path != NULL ||
+	    opts.checkpoint_path != NULL)) {
+		fprintf(stderr, "comphist: --dedup cannot be combined with -p, "
+		    "--single-pass, --unique, --sample, --cache, --checkpoint "
+		    "or --resume\n");
+		return 2;
 	}
 
-	comphist_stats_init(&stats);
+	if (opts.sample > 0.0 && (opts.unique || opts.simulate != NULL ||
+	    opts.entropy != 0 || opts.zstd_levels)) {
+		fprintf(stderr, "comphist: --sample cannot be combined with "
+		    "--unique, --simulate, --entropy or --zstd-levels\n");
+		return 2;
+	}
 
-	if (comphist_walk(target, &opts, &stats) != 0) {
-		fprintf(stderr, "comphist: failed to walk '%s': %s\n",
-		    target, strerror(errno));
+	if (opts.format == COMPHIST_FMT_CSV && (opts.sample > 0.0 ||
+	    opts.objtypes || opts.entropy != 0 || opts.simulate != NULL ||
+	    opts.eras || opts.vdevs || opts.histogram || opts.metrics ||
+	    opts.dedup || opts.zstd_levels || top > 0)) {
+		fprintf(stderr, "comphist: --format=csv carries the "
+		    "compression table only; use json or ndjson for --sample, "
+		    "--types, --entropy, --zstd-levels, --simulate, --eras, "
+		    "--vdevs, --histogram, --metrics, --dedup or --top\n");
+		return 2;
+	}
+
+	if (top > 0)
+		opts.top = comphist_top_create((size_t)top);
+
+	if (!opts.per_dataset)
+		stats = comphist_stats_alloc();
+	w = comphist_writer_open(STDOUT_FILENO, &opts, target, has_snap);
+	if (w == NULL || (top > 0 && opts.top == NULL) ||
+	    (!opts.per_dataset && stats == NULL) ||
+	    comphist_session_open(&sess) != 0) {
+		fprintf(stderr, "comphist: %s\n", strerror(ENOMEM));
 		return 1;
 	}
 
-	if (opts.json) {
-		print_json(&stats, target, has_snap, &opts);
+	if (opts.per_dataset) {
+		err = comphist_session_walk_datasets(sess, target, &opts,
+		    report_dataset_cb, w);
 	} else {
-		comphist_stats_print(&stats, stdout);
-		if (stats.traversal_errors > 0) {
-			fprintf(stdout, "traversal errors: %" PRIu64 "\n",
-			    stats.traversal_errors);
-		}
-		if (has_snap) {
-			fprintf(stdout, "snapshot mode\n");
-		} else if (opts.allow_live) {
-			fprintf(stdout, "live mode enabled\n");
-		}
+		err = comphist_session_walk(sess, target, &opts, stats);
+		if (err == 0)
+			err = comphist_writer_total(w, stats);
+	}
+	if (err != 0)
+		err = errno;
+	comphist_session_close(sess);
+	comphist_stats_free(stats);
+	if (err != 0) {
+		(void)comphist_writer_close(w);
+		fprintf(stderr, "comphist: failed to walk '%s': %s\n",
+		    target, strerror(err));
+		return 1;
+	}
+
+	err = comphist_writer_close(w);
+	comphist_top_destroy(opts.top);
+	if (err != 0) {
+		fprintf(stderr, "comphist: failed to write output: %s\n",
+		    strerror(errno));
+		return 1;
 	}
 	return 0;
 }
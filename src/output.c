@@ -0,0 +1,210 @@
+#include "output.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct comphist_out {
+	int fd;
+	int err;
+	size_t len;
+	char buf[COMPHIST_OUT_BUFSIZE];
+};
+
+struct comphist_out *
+comphist_out_open(int fd)
+{
+	struct comphist_out *out = malloc(sizeof(*out));
+
+	if (out == NULL)
+		return (NULL);
+
+	out->fd = fd;
+	out->err = 0;
+	out->len = 0;
+	return (out);
+}
+
+static void
+comphist_out_drain(struct comphist_out *out, const char *buf, size_t len)
+{
+	while (len > 0 && out->err == 0) {
+		ssize_t n = write(out->fd, buf, len);
+
+		if (n < 0) {
+			if (errno != EINTR)
+				out->err = errno;
+			continue;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+}
+
+int
+comphist_out_flush(struct comphist_out *out)
+{
+	comphist_out_drain(out, out->buf, out->len);
+	out->len = 0;
+	return (out->err);
+}
+
+int
+comphist_out_close(struct comphist_out *out)
+{
+	int err = comphist_out_flush(out);
+
+	free(out);
+	return (err);
+}
+
+void
+comphist_out_write(struct comphist_out *out, const char *buf, size_t len)
+{
+	if (out->len + len > sizeof(out->buf)) {
+		(void)comphist_out_flush(out);
+		if (len > sizeof(out->buf)) {
+			comphist_out_drain(out, buf, len);
+			return;
+		}
+	}
+
+	memcpy(out->buf + out->len, buf, len);
+	out->len += len;
+}
+
+void
+comphist_out_puts(struct comphist_out *out, const char *s)
+{
+	comphist_out_write(out, s, strlen(s));
+}
+
+void
+comphist_out_vprintf(struct comphist_out *out, const char *fmt, va_list ap)
+{
+	size_t avail = sizeof(out->buf) - out->len;
+	va_list copy;
+	char *big;
+	int n;
+
+	va_copy(copy, ap);
+	n = vsnprintf(out->buf + out->len, avail, fmt, copy);
+	va_end(copy);
+	if (n < 0)
+		return;
+	if ((size_t)n < avail) {
+		out->len += (size_t)n;
+		return;
+	}
+
+	/* Did not fit: retry in an empty buffer, or format on the heap. */
+	(void)comphist_out_flush(out);
+	if ((size_t)n < sizeof(out->buf)) {
+		out->len = (size_t)vsnprintf(out->buf, sizeof(out->buf), fmt,
+		    ap);
+		return;
+	}
+
+	big = malloc((size_t)n + 1);
+	if (big == NULL) {
+		if (out->err == 0)
+			out->err = ENOMEM;
+		return;
+	}
+	(void)vsnprintf(big, (size_t)n + 1, fmt, ap);
+	comphist_out_drain(out, big, (size_t)n);
+	free(big);
+}
+
+void
+comphist_out_printf(struct comphist_out *out, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	comphist_out_vprintf(out, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Dataset and snapshot names are byte strings; bytes above 0x7f are passed
+ * through unchanged, so names that are valid UTF-8 stay readable.
+ */
+void
+comphist_out_json_string(struct comphist_out *out, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run;
+
+	if (s == NULL) {
+		comphist_out_write(out, "null", 4);
+		return;
+	}
+
+	comphist_out_write(out, "\"", 1);
+	for (run = s; *s != '\0'; s++) {
+		unsigned char c = (unsigned char)*s;
+		char esc[6] = { '\\', 'u', '0', '0' };
+		size_t elen = 2;
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		comphist_out_write(out, run, (size_t)(s - run));
+		run = s + 1;
+
+		switch (c) {
+		case '"':
+		case '\\':
+			esc[1] = (char)c;
+			break;
+		case '\b':
+			esc[1] = 'b';
+			break;
+		case '\f':
+			esc[1] = 'f';
+			break;
+		case '\n':
+			esc[1] = 'n';
+			break;
+		case '\r':
+			esc[1] = 'r';
+			break;
+		case '\t':
+			esc[1] = 't';
+			break;
+		default:
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			elen = sizeof(esc);
+			break;
+		}
+		comphist_out_write(out, esc, elen);
+	}
+	comphist_out_write(out, run, (size_t)(s - run));
+	comphist_out_write(out, "\"", 1);
+}
+
+void
+comphist_out_csv_field(struct comphist_out *out, const char *s)
+{
+	const char *run;
+
+	if (s[strcspn(s, ",\"\r\n")] == '\0') {
+		comphist_out_puts(out, s);
+		return;
+	}
+
+	comphist_out_write(out, "\"", 1);
+	for (run = s; *s != '\0'; s++) {
+		if (*s != '"')
+			continue;
+		/* Write the quote twice: once with the run, once here. */
+		comphist_out_write(out, run, (size_t)(s - run) + 1);
+		run = s;
+	}
+	comphist_out_write(out, run, (size_t)(s - run));
+	comphist_out_write(out, "\"", 1);
+}
@@ -0,0 +1,35 @@
+#ifndef COMPHIST_OUTPUT_H
+#define COMPHIST_OUTPUT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/*
+ * Buffered report writer.  Output is collected in a COMPHIST_OUT_BUFSIZE
+ * buffer and handed to write(2) when it fills or on an explicit flush, so a
+ * report of many small fields costs one system call per buffer rather than
+ * one stdio call per field.  The first write error is kept and returned by
+ * comphist_out_flush() and comphist_out_close(); later output is dropped.
+ */
+#define COMPHIST_OUT_BUFSIZE	(256 << 10)
+
+struct comphist_out;
+
+struct comphist_out *comphist_out_open(int fd);
+int comphist_out_close(struct comphist_out *out);
+int comphist_out_flush(struct comphist_out *out);
+
+void comphist_out_write(struct comphist_out *out, const char *buf,
+    size_t len);
+void comphist_out_puts(struct comphist_out *out, const char *s);
+void comphist_out_printf(struct comphist_out *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void comphist_out_vprintf(struct comphist_out *out, const char *fmt,
+    va_list ap) __attribute__((format(printf, 2, 0)));
+
+/* Quoted and escaped JSON string; NULL is written as null. */
+void comphist_out_json_string(struct comphist_out *out, const char *s);
+/* RFC 4180 field: quoted only when it holds a comma, quote or line break. */
+void comphist_out_csv_field(struct comphist_out *out, const char *s);
+
+#endif
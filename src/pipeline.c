@@ -0,0 +1,244 @@
+#include "pipeline.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/zfs_context.h>
+
+/*
+ * Traversal/accounting pipeline.
+ *
+ * The traversal thread is the only producer.  It fills fixed-size batches of
+ * struct comphist_block in place inside a per-aggregator SPSC ring and hands
+ * full batches to the aggregators round-robin.  Each aggregator drains its
+ * ring into private stats, which are merged into the caller's stats when the
+ * pipeline is finished.  Neither side takes a lock; a full ring stalls the
+ * producer and an empty ring idles the aggregator, and both are timed.
+ */
+
+#define COMPHIST_PIPE_BATCH	512
+#define COMPHIST_PIPE_SLOTS	64
+#define COMPHIST_PIPE_SPINS	64
+
+struct comphist_batch {
+	uint32_t count;
+	struct comphist_block blocks[COMPHIST_PIPE_BATCH];
+};
+
+struct comphist_ring {
+	_Alignas(64) atomic_uint_fast64_t head;
+	_Alignas(64) atomic_uint_fast64_t tail;
+	_Alignas(64) atomic_bool done;
+	struct comphist_stats stats;
+	uint64_t idle_ns;
+	struct comphist_batch slots[COMPHIST_PIPE_SLOTS];
+};
+
+struct comphist_pipeline {
+	int nrings;
+	int cur;
+	struct comphist_batch *batch;
+	uint64_t batches;
+	uint64_t depth_sum;
+	uint64_t depth_max;
+	uint64_t stall_ns;
+	taskq_t *tq;
+	struct comphist_ring *rings;
+};
+
+static uint64_t
+comphist_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static void
+comphist_backoff(unsigned *spins)
+{
+	if (++*spins < COMPHIST_PIPE_SPINS) {
+		sched_yield();
+	} else {
+		struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000 };
+
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void
+comphist_aggregator_task(void *arg)
+{
+	struct comphist_ring *ring = arg;
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	for (;;) {
+		uint64_t tail = atomic_load_explicit(&ring->tail,
+		    memory_order_acquire);
+
+		if (head == tail) {
+			uint64_t start;
+			unsigned spins = 0;
+
+			if (atomic_load_explicit(&ring->done,
+			    memory_order_acquire) &&
+			    head == atomic_load_explicit(&ring->tail,
+			    memory_order_acquire))
+				return;
+
+			start = comphist_now_ns();
+			while (head == atomic_load_explicit(&ring->tail,
+			    memory_order_acquire) &&
+			    !atomic_load_explicit(&ring->done,
+			    memory_order_acquire))
+				comphist_backoff(&spins);
+			ring->idle_ns += comphist_now_ns() - start;
+			continue;
+		}
+
+		while (head != tail) {
+			struct comphist_batch *batch =
+			    &ring->slots[head % COMPHIST_PIPE_SLOTS];
+
+			for (uint32_t i = 0; i < batch->count; i++)
+				comphist_stats_account(&ring->stats,
+				    &batch->blocks[i]);
+			head++;
+			atomic_store_explicit(&ring->head, head,
+			    memory_order_release);
+		}
+	}
+}
+
+/*
+ * Claim the next free slot in the current ring, stalling while the
+ * aggregator is a full ring behind.
+ */
+static struct comphist_batch *
+comphist_pipeline_claim(struct comphist_pipeline *pipe)
+{
+	struct comphist_ring *ring = &pipe->rings[pipe->cur];
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	struct comphist_batch *batch;
+
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >=
+	    COMPHIST_PIPE_SLOTS) {
+		uint64_t start = comphist_now_ns();
+		unsigned spins = 0;
+
+		while (tail - atomic_load_explicit(&ring->head,
+		    memory_order_acquire) >= COMPHIST_PIPE_SLOTS)
+			comphist_backoff(&spins);
+		pipe->stall_ns += comphist_now_ns() - start;
+	}
+
+	batch = &ring->slots[tail % COMPHIST_PIPE_SLOTS];
+	batch->count = 0;
+	return (batch);
+}
+
+static void
+comphist_pipeline_publish(struct comphist_pipeline *pipe)
+{
+	struct comphist_ring *ring = &pipe->rings[pipe->cur];
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint64_t depth = tail + 1 -
+	    atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	pipe->batches++;
+	pipe->depth_sum += depth;
+	if (depth > pipe->depth_max)
+		pipe->depth_max = depth;
+
+	pipe->batch = NULL;
+	pipe->cur = (pipe->cur + 1) % pipe->nrings;
+}
+
+struct comphist_pipeline *
+comphist_pipeline_create(int naggregators)
+{
+	struct comphist_pipeline *pipe;
+
+	if (naggregators < 1)
+		naggregators = 1;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (pipe == NULL)
+		return (NULL);
+
+	pipe->rings = aligned_alloc(64, naggregators * sizeof(*pipe->rings));
+	if (pipe->rings == NULL) {
+		free(pipe);
+		return (NULL);
+	}
+	pipe->nrings = naggregators;
+
+	pipe->tq = taskq_create("z_comphist_agg", naggregators, defclsyspri,
+	    naggregators, naggregators, TASKQ_PREPOPULATE);
+
+	for (int i = 0; i < naggregators; i++) {
+		struct comphist_ring *ring = &pipe->rings[i];
+
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_init(&ring->done, false);
+		comphist_stats_init(&ring->stats);
+		ring->idle_ns = 0;
+		(void)taskq_dispatch(pipe->tq, comphist_aggregator_task, ring,
+		    TQ_SLEEP);
+	}
+
+	return (pipe);
+}
+
+void
+comphist_pipeline_push(struct comphist_pipeline *pipe,
+    const struct comphist_block *blk)
+{
+	if (pipe->batch == NULL)
+		pipe->batch = comphist_pipeline_claim(pipe);
+
+	pipe->batch->blocks[pipe->batch->count++] = *blk;
+	if (pipe->batch->count == COMPHIST_PIPE_BATCH)
+		comphist_pipeline_publish(pipe);
+}
+
+/*
+ * Flush the partial batch, wait for the aggregators to drain and fold their
+ * results and the pipeline counters into stats.  Frees the pipeline.
+ */
+void
+comphist_pipeline_finish(struct comphist_pipeline *pipe,
+    struct comphist_stats *stats)
+{
+	if (pipe->batch != NULL && pipe->batch->count > 0)
+		comphist_pipeline_publish(pipe);
+
+	for (int i = 0; i < pipe->nrings; i++)
+		atomic_store_explicit(&pipe->rings[i].done, true,
+		    memory_order_release);
+
+	taskq_wait(pipe->tq);
+	taskq_destroy(pipe->tq);
+
+	for (int i = 0; i < pipe->nrings; i++) {
+		comphist_stats_merge(stats, &pipe->rings[i].stats);
+		stats->pipeline_idle_ns += pipe->rings[i].idle_ns;
+	}
+
+	stats->pipeline_batches += pipe->batches;
+	stats->pipeline_depth_sum += pipe->depth_sum;
+	if (pipe->depth_max > stats->pipeline_depth_max)
+		stats->pipeline_depth_max = pipe->depth_max;
+	stats->pipeline_stall_ns += pipe->stall_ns;
+
+	free(pipe->rings);
+	free(pipe);
+}
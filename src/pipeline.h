@@ -0,0 +1,14 @@
+#ifndef COMPHIST_PIPELINE_H
+#define COMPHIST_PIPELINE_H
+
+#include "stats.h"
+
+struct comphist_pipeline;
+
+struct comphist_pipeline *comphist_pipeline_create(int naggregators);
+void comphist_pipeline_push(struct comphist_pipeline *pipe,
+    const struct comphist_block *blk);
+void comphist_pipeline_finish(struct comphist_pipeline *pipe,
+    struct comphist_stats *stats);
+
+#endif
@@ -0,0 +1,230 @@
+#include "progress.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/zfs_context.h>
+
+/*
+ * Progress is estimated from allocated bytes visited against the sum of the
+ * datasets' referenced bytes.  Datasets that finish early (sampled, cached
+ * or mostly shared) are credited with their full referenced size, so the
+ * estimate uses whichever of the two measures is further along.
+ */
+static struct {
+	atomic_uint_fast64_t blocks;
+	atomic_uint_fast64_t bytes;
+	atomic_uint_fast64_t done_bytes;
+	atomic_uint_fast64_t datasets_done;
+	_Atomic(const char *) current;
+	atomic_bool active;
+	atomic_bool stop;
+	uint64_t datasets;
+	uint64_t expected;
+	int interval;
+	hrtime_t start;
+	sem_t wake;
+	taskq_t *tq;
+	struct sigaction old_usr1;
+#ifdef SIGINFO
+	struct sigaction old_info;
+#endif
+} comphist_progress;
+
+void
+comphist_progress_add(uint64_t blocks, uint64_t bytes)
+{
+	atomic_fetch_add_explicit(&comphist_progress.blocks, blocks,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&comphist_progress.bytes, bytes,
+	    memory_order_relaxed);
+}
+
+void
+comphist_progress_dataset_begin(const char *dsname)
+{
+	atomic_store_explicit(&comphist_progress.current, dsname,
+	    memory_order_relaxed);
+}
+
+void
+comphist_progress_dataset_done(uint64_t referenced)
+{
+	atomic_fetch_add_explicit(&comphist_progress.done_bytes, referenced,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&comphist_progress.datasets_done, 1,
+	    memory_order_relaxed);
+}
+
+static void
+comphist_progress_size(char *buf, size_t len, double size)
+{
+	static const char suffix[] = "KMGTPE";
+	int unit = -1;
+
+	while (size >= 1024.0 && unit < 5) {
+		size /= 1024.0;
+		unit++;
+	}
+
+	if (unit < 0)
+		snprintf(buf, len, "%.0f", size);
+	else
+		snprintf(buf, len, "%.1f%c", size, suffix[unit]);
+}
+
+static void
+comphist_progress_print(void)
+{
+	uint64_t blocks = atomic_load_explicit(&comphist_progress.blocks,
+	    memory_order_relaxed);
+	uint64_t bytes = atomic_load_explicit(&comphist_progress.bytes,
+	    memory_order_relaxed);
+	uint64_t done_bytes = atomic_load_explicit(
+	    &comphist_progress.done_bytes, memory_order_relaxed);
+	uint64_t done = atomic_load_explicit(&comphist_progress.datasets_done,
+	    memory_order_relaxed);
+	const char *current = atomic_load_explicit(&comphist_progress.current,
+	    memory_order_relaxed);
+	double secs = (double)(gethrtime() - comphist_progress.start) / 1e9;
+	double progress = (double)MAX(bytes, done_bytes);
+	double expected = (double)comphist_progress.expected;
+	char seen[16], total[16], rate[16], eta[32] = "unknown";
+
+	comphist_progress_size(seen, sizeof(seen), (double)bytes);
+	comphist_progress_size(total, sizeof(total), expected);
+	comphist_progress_size(rate, sizeof(rate),
+	    secs > 0.0 ? (double)bytes / secs : 0.0);
+
+	if (progress > 0.0 && secs > 0.0 && expected > progress) {
+		uint64_t left = (uint64_t)((expected - progress) * secs /
+		    progress);
+
+		snprintf(eta, sizeof(eta), "%" PRIu64 "h%02" PRIu64 "m%02"
+		    PRIu64 "s", left / 3600, left / 60 % 60, left % 60);
+	} else if (expected > 0.0 && progress >= expected) {
+		snprintf(eta, sizeof(eta), "finishing");
+	}
+
+	fprintf(stderr, "progress: %" PRIu64 " blocks, %s of %s (%.1f%%)",
+	    blocks, seen, total,
+	    expected > 0.0 ? MIN(progress / expected, 1.0) * 100.0 : 0.0);
+	if (comphist_progress.datasets > 0) {
+		fprintf(stderr, ", %" PRIu64 " of %" PRIu64 " datasets",
+		    MIN(done, comphist_progress.datasets),
+		    comphist_progress.datasets);
+	}
+	fprintf(stderr, ", %s/s, ETA %s", rate, eta);
+	if (current != NULL)
+		fprintf(stderr, ", at %s", current);
+	fprintf(stderr, "\n");
+}
+
+static void
+comphist_progress_signal(int sig)
+{
+	int saved = errno;
+
+	(void)sig;
+	(void)sem_post(&comphist_progress.wake);
+	errno = saved;
+}
+
+/*
+ * Reporter thread.  Signal handlers only post the semaphore; all printing
+ * happens here.
+ */
+static void
+comphist_progress_task(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		int err;
+
+		if (comphist_progress.interval > 0) {
+			struct timespec ts;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += comphist_progress.interval;
+			err = sem_timedwait(&comphist_progress.wake, &ts);
+		} else {
+			err = sem_wait(&comphist_progress.wake);
+		}
+
+		if (atomic_load(&comphist_progress.stop))
+			return;
+		if (err != 0 && errno == EINTR)
+			continue;
+		comphist_progress_print();
+	}
+}
+
+int
+comphist_progress_start(int interval, uint64_t ndatasets,
+    uint64_t expected_bytes)
+{
+	struct sigaction sa;
+
+	/* One reporter per process; concurrent walks go unreported. */
+	if (atomic_exchange(&comphist_progress.active, true))
+		return (EBUSY);
+
+	atomic_store(&comphist_progress.blocks, 0);
+	atomic_store(&comphist_progress.bytes, 0);
+	atomic_store(&comphist_progress.done_bytes, 0);
+	atomic_store(&comphist_progress.datasets_done, 0);
+	atomic_store(&comphist_progress.current, NULL);
+	atomic_store(&comphist_progress.stop, false);
+	comphist_progress.datasets = ndatasets;
+	comphist_progress.expected = expected_bytes;
+	comphist_progress.interval = interval;
+	comphist_progress.start = gethrtime();
+
+	if (sem_init(&comphist_progress.wake, 0, 0) != 0) {
+		int err = errno;
+
+		atomic_store(&comphist_progress.active, false);
+		return (err);
+	}
+
+	comphist_progress.tq = taskq_create("z_comphist_progress", 1,
+	    defclsyspri, 1, 1, TASKQ_PREPOPULATE);
+	(void)taskq_dispatch(comphist_progress.tq, comphist_progress_task,
+	    NULL, TQ_SLEEP);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = comphist_progress_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	(void)sigaction(SIGUSR1, &sa, &comphist_progress.old_usr1);
+#ifdef SIGINFO
+	(void)sigaction(SIGINFO, &sa, &comphist_progress.old_info);
+#endif
+
+	return (0);
+}
+
+void
+comphist_progress_stop(void)
+{
+	(void)sigaction(SIGUSR1, &comphist_progress.old_usr1, NULL);
+#ifdef SIGINFO
+	(void)sigaction(SIGINFO, &comphist_progress.old_info, NULL);
+#endif
+
+	atomic_store(&comphist_progress.stop, true);
+	(void)sem_post(&comphist_progress.wake);
+	taskq_wait(comphist_progress.tq);
+	taskq_destroy(comphist_progress.tq);
+	comphist_progress.tq = NULL;
+	(void)sem_destroy(&comphist_progress.wake);
+	atomic_store(&comphist_progress.active, false);
+}
@@ -0,0 +1,25 @@
+#ifndef COMPHIST_PROGRESS_H
+#define COMPHIST_PROGRESS_H
+
+#include <stdint.h>
+
+/*
+ * Walk progress, reported on SIGUSR1 (and SIGINFO where it exists) and,
+ * with a non-zero interval, every interval seconds on stderr.  The reporter
+ * is process-wide: comphist_progress_start() fails with EBUSY while another
+ * walk owns it.
+ *
+ * Traversal threads batch their counts locally and publish them with
+ * comphist_progress_add() every COMPHIST_PROGRESS_BATCH blocks, so the
+ * per-block cost is two local additions.
+ */
+#define COMPHIST_PROGRESS_BATCH	1024
+
+int comphist_progress_start(int interval, uint64_t ndatasets,
+    uint64_t expected_bytes);
+void comphist_progress_stop(void);
+void comphist_progress_add(uint64_t blocks, uint64_t bytes);
+void comphist_progress_dataset_begin(const char *dsname);
+void comphist_progress_dataset_done(uint64_t referenced);
+
+#endif
@@ -0,0 +1,233 @@
+#include "reader.h"
+
+#include <stdlib.h>
+
+#include <sys/vdev_impl.h>
+#include <sys/zfs_context.h>
+#include <sys/zio.h>
+
+/*
+ * Bounded-depth asynchronous block reader.
+ *
+ * Reads are issued with zio_nowait() so the caller (usually a traversal
+ * callback) never waits on a single block.  At most "depth" reads are in
+ * flight; submitting beyond that blocks until one completes, which keeps
+ * memory bounded and lets the pool's I/O queues stay full.  Completed
+ * buffers are handed to a taskq so callbacks do CPU work off the ZIO
+ * completion threads.  Header reads skip the logical pipeline and read one
+ * sector of a block's first copy straight from its top-level vdev.
+ */
+
+struct comphist_reader {
+	spa_t *spa;
+	int depth;
+	comphist_read_done_t done;
+	void *arg;
+	taskq_t *tq;
+	kmutex_t lock;
+	kcondvar_t cv;
+	int inflight;
+};
+
+struct comphist_read_req {
+	struct comphist_reader *reader;
+	blkptr_t bp;
+	abd_t *abd;
+	uint64_t size;
+	int error;
+	bool held;		/* SCL_STATE held for a header read */
+};
+
+static void
+comphist_reader_complete(void *arg)
+{
+	struct comphist_read_req *req = arg;
+	struct comphist_reader *reader = req->reader;
+
+	if (req->error == 0) {
+		reader->done(reader->arg, &req->bp, abd_to_buf(req->abd),
+		    req->size, 0);
+	} else {
+		reader->done(reader->arg, &req->bp, NULL, req->size,
+		    req->error);
+	}
+
+	abd_free(req->abd);
+	free(req);
+
+	mutex_enter(&reader->lock);
+	reader->inflight--;
+	cv_broadcast(&reader->cv);
+	mutex_exit(&reader->lock);
+}
+
+static void
+comphist_reader_zio_done(zio_t *zio)
+{
+	struct comphist_read_req *req = zio->io_private;
+
+	req->error = zio->io_error;
+	if (req->held)
+		spa_config_exit(req->reader->spa, SCL_STATE, req);
+	(void)taskq_dispatch(req->reader->tq, comphist_reader_complete, req,
+	    TQ_SLEEP);
+}
+
+struct comphist_reader *
+comphist_reader_create(spa_t *spa, int depth, int nthreads,
+    comphist_read_done_t done, void *arg)
+{
+	struct comphist_reader *reader;
+
+	reader = calloc(1, sizeof(*reader));
+	if (reader == NULL)
+		return (NULL);
+
+	reader->spa = spa;
+	reader->depth = depth < 1 ? 1 : depth;
+	reader->done = done;
+	reader->arg = arg;
+	mutex_init(&reader->lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&reader->cv, NULL, CV_DEFAULT, NULL);
+	reader->tq = taskq_create("z_comphist_read", nthreads < 1 ? 1 : nthreads,
+	    defclsyspri, reader->depth, INT_MAX, TASKQ_PREPOPULATE);
+
+	return (reader);
+}
+
+/*
+ * Take a slot for bp, blocking while the reader is at its queue depth.
+ * Allocation failures are reported through the callback like read errors,
+ * and NULL is returned.
+ */
+static struct comphist_read_req *
+comphist_reader_req(struct comphist_reader *reader, const blkptr_t *bp,
+    uint64_t size)
+{
+	struct comphist_read_req *req;
+
+	mutex_enter(&reader->lock);
+	while (reader->inflight >= reader->depth)
+		cv_wait(&reader->cv, &reader->lock);
+	reader->inflight++;
+	mutex_exit(&reader->lock);
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		reader->done(reader->arg, bp, NULL, size, ENOMEM);
+		mutex_enter(&reader->lock);
+		reader->inflight--;
+		cv_broadcast(&reader->cv);
+		mutex_exit(&reader->lock);
+		return (NULL);
+	}
+
+	req->reader = reader;
+	req->bp = *bp;
+	req->size = size;
+	return (req);
+}
+
+static void
+comphist_reader_submit(struct comphist_read_req *req,
+    const zbookmark_phys_t *zb, zio_flag_t flags)
+{
+	req->abd = abd_alloc_linear(req->size, B_FALSE);
+	zio_nowait(zio_read(NULL, req->reader->spa, &req->bp, req->abd,
+	    req->size, comphist_reader_zio_done, req, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_CANFAIL | flags, zb));
+}
+
+static void
+comphist_reader_issue(struct comphist_reader *reader, const blkptr_t *bp,
+    const zbookmark_phys_t *zb, uint64_t size, zio_flag_t flags)
+{
+	struct comphist_read_req *req = comphist_reader_req(reader, bp, size);
+
+	if (req != NULL)
+		comphist_reader_submit(req, zb, flags);
+}
+
+/*
+ * Issue a logical (decompressed) read of bp.
+ */
+void
+comphist_reader_read(struct comphist_reader *reader, const blkptr_t *bp,
+    const zbookmark_phys_t *zb)
+{
+	comphist_reader_issue(reader, bp, zb, BP_GET_LSIZE(bp), 0);
+}
+
+/*
+ * Issue a read of bp as it is stored, checksummed but not decompressed;
+ * the callback gets BP_GET_PSIZE() bytes.  The data of encrypted blocks
+ * is still decrypted, so those need their key loaded.
+ */
+void
+comphist_reader_read_raw(struct comphist_reader *reader, const blkptr_t *bp,
+    const zbookmark_phys_t *zb)
+{
+	comphist_reader_issue(reader, bp, zb, BP_GET_PSIZE(bp),
+	    ZIO_FLAG_RAW_COMPRESS);
+}
+
+/*
+ * Read the first sector of bp's first copy as it is on disk, unchecked;
+ * the callback gets one sector of the top-level vdev.  Single disks and
+ * mirrors store a block contiguously at its DVA offset.  RAIDZ and dRAID
+ * spread it over their children by their own layout, and gang blocks keep
+ * their data elsewhere, so those are read whole with
+ * comphist_reader_read_raw() instead.  The pool's vdev configuration is
+ * held until the read completes.
+ */
+void
+comphist_reader_read_head(struct comphist_reader *reader, const blkptr_t *bp,
+    const zbookmark_phys_t *zb)
+{
+	const dva_t *dva = &bp->blk_dva[0];
+	struct comphist_read_req *req;
+	vdev_t *tvd;
+	zio_t *zio;
+
+	req = comphist_reader_req(reader, bp, BP_GET_PSIZE(bp));
+	if (req == NULL)
+		return;
+
+	spa_config_enter(reader->spa, SCL_STATE, req, RW_READER);
+	tvd = vdev_lookup_top(reader->spa, DVA_GET_VDEV(dva));
+	if (BP_IS_GANG(bp) || tvd == NULL ||
+	    (!tvd->vdev_ops->vdev_op_leaf &&
+	    tvd->vdev_ops != &vdev_mirror_ops)) {
+		spa_config_exit(reader->spa, SCL_STATE, req);
+		comphist_reader_submit(req, zb, ZIO_FLAG_RAW_COMPRESS);
+		return;
+	}
+
+	req->held = true;
+	req->size = 1ULL << tvd->vdev_ashift;
+	req->abd = abd_alloc_linear(req->size, B_FALSE);
+	zio = zio_root(reader->spa, comphist_reader_zio_done, req,
+	    ZIO_FLAG_CANFAIL);
+	zio_nowait(zio_vdev_child_io(zio, NULL, tvd, DVA_GET_OFFSET(dva),
+	    req->abd, req->size, ZIO_TYPE_READ, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_CANFAIL, NULL, NULL));
+	zio_nowait(zio);
+}
+
+/*
+ * Wait for all outstanding reads and their callbacks, then free the reader.
+ */
+void
+comphist_reader_destroy(struct comphist_reader *reader)
+{
+	mutex_enter(&reader->lock);
+	while (reader->inflight > 0)
+		cv_wait(&reader->cv, &reader->lock);
+	mutex_exit(&reader->lock);
+
+	taskq_wait(reader->tq);
+	taskq_destroy(reader->tq);
+	cv_destroy(&reader->cv);
+	mutex_destroy(&reader->lock);
+	free(reader);
+}
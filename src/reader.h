@@ -0,0 +1,28 @@
+#ifndef COMPHIST_READER_H
+#define COMPHIST_READER_H
+
+#include <stdint.h>
+
+#include <sys/spa.h>
+
+struct comphist_reader;
+
+/*
+ * Completion callback, run on one of the reader's worker threads.  buf is
+ * only valid for the duration of the call; err is non-zero if the read
+ * failed, in which case buf is NULL.
+ */
+typedef void (*comphist_read_done_t)(void *arg, const blkptr_t *bp,
+    const void *buf, uint64_t size, int err);
+
+struct comphist_reader *comphist_reader_create(spa_t *spa, int depth,
+    int nthreads, comphist_read_done_t done, void *arg);
+void comphist_reader_read(struct comphist_reader *reader, const blkptr_t *bp,
+    const zbookmark_phys_t *zb);
+void comphist_reader_read_raw(struct comphist_reader *reader,
+    const blkptr_t *bp, const zbookmark_phys_t *zb);
+void comphist_reader_read_head(struct comphist_reader *reader,
+    const blkptr_t *bp, const zbookmark_phys_t *zb);
+void comphist_reader_destroy(struct comphist_reader *reader);
+
+#endif
@@ -0,0 +1,953 @@
+#include "report.h"
+
+#include "entropy.h"
+#include "top.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const comphist_format_names[] = {
+	[COMPHIST_FMT_TEXT] = "text",
+	[COMPHIST_FMT_JSON] = "json",
+	[COMPHIST_FMT_NDJSON] = "ndjson",
+	[COMPHIST_FMT_CSV] = "csv",
+};
+
+int
+comphist_format_parse(const char *arg, enum comphist_format *format)
+{
+	for (size_t i = 0; i < sizeof(comphist_format_names) /
+	    sizeof(comphist_format_names[0]); i++) {
+		if (strcmp(arg, comphist_format_names[i]) == 0) {
+			*format = (enum comphist_format)i;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+static double
+block_percent(uint64_t blocks, uint64_t total)
+{
+	if (total == 0)
+		return (0.0);
+
+	return ((double)blocks * 100.0 / (double)total);
+}
+
+static double
+ratio(uint64_t lsize, uint64_t psize)
+{
+	if (psize == 0)
+		return (0.0);
+
+	return ((double)lsize / (double)psize);
+}
+
+static const char *
+dataset_mode(const char *dsname)
+{
+	return (strchr(dsname, '@') != NULL ? "snapshot" : "live");
+}
+
+/*
+ * JSON objects.  Pretty objects put each member on its own line and are
+ * used for the single-document --format=json output; compact objects are
+ * used for dataset records, which must fit on one NDJSON line.
+ */
+struct comphist_json {
+	struct comphist_out *out;
+	bool pretty;
+	bool first;
+};
+
+static void
+comphist_json_open(struct comphist_json *j, struct comphist_out *out,
+    bool pretty)
+{
+	j->out = out;
+	j->pretty = pretty;
+	j->first = true;
+	comphist_out_puts(out, "{");
+}
+
+static void
+comphist_json_key(struct comphist_json *j, const char *key)
+{
+	if (j->pretty)
+		comphist_out_puts(j->out, j->first ? "\n  " : ",\n  ");
+	else if (!j->first)
+		comphist_out_puts(j->out, ",");
+	j->first = false;
+	comphist_out_printf(j->out, "\"%s\":%s", key, j->pretty ? " " : "");
+}
+
+static void
+comphist_json_close(struct comphist_json *j)
+{
+	comphist_out_puts(j->out, j->pretty ? "\n}" : "}");
+}
+
+static void
+comphist_json_u64(struct comphist_json *j, const char *key, uint64_t val)
+{
+	comphist_json_key(j, key);
+	comphist_out_printf(j->out, "%" PRIu64, val);
+}
+
+static void
+comphist_json_bool(struct comphist_json *j, const char *key, bool val)
+{
+	comphist_json_key(j, key);
+	comphist_out_puts(j->out, val ? "true" : "false");
+}
+
+static void
+comphist_json_str(struct comphist_json *j, const char *key, const char *val)
+{
+	comphist_json_key(j, key);
+	comphist_out_json_string(j->out, val);
+}
+
+static void
+comphist_json_pipeline(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	comphist_out_printf(out, "{\"batches\":%" PRIu64
+	    ",\"queue_depth_sum\":%" PRIu64 ",\"queue_depth_max\":%" PRIu64
+	    ",\"producer_stall_ns\":%" PRIu64 ",\"aggregator_idle_ns\":%"
+	    PRIu64 "}",
+	    stats->pipeline_batches, stats->pipeline_depth_sum,
+	    stats->pipeline_depth_max, stats->pipeline_stall_ns,
+	    stats->pipeline_idle_ns);
+}
+
+/*
+ * "seconds" is wall-clock time and "cpu_seconds" the traversal threads'
+ * CPU time; see struct comphist_stats.
+ */
+static void
+comphist_json_scan(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	double secs = (double)stats->scan_ns / 1e9;
+
+	comphist_out_printf(out, "{\"seconds\":%.6f,\"cpu_seconds\":%.6f"
+	    ",\"blocks_per_second\":%.0f"
+	    ",\"metadata_blocks\":%" PRIu64 ",\"metadata_bytes\":%" PRIu64
+	    ",\"metadata_reads\":%" PRIu64 ",\"arc_hits\":%" PRIu64
+	    ",\"arc_misses\":%" PRIu64 ",\"retries\":%" PRIu64 "}", secs,
+	    (double)stats->scan_cpu_ns / 1e9,
+	    secs > 0.0 ? (double)stats->total_blocks / secs : 0.0,
+	    stats->scan_meta_blocks, stats->scan_meta_bytes,
+	    stats->scan_meta_reads, stats->scan_arc_hits,
+	    stats->scan_arc_misses, stats->scan_retries);
+}
+
+static void
+comphist_json_buckets(struct comphist_out *out, const uint64_t *buckets)
+{
+	comphist_out_puts(out, "[");
+	for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+		comphist_out_printf(out, "%s%" PRIu64, b == 0 ? "" : ",",
+		    buckets[b]);
+	comphist_out_puts(out, "]");
+}
+
+/*
+ * Histogram arrays count sizes of zero at index 0 and are otherwise indexed
+ * by floor(log2(bytes)) + 1.
+ */
+static void
+comphist_json_hist(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	bool first = true;
+
+	comphist_out_puts(out, "[");
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		if (stats->entries[i].blocks == 0)
+			continue;
+
+		comphist_out_printf(out, "%s{\"name\":\"%s\",\"logical\":",
+		    first ? "" : ",", comphist_comp_name(i));
+		comphist_json_buckets(out, stats->hist[i][COMPHIST_HIST_LSIZE]);
+		comphist_out_puts(out, ",\"physical\":");
+		comphist_json_buckets(out, stats->hist[i][COMPHIST_HIST_PSIZE]);
+		comphist_out_puts(out, ",\"allocated\":");
+		comphist_json_buckets(out, stats->hist[i][COMPHIST_HIST_ASIZE]);
+		comphist_out_puts(out, "}");
+		first = false;
+	}
+	comphist_out_puts(out, "]");
+}
+
+/*
+ * Levels are reported as "L0".."L3+"; the last level includes all higher
+ * indirection levels.
+ */
+static void
+comphist_json_objtypes(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	bool first = true;
+
+	comphist_out_puts(out, "[");
+	for (int oc = 0; oc < COMPHIST_OC_COUNT; oc++) {
+		for (int l = 0; l < COMPHIST_LEVELS; l++) {
+			for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+				const struct comphist_cell *cell =
+				    &stats->objtype[oc][l][i];
+
+				if (cell->blocks == 0)
+					continue;
+
+				comphist_out_printf(out, "%s{\"type\":\"%s\","
+				    "\"level\":\"L%d%s\",\"name\":\"%s\","
+				    "\"blocks\":%" PRIu64 ",\"logical_bytes\":%"
+				    PRIu64 ",\"physical_bytes\":%" PRIu64
+				    ",\"allocated_bytes\":%" PRIu64 "}",
+				    first ? "" : ",",
+				    comphist_objclass_name(oc), l,
+				    l == COMPHIST_LEVELS - 1 ? "+" : "",
+				    comphist_comp_name(i), cell->blocks,
+				    cell->lsize, cell->psize, cell->asize);
+				first = false;
+			}
+		}
+	}
+	comphist_out_puts(out, "]");
+}
+
+static void
+comphist_json_dva_cell(struct comphist_out *out,
+    const struct comphist_dva_cell *cell)
+{
+	comphist_out_printf(out, ",\"dvas\":%" PRIu64 ",\"physical_bytes\":%"
+	    PRIu64 ",\"allocated_bytes\":%" PRIu64 ",\"padding_bytes\":%"
+	    PRIu64 ",\"copy_dvas\":%" PRIu64 ",\"copy_allocated_bytes\":%"
+	    PRIu64 ",\"gang_dvas\":%" PRIu64 "}", cell->dvas, cell->psize,
+	    cell->asize, cell->asize - cell->psize, cell->copy_dvas,
+	    cell->copy_asize, cell->gang_dvas);
+}
+
+/*
+ * The last vdev row also collects every higher-numbered top-level vdev,
+ * and a row allocated from more than one class is labeled "mixed".
+ */
+static void
+comphist_json_vdevs(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	bool first = true;
+
+	comphist_out_puts(out, "{\"classes\":[");
+	for (int ac = 0; ac < COMPHIST_AC_COUNT; ac++) {
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+			if (stats->alloc_class[ac][i].dvas == 0)
+				continue;
+			comphist_out_printf(out, "%s{\"class\":\"%s\","
+			    "\"name\":\"%s\"", first ? "" : ",",
+			    comphist_alloc_class_name(ac),
+			    comphist_comp_name(i));
+			comphist_json_dva_cell(out, &stats->alloc_class[ac][i]);
+			first = false;
+		}
+	}
+
+	comphist_out_puts(out, "],\"vdevs\":[");
+	first = true;
+	for (int v = 0; v < COMPHIST_VDEVS; v++) {
+		if (stats->vdev[v].dvas == 0)
+			continue;
+		comphist_out_printf(out, "%s{\"vdev\":%d,\"class\":\"%s\"",
+		    first ? "" : ",", v,
+		    comphist_alloc_class_name(stats->vdev_class[v]));
+		comphist_json_dva_cell(out, &stats->vdev[v]);
+		first = false;
+	}
+
+	comphist_out_puts(out, "],\"class_sizes\":[");
+	first = true;
+	for (int ac = 0; ac < COMPHIST_AC_COUNT; ac++) {
+		bool used = false;
+
+		for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+			used |= stats->alloc_hist[ac][b] != 0;
+		if (!used)
+			continue;
+		comphist_out_printf(out, "%s{\"class\":\"%s\","
+		    "\"allocated\":", first ? "" : ",",
+		    comphist_alloc_class_name(ac));
+		comphist_json_buckets(out, stats->alloc_hist[ac]);
+		comphist_out_puts(out, "}");
+		first = false;
+	}
+	comphist_out_puts(out, "]}");
+}
+
+/*
+ * Era times are seconds since the epoch, or 0 when unknown.  The last era
+ * has no upper txg bound.
+ */
+static void
+comphist_json_eras(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	bool first_era = true;
+
+	comphist_out_puts(out, "[");
+	for (int e = 0; e < COMPHIST_ERAS; e++) {
+		bool first = true;
+
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+			const struct comphist_cell *cell = &stats->era[e][i];
+
+			if (cell->blocks == 0)
+				continue;
+
+			if (first) {
+				comphist_out_printf(out, "%s{\"first_txg\":%"
+				    PRIu64, first_era ? "" : ",",
+				    (uint64_t)e << stats->era_shift);
+				if (e < COMPHIST_ERAS - 1)
+					comphist_out_printf(out,
+					    ",\"last_txg\":%" PRIu64,
+					    (((uint64_t)e + 1) <<
+					    stats->era_shift) - 1);
+				comphist_out_printf(out, ",\"start_time\":%"
+				    PRIu64 ",\"end_time\":%" PRIu64
+				    ",\"entries\":[", stats->era_time[e],
+				    stats->era_time[e + 1]);
+				first_era = false;
+			}
+
+			comphist_out_printf(out, "%s{\"name\":\"%s\","
+			    "\"blocks\":%" PRIu64 ",\"logical_bytes\":%" PRIu64
+			    ",\"physical_bytes\":%" PRIu64
+			    ",\"allocated_bytes\":%" PRIu64 "}",
+			    first ? "" : ",", comphist_comp_name(i),
+			    cell->blocks, cell->lsize, cell->psize,
+			    cell->asize);
+			first = false;
+		}
+		if (!first)
+			comphist_out_puts(out, "]}");
+	}
+	comphist_out_puts(out, "]");
+}
+
+static void
+comphist_json_sample_row(struct comphist_out *out, const double *var)
+{
+	comphist_out_printf(out, "{\"blocks_ci95\":%.0f"
+	    ",\"logical_bytes_ci95\":%.0f,\"physical_bytes_ci95\":%.0f"
+	    ",\"allocated_bytes_ci95\":%.0f}",
+	    1.96 * sqrt(var[COMPHIST_M_BLOCKS]),
+	    1.96 * sqrt(var[COMPHIST_M_LSIZE]),
+	    1.96 * sqrt(var[COMPHIST_M_PSIZE]),
+	    1.96 * sqrt(var[COMPHIST_M_ASIZE]));
+}
+
+/*
+ * Confidence half-widths of the scaled-up block and byte counts reported in
+ * "entries" and "total".
+ */
+static void
+comphist_json_sample(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	const struct comphist_sample *sample = &stats->sample;
+	bool first = true;
+
+	comphist_out_printf(out, "{\"rate\":%.6f,\"objects\":%" PRIu64
+	    ",\"sampled_objects\":%" PRIu64 ",\"entries\":[", sample->rate,
+	    sample->objects, sample->sampled_objects);
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		if (stats->entries[i].blocks == 0)
+			continue;
+
+		comphist_out_printf(out, "%s{\"name\":\"%s\",\"error\":",
+		    first ? "" : ",", comphist_comp_name(i));
+		comphist_json_sample_row(out, sample->var[i]);
+		comphist_out_puts(out, "}");
+		first = false;
+	}
+	comphist_out_puts(out, "],\"total\":");
+	comphist_json_sample_row(out, sample->var[ZIO_COMPRESS_FUNCTIONS]);
+	comphist_out_puts(out, "}");
+}
+
+static void
+comphist_json_zstd(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	bool first = true;
+
+	comphist_out_printf(out, "{\"unread_blocks\":%" PRIu64
+	    ",\"levels\":[", stats->zstd_unread);
+	for (int l = 0; l < COMPHIST_ZSTD_LEVELS; l++) {
+		const struct comphist_cell *cell = &stats->zstd[l];
+		char name[24];
+
+		if (cell->blocks == 0)
+			continue;
+
+		comphist_zstd_level_name(l, name, sizeof(name));
+		comphist_out_printf(out, "%s{\"name\":\"%s\",\"blocks\":%"
+		    PRIu64 ",\"logical_bytes\":%" PRIu64
+		    ",\"physical_bytes\":%" PRIu64 ",\"allocated_bytes\":%"
+		    PRIu64 "}", first ? "" : ",", name, cell->blocks,
+		    cell->lsize, cell->psize, cell->asize);
+		first = false;
+	}
+	comphist_out_puts(out, "]}");
+}
+
+static void
+comphist_json_entropy(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	bool first = true;
+
+	comphist_out_printf(out, "{\"threshold_bits_per_byte\":%.1f"
+	    ",\"entries\":[", COMPHIST_ENTROPY_THRESHOLD);
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const struct comphist_entropy_cell *cell = &stats->entropy[i];
+
+		if (cell->low_blocks + cell->high_blocks +
+		    cell->unread_blocks == 0)
+			continue;
+
+		comphist_out_printf(out, "%s{\"name\":\"%s\""
+		    ",\"compressible_blocks\":%" PRIu64
+		    ",\"compressible_logical_bytes\":%" PRIu64
+		    ",\"incompressible_blocks\":%" PRIu64
+		    ",\"incompressible_logical_bytes\":%" PRIu64
+		    ",\"unread_blocks\":%" PRIu64 "}", first ? "" : ",",
+		    comphist_comp_name(i), cell->low_blocks, cell->low_lsize,
+		    cell->high_blocks, cell->high_lsize, cell->unread_blocks);
+		first = false;
+	}
+	comphist_out_puts(out, "]}");
+}
+
+static void
+comphist_json_sim(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	const struct comphist_sim_result *sim = &stats->sim;
+
+	comphist_out_printf(out, "{\"population_blocks\":%" PRIu64
+	    ",\"population_logical_bytes\":%" PRIu64
+	    ",\"population_physical_bytes\":%" PRIu64
+	    ",\"population_allocated_bytes\":%" PRIu64 ",\"samples\":%"
+	    PRIu64 ",\"unreadable_samples\":%" PRIu64 ",\"candidates\":[",
+	    sim->population_blocks, sim->population_lsize,
+	    sim->population_psize, sim->population_asize, sim->samples,
+	    sim->sample_errors);
+	for (int c = 0; c < sim->ncandidates; c++) {
+		const struct comphist_sim_entry *entry = &sim->candidates[c];
+
+		comphist_out_printf(out, "%s{\"name\":\"%s\","
+		    "\"physical_bytes\":%" PRIu64
+		    ",\"physical_bytes_ci95\":%.0f"
+		    ",\"allocated_bytes\":%" PRIu64
+		    ",\"allocated_bytes_ci95\":%.0f}", c == 0 ? "" : ",",
+		    entry->name, entry->psize, entry->psize_ci, entry->asize,
+		    entry->asize_ci);
+	}
+	comphist_out_puts(out, "]}");
+}
+
+static void
+comphist_json_dedup(struct comphist_out *out,
+    const struct comphist_stats *stats)
+{
+	const struct comphist_dedup_result *dd = &stats->dedup;
+	bool first = true;
+
+	comphist_out_printf(out, "{\"ddt_entry_disk_bytes\":%" PRIu64
+	    ",\"ddt_entry_core_bytes\":%" PRIu64 ",\"unresolved_blocks\":%"
+	    PRIu64 ",\"algorithms\":[", dd->ddt_entry_dspace,
+	    dd->ddt_entry_mspace, dd->unresolved);
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const struct comphist_dedup_cell *cell = &dd->cells[i];
+
+		if (cell->refs == 0 && cell->ddt_entries == 0)
+			continue;
+
+		comphist_out_printf(out, "%s{\"name\":\"%s\","
+		    "\"references\":%" PRIu64
+		    ",\"referenced_logical_bytes\":%" PRIu64
+		    ",\"referenced_physical_bytes\":%" PRIu64
+		    ",\"referenced_allocated_bytes\":%" PRIu64
+		    ",\"entries\":%" PRIu64 ",\"physical_bytes\":%" PRIu64
+		    ",\"allocated_bytes\":%" PRIu64
+		    ",\"charged_allocated_bytes\":%" PRIu64
+		    ",\"ddt_entries\":%" PRIu64 "}", first ? "" : ",",
+		    comphist_comp_name(i), cell->refs, cell->ref_lsize,
+		    cell->ref_psize, cell->ref_asize, cell->blocks,
+		    cell->psize, cell->asize, cell->charged_asize,
+		    cell->ddt_entries);
+		first = false;
+	}
+	comphist_out_puts(out, "]}");
+}
+
+static void
+comphist_json_top(struct comphist_out *out, const struct comphist_top *top)
+{
+	comphist_out_puts(out, "[");
+	for (size_t i = 0; i < top->count; i++) {
+		const struct comphist_top_entry *e = &top->heap[i];
+
+		comphist_out_printf(out, "%s{\"objset\":%" PRIu64
+		    ",\"object\":%" PRIu64 ",\"dataset\":", i > 0 ? "," : "",
+		    e->objset, e->object);
+		if (e->dataset != NULL)
+			comphist_out_json_string(out, e->dataset);
+		else
+			comphist_out_puts(out, "null");
+		comphist_out_puts(out, ",\"path\":");
+		if (e->path != NULL)
+			comphist_out_json_string(out, e->path);
+		else
+			comphist_out_puts(out, "null");
+		comphist_out_printf(out, ",\"blocks\":%" PRIu64
+		    ",\"logical_bytes\":%" PRIu64 ",\"allocated_bytes\":%"
+		    PRIu64 ",\"legacy_blocks\":%" PRIu64
+		    ",\"legacy_logical_bytes\":%" PRIu64
+		    ",\"legacy_allocated_bytes\":%" PRIu64 "}", e->blocks,
+		    e->lsize, e->asize, e->legacy_blocks, e->legacy_lsize,
+		    e->legacy_asize);
+	}
+	comphist_out_puts(out, "]");
+}
+
+static void
+comphist_json_entries(struct comphist_json *j,
+    const struct comphist_stats *stats)
+{
+	const char *sep = j->pretty ? "\n    " : "";
+	bool first = true;
+
+	comphist_json_key(j, "entries");
+	comphist_out_puts(j->out, "[");
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const struct comphist_entry *entry = &stats->entries[i];
+
+		if (entry->blocks == 0)
+			continue;
+
+		if (!first)
+			comphist_out_puts(j->out, ",");
+		comphist_out_puts(j->out, sep);
+		first = false;
+
+		comphist_out_printf(j->out, "{\"name\":\"%s\",\"blocks\":%"
+		    PRIu64 ",\"block_percent\":%.4f,\"logical_bytes\":%" PRIu64
+		    ",\"physical_bytes\":%" PRIu64 ",\"allocated_bytes\":%"
+		    PRIu64 ",\"ratio\":%.6f}",
+		    comphist_comp_name(i), entry->blocks,
+		    block_percent(entry->blocks, stats->total_blocks),
+		    entry->lsize, entry->psize, entry->asize,
+		    ratio(entry->lsize, entry->psize));
+	}
+	comphist_out_puts(j->out, j->pretty && !first ? "\n  ]" : "]");
+}
+
+/*
+ * The members every record carries after its identifying fields, with the
+ * optional sections in the same order as the text output.
+ */
+static void
+comphist_json_stats(struct comphist_json *j,
+    const struct comphist_stats *stats, const struct comphist_options *opts)
+{
+	comphist_json_entries(j, stats);
+	comphist_json_key(j, "total");
+	comphist_out_printf(j->out, "{\"blocks\":%" PRIu64
+	    ",\"logical_bytes\":%" PRIu64 ",\"physical_bytes\":%" PRIu64
+	    ",\"allocated_bytes\":%" PRIu64 ",\"ratio\":%.6f}",
+	    stats->total_blocks, stats->total_lsize, stats->total_psize,
+	    stats->total_asize, ratio(stats->total_lsize, stats->total_psize));
+	comphist_json_u64(j, "holes", stats->total_holes);
+	comphist_json_u64(j, "embedded_blocks", stats->total_embedded_blocks);
+	comphist_json_u64(j, "embedded_logical_bytes",
+	    stats->total_embedded_lsize);
+	comphist_json_u64(j, "redacted_blocks", stats->total_redacted);
+	comphist_json_u64(j, "unknown_compression_blocks",
+	    stats->total_unknown);
+
+	if (opts->sample > 0.0) {
+		comphist_json_key(j, "sample");
+		comphist_json_sample(j->out, stats);
+	}
+	if (opts->objtypes) {
+		comphist_json_key(j, "object_types");
+		comphist_json_objtypes(j->out, stats);
+	}
+	if (opts->entropy != 0) {
+		comphist_json_key(j, "entropy");
+		comphist_json_entropy(j->out, stats);
+	}
+	if (opts->zstd_levels) {
+		comphist_json_key(j, "zstd_levels");
+		comphist_json_zstd(j->out, stats);
+	}
+	if (opts->simulate != NULL) {
+		comphist_json_key(j, "simulation");
+		comphist_json_sim(j->out, stats);
+	}
+	if (opts->dedup) {
+		comphist_json_key(j, "dedup");
+		comphist_json_dedup(j->out, stats);
+	}
+	if (opts->top != NULL) {
+		comphist_json_key(j, "top_objects");
+		comphist_json_top(j->out, opts->top);
+	}
+	if (opts->eras) {
+		comphist_json_key(j, "eras");
+		comphist_json_eras(j->out, stats);
+	}
+	if (opts->vdevs) {
+		comphist_json_key(j, "allocation");
+		comphist_json_vdevs(j->out, stats);
+	}
+	if (opts->histogram) {
+		comphist_json_key(j, "histograms");
+		comphist_json_hist(j->out, stats);
+	}
+	if (opts->pipeline > 0) {
+		comphist_json_key(j, "pipeline");
+		comphist_json_pipeline(j->out, stats);
+	}
+	if (opts->metrics) {
+		comphist_json_key(j, "scan");
+		comphist_json_scan(j->out, stats);
+	}
+	comphist_json_u64(j, "traversal_errors", stats->traversal_errors);
+}
+
+static void
+comphist_json_dataset(struct comphist_out *out, const char *dsname,
+    const struct comphist_stats *stats, const struct comphist_options *opts)
+{
+	struct comphist_json j;
+
+	comphist_json_open(&j, out, false);
+	comphist_json_str(&j, "name", dsname);
+	comphist_json_str(&j, "mode", dataset_mode(dsname));
+	comphist_json_stats(&j, stats, opts);
+	comphist_json_close(&j);
+}
+
+static void
+comphist_csv_row(struct comphist_out *out, const char *dsname,
+    const char *name, uint64_t blocks, double percent, uint64_t lsize,
+    uint64_t psize, uint64_t asize)
+{
+	comphist_out_csv_field(out, dsname);
+	comphist_out_printf(out, ",%s,%s,%" PRIu64 ",%.4f,%" PRIu64 ",%" PRIu64
+	    ",%" PRIu64 ",%.6f\n", dataset_mode(dsname), name, blocks, percent,
+	    lsize, psize, asize, ratio(lsize, psize));
+}
+
+static void
+comphist_csv_stats(struct comphist_out *out, const char *dsname,
+    const struct comphist_stats *stats)
+{
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const struct comphist_entry *entry = &stats->entries[i];
+
+		if (entry->blocks == 0)
+			continue;
+
+		comphist_csv_row(out, dsname, comphist_comp_name(i),
+		    entry->blocks,
+		    block_percent(entry->blocks, stats->total_blocks),
+		    entry->lsize, entry->psize, entry->asize);
+	}
+	comphist_csv_row(out, dsname, "total", stats->total_blocks,
+	    stats->total_blocks ? 100.0 : 0.0, stats->total_lsize,
+	    stats->total_psize, stats->total_asize);
+}
+
+static void
+comphist_text_stats(struct comphist_out *out,
+    const struct comphist_stats *stats, const struct comphist_options *opts)
+{
+	comphist_stats_print(stats, out);
+	if (stats->traversal_errors > 0) {
+		comphist_out_printf(out, "traversal errors: %" PRIu64 "\n",
+		    stats->traversal_errors);
+	}
+	if (opts->sample > 0.0)
+		comphist_stats_print_sample(stats, out);
+	if (opts->objtypes)
+		comphist_stats_print_objtypes(stats, out);
+	if (opts->entropy != 0)
+		comphist_stats_print_entropy(stats, out);
+	if (opts->zstd_levels)
+		comphist_stats_print_zstd(stats, out);
+	if (opts->simulate != NULL)
+		comphist_stats_print_sim(stats, out);
+	if (opts->dedup)
+		comphist_stats_print_dedup(stats, out);
+	if (opts->top != NULL)
+		comphist_top_print(opts->top, out);
+	if (opts->eras)
+		comphist_stats_print_eras(stats, out);
+	if (opts->vdevs)
+		comphist_stats_print_vdevs(stats, out);
+	if (opts->histogram)
+		comphist_stats_print_hist(stats, out);
+	if (opts->pipeline > 0)
+		comphist_stats_print_pipeline(stats, out);
+	if (opts->metrics)
+		comphist_stats_print_metrics(stats, out);
+}
+
+void
+comphist_report_begin(struct comphist_report *rep, struct comphist_out *out,
+    const struct comphist_options *opts, const char *target,
+    bool snapshot_mode)
+{
+	rep->out = out;
+	rep->opts = opts;
+	rep->target = target;
+	rep->snapshot_mode = snapshot_mode;
+	rep->records = 0;
+
+	switch (opts->format) {
+	case COMPHIST_FMT_JSON:
+		if (opts->per_dataset) {
+			struct comphist_json j;
+
+			/* Closed by comphist_report_end(). */
+			comphist_json_open(&j, out, true);
+			comphist_json_str(&j, "target", target);
+			comphist_json_bool(&j, "allow_live", opts->allow_live);
+			comphist_json_bool(&j, "best_effort",
+			    opts->best_effort);
+			comphist_json_key(&j, "datasets");
+			comphist_out_puts(out, "[");
+		}
+		break;
+	case COMPHIST_FMT_CSV:
+		comphist_out_puts(out, "dataset,mode,compression,blocks,"
+		    "block_percent,logical_bytes,physical_bytes,"
+		    "allocated_bytes,ratio\n");
+		break;
+	default:
+		break;
+	}
+}
+
+int
+comphist_report_dataset(struct comphist_report *rep, const char *dsname,
+    const struct comphist_stats *stats)
+{
+	struct comphist_out *out = rep->out;
+
+	switch (rep->opts->format) {
+	case COMPHIST_FMT_TEXT:
+		if (rep->records > 0)
+			comphist_out_puts(out, "\n");
+		comphist_out_printf(out, "Dataset: %s\n", dsname);
+		comphist_text_stats(out, stats, rep->opts);
+		break;
+	case COMPHIST_FMT_JSON:
+		comphist_out_puts(out, rep->records > 0 ? ",\n    " : "\n    ");
+		comphist_json_dataset(out, dsname, stats, rep->opts);
+		break;
+	case COMPHIST_FMT_NDJSON:
+		comphist_json_dataset(out, dsname, stats, rep->opts);
+		comphist_out_puts(out, "\n");
+		break;
+	case COMPHIST_FMT_CSV:
+		comphist_csv_stats(out, dsname, stats);
+		break;
+	}
+	rep->records++;
+
+	return (comphist_out_flush(out));
+}
+
+void
+comphist_report_total(struct comphist_report *rep,
+    const struct comphist_stats *stats)
+{
+	const struct comphist_options *opts = rep->opts;
+	struct comphist_out *out = rep->out;
+	struct comphist_json j;
+
+	switch (opts->format) {
+	case COMPHIST_FMT_TEXT:
+		comphist_text_stats(out, stats, opts);
+		break;
+	case COMPHIST_FMT_JSON:
+	case COMPHIST_FMT_NDJSON:
+		comphist_json_open(&j, out, opts->format == COMPHIST_FMT_JSON);
+		comphist_json_str(&j, "target", rep->target);
+		comphist_json_str(&j, "mode",
+		    rep->snapshot_mode ? "snapshot" : "live");
+		comphist_json_bool(&j, "best_effort", opts->best_effort);
+		comphist_json_bool(&j, "unique", opts->unique);
+		comphist_json_stats(&j, stats, opts);
+		comphist_json_close(&j);
+		comphist_out_puts(out, "\n");
+		break;
+	case COMPHIST_FMT_CSV:
+		comphist_csv_stats(out, rep->target, stats);
+		break;
+	}
+	rep->records++;
+}
+
+int
+comphist_report_end(struct comphist_report *rep)
+{
+	const struct comphist_options *opts = rep->opts;
+	struct comphist_out *out = rep->out;
+
+	switch (opts->format) {
+	case COMPHIST_FMT_TEXT:
+		if (opts->per_dataset)
+			comphist_out_puts(out, "\n");
+		if (opts->unique)
+			comphist_out_puts(out, "unique blocks only\n");
+		if (rep->snapshot_mode)
+			comphist_out_puts(out, "snapshot mode\n");
+		else if (opts->allow_live)
+			comphist_out_puts(out, "live mode enabled\n");
+		break;
+	case COMPHIST_FMT_JSON:
+		if (opts->per_dataset)
+			comphist_out_puts(out,
+			    rep->records > 0 ? "\n  ]\n}\n" : "]\n}\n");
+		break;
+	default:
+		break;
+	}
+
+	return (comphist_out_flush(out));
+}
+
+/*
+ * The report emitter behind the library's writer API.
+ */
+struct comphist_writer {
+	struct comphist_report rep;
+};
+
+struct comphist_writer *
+comphist_writer_open(int fd, const struct comphist_options *opts,
+    const char *target, bool snapshot_mode)
+{
+	struct comphist_writer *w = malloc(sizeof(*w));
+	struct comphist_out *out = comphist_out_open(fd);
+
+	if (w == NULL || out == NULL) {
+		free(w);
+		if (out != NULL)
+			(void)comphist_out_close(out);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	comphist_report_begin(&w->rep, out, opts, target, snapshot_mode);
+	return (w);
+}
+
+int
+comphist_writer_dataset(struct comphist_writer *w, const char *dsname,
+    const struct comphist_stats *stats)
+{
+	int err = comphist_report_dataset(&w->rep, dsname, stats);
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+int
+comphist_writer_total(struct comphist_writer *w,
+    const struct comphist_stats *stats)
+{
+	comphist_report_total(&w->rep, stats);
+	return (0);
+}
+
+int
+comphist_writer_close(struct comphist_writer *w)
+{
+	int err, cerr;
+
+	/* Keep the first error; closing flushes what is still buffered. */
+	err = comphist_report_end(&w->rep);
+	cerr = comphist_out_close(w->rep.out);
+	free(w);
+	if (err == 0)
+		err = cerr;
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+comphist_ndjson_finish(struct comphist_out *out)
+{
+	int err = comphist_out_close(out);
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+int
+comphist_ndjson_record(int fd, const struct comphist_options *opts,
+    const char *dsname, const struct comphist_stats *stats)
+{
+	struct comphist_out *out = comphist_out_open(fd);
+
+	if (out == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	comphist_json_dataset(out, dsname, stats, opts);
+	comphist_out_puts(out, "\n");
+	return (comphist_ndjson_finish(out));
+}
+
+int
+comphist_ndjson_error(int fd, const char *dsname, const char *msg)
+{
+	struct comphist_out *out = comphist_out_open(fd);
+
+	if (out == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	comphist_out_puts(out, "{\"name\":");
+	comphist_out_json_string(out, dsname);
+	comphist_out_puts(out, ",\"error\":");
+	comphist_out_json_string(out, msg);
+	comphist_out_puts(out, "}\n");
+	return (comphist_ndjson_finish(out));
+}
@@ -0,0 +1,44 @@
+#ifndef COMPHIST_REPORT_H
+#define COMPHIST_REPORT_H
+
+#include "output.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libcomphist.h"
+
+/*
+ * Report emitter shared by all output formats.  A report is
+ * comphist_report_begin(), then either one comphist_report_total() or, for
+ * per-dataset output, a comphist_report_dataset() per dataset as the walk
+ * finishes it, then comphist_report_end().
+ *
+ * Every dataset record is flushed when it is complete, so NDJSON and CSV
+ * consumers can process a long -p walk while it runs.
+ *
+ *	text	the tables, one block per dataset with -p
+ *	json	one document; datasets are an array with -p
+ *	ndjson	one JSON object per line: per dataset with -p, else one
+ *	csv	one row per algorithm plus a "total" row, per dataset with -p
+ */
+struct comphist_report {
+	struct comphist_out *out;
+	const struct comphist_options *opts;
+	const char *target;
+	bool snapshot_mode;
+	uint64_t records;
+};
+
+
+void comphist_report_begin(struct comphist_report *rep,
+    struct comphist_out *out, const struct comphist_options *opts,
+    const char *target, bool snapshot_mode);
+int comphist_report_dataset(struct comphist_report *rep, const char *dsname,
+    const struct comphist_stats *stats);
+void comphist_report_total(struct comphist_report *rep,
+    const struct comphist_stats *stats);
+int comphist_report_end(struct comphist_report *rep);
+
+#endif
@@ -0,0 +1,575 @@
+#include "simulate.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/dmu.h>
+#include <sys/spa.h>
+#include <sys/vdev_impl.h>
+#include <sys/zfs_context.h>
+#include <sys/zio.h>
+#include <sys/zio_compress.h>
+
+/*
+ * Recompression what-if simulator.
+ *
+ * During traversal every eligible L0 data block is offered to a reservoir
+ * sampler (Algorithm R), which keeps a uniform random sample of block
+ * pointers.  Each traversal fills a reservoir of its own without locking;
+ * finished reservoirs are merged into the walk's by drawing from the two
+ * populations in proportion to their sizes.  After the walk the sampled
+ * blocks are read and decompressed through the normal ZIO path and
+ * recompressed with each candidate algorithm on a taskq.  Projected sizes
+ * are ratio estimates: the sampled candidate size per logical byte, scaled
+ * to the logical size of the whole eligible population.
+ */
+
+#define COMPHIST_SIM_Z95	1.96
+
+struct comphist_sim_candidate {
+	char name[16];
+	enum zio_compress comp;
+	uint8_t level;
+};
+
+struct comphist_sim_sample {
+	blkptr_t bp;
+	zbookmark_phys_t zb;
+	bool ok;
+	uint64_t psize[COMPHIST_SIM_MAX];
+	uint64_t asize[COMPHIST_SIM_MAX];
+};
+
+struct comphist_sim_ref {
+	blkptr_t bp;
+	zbookmark_phys_t zb;
+};
+
+struct comphist_sim_local {
+	uint64_t capacity;
+	uint64_t seen;
+	uint64_t rng;
+	uint64_t pop_lsize;
+	uint64_t pop_psize;
+	uint64_t pop_asize;
+	struct comphist_sim_ref *refs;
+};
+
+struct comphist_sim {
+	kmutex_t lock;
+	int ncandidates;
+	struct comphist_sim_candidate candidates[COMPHIST_SIM_MAX];
+	uint64_t capacity;
+	uint64_t seen;
+	uint64_t rng;
+	uint64_t pop_lsize;
+	uint64_t pop_psize;
+	uint64_t pop_asize;
+	struct comphist_sim_sample *samples;
+};
+
+struct comphist_sim_job {
+	struct comphist_sim *sim;
+	spa_t *spa;
+	struct comphist_sim_sample *sample;
+};
+
+static int
+comphist_sim_parse_one(const char *name, struct comphist_sim_candidate *cand)
+{
+	static const struct {
+		const char *name;
+		enum zio_compress comp;
+	} plain[] = {
+		{ "lzjb", ZIO_COMPRESS_LZJB },
+		{ "zle", ZIO_COMPRESS_ZLE },
+		{ "lz4", ZIO_COMPRESS_LZ4 },
+		{ "gzip", ZIO_COMPRESS_GZIP_6 },
+		{ "zstd", ZIO_COMPRESS_ZSTD },
+	};
+	char *end;
+	long level;
+
+	if (strlen(name) >= sizeof(cand->name))
+		return (EINVAL);
+	(void)strlcpy(cand->name, name, sizeof(cand->name));
+	cand->level = 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(plain); i++) {
+		if (strcmp(name, plain[i].name) == 0) {
+			cand->comp = plain[i].comp;
+			cand->level = cand->comp == ZIO_COMPRESS_ZSTD ? 3 : 0;
+			return (0);
+		}
+	}
+
+	if (strncmp(name, "gzip-", 5) == 0) {
+		level = strtol(name + 5, &end, 10);
+		if (*end != '\0' || level < 1 || level > 9)
+			return (EINVAL);
+		cand->comp = ZIO_COMPRESS_GZIP_1 + (level - 1);
+		return (0);
+	}
+
+	if (strncmp(name, "zstd-", 5) == 0) {
+		level = strtol(name + 5, &end, 10);
+		if (*end != '\0' || level < 1 || level > 19)
+			return (EINVAL);
+		cand->comp = ZIO_COMPRESS_ZSTD;
+		cand->level = (uint8_t)level;
+		return (0);
+	}
+
+	return (EINVAL);
+}
+
+static int
+comphist_sim_parse(const char *spec, struct comphist_sim_candidate *cands,
+    int *ncands)
+{
+	char *copy = strdup(spec);
+	char *save = NULL;
+	int err = 0;
+
+	if (copy == NULL)
+		return (ENOMEM);
+
+	*ncands = 0;
+	for (char *tok = strtok_r(copy, ",", &save); tok != NULL;
+	    tok = strtok_r(NULL, ",", &save)) {
+		if (*ncands == COMPHIST_SIM_MAX) {
+			err = E2BIG;
+			break;
+		}
+		err = comphist_sim_parse_one(tok, &cands[*ncands]);
+		if (err != 0)
+			break;
+		(*ncands)++;
+	}
+	if (err == 0 && *ncands == 0)
+		err = EINVAL;
+
+	free(copy);
+	return (err);
+}
+
+bool
+comphist_sim_spec_valid(const char *spec)
+{
+	struct comphist_sim_candidate cands[COMPHIST_SIM_MAX];
+	int ncands;
+
+	return (comphist_sim_parse(spec, cands, &ncands) == 0);
+}
+
+struct comphist_sim *
+comphist_sim_create(const char *spec, uint64_t samples, uint64_t seed)
+{
+	struct comphist_sim *sim;
+
+	sim = calloc(1, sizeof(*sim));
+	if (sim == NULL)
+		return (NULL);
+
+	if (comphist_sim_parse(spec, sim->candidates, &sim->ncandidates) != 0)
+		goto fail;
+
+	sim->samples = calloc(samples, sizeof(*sim->samples));
+	if (sim->samples == NULL)
+		goto fail;
+
+	sim->capacity = samples;
+	sim->rng = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+	mutex_init(&sim->lock, NULL, MUTEX_DEFAULT, NULL);
+	return (sim);
+
+fail:
+	free(sim->samples);
+	free(sim);
+	return (NULL);
+}
+
+void
+comphist_sim_destroy(struct comphist_sim *sim)
+{
+	mutex_destroy(&sim->lock);
+	free(sim->samples);
+	free(sim);
+}
+
+/* splitmix64 */
+static uint64_t
+comphist_sim_random(uint64_t *rng)
+{
+	uint64_t z = (*rng += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Forget everything offered so far, for walks that start over.
+ */
+void
+comphist_sim_reset(struct comphist_sim *sim)
+{
+	mutex_enter(&sim->lock);
+	sim->seen = 0;
+	sim->pop_lsize = 0;
+	sim->pop_psize = 0;
+	sim->pop_asize = 0;
+	mutex_exit(&sim->lock);
+}
+
+/*
+ * Only readable L0 file and zvol data is eligible: encrypted blocks cannot
+ * be decompressed without their key.
+ */
+static bool
+comphist_sim_eligible(const blkptr_t *bp)
+{
+	return (!BP_IS_HOLE(bp) && !BP_IS_EMBEDDED(bp) &&
+	    !BP_IS_REDACTED(bp) && !BP_IS_ENCRYPTED(bp) &&
+	    BP_GET_LEVEL(bp) == 0 &&
+	    (BP_GET_TYPE(bp) == DMU_OT_PLAIN_FILE_CONTENTS ||
+	    BP_GET_TYPE(bp) == DMU_OT_ZVOL));
+}
+
+/*
+ * Offer a block straight to the walk's reservoir, for single-threaded
+ * walks that have no traversal reservoir.
+ */
+void
+comphist_sim_offer(struct comphist_sim *sim, const blkptr_t *bp,
+    const zbookmark_phys_t *zb)
+{
+	uint64_t slot;
+
+	if (!comphist_sim_eligible(bp))
+		return;
+
+	mutex_enter(&sim->lock);
+	sim->pop_lsize += BP_GET_LSIZE(bp);
+	sim->pop_psize += BP_GET_PSIZE(bp);
+	sim->pop_asize += BP_GET_ASIZE(bp);
+
+	slot = sim->seen++;
+	if (slot >= sim->capacity)
+		slot = comphist_sim_random(&sim->rng) % sim->seen;
+	if (slot < sim->capacity) {
+		sim->samples[slot].bp = *bp;
+		sim->samples[slot].zb = *zb;
+	}
+	mutex_exit(&sim->lock);
+}
+
+struct comphist_sim_local *
+comphist_sim_local_create(struct comphist_sim *sim)
+{
+	struct comphist_sim_local *local;
+
+	local = calloc(1, sizeof(*local));
+	if (local == NULL)
+		return (NULL);
+	local->refs = calloc(sim->capacity, sizeof(*local->refs));
+	if (local->refs == NULL) {
+		free(local);
+		return (NULL);
+	}
+
+	local->capacity = sim->capacity;
+	mutex_enter(&sim->lock);
+	local->rng = comphist_sim_random(&sim->rng);
+	mutex_exit(&sim->lock);
+	return (local);
+}
+
+void
+comphist_sim_local_destroy(struct comphist_sim_local *local)
+{
+	if (local == NULL)
+		return;
+	free(local->refs);
+	free(local);
+}
+
+void
+comphist_sim_local_offer(struct comphist_sim_local *local,
+    const blkptr_t *bp, const zbookmark_phys_t *zb)
+{
+	uint64_t slot;
+
+	if (!comphist_sim_eligible(bp))
+		return;
+
+	local->pop_lsize += BP_GET_LSIZE(bp);
+	local->pop_psize += BP_GET_PSIZE(bp);
+	local->pop_asize += BP_GET_ASIZE(bp);
+
+	slot = local->seen++;
+	if (slot >= local->capacity)
+		slot = comphist_sim_random(&local->rng) % local->seen;
+	if (slot < local->capacity) {
+		local->refs[slot].bp = *bp;
+		local->refs[slot].zb = *zb;
+	}
+}
+
+/*
+ * Merge a traversal's reservoir into the walk's.  Each of the merged
+ * reservoir's slots is drawn, without replacement, from the walk's
+ * population or the traversal's in proportion to what is left of each;
+ * a uniform subset of a reservoir is a uniform sample of its population,
+ * so the result is a uniform sample of both.  The local reservoir is
+ * left shuffled.
+ */
+void
+comphist_sim_merge(struct comphist_sim *sim, struct comphist_sim_local *local)
+{
+	uint64_t na, nb, ka, kb, k, take = 0;
+
+	if (local->seen == 0)
+		return;
+
+	mutex_enter(&sim->lock);
+	na = sim->seen;
+	nb = local->seen;
+	ka = MIN(na, sim->capacity);
+	kb = MIN(nb, local->capacity);
+	k = MIN(na + nb, sim->capacity);
+
+	for (uint64_t i = 0, ra = na, rb = nb; i < k; i++) {
+		if (comphist_sim_random(&sim->rng) % (ra + rb) < ra) {
+			take++;
+			ra--;
+		} else {
+			rb--;
+		}
+	}
+
+	/* Partial Fisher-Yates shuffles pick the slots kept from each. */
+	for (uint64_t i = 0; i < take; i++) {
+		uint64_t j = i + comphist_sim_random(&sim->rng) % (ka - i);
+		struct comphist_sim_sample tmp = sim->samples[i];
+
+		sim->samples[i] = sim->samples[j];
+		sim->samples[j] = tmp;
+	}
+	for (uint64_t i = 0; i < k - take; i++) {
+		uint64_t j = i + comphist_sim_random(&sim->rng) % (kb - i);
+		struct comphist_sim_ref tmp = local->refs[i];
+
+		local->refs[i] = local->refs[j];
+		local->refs[j] = tmp;
+		sim->samples[take + i].bp = local->refs[i].bp;
+		sim->samples[take + i].zb = local->refs[i].zb;
+	}
+
+	sim->seen = na + nb;
+	sim->pop_lsize += local->pop_lsize;
+	sim->pop_psize += local->pop_psize;
+	sim->pop_asize += local->pop_asize;
+	mutex_exit(&sim->lock);
+}
+
+static uint64_t
+comphist_sim_asize(spa_t *spa, const blkptr_t *bp, uint64_t psize)
+{
+	uint64_t asize = 0;
+
+	if (psize == 0)
+		return (0);
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	for (int d = 0; d < BP_GET_NDVAS(bp); d++) {
+		vdev_t *vd = vdev_lookup_top(spa,
+		    DVA_GET_VDEV(&bp->blk_dva[d]));
+
+		if (vd != NULL)
+			asize += vdev_psize_to_asize(vd, psize);
+	}
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	return (asize);
+}
+
+static void
+comphist_sim_task(void *arg)
+{
+	struct comphist_sim_job *job = arg;
+	struct comphist_sim_sample *sample = job->sample;
+	const blkptr_t *bp = &sample->bp;
+	uint64_t lsize = BP_GET_LSIZE(bp);
+	abd_t *abd = abd_alloc_linear(lsize, B_FALSE);
+	int err;
+
+	err = zio_wait(zio_read(NULL, job->spa, bp, abd, lsize, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL, &sample->zb));
+	if (err != 0) {
+		abd_free(abd);
+		return;
+	}
+
+	for (int c = 0; c < job->sim->ncandidates; c++) {
+		const struct comphist_sim_candidate *cand =
+		    &job->sim->candidates[c];
+		uint64_t max = lsize - (lsize >> 3);
+		abd_t *cabd = NULL;
+		uint64_t psize;
+
+		/*
+		 * Like the write path, keep the block uncompressed unless
+		 * compression saves at least 12.5%.  Results that would fit in
+		 * the block pointer are embedded and allocate nothing.
+		 */
+		psize = zio_compress_data(cand->comp, abd, &cabd, lsize, max,
+		    cand->level);
+		if (psize >= max) {
+			psize = lsize;
+		} else if (psize <= BPE_PAYLOAD_SIZE) {
+			sample->psize[c] = psize;
+			sample->asize[c] = 0;
+			if (cabd != NULL)
+				abd_free(cabd);
+			continue;
+		} else {
+			psize = P2ROUNDUP(psize, SPA_MINBLOCKSIZE);
+		}
+		if (cabd != NULL)
+			abd_free(cabd);
+
+		sample->psize[c] = psize;
+		sample->asize[c] = comphist_sim_asize(job->spa, bp, psize);
+	}
+
+	abd_free(abd);
+	sample->ok = true;
+}
+
+/*
+ * Ratio estimate of a population total from sampled (x, y) pairs, where x
+ * is the logical size and X the population's logical total.  The returned
+ * confidence half-width uses the usual linearized variance with a finite
+ * population correction.
+ */
+static void
+comphist_sim_estimate(const double *x, const double *y, uint64_t n,
+    uint64_t population, double total_x, uint64_t *est, double *ci)
+{
+	double sum_x = 0.0, sum_y = 0.0, ratio, var = 0.0, mean_x, fpc;
+
+	for (uint64_t i = 0; i < n; i++) {
+		sum_x += x[i];
+		sum_y += y[i];
+	}
+	if (n == 0 || sum_x == 0.0) {
+		*est = 0;
+		*ci = 0.0;
+		return;
+	}
+
+	ratio = sum_y / sum_x;
+	*est = (uint64_t)llround(ratio * total_x);
+	if (n < 2) {
+		*ci = 0.0;
+		return;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		double r = y[i] - ratio * x[i];
+
+		var += r * r;
+	}
+	var /= (double)(n - 1);
+	mean_x = sum_x / (double)n;
+	fpc = population > n ? 1.0 - (double)n / (double)population : 0.0;
+
+	*ci = COMPHIST_SIM_Z95 * sqrt(var / (double)n * fpc) / mean_x *
+	    total_x;
+}
+
+int
+comphist_sim_run(struct comphist_sim *sim, spa_t *spa, int nthreads,
+    struct comphist_sim_result *result)
+{
+	uint64_t n = MIN(sim->seen, sim->capacity);
+	struct comphist_sim_job *jobs;
+	double *x, *yp, *ya;
+	uint64_t ok = 0;
+	taskq_t *tq;
+
+	memset(result, 0, sizeof(*result));
+	result->population_blocks = sim->seen;
+	result->population_lsize = sim->pop_lsize;
+	result->population_psize = sim->pop_psize;
+	result->population_asize = sim->pop_asize;
+	result->ncandidates = sim->ncandidates;
+	for (int c = 0; c < sim->ncandidates; c++)
+		(void)strlcpy(result->candidates[c].name,
+		    sim->candidates[c].name,
+		    sizeof(result->candidates[c].name));
+
+	jobs = calloc(n, sizeof(*jobs));
+	x = calloc(n, sizeof(*x));
+	yp = calloc(n, sizeof(*yp));
+	ya = calloc(n, sizeof(*ya));
+	if ((jobs == NULL || x == NULL || yp == NULL || ya == NULL) && n > 0) {
+		free(jobs);
+		free(x);
+		free(yp);
+		free(ya);
+		return (ENOMEM);
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	tq = taskq_create("z_comphist_sim", nthreads, defclsyspri, nthreads,
+	    INT_MAX, TASKQ_PREPOPULATE);
+	for (uint64_t i = 0; i < n; i++) {
+		jobs[i].sim = sim;
+		jobs[i].spa = spa;
+		jobs[i].sample = &sim->samples[i];
+		(void)taskq_dispatch(tq, comphist_sim_task, &jobs[i], TQ_SLEEP);
+	}
+	taskq_wait(tq);
+	taskq_destroy(tq);
+
+	/*
+	 * Blocks of live datasets may have been freed since they were
+	 * sampled; unreadable samples are dropped from the estimate.
+	 */
+	for (uint64_t i = 0; i < n; i++) {
+		if (sim->samples[i].ok)
+			x[ok++] = (double)BP_GET_LSIZE(&sim->samples[i].bp);
+	}
+	result->samples = ok;
+	result->sample_errors = n - ok;
+
+	for (int c = 0; c < sim->ncandidates; c++) {
+		struct comphist_sim_entry *entry = &result->candidates[c];
+		uint64_t j = 0;
+
+		for (uint64_t i = 0; i < n; i++) {
+			if (!sim->samples[i].ok)
+				continue;
+			yp[j] = (double)sim->samples[i].psize[c];
+			ya[j] = (double)sim->samples[i].asize[c];
+			j++;
+		}
+
+		comphist_sim_estimate(x, yp, ok, sim->seen,
+		    (double)sim->pop_lsize, &entry->psize, &entry->psize_ci);
+		comphist_sim_estimate(x, ya, ok, sim->seen,
+		    (double)sim->pop_lsize, &entry->asize, &entry->asize_ci);
+	}
+
+	free(jobs);
+	free(x);
+	free(yp);
+	free(ya);
+	return (0);
+}
@@ -0,0 +1,30 @@
+#ifndef COMPHIST_SIMULATE_H
+#define COMPHIST_SIMULATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/spa.h>
+
+#include "libcomphist.h"
+#include "stats.h"
+
+struct comphist_sim;
+struct comphist_sim_local;
+
+struct comphist_sim *comphist_sim_create(const char *spec, uint64_t samples,
+    uint64_t seed);
+void comphist_sim_offer(struct comphist_sim *sim, const blkptr_t *bp,
+    const zbookmark_phys_t *zb);
+void comphist_sim_reset(struct comphist_sim *sim);
+struct comphist_sim_local *comphist_sim_local_create(struct comphist_sim *sim);
+void comphist_sim_local_destroy(struct comphist_sim_local *local);
+void comphist_sim_local_offer(struct comphist_sim_local *local,
+    const blkptr_t *bp, const zbookmark_phys_t *zb);
+void comphist_sim_merge(struct comphist_sim *sim,
+    struct comphist_sim_local *local);
+int comphist_sim_run(struct comphist_sim *sim, spa_t *spa, int nthreads,
+    struct comphist_sim_result *result);
+void comphist_sim_destroy(struct comphist_sim *sim);
+
+#endif
@@ -1,7 +1,17 @@
 #include "stats.h"
 
+#include "entropy.h"
+#include "output.h"
+
+#include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <sys/dmu.h>
 
 void
 comphist_stats_init(struct comphist_stats *stats)
@@ -9,6 +19,87 @@ comphist_stats_init(struct comphist_stats *stats)
 	memset(stats, 0, sizeof(*stats));
 }
 
+struct comphist_stats *
+comphist_stats_alloc(void)
+{
+	/* calloc() leaves the stats as comphist_stats_init() would. */
+	return calloc(1, sizeof(struct comphist_stats));
+}
+
+void
+comphist_stats_free(struct comphist_stats *stats)
+{
+	free(stats);
+}
+
+int
+comphist_stats_algorithms(void)
+{
+	return ZIO_COMPRESS_FUNCTIONS;
+}
+
+const char *
+comphist_stats_algorithm(int comp)
+{
+	if (comp < 0 || comp >= ZIO_COMPRESS_FUNCTIONS)
+		return NULL;
+
+	return comphist_comp_name(comp);
+}
+
+int
+comphist_stats_get(const struct comphist_stats *stats, int comp,
+    struct comphist_totals *totals)
+{
+	const struct comphist_entry *e;
+
+	if (comp == COMPHIST_ALL) {
+		totals->blocks = stats->total_blocks;
+		totals->lsize = stats->total_lsize;
+		totals->psize = stats->total_psize;
+		totals->asize = stats->total_asize;
+		totals->embedded_blocks = stats->total_embedded_blocks;
+		totals->embedded_lsize = stats->total_embedded_lsize;
+		return 0;
+	}
+	if (comp < 0 || comp >= ZIO_COMPRESS_FUNCTIONS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	e = &stats->entries[comp];
+	totals->blocks = e->blocks;
+	totals->lsize = e->lsize;
+	totals->psize = e->psize;
+	totals->asize = e->asize;
+	totals->embedded_blocks = e->embedded_blocks;
+	totals->embedded_lsize = e->embedded_lsize;
+	return 0;
+}
+
+void
+comphist_stats_counts(const struct comphist_stats *stats,
+    struct comphist_counts *counts)
+{
+	counts->holes = stats->total_holes;
+	counts->redacted = stats->total_redacted;
+	counts->unknown = stats->total_unknown;
+	counts->traversal_errors = stats->traversal_errors;
+}
+
+size_t
+comphist_stats_size(void)
+{
+	return sizeof(struct comphist_stats);
+}
+
+void
+comphist_stats_copy(struct comphist_stats *dst,
+    const struct comphist_stats *src)
+{
+	memcpy(dst, src, sizeof(*dst));
+}
+
 static enum zio_compress
 comphist_normalize_comp(enum zio_compress comp)
 {
@@ -19,18 +110,36 @@ comphist_normalize_comp(enum zio_compress comp)
 	return comp;
 }
 
+static inline unsigned
+comphist_hist_bucket(uint64_t size)
+{
+	unsigned bucket;
+
+	if (size == 0)
+		return 0;
+	bucket = 64 - __builtin_clzll(size);
+
+	return bucket < COMPHIST_HIST_BUCKETS ? bucket :
+	    COMPHIST_HIST_BUCKETS - 1;
+}
+
 void
 comphist_stats_add_block(struct comphist_stats *stats, enum zio_compress comp,
     uint64_t lsize, uint64_t psize, uint64_t asize, bool embedded)
 {
 	enum zio_compress idx = comphist_normalize_comp(comp);
 	struct comphist_entry *entry = &stats->entries[idx];
+	uint64_t (*hist)[COMPHIST_HIST_BUCKETS] = stats->hist[idx];
 
 	entry->blocks++;
 	entry->lsize += lsize;
 	entry->psize += psize;
 	entry->asize += asize;
 
+	hist[COMPHIST_HIST_LSIZE][comphist_hist_bucket(lsize)]++;
+	hist[COMPHIST_HIST_PSIZE][comphist_hist_bucket(psize)]++;
+	hist[COMPHIST_HIST_ASIZE][comphist_hist_bucket(asize)]++;
+
 	stats->total_blocks++;
 	stats->total_lsize += lsize;
 	stats->total_psize += psize;
@@ -48,6 +157,309 @@ comphist_stats_add_block(struct comphist_stats *stats, enum zio_compress comp,
 	}
 }
 
+static inline void
+comphist_dva_cell_add(struct comphist_dva_cell *cell, int d, uint64_t psize,
+    uint64_t asize, bool gang)
+{
+	cell->dvas++;
+	cell->psize += psize;
+	cell->asize += asize;
+	if (d > 0) {
+		cell->copy_dvas++;
+		cell->copy_asize += asize;
+	}
+	if (gang)
+		cell->gang_dvas++;
+}
+
+static void
+comphist_dva_cell_merge(struct comphist_dva_cell *d,
+    const struct comphist_dva_cell *s)
+{
+	d->dvas += s->dvas;
+	d->psize += s->psize;
+	d->asize += s->asize;
+	d->copy_dvas += s->copy_dvas;
+	d->copy_asize += s->copy_asize;
+	d->gang_dvas += s->gang_dvas;
+}
+
+void
+comphist_stats_account(struct comphist_stats *stats,
+    const struct comphist_block *blk)
+{
+	struct comphist_cell *cell;
+
+	if (blk->flags & COMPHIST_BLK_HOLE) {
+		comphist_stats_note_hole(stats);
+		return;
+	}
+
+	if (blk->flags & COMPHIST_BLK_REDACTED) {
+		comphist_stats_note_redacted(stats);
+		return;
+	}
+
+	comphist_stats_add_block(stats, blk->comp, blk->lsize, blk->psize,
+	    blk->asize, (blk->flags & COMPHIST_BLK_EMBEDDED) != 0);
+
+	cell = &stats->objtype[comphist_objclass(blk->type)]
+	    [blk->level < COMPHIST_LEVELS ? blk->level : COMPHIST_LEVELS - 1]
+	    [comphist_normalize_comp(blk->comp)];
+	cell->blocks++;
+	cell->lsize += blk->lsize;
+	cell->psize += blk->psize;
+	cell->asize += blk->asize;
+
+	cell = &stats->era[blk->era < COMPHIST_ERAS ? blk->era :
+	    COMPHIST_ERAS - 1][comphist_normalize_comp(blk->comp)];
+	cell->blocks++;
+	cell->lsize += blk->lsize;
+	cell->psize += blk->psize;
+	cell->asize += blk->asize;
+
+	for (int d = 0; d < blk->ndvas; d++) {
+		uint64_t asize = (uint64_t)blk->dva_asize[d] << 9;
+		bool gang = (blk->dva_gang & (1U << d)) != 0;
+		uint8_t ac = blk->dva_class[d];
+		int v = MIN(blk->dva_vdev[d], COMPHIST_VDEVS - 1);
+
+		comphist_dva_cell_add(&stats->alloc_class[ac]
+		    [comphist_normalize_comp(blk->comp)], d, blk->psize, asize,
+		    gang);
+		if (stats->vdev[v].dvas == 0)
+			stats->vdev_class[v] = ac;
+		else if (stats->vdev_class[v] != ac)
+			stats->vdev_class[v] = COMPHIST_AC_MIXED;
+		comphist_dva_cell_add(&stats->vdev[v], d, blk->psize, asize,
+		    gang);
+		stats->alloc_hist[ac][comphist_hist_bucket(asize)]++;
+	}
+}
+
+void
+comphist_stats_merge(struct comphist_stats *dst,
+    const struct comphist_stats *src)
+{
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		struct comphist_entry *d = &dst->entries[i];
+		const struct comphist_entry *s = &src->entries[i];
+
+		d->blocks += s->blocks;
+		d->lsize += s->lsize;
+		d->psize += s->psize;
+		d->asize += s->asize;
+		d->embedded_blocks += s->embedded_blocks;
+		d->embedded_lsize += s->embedded_lsize;
+
+		for (int k = 0; k < COMPHIST_HIST_KINDS; k++) {
+			for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+				dst->hist[i][k][b] += src->hist[i][k][b];
+		}
+	}
+
+	for (int oc = 0; oc < COMPHIST_OC_COUNT; oc++) {
+		for (int l = 0; l < COMPHIST_LEVELS; l++) {
+			for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+				struct comphist_cell *d = &dst->objtype[oc][l][i];
+				const struct comphist_cell *s =
+				    &src->objtype[oc][l][i];
+
+				d->blocks += s->blocks;
+				d->lsize += s->lsize;
+				d->psize += s->psize;
+				d->asize += s->asize;
+			}
+		}
+	}
+
+	for (int e = 0; e < COMPHIST_ERAS; e++) {
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+			struct comphist_cell *d = &dst->era[e][i];
+			const struct comphist_cell *s = &src->era[e][i];
+
+			d->blocks += s->blocks;
+			d->lsize += s->lsize;
+			d->psize += s->psize;
+			d->asize += s->asize;
+		}
+	}
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		struct comphist_entropy_cell *d = &dst->entropy[i];
+		const struct comphist_entropy_cell *s = &src->entropy[i];
+
+		d->low_blocks += s->low_blocks;
+		d->low_lsize += s->low_lsize;
+		d->high_blocks += s->high_blocks;
+		d->high_lsize += s->high_lsize;
+		d->unread_blocks += s->unread_blocks;
+	}
+
+	for (int l = 0; l < COMPHIST_ZSTD_LEVELS; l++) {
+		struct comphist_cell *d = &dst->zstd[l];
+		const struct comphist_cell *s = &src->zstd[l];
+
+		d->blocks += s->blocks;
+		d->lsize += s->lsize;
+		d->psize += s->psize;
+		d->asize += s->asize;
+	}
+	dst->zstd_unread += src->zstd_unread;
+
+	for (int ac = 0; ac < COMPHIST_AC_COUNT; ac++) {
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++)
+			comphist_dva_cell_merge(&dst->alloc_class[ac][i],
+			    &src->alloc_class[ac][i]);
+		for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+			dst->alloc_hist[ac][b] += src->alloc_hist[ac][b];
+	}
+	for (int v = 0; v < COMPHIST_VDEVS; v++) {
+		if (src->vdev[v].dvas == 0)
+			continue;
+		if (dst->vdev[v].dvas == 0)
+			dst->vdev_class[v] = src->vdev_class[v];
+		else if (dst->vdev_class[v] != src->vdev_class[v])
+			dst->vdev_class[v] = COMPHIST_AC_MIXED;
+		comphist_dva_cell_merge(&dst->vdev[v], &src->vdev[v]);
+	}
+
+	if (src->sample.rate > dst->sample.rate)
+		dst->sample.rate = src->sample.rate;
+	dst->sample.objects += src->sample.objects;
+	dst->sample.sampled_objects += src->sample.sampled_objects;
+	for (int i = 0; i <= ZIO_COMPRESS_FUNCTIONS; i++) {
+		for (int m = 0; m < COMPHIST_METRICS; m++)
+			dst->sample.var[i][m] += src->sample.var[i][m];
+	}
+
+	if (src->era_shift > dst->era_shift)
+		dst->era_shift = src->era_shift;
+	for (int e = 0; e <= COMPHIST_ERAS; e++) {
+		if (dst->era_time[e] == 0)
+			dst->era_time[e] = src->era_time[e];
+	}
+
+	dst->total_blocks += src->total_blocks;
+	dst->total_lsize += src->total_lsize;
+	dst->total_psize += src->total_psize;
+	dst->total_asize += src->total_asize;
+	dst->total_embedded_blocks += src->total_embedded_blocks;
+	dst->total_embedded_lsize += src->total_embedded_lsize;
+	dst->total_holes += src->total_holes;
+	dst->total_redacted += src->total_redacted;
+	dst->total_unknown += src->total_unknown;
+	dst->traversal_errors += src->traversal_errors;
+	dst->pipeline_batches += src->pipeline_batches;
+	dst->pipeline_depth_sum += src->pipeline_depth_sum;
+	if (src->pipeline_depth_max > dst->pipeline_depth_max)
+		dst->pipeline_depth_max = src->pipeline_depth_max;
+	dst->pipeline_stall_ns += src->pipeline_stall_ns;
+	dst->pipeline_idle_ns += src->pipeline_idle_ns;
+	dst->scan_ns += src->scan_ns;
+	dst->scan_cpu_ns += src->scan_cpu_ns;
+	dst->scan_meta_blocks += src->scan_meta_blocks;
+	dst->scan_meta_bytes += src->scan_meta_bytes;
+	dst->scan_meta_reads += src->scan_meta_reads;
+	dst->scan_arc_hits += src->scan_arc_hits;
+	dst->scan_arc_misses += src->scan_arc_misses;
+	dst->scan_retries += src->scan_retries;
+}
+
+static inline void
+comphist_scale(uint64_t *val, double factor)
+{
+	*val = (uint64_t)((double)*val * factor + 0.5);
+}
+
+static void
+comphist_scale_cell(struct comphist_cell *cell, double factor)
+{
+	comphist_scale(&cell->blocks, factor);
+	comphist_scale(&cell->lsize, factor);
+	comphist_scale(&cell->psize, factor);
+	comphist_scale(&cell->asize, factor);
+}
+
+static void
+comphist_scale_dva_cell(struct comphist_dva_cell *cell, double factor)
+{
+	comphist_scale(&cell->dvas, factor);
+	comphist_scale(&cell->psize, factor);
+	comphist_scale(&cell->asize, factor);
+	comphist_scale(&cell->copy_dvas, factor);
+	comphist_scale(&cell->copy_asize, factor);
+	comphist_scale(&cell->gang_dvas, factor);
+}
+
+/*
+ * Multiply every block and byte count by factor, used to scale a sample up
+ * to the population it was drawn from.  Traversal error and pipeline
+ * counters describe the scan itself and are left alone.
+ */
+void
+comphist_stats_scale(struct comphist_stats *stats, double factor)
+{
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		struct comphist_entry *entry = &stats->entries[i];
+		struct comphist_entropy_cell *ent = &stats->entropy[i];
+
+		comphist_scale(&entry->blocks, factor);
+		comphist_scale(&entry->lsize, factor);
+		comphist_scale(&entry->psize, factor);
+		comphist_scale(&entry->asize, factor);
+		comphist_scale(&entry->embedded_blocks, factor);
+		comphist_scale(&entry->embedded_lsize, factor);
+
+		for (int k = 0; k < COMPHIST_HIST_KINDS; k++) {
+			for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+				comphist_scale(&stats->hist[i][k][b], factor);
+		}
+
+		comphist_scale(&ent->low_blocks, factor);
+		comphist_scale(&ent->low_lsize, factor);
+		comphist_scale(&ent->high_blocks, factor);
+		comphist_scale(&ent->high_lsize, factor);
+		comphist_scale(&ent->unread_blocks, factor);
+	}
+
+	for (int oc = 0; oc < COMPHIST_OC_COUNT; oc++) {
+		for (int l = 0; l < COMPHIST_LEVELS; l++) {
+			for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++)
+				comphist_scale_cell(&stats->objtype[oc][l][i],
+				    factor);
+		}
+	}
+
+	for (int e = 0; e < COMPHIST_ERAS; e++) {
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++)
+			comphist_scale_cell(&stats->era[e][i], factor);
+	}
+
+	for (int l = 0; l < COMPHIST_ZSTD_LEVELS; l++)
+		comphist_scale_cell(&stats->zstd[l], factor);
+	comphist_scale(&stats->zstd_unread, factor);
+
+	for (int ac = 0; ac < COMPHIST_AC_COUNT; ac++) {
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++)
+			comphist_scale_dva_cell(&stats->alloc_class[ac][i],
+			    factor);
+		for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+			comphist_scale(&stats->alloc_hist[ac][b], factor);
+	}
+	for (int v = 0; v < COMPHIST_VDEVS; v++)
+		comphist_scale_dva_cell(&stats->vdev[v], factor);
+
+	comphist_scale(&stats->total_blocks, factor);
+	comphist_scale(&stats->total_lsize, factor);
+	comphist_scale(&stats->total_psize, factor);
+	comphist_scale(&stats->total_asize, factor);
+	comphist_scale(&stats->total_embedded_blocks, factor);
+	comphist_scale(&stats->total_embedded_lsize, factor);
+	comphist_scale(&stats->total_holes, factor);
+	comphist_scale(&stats->total_redacted, factor);
+	comphist_scale(&stats->total_unknown, factor);
+}
+
 void
 comphist_stats_note_hole(struct comphist_stats *stats)
 {
@@ -66,6 +478,93 @@ comphist_stats_note_traversal_error(struct comphist_stats *stats)
 	stats->traversal_errors++;
 }
 
+static uint8_t *
+comphist_pack_varint(uint8_t *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (uint8_t)val;
+	return p;
+}
+
+static const uint8_t *
+comphist_unpack_varint(const uint8_t *p, const uint8_t *end, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*val = v;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Encode stats into buf, which must hold COMPHIST_STATS_PACKED_MAX bytes,
+ * and return the encoded length.  Nearly all cells of a dataset's stats
+ * are zero, so only nonzero 64-bit words are stored, each as the number of
+ * zero words skipped since the previous one and its value.
+ */
+size_t
+comphist_stats_pack(const struct comphist_stats *stats, uint8_t *buf)
+{
+	const uint8_t *src = (const uint8_t *)stats;
+	uint8_t *p = buf;
+	size_t next = 0;
+
+	for (size_t w = 0; w < COMPHIST_STATS_WORDS; w++) {
+		uint64_t val;
+
+		memcpy(&val, src + w * sizeof(val), sizeof(val));
+		if (val == 0)
+			continue;
+		p = comphist_pack_varint(p, w - next);
+		p = comphist_pack_varint(p, val);
+		next = w + 1;
+	}
+
+	return (size_t)(p - buf);
+}
+
+/*
+ * Decode len bytes written by comphist_stats_pack().  Returns EINVAL, with
+ * stats cleared, for anything that is not exactly one encoded record.
+ */
+int
+comphist_stats_unpack(const uint8_t *buf, size_t len,
+    struct comphist_stats *stats)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + len;
+	uint8_t *dst = (uint8_t *)stats;
+	uint64_t next = 0;
+
+	comphist_stats_init(stats);
+	while (p < end) {
+		uint64_t skip, val;
+
+		if ((p = comphist_unpack_varint(p, end, &skip)) == NULL ||
+		    (p = comphist_unpack_varint(p, end, &val)) == NULL ||
+		    skip >= COMPHIST_STATS_WORDS - next || val == 0) {
+			comphist_stats_init(stats);
+			return EINVAL;
+		}
+		next += skip;
+		memcpy(dst + next * sizeof(val), &val, sizeof(val));
+		next++;
+	}
+
+	return 0;
+}
+
 const char *
 comphist_comp_name(enum zio_compress comp)
 {
@@ -109,23 +608,125 @@ comphist_comp_name(enum zio_compress comp)
 	}
 }
 
+enum comphist_objclass
+comphist_objclass(uint8_t type)
+{
+	if (type & DMU_OT_NEWTYPE) {
+		return DMU_OT_BYTESWAP(type) == DMU_BSWAP_ZAP ?
+		    COMPHIST_OC_ZAP : COMPHIST_OC_OTHER;
+	}
+
+	switch (type) {
+	case DMU_OT_PLAIN_FILE_CONTENTS:
+		return COMPHIST_OC_FILE;
+	case DMU_OT_DIRECTORY_CONTENTS:
+		return COMPHIST_OC_DIR;
+	case DMU_OT_DNODE:
+		return COMPHIST_OC_DNODE;
+	case DMU_OT_OBJSET:
+		return COMPHIST_OC_OBJSET;
+	case DMU_OT_SA:
+	case DMU_OT_SA_MASTER_NODE:
+	case DMU_OT_SA_ATTR_REGISTRATION:
+	case DMU_OT_SA_ATTR_LAYOUTS:
+		return COMPHIST_OC_SA;
+	case DMU_OT_ZVOL:
+		return COMPHIST_OC_ZVOL;
+	case DMU_OT_INTENT_LOG:
+		return COMPHIST_OC_ZIL;
+	default:
+		/* Legacy types carry their byteswap kind in dmu_ot[]. */
+		return type < DMU_OT_NUMTYPES &&
+		    dmu_ot[type].ot_byteswap == DMU_BSWAP_ZAP ?
+		    COMPHIST_OC_ZAP : COMPHIST_OC_OTHER;
+	}
+}
+
+const char *
+comphist_objclass_name(enum comphist_objclass oc)
+{
+	switch (oc) {
+	case COMPHIST_OC_FILE:
+		return "file";
+	case COMPHIST_OC_DIR:
+		return "directory";
+	case COMPHIST_OC_DNODE:
+		return "dnode";
+	case COMPHIST_OC_OBJSET:
+		return "objset";
+	case COMPHIST_OC_SA:
+		return "sa";
+	case COMPHIST_OC_ZAP:
+		return "zap";
+	case COMPHIST_OC_ZVOL:
+		return "zvol";
+	case COMPHIST_OC_ZIL:
+		return "zil";
+	default:
+		return "other";
+	}
+}
+
+const char *
+comphist_alloc_class_name(enum comphist_alloc_class ac)
+{
+	switch (ac) {
+	case COMPHIST_AC_NORMAL:
+		return "normal";
+	case COMPHIST_AC_SPECIAL:
+		return "special";
+	case COMPHIST_AC_DEDUP:
+		return "dedup";
+	case COMPHIST_AC_LOG:
+		return "log";
+	case COMPHIST_AC_REMOVED:
+		return "removed";
+	default:
+		return "mixed";
+	}
+}
+
+/*
+ * Levels as zfs set compression= spells them.  The header stores the fast
+ * levels as ZIO_ZSTD_LEVEL_FAST_1 (103) to _FAST_10, then _FAST_20 to
+ * _FAST_100 in steps of ten, then _FAST_500 and _FAST_1000.
+ */
+void
+comphist_zstd_level_name(unsigned level, char *buf, size_t len)
+{
+	if (level >= 1 && level <= 19)
+		snprintf(buf, len, "zstd-%u", level);
+	else if (level >= 103 && level <= 112)
+		snprintf(buf, len, "zstd-fast-%u", level - 102);
+	else if (level >= 113 && level <= 121)
+		snprintf(buf, len, "zstd-fast-%u", (level - 111) * 10);
+	else if (level == 122)
+		snprintf(buf, len, "zstd-fast-500");
+	else if (level == 123)
+		snprintf(buf, len, "zstd-fast-1000");
+	else
+		snprintf(buf, len, "zstd-?%u", level);
+}
+
 static void
-comphist_print_row(FILE *out, const char *name, uint64_t blocks,
-    double block_percent, uint64_t lsize, uint64_t psize, uint64_t asize,
-    double ratio)
+comphist_print_row(struct comphist_out *out, const char *name,
+    uint64_t blocks, double block_percent, uint64_t lsize, uint64_t psize,
+    uint64_t asize, double ratio)
 {
-	fprintf(out, "%-12s %12" PRIu64 " %8.2f %14" PRIu64 " %14" PRIu64
-	    " %14" PRIu64 " %7.2f\n",
+	comphist_out_printf(out, "%-12s %12" PRIu64 " %8.2f %14" PRIu64 " %14"
+	    PRIu64 " %14" PRIu64 " %7.2f\n",
 	    name, blocks, block_percent, lsize, psize, asize, ratio);
 }
 
 void
-comphist_stats_print(const struct comphist_stats *stats, FILE *out)
+comphist_stats_print(const struct comphist_stats *stats,
+    struct comphist_out *out)
 {
-	fprintf(out, "Compression   Blocks     Block_%%   Logical_B     Physical_B"
-	    "     Allocated_B  Ratio\n");
-	fprintf(out, "------------------------------------------------------------"
-	    "------------------------\n");
+	comphist_out_printf(out, "Compression   Blocks     Block_%%   Logical_B"
+	    "     Physical_B     Allocated_B  Ratio\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------"
+	    "----\n");
 
 	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
 		const struct comphist_entry *entry = &stats->entries[i];
@@ -151,8 +752,9 @@ comphist_stats_print(const struct comphist_stats *stats, FILE *out)
 		    entry->asize, ratio);
 	}
 
-	fprintf(out, "------------------------------------------------------------"
-	    "------------------------\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------"
+	    "----\n");
 	comphist_print_row(out, "total", stats->total_blocks,
 	    stats->total_blocks ? 100.0 : 0.0, stats->total_lsize,
 	    stats->total_psize, stats->total_asize,
@@ -160,19 +762,459 @@ comphist_stats_print(const struct comphist_stats *stats, FILE *out)
 	    (double)stats->total_lsize / (double)stats->total_psize);
 
 	if (stats->total_holes > 0) {
-		fprintf(out, "holes: %" PRIu64 "\n", stats->total_holes);
+		comphist_out_printf(out, "holes: %" PRIu64 "\n",
+		    stats->total_holes);
 	}
 	if (stats->total_redacted > 0) {
-		fprintf(out, "redacted blocks: %" PRIu64 "\n",
+		comphist_out_printf(out, "redacted blocks: %" PRIu64 "\n",
 		    stats->total_redacted);
 	}
 	if (stats->total_embedded_blocks > 0) {
-		fprintf(out, "embedded blocks: %" PRIu64 " (logical bytes: %" PRIu64
-		    ")\n", stats->total_embedded_blocks,
-		    stats->total_embedded_lsize);
+		comphist_out_printf(out, "embedded blocks: %" PRIu64
+		    " (logical bytes: %" PRIu64 ")\n",
+		    stats->total_embedded_blocks, stats->total_embedded_lsize);
 	}
 	if (stats->total_unknown > 0) {
-		fprintf(out, "unknown compression blocks: %" PRIu64 "\n",
-		    stats->total_unknown);
+		comphist_out_printf(out, "unknown compression blocks: %" PRIu64
+		    "\n", stats->total_unknown);
+	}
+}
+
+static void
+comphist_format_size(char *buf, size_t len, uint64_t size)
+{
+	static const char suffix[] = "KMGT";
+	int unit = -1;
+
+	while (size >= 1024 && size % 1024 == 0 && unit < 3) {
+		size /= 1024;
+		unit++;
+	}
+
+	if (unit < 0)
+		snprintf(buf, len, "%" PRIu64, size);
+	else
+		snprintf(buf, len, "%" PRIu64 "%c", size, suffix[unit]);
+}
+
+/* Label a histogram bucket with the smallest size it holds. */
+static void
+comphist_format_bucket(char *buf, size_t len, int bucket)
+{
+	comphist_format_size(buf, len, bucket == 0 ? 0 : 1ULL << (bucket - 1));
+}
+
+void
+comphist_stats_print_hist(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const uint64_t (*hist)[COMPHIST_HIST_BUCKETS] = stats->hist[i];
+		int lo = COMPHIST_HIST_BUCKETS, hi = -1;
+
+		if (stats->entries[i].blocks == 0)
+			continue;
+
+		for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++) {
+			for (int k = 0; k < COMPHIST_HIST_KINDS; k++) {
+				if (hist[k][b] == 0)
+					continue;
+				if (b < lo)
+					lo = b;
+				if (b > hi)
+					hi = b;
+			}
+		}
+
+		comphist_out_printf(out, "\n%s block sizes\n",
+		    comphist_comp_name(i));
+		comphist_out_puts(out, "  Size           Logical       "
+		    "Physical      Allocated\n");
+		for (int b = lo; b <= hi; b++) {
+			char label[16];
+
+			comphist_format_bucket(label, sizeof(label), b);
+			comphist_out_printf(out, "  %-8s %14" PRIu64
+			    " %14" PRIu64 " %14" PRIu64 "\n", label,
+			    hist[COMPHIST_HIST_LSIZE][b],
+			    hist[COMPHIST_HIST_PSIZE][b],
+			    hist[COMPHIST_HIST_ASIZE][b]);
+		}
+	}
+}
+
+void
+comphist_stats_print_objtypes(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	comphist_out_puts(out, "\nObject_Type Level Compression   Blocks"
+	    "   Logical_B     Physical_B     Allocated_B  Ratio\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------"
+	    "----------------\n");
+
+	for (int oc = 0; oc < COMPHIST_OC_COUNT; oc++) {
+		for (int l = 0; l < COMPHIST_LEVELS; l++) {
+			for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+				const struct comphist_cell *cell =
+				    &stats->objtype[oc][l][i];
+				char level[8];
+
+				if (cell->blocks == 0)
+					continue;
+
+				snprintf(level, sizeof(level), "L%d%s", l,
+				    l == COMPHIST_LEVELS - 1 ? "+" : "");
+				comphist_out_printf(out, "%-11s %-5s %-11s %8"
+				    PRIu64 " %14" PRIu64 " %14" PRIu64 " %14"
+				    PRIu64 " %7.2f\n",
+				    comphist_objclass_name(oc), level,
+				    comphist_comp_name(i), cell->blocks,
+				    cell->lsize, cell->psize, cell->asize,
+				    cell->psize == 0 ? 0.0 :
+				    (double)cell->lsize / (double)cell->psize);
+			}
+		}
+	}
+}
+
+static void
+comphist_print_dva_row(struct comphist_out *out, const char *name,
+    const char *label, const struct comphist_dva_cell *cell)
+{
+	comphist_out_printf(out, "%-8s %-11s %10" PRIu64 " %14" PRIu64 " %14"
+	    PRIu64 " %12" PRIu64 " %14" PRIu64 " %8" PRIu64 "\n", name, label,
+	    cell->dvas, cell->psize, cell->asize, cell->asize - cell->psize,
+	    cell->copy_asize, cell->gang_dvas);
+}
+
+void
+comphist_stats_print_vdevs(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	static const char *const header =
+	    "       DVAs     Physical_B    Allocated_B    Padding_B"
+	    "       Copies_B     Gang\n";
+	static const char *const rule =
+	    "----------------------------------------"
+	    "----------------------------------------"
+	    "------------------\n";
+
+	comphist_out_printf(out, "\nClass    Compression%s", header);
+	comphist_out_puts(out, rule);
+	for (int ac = 0; ac < COMPHIST_AC_COUNT; ac++) {
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+			if (stats->alloc_class[ac][i].dvas == 0)
+				continue;
+			comphist_print_dva_row(out,
+			    comphist_alloc_class_name(ac),
+			    comphist_comp_name(i), &stats->alloc_class[ac][i]);
+		}
+	}
+
+	comphist_out_printf(out, "\nVdev     Class      %s", header);
+	comphist_out_puts(out, rule);
+	for (int v = 0; v < COMPHIST_VDEVS; v++) {
+		char name[16];
+
+		if (stats->vdev[v].dvas == 0)
+			continue;
+		snprintf(name, sizeof(name), "%d%s", v,
+		    v == COMPHIST_VDEVS - 1 ? "+" : "");
+		comphist_print_dva_row(out, name,
+		    comphist_alloc_class_name(stats->vdev_class[v]),
+		    &stats->vdev[v]);
+	}
+
+	for (int ac = 0; ac < COMPHIST_AC_COUNT; ac++) {
+		const uint64_t *hist = stats->alloc_hist[ac];
+		int lo = COMPHIST_HIST_BUCKETS, hi = -1;
+
+		for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++) {
+			if (hist[b] == 0)
+				continue;
+			if (b < lo)
+				lo = b;
+			hi = b;
+		}
+		if (hi < 0)
+			continue;
+
+		comphist_out_printf(out, "\n%s class allocation sizes\n",
+		    comphist_alloc_class_name(ac));
+		comphist_out_puts(out, "  Size              DVAs\n");
+		for (int b = lo; b <= hi; b++) {
+			char label[16];
+
+			comphist_format_bucket(label, sizeof(label), b);
+			comphist_out_printf(out, "  %-8s %14" PRIu64 "\n",
+			    label, hist[b]);
+		}
+	}
+}
+
+static void
+comphist_format_date(char *buf, size_t len, uint64_t when)
+{
+	time_t t = (time_t)when;
+	struct tm tm;
+
+	if (when == 0 || localtime_r(&t, &tm) == NULL ||
+	    strftime(buf, len, "%Y-%m-%d", &tm) == 0)
+		snprintf(buf, len, "-");
+}
+
+void
+comphist_stats_print_eras(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	comphist_out_puts(out, "\nFirst_txg   Last_txg From       To         "
+	    "Compression   Blocks   Logical_B     Physical_B     Allocated_B"
+	    "  Ratio\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------"
+	    "------------------------------------\n");
+
+	for (int e = 0; e < COMPHIST_ERAS; e++) {
+		uint64_t first = (uint64_t)e << stats->era_shift;
+		char from[16], to[16], last[24];
+
+		comphist_format_date(from, sizeof(from), stats->era_time[e]);
+		comphist_format_date(to, sizeof(to), stats->era_time[e + 1]);
+		if (e == COMPHIST_ERAS - 1)
+			snprintf(last, sizeof(last), "-");
+		else
+			snprintf(last, sizeof(last), "%" PRIu64,
+			    (((uint64_t)e + 1) << stats->era_shift) - 1);
+
+		for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+			const struct comphist_cell *cell = &stats->era[e][i];
+
+			if (cell->blocks == 0)
+				continue;
+
+			comphist_out_printf(out, "%9" PRIu64
+			    " %10s %-10s %-10s %-11s %8" PRIu64 " %14"
+			    PRIu64 " %14" PRIu64 " %14" PRIu64
+			    " %7.2f\n", first, last, from, to,
+			    comphist_comp_name(i), cell->blocks, cell->lsize,
+			    cell->psize, cell->asize,
+			    cell->psize == 0 ? 0.0 :
+			    (double)cell->lsize / (double)cell->psize);
+		}
+	}
+}
+
+void
+comphist_stats_print_zstd(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	comphist_out_puts(out, "\nzstd level          Blocks      Logical_B"
+	    "     Physical_B    Allocated_B  Ratio\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------\n");
+
+	for (int l = 0; l < COMPHIST_ZSTD_LEVELS; l++) {
+		const struct comphist_cell *cell = &stats->zstd[l];
+		char name[24];
+
+		if (cell->blocks == 0)
+			continue;
+
+		comphist_zstd_level_name(l, name, sizeof(name));
+		comphist_out_printf(out, "%-14s %11" PRIu64 " %14" PRIu64 " %14"
+		    PRIu64 " %14" PRIu64 " %6.2f\n", name, cell->blocks,
+		    cell->lsize, cell->psize, cell->asize,
+		    cell->psize == 0 ? 0.0 :
+		    (double)cell->lsize / (double)cell->psize);
 	}
+	if (stats->zstd_unread > 0) {
+		comphist_out_printf(out, "unread zstd headers: %" PRIu64 "\n",
+		    stats->zstd_unread);
+	}
+}
+
+void
+comphist_stats_print_entropy(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	comphist_out_printf(out, "\nContent entropy (below %.1f bits/byte"
+	    " counts as compressible)\n", COMPHIST_ENTROPY_THRESHOLD);
+	comphist_out_puts(out, "Name        Compressible      Logical_B  "
+	    "Incompressible      Logical_B    Unread\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------"
+	    "------\n");
+
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const struct comphist_entropy_cell *cell = &stats->entropy[i];
+
+		if (cell->low_blocks + cell->high_blocks +
+		    cell->unread_blocks == 0)
+			continue;
+
+		comphist_out_printf(out, "%-8s %15" PRIu64 " %14" PRIu64 " %15"
+		    PRIu64 " %14" PRIu64 " %9" PRIu64 "\n",
+		    comphist_comp_name(i), cell->low_blocks, cell->low_lsize,
+		    cell->high_blocks, cell->high_lsize, cell->unread_blocks);
+	}
+}
+
+static void
+comphist_print_sample_row(struct comphist_out *out, const char *name,
+    const double *var)
+{
+	comphist_out_printf(out, "%-12s %12.0f %15.0f %15.0f %15.0f\n", name,
+	    1.96 * sqrt(var[COMPHIST_M_BLOCKS]),
+	    1.96 * sqrt(var[COMPHIST_M_LSIZE]),
+	    1.96 * sqrt(var[COMPHIST_M_PSIZE]),
+	    1.96 * sqrt(var[COMPHIST_M_ASIZE]));
+}
+
+void
+comphist_stats_print_sample(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	const struct comphist_sample *sample = &stats->sample;
+
+	comphist_out_printf(out, "\nSampled %" PRIu64 " of %" PRIu64
+	    " objects (%.2f%%); 95%% confidence half-widths\n",
+	    sample->sampled_objects,
+	    sample->objects, sample->rate * 100.0);
+	comphist_out_puts(out, "Compression       +/-Blocks  +/-Logical_B"
+	    "   +/-Physical_B  +/-Allocated_B\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "-------------------------------------\n");
+
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		if (stats->entries[i].blocks == 0)
+			continue;
+		comphist_print_sample_row(out, comphist_comp_name(i),
+		    sample->var[i]);
+	}
+	comphist_print_sample_row(out, "total",
+	    sample->var[ZIO_COMPRESS_FUNCTIONS]);
+}
+
+void
+comphist_stats_print_sim(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	const struct comphist_sim_result *sim = &stats->sim;
+
+	comphist_out_printf(out, "\nRecompression estimate (%" PRIu64 " of %"
+	    PRIu64 " L0 data blocks sampled, 95%% confidence)\n", sim->samples,
+	    sim->population_blocks);
+	comphist_out_puts(out, "Algorithm        Physical_B        +/-"
+	    "     Allocated_B        +/-   Ratio\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "------------------------------------\n");
+	comphist_out_printf(out, "%-12s %14" PRIu64 " %10s %15" PRIu64
+	    " %10s %7.2f\n", "current", sim->population_psize, "-",
+	    sim->population_asize, "-",
+	    sim->population_psize == 0 ? 0.0 :
+	    (double)sim->population_lsize / (double)sim->population_psize);
+
+	for (int c = 0; c < sim->ncandidates; c++) {
+		const struct comphist_sim_entry *entry = &sim->candidates[c];
+
+		comphist_out_printf(out, "%-12s %14" PRIu64 " %10.0f %15" PRIu64
+		    " %10.0f %7.2f\n", entry->name, entry->psize,
+		    entry->psize_ci, entry->asize, entry->asize_ci,
+		    entry->psize == 0 ? 0.0 :
+		    (double)sim->population_lsize / (double)entry->psize);
+	}
+
+	if (sim->sample_errors > 0) {
+		comphist_out_printf(out, "unreadable samples: %" PRIu64 "\n",
+		    sim->sample_errors);
+	}
+}
+
+/*
+ * The closing line counts the DDT entries of blocks stored with another
+ * algorithm than zstd, by the algorithm alone: it is the part of the DDT a
+ * rewrite with zstd would replace, not an estimate of what that would
+ * save.  --simulate estimates the savings.
+ */
+void
+comphist_stats_print_dedup(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	const struct comphist_dedup_result *dd = &stats->dedup;
+	uint64_t entries = 0, legacy = 0;
+
+	comphist_out_puts(out, "\nCompression       Refs    Referenced_B"
+	    "    Entries     Allocated_B       Charged_B  DDT_Entries"
+	    "     DDT_Disk_B\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------"
+	    "-----------------------------\n");
+
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		const struct comphist_dedup_cell *cell = &dd->cells[i];
+
+		entries += cell->ddt_entries;
+		if (i != ZIO_COMPRESS_ZSTD)
+			legacy += cell->ddt_entries;
+		if (cell->refs == 0 && cell->ddt_entries == 0)
+			continue;
+
+		comphist_out_printf(out, "%-11s %10" PRIu64 " %15" PRIu64
+		    " %10" PRIu64 " %15" PRIu64 " %15" PRIu64 " %12" PRIu64
+		    " %14" PRIu64 "\n", comphist_comp_name(i), cell->refs,
+		    cell->ref_asize, cell->blocks, cell->asize,
+		    cell->charged_asize, cell->ddt_entries,
+		    cell->ddt_entries * dd->ddt_entry_dspace);
+	}
+
+	comphist_out_printf(out, "DDT entries stored with other algorithms "
+	    "than zstd: %" PRIu64 " of %" PRIu64 " (%" PRIu64 " bytes on disk, "
+	    "%" PRIu64 " in core)\n", legacy, entries,
+	    legacy * dd->ddt_entry_dspace, legacy * dd->ddt_entry_mspace);
+	if (dd->unresolved > 0) {
+		comphist_out_printf(out, "dedup blocks not in the DDT: %" PRIu64
+		    "\n", dd->unresolved);
+	}
+}
+
+void
+comphist_stats_print_metrics(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	double secs = (double)stats->scan_ns / 1e9;
+	uint64_t lookups = stats->scan_arc_hits + stats->scan_arc_misses;
+	char meta[16];
+
+	comphist_format_size(meta, sizeof(meta), stats->scan_meta_bytes);
+	comphist_out_printf(out, "scan: %.3fs wall, %.3fs traversal CPU, "
+	    "%.0f blocks/s, metadata %" PRIu64 " blocks (%s) with %" PRIu64
+	    " reads issued, ARC hit rate %.1f%% (%" PRIu64 " hits, %" PRIu64
+	    " misses), %" PRIu64 " retries\n",
+	    secs, (double)stats->scan_cpu_ns / 1e9,
+	    secs > 0.0 ? (double)stats->total_blocks / secs : 0.0,
+	    stats->scan_meta_blocks, meta, stats->scan_meta_reads,
+	    lookups == 0 ? 0.0 :
+	    (double)stats->scan_arc_hits * 100.0 / (double)lookups,
+	    stats->scan_arc_hits, stats->scan_arc_misses,
+	    stats->scan_retries);
+}
+
+void
+comphist_stats_print_pipeline(const struct comphist_stats *stats,
+    struct comphist_out *out)
+{
+	double avg_depth = 0.0;
+
+	if (stats->pipeline_batches > 0) {
+		avg_depth = (double)stats->pipeline_depth_sum /
+		    (double)stats->pipeline_batches;
+	}
+
+	comphist_out_printf(out, "pipeline: batches %" PRIu64
+	    ", queue depth avg %.2f max %" PRIu64
+	    ", producer stall %.3fs, aggregator idle %.3fs\n",
+	    stats->pipeline_batches, avg_depth, stats->pipeline_depth_max,
+	    (double)stats->pipeline_stall_ns / 1e9,
+	    (double)stats->pipeline_idle_ns / 1e9);
 }
@@ -2,11 +2,15 @@
 #define COMPHIST_STATS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include <sys/zio_compress.h>
 
+#include "libcomphist.h"
+
+struct comphist_out;
+
 struct comphist_entry {
 	uint64_t blocks;
 	uint64_t lsize;
@@ -16,6 +20,218 @@ struct comphist_entry {
 	uint64_t embedded_lsize;
 };
 
+#define COMPHIST_BLK_HOLE	0x01
+#define COMPHIST_BLK_REDACTED	0x02
+#define COMPHIST_BLK_EMBEDDED	0x04
+
+/* SPA_DVAS_PER_BP */
+#define COMPHIST_DVAS		3
+
+/*
+ * The subset of a block pointer the accounting code needs.  Traversal
+ * callbacks fill one of these per block so accounting can run on another
+ * thread without holding on to the blkptr_t.  The DVA fields are only
+ * filled in for --vdevs; dva_asize is in 512-byte sectors, as in the DVA,
+ * and bit d of dva_gang is set when DVA d is a gang block.
+ */
+struct comphist_block {
+	uint64_t lsize;
+	uint64_t psize;
+	uint64_t asize;
+	uint8_t comp;
+	uint8_t flags;
+	uint8_t type;
+	uint8_t level;
+	uint8_t era;
+	uint8_t ndvas;
+	uint8_t dva_gang;
+	uint8_t dva_class[COMPHIST_DVAS];
+	uint16_t dva_vdev[COMPHIST_DVAS];
+	uint64_t birth;
+	uint32_t dva_asize[COMPHIST_DVAS];
+};
+
+/*
+ * Block size histograms use power-of-two buckets: bucket 0 counts sizes of
+ * zero, such as the allocated size of embedded blocks, and bucket b > 0
+ * counts sizes in [2^(b-1), 2^b).
+ */
+#define COMPHIST_HIST_BUCKETS	32
+
+enum comphist_hist_kind {
+	COMPHIST_HIST_LSIZE,
+	COMPHIST_HIST_PSIZE,
+	COMPHIST_HIST_ASIZE,
+	COMPHIST_HIST_KINDS
+};
+
+/*
+ * Object classes for the type x level breakdown.  Directory-based xattrs are
+ * ordinary files and directories at the block pointer level; SA-based
+ * xattrs are counted under COMPHIST_OC_SA.
+ */
+enum comphist_objclass {
+	COMPHIST_OC_FILE,
+	COMPHIST_OC_DIR,
+	COMPHIST_OC_DNODE,
+	COMPHIST_OC_OBJSET,
+	COMPHIST_OC_SA,
+	COMPHIST_OC_ZAP,
+	COMPHIST_OC_ZVOL,
+	COMPHIST_OC_ZIL,
+	COMPHIST_OC_OTHER,
+	COMPHIST_OC_COUNT
+};
+
+/* Indirection levels L0, L1, L2 and L3+. */
+#define COMPHIST_LEVELS		4
+
+struct comphist_cell {
+	uint64_t blocks;
+	uint64_t lsize;
+	uint64_t psize;
+	uint64_t asize;
+};
+
+/*
+ * Birth txg eras.  Era e covers txgs [e << era_shift, (e + 1) << era_shift);
+ * the last era also collects anything newer.  era_time holds the estimated
+ * wall-clock time (seconds since the epoch) at each era boundary, or 0 when
+ * it cannot be estimated.
+ */
+#define COMPHIST_ERAS		32
+
+/*
+ * --vdevs: allocations by allocation class and top-level vdev, counted per
+ * DVA so copies= and the extra copies of metadata show up where they are
+ * allocated.  "copy" DVAs are the second and third DVAs of a block.  The
+ * padding of a DVA is its allocated size beyond the block's physical size:
+ * sector rounding, RAID-Z parity and skip sectors, and for gang blocks the
+ * gang headers.  Top-level vdevs from COMPHIST_VDEVS - 1 up share the last
+ * row; a row whose DVAs come from more than one class is labeled
+ * COMPHIST_AC_MIXED.
+ */
+enum comphist_alloc_class {
+	COMPHIST_AC_NORMAL,
+	COMPHIST_AC_SPECIAL,
+	COMPHIST_AC_DEDUP,
+	COMPHIST_AC_LOG,
+	COMPHIST_AC_REMOVED,
+	COMPHIST_AC_COUNT
+};
+
+#define COMPHIST_AC_MIXED	COMPHIST_AC_COUNT
+#define COMPHIST_VDEVS		256
+
+struct comphist_dva_cell {
+	uint64_t dvas;
+	uint64_t psize;
+	uint64_t asize;
+	uint64_t copy_dvas;
+	uint64_t copy_asize;
+	uint64_t gang_dvas;
+};
+
+/*
+ * Recompression estimate produced by --simulate.  Projected sizes are ratio
+ * estimates scaled to the population of eligible L0 data blocks; the *_ci
+ * fields are the half-width of a 95% confidence interval.
+ */
+#define COMPHIST_SIM_MAX	8
+
+struct comphist_sim_entry {
+	char name[16];
+	uint64_t psize;
+	uint64_t asize;
+	double psize_ci;
+	double asize_ci;
+};
+
+struct comphist_sim_result {
+	uint64_t population_blocks;
+	uint64_t population_lsize;
+	uint64_t population_psize;
+	uint64_t population_asize;
+	uint64_t samples;
+	uint64_t sample_errors;
+	int ncandidates;
+	struct comphist_sim_entry candidates[COMPHIST_SIM_MAX];
+};
+
+/*
+ * --dedup: blocks written with dedup, resolved against the pool's dedup
+ * table.  The ref_* fields count every reference the walk visited, as the
+ * main table does; blocks, psize and asize count each DDT entry once, and
+ * charged_asize is the walk's share of the allocation, asize times the
+ * references visited over the entry's reference count.  ddt_entries counts
+ * the entries of the whole DDT by algorithm, and ddt_entry_dspace and
+ * ddt_entry_mspace are the average on-disk and in-core size of an entry.
+ * Blocks whose entry was not found (freed since a live walk visited them)
+ * are charged in full and counted in unresolved.
+ */
+struct comphist_dedup_cell {
+	uint64_t refs;
+	uint64_t ref_lsize;
+	uint64_t ref_psize;
+	uint64_t ref_asize;
+	uint64_t blocks;
+	uint64_t psize;
+	uint64_t asize;
+	uint64_t charged_asize;
+	uint64_t ddt_entries;
+};
+
+struct comphist_dedup_result {
+	struct comphist_dedup_cell cells[ZIO_COMPRESS_FUNCTIONS];
+	uint64_t ddt_entry_dspace;
+	uint64_t ddt_entry_mspace;
+	uint64_t unresolved;
+};
+
+/*
+ * --entropy classification of blocks stored without effective compression.
+ * Blocks are read back and split by the order-0 entropy of their contents:
+ * "low" blocks would likely compress if rewritten, "high" blocks would not.
+ * Blocks that could not be read (including encrypted blocks) are unread.
+ */
+struct comphist_entropy_cell {
+	uint64_t low_blocks;
+	uint64_t low_lsize;
+	uint64_t high_blocks;
+	uint64_t high_lsize;
+	uint64_t unread_blocks;
+};
+
+/*
+ * --zstd-levels: zstd blocks by the compression level recorded in their
+ * on-disk header, indexed by the header's level byte (enum zio_zstd_levels:
+ * 1-19, then the negative "fast" levels from 102).  Blocks whose header
+ * could not be read, including encrypted blocks, are counted in
+ * zstd_unread.
+ */
+#define COMPHIST_ZSTD_LEVELS	256
+
+/*
+ * --sample estimates.  var[i] holds the Horvitz-Thompson variance of the
+ * estimated blocks, logical, physical and allocated bytes of algorithm i;
+ * var[ZIO_COMPRESS_FUNCTIONS] is the variance of the total row.  Datasets
+ * are sampled independently, so variances add when stats are merged.
+ */
+enum comphist_metric {
+	COMPHIST_M_BLOCKS,
+	COMPHIST_M_LSIZE,
+	COMPHIST_M_PSIZE,
+	COMPHIST_M_ASIZE,
+	COMPHIST_METRICS
+};
+
+struct comphist_sample {
+	double rate;
+	uint64_t objects;
+	uint64_t sampled_objects;
+	double var[ZIO_COMPRESS_FUNCTIONS + 1][COMPHIST_METRICS];
+};
+
 struct comphist_stats {
 	struct comphist_entry entries[ZIO_COMPRESS_FUNCTIONS];
 	uint64_t total_blocks;
@@ -28,17 +244,101 @@ struct comphist_stats {
 	uint64_t total_redacted;
 	uint64_t total_unknown;
 	uint64_t traversal_errors;
+	uint64_t hist[ZIO_COMPRESS_FUNCTIONS][COMPHIST_HIST_KINDS]
+	    [COMPHIST_HIST_BUCKETS];
+	struct comphist_cell objtype[COMPHIST_OC_COUNT][COMPHIST_LEVELS]
+	    [ZIO_COMPRESS_FUNCTIONS];
+	struct comphist_cell era[COMPHIST_ERAS][ZIO_COMPRESS_FUNCTIONS];
+	uint64_t era_shift;
+	uint64_t era_time[COMPHIST_ERAS + 1];
+	struct comphist_entropy_cell entropy[ZIO_COMPRESS_FUNCTIONS];
+	struct comphist_cell zstd[COMPHIST_ZSTD_LEVELS];
+	uint64_t zstd_unread;
+	struct comphist_dva_cell alloc_class[COMPHIST_AC_COUNT]
+	    [ZIO_COMPRESS_FUNCTIONS];
+	uint64_t alloc_hist[COMPHIST_AC_COUNT][COMPHIST_HIST_BUCKETS];
+	struct comphist_dva_cell vdev[COMPHIST_VDEVS];
+	uint8_t vdev_class[COMPHIST_VDEVS];
+	struct comphist_sample sample;
+	/* Walk-wide; filled in once at the end and not merged. */
+	struct comphist_sim_result sim;
+	struct comphist_dedup_result dedup;
+	uint64_t pipeline_batches;
+	uint64_t pipeline_depth_sum;
+	uint64_t pipeline_depth_max;
+	uint64_t pipeline_stall_ns;
+	uint64_t pipeline_idle_ns;
+	/*
+	 * Scan cost.  scan_ns is wall-clock time: per dataset, its traversal
+	 * including every shard; for an aggregate walk, the whole walk.  ARC
+	 * counters are pool-wide deltas over the same interval, so the records
+	 * of concurrent datasets (-j) see each other's traffic.  scan_cpu_ns
+	 * is the CPU time of the traversal threads, summed over threads.
+	 */
+	uint64_t scan_ns;
+	uint64_t scan_cpu_ns;
+	uint64_t scan_meta_blocks;
+	uint64_t scan_meta_bytes;
+	uint64_t scan_meta_reads;
+	uint64_t scan_arc_hits;
+	uint64_t scan_arc_misses;
+	uint64_t scan_retries;
 };
 
 void comphist_stats_init(struct comphist_stats *stats);
 void comphist_stats_add_block(struct comphist_stats *stats,
     enum zio_compress comp, uint64_t lsize, uint64_t psize, uint64_t asize,
     bool embedded);
+void comphist_stats_account(struct comphist_stats *stats,
+    const struct comphist_block *blk);
+void comphist_stats_merge(struct comphist_stats *dst,
+    const struct comphist_stats *src);
+void comphist_stats_scale(struct comphist_stats *stats, double factor);
 void comphist_stats_note_hole(struct comphist_stats *stats);
 void comphist_stats_note_redacted(struct comphist_stats *stats);
 void comphist_stats_note_traversal_error(struct comphist_stats *stats);
 
+/*
+ * Compact encoding of one stats record, for the cache and checkpoint
+ * files: a few hundred bytes for a typical dataset instead of the whole
+ * struct.
+ */
+#define COMPHIST_STATS_WORDS	\
+	(sizeof(struct comphist_stats) / sizeof(uint64_t))
+#define COMPHIST_STATS_PACKED_MAX	(COMPHIST_STATS_WORDS * 20)
+
+size_t comphist_stats_pack(const struct comphist_stats *stats, uint8_t *buf);
+int comphist_stats_unpack(const uint8_t *buf, size_t len,
+    struct comphist_stats *stats);
+
 const char *comphist_comp_name(enum zio_compress comp);
-void comphist_stats_print(const struct comphist_stats *stats, FILE *out);
+enum comphist_objclass comphist_objclass(uint8_t type);
+const char *comphist_objclass_name(enum comphist_objclass oc);
+const char *comphist_alloc_class_name(enum comphist_alloc_class ac);
+void comphist_zstd_level_name(unsigned level, char *buf, size_t len);
+void comphist_stats_print(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_hist(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_objtypes(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_eras(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_vdevs(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_entropy(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_zstd(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_sample(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_dedup(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_sim(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_metrics(const struct comphist_stats *stats,
+    struct comphist_out *out);
+void comphist_stats_print_pipeline(const struct comphist_stats *stats,
+    struct comphist_out *out);
 
 #endif
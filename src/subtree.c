@@ -0,0 +1,163 @@
+#include "subtree.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/dmu_objset.h>
+#include <sys/zap.h>
+#include <sys/zfs_context.h>
+#include <sys/zfs_znode.h>
+
+struct comphist_objlist {
+	uint64_t *objs;
+	size_t count;
+	size_t cap;
+};
+
+static int
+comphist_objlist_add(struct comphist_objlist *list, uint64_t obj)
+{
+	if (list->count == list->cap) {
+		size_t cap = list->cap == 0 ? 256 : list->cap * 2;
+		uint64_t *objs = realloc(list->objs, cap * sizeof(*objs));
+
+		if (objs == NULL)
+			return (ENOMEM);
+		list->objs = objs;
+		list->cap = cap;
+	}
+
+	list->objs[list->count++] = obj;
+	return (0);
+}
+
+static int
+comphist_obj_compare(const void *a, const void *b)
+{
+	uint64_t oa = *(const uint64_t *)a;
+	uint64_t ob = *(const uint64_t *)b;
+
+	return (oa < ob ? -1 : oa > ob);
+}
+
+/*
+ * Follow the components of path from the root directory.  Lookups are
+ * exact; "." components are skipped and ".." is not supported.
+ */
+static int
+comphist_subtree_lookup(objset_t *os, const char *path, uint64_t *objp,
+    bool *is_dir)
+{
+	char *buf, *tok, *save = NULL;
+	uint64_t obj;
+	int err;
+
+	err = zap_lookup(os, MASTER_NODE_OBJ, ZFS_ROOT_OBJ, 8, 1, &obj);
+	if (err != 0)
+		return (err);
+	*is_dir = true;
+
+	buf = strdup(path);
+	if (buf == NULL)
+		return (ENOMEM);
+
+	for (tok = strtok_r(buf, "/", &save); tok != NULL;
+	    tok = strtok_r(NULL, "/", &save)) {
+		uint64_t ent;
+
+		if (strcmp(tok, ".") == 0)
+			continue;
+		if (strcmp(tok, "..") == 0) {
+			err = EINVAL;
+			break;
+		}
+		if (!*is_dir) {
+			err = ENOTDIR;
+			break;
+		}
+
+		err = zap_lookup(os, obj, tok, 8, 1, &ent);
+		if (err != 0)
+			break;
+		obj = ZFS_DIRENT_OBJ(ent);
+		*is_dir = ZFS_DIRENT_TYPE(ent) == DT_DIR;
+	}
+	free(buf);
+
+	*objp = obj;
+	return (err);
+}
+
+/*
+ * Directories are read depth first from a stack of those found but not yet
+ * expanded.
+ */
+int
+comphist_subtree_collect(objset_t *os, const char *path, uint64_t **objsp,
+    size_t *countp)
+{
+	struct comphist_objlist list = {0};
+	struct comphist_objlist dirs = {0};
+	zap_attribute_t *za;
+	uint64_t top;
+	bool is_dir;
+	size_t n = 0;
+	int err;
+
+	if (dmu_objset_type(os) != DMU_OST_ZFS)
+		return (ENOTSUP);
+
+	err = comphist_subtree_lookup(os, path, &top, &is_dir);
+	if (err != 0)
+		return (err);
+
+	za = zap_attribute_alloc();
+	err = comphist_objlist_add(&list, top);
+	if (err == 0 && is_dir)
+		err = comphist_objlist_add(&dirs, top);
+
+	while (err == 0 && dirs.count > 0) {
+		uint64_t dir = dirs.objs[--dirs.count];
+		zap_cursor_t zc;
+
+		for (zap_cursor_init(&zc, os, dir);
+		    (err = zap_cursor_retrieve(&zc, za)) == 0;
+		    zap_cursor_advance(&zc)) {
+			uint64_t obj = ZFS_DIRENT_OBJ(za->za_first_integer);
+
+			if (za->za_integer_length != 8 ||
+			    za->za_num_integers != 1)
+				continue;
+
+			err = comphist_objlist_add(&list, obj);
+			if (err == 0 &&
+			    ZFS_DIRENT_TYPE(za->za_first_integer) == DT_DIR)
+				err = comphist_objlist_add(&dirs, obj);
+			if (err != 0)
+				break;
+		}
+		zap_cursor_fini(&zc);
+		if (err == ENOENT)
+			err = 0;
+	}
+	zap_attribute_free(za);
+	free(dirs.objs);
+
+	if (err != 0) {
+		free(list.objs);
+		return (err);
+	}
+
+	qsort(list.objs, list.count, sizeof(*list.objs), comphist_obj_compare);
+	for (size_t i = 0; i < list.count; i++) {
+		if (n == 0 || list.objs[i] != list.objs[n - 1])
+			list.objs[n++] = list.objs[i];
+	}
+
+	*objsp = list.objs;
+	*countp = n;
+	return (0);
+}
@@ -0,0 +1,18 @@
+#ifndef COMPHIST_SUBTREE_H
+#define COMPHIST_SUBTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/dmu.h>
+
+/*
+ * --path: the objects of one directory tree of a filesystem, found by
+ * walking the directory ZAPs from the given path down.  The list is
+ * sorted, without duplicates (hard links), and includes the directories
+ * themselves.
+ */
+int comphist_subtree_collect(objset_t *os, const char *path,
+    uint64_t **objsp, size_t *countp);
+
+#endif
@@ -0,0 +1,251 @@
+#include "top.h"
+
+#include "output.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMPHIST_TOP_EMPTY	SIZE_MAX
+
+struct comphist_top *
+comphist_top_create(size_t limit)
+{
+	struct comphist_top *top = malloc(sizeof(*top));
+
+	if (top == NULL)
+		return (NULL);
+
+	top->limit = limit;
+	top->count = 0;
+	top->index_size = 1;
+	while (top->index_size < limit * 2)
+		top->index_size <<= 1;
+	top->heap = calloc(limit, sizeof(*top->heap));
+	top->index = malloc(top->index_size * sizeof(*top->index));
+	if (top->heap == NULL || top->index == NULL) {
+		free(top->heap);
+		free(top->index);
+		free(top);
+		return (NULL);
+	}
+	for (size_t i = 0; i < top->index_size; i++)
+		top->index[i] = COMPHIST_TOP_EMPTY;
+	return (top);
+}
+
+void
+comphist_top_destroy(struct comphist_top *top)
+{
+	if (top == NULL)
+		return;
+
+	for (size_t i = 0; i < top->count; i++) {
+		free(top->heap[i].dataset);
+		free(top->heap[i].path);
+	}
+	free(top->heap);
+	free(top->index);
+	free(top);
+}
+
+static bool
+comphist_top_same(const struct comphist_top_entry *a,
+    const struct comphist_top_entry *b)
+{
+	return (a->dir == b->dir && a->object == b->object);
+}
+
+static size_t
+comphist_top_hash(const struct comphist_top *top,
+    const struct comphist_top_entry *e)
+{
+	uint64_t h = (e->dir * 0x9e3779b97f4a7c15ULL) ^ e->object;
+
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return ((size_t)(h >> 32) & (top->index_size - 1));
+}
+
+/* Index slot holding the key of e, or the empty slot where it would go. */
+static size_t
+comphist_top_slot(const struct comphist_top *top,
+    const struct comphist_top_entry *e)
+{
+	size_t slot = comphist_top_hash(top, e);
+
+	while (top->index[slot] != COMPHIST_TOP_EMPTY &&
+	    !comphist_top_same(&top->heap[top->index[slot]], e))
+		slot = (slot + 1) & (top->index_size - 1);
+	return (slot);
+}
+
+/* Linear probing deletion: shift later entries of the run back. */
+static void
+comphist_top_unindex(struct comphist_top *top, size_t slot)
+{
+	size_t mask = top->index_size - 1;
+	size_t next = slot;
+
+	for (;;) {
+		size_t home;
+
+		top->index[slot] = COMPHIST_TOP_EMPTY;
+		for (;;) {
+			next = (next + 1) & mask;
+			if (top->index[next] == COMPHIST_TOP_EMPTY)
+				return;
+			home = comphist_top_hash(top,
+			    &top->heap[top->index[next]]);
+			/* Move it back unless home lies in (slot, next]. */
+			if (slot <= next ? (home <= slot || home > next) :
+			    (home <= slot && home > next))
+				break;
+		}
+		top->index[slot] = top->index[next];
+		slot = next;
+	}
+}
+
+static void
+comphist_top_swap(struct comphist_top *top, size_t i, size_t j)
+{
+	size_t si = comphist_top_slot(top, &top->heap[i]);
+	size_t sj = comphist_top_slot(top, &top->heap[j]);
+	struct comphist_top_entry tmp = top->heap[i];
+
+	top->heap[i] = top->heap[j];
+	top->heap[j] = tmp;
+	top->index[si] = j;
+	top->index[sj] = i;
+}
+
+/* Ranking: legacy allocated bytes, then legacy logical bytes. */
+static int
+comphist_top_cmp(const struct comphist_top_entry *a,
+    const struct comphist_top_entry *b)
+{
+	if (a->legacy_asize != b->legacy_asize)
+		return (a->legacy_asize < b->legacy_asize ? -1 : 1);
+	if (a->legacy_lsize != b->legacy_lsize)
+		return (a->legacy_lsize < b->legacy_lsize ? -1 : 1);
+	return (0);
+}
+
+static void
+comphist_top_sift_down(struct comphist_top *top, size_t count, size_t i)
+{
+	struct comphist_top_entry *heap = top->heap;
+
+	for (;;) {
+		size_t min = i;
+		size_t l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < count && comphist_top_cmp(&heap[l], &heap[min]) < 0)
+			min = l;
+		if (r < count && comphist_top_cmp(&heap[r], &heap[min]) < 0)
+			min = r;
+		if (min == i)
+			return;
+
+		comphist_top_swap(top, i, min);
+		i = min;
+	}
+}
+
+/*
+ * Objects without legacy blocks are never listed.  Names are not copied;
+ * entries are offered before they are resolved.
+ */
+void
+comphist_top_offer(struct comphist_top *top,
+    const struct comphist_top_entry *entry)
+{
+	struct comphist_top_entry *heap = top->heap;
+	size_t slot;
+
+	if (entry->legacy_blocks == 0)
+		return;
+
+	/* Another copy of the same object only replaces a smaller one. */
+	slot = comphist_top_slot(top, entry);
+	if (top->index[slot] != COMPHIST_TOP_EMPTY) {
+		size_t i = top->index[slot];
+
+		if (comphist_top_cmp(entry, &heap[i]) <= 0)
+			return;
+		heap[i] = *entry;
+		comphist_top_sift_down(top, top->count, i);
+		return;
+	}
+
+	if (top->count < top->limit) {
+		size_t i = top->count++;
+
+		heap[i] = *entry;
+		top->index[slot] = i;
+		while (i > 0 &&
+		    comphist_top_cmp(&heap[i], &heap[(i - 1) / 2]) < 0) {
+			comphist_top_swap(top, i, (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+
+	if (comphist_top_cmp(entry, &heap[0]) <= 0)
+		return;
+	comphist_top_unindex(top, comphist_top_slot(top, &heap[0]));
+	heap[0] = *entry;
+	top->index[comphist_top_slot(top, entry)] = 0;
+	comphist_top_sift_down(top, top->count, 0);
+}
+
+void
+comphist_top_merge(struct comphist_top *dst, const struct comphist_top *src)
+{
+	for (size_t i = 0; i < src->count; i++)
+		comphist_top_offer(dst, &src->heap[i]);
+}
+
+/*
+ * Heapsort in place, leaving the entries largest first.  The heap is no
+ * longer usable for offers afterwards.
+ */
+void
+comphist_top_sort(struct comphist_top *top)
+{
+	for (size_t n = top->count; n > 1; n--) {
+		comphist_top_swap(top, 0, n - 1);
+		comphist_top_sift_down(top, n - 1, 0);
+	}
+}
+
+void
+comphist_top_print(const struct comphist_top *top, struct comphist_out *out)
+{
+	comphist_out_printf(out, "\nTop %zu objects by bytes in uncompressed "
+	    "and lzjb blocks\n", top->count);
+	comphist_out_puts(out, "Rank     Legacy_B  Legacy_%    Allocated_B"
+	    "      Logical_B  Object / Path\n");
+	comphist_out_puts(out, "----------------------------------------"
+	    "----------------------------------------\n");
+
+	for (size_t i = 0; i < top->count; i++) {
+		const struct comphist_top_entry *e = &top->heap[i];
+
+		comphist_out_printf(out, "%-4zu %12" PRIu64 " %9.2f %14" PRIu64
+		    " %14" PRIu64 "  ", i + 1, e->legacy_asize,
+		    e->asize == 0 ? 0.0 :
+		    (double)e->legacy_asize * 100.0 / (double)e->asize,
+		    e->asize, e->lsize);
+		if (e->dataset != NULL && e->path != NULL)
+			comphist_out_printf(out, "%s:%s\n", e->dataset,
+			    e->path);
+		else if (e->dataset != NULL)
+			comphist_out_printf(out, "%s object %" PRIu64 "\n",
+			    e->dataset, e->object);
+		else
+			comphist_out_printf(out, "objset %" PRIu64 " object %"
+			    PRIu64 "\n", e->objset, e->object);
+	}
+}
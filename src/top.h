@@ -0,0 +1,57 @@
+#ifndef COMPHIST_TOP_H
+#define COMPHIST_TOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libcomphist.h"
+
+struct comphist_out;
+
+/*
+ * --top: the objects holding the most bytes in blocks stored without
+ * compression or with legacy lzjb, the ones worth rewriting first.
+ *
+ * Traversal visits each object's blocks in one piece, so a traversal only
+ * totals its current object and offers it to a min-heap of the best
+ * "limit" objects when the next one starts; memory is bounded by the
+ * limit, not by the number of objects.  Dataset names and paths are looked
+ * up for the final entries only.
+ *
+ * Snapshots share their blocks with the filesystem they were taken of, so
+ * entries are keyed by DSL directory and object: a file seen in several
+ * snapshots of one filesystem is listed once, as the copy with the most
+ * legacy bytes.  "index" maps keys to heap positions for that.
+ */
+
+struct comphist_top_entry {
+	uint64_t objset;
+	uint64_t dir;
+	uint64_t object;
+	uint64_t blocks;
+	uint64_t lsize;
+	uint64_t asize;
+	uint64_t legacy_blocks;
+	uint64_t legacy_lsize;
+	uint64_t legacy_asize;
+	char *dataset;
+	char *path;
+};
+
+struct comphist_top {
+	size_t limit;
+	size_t count;
+	struct comphist_top_entry *heap;
+	size_t *index;
+	size_t index_size;
+};
+
+void comphist_top_offer(struct comphist_top *top,
+    const struct comphist_top_entry *entry);
+void comphist_top_merge(struct comphist_top *dst,
+    const struct comphist_top *src);
+void comphist_top_sort(struct comphist_top *top);
+void comphist_top_print(const struct comphist_top *top,
+    struct comphist_out *out);
+
+#endif
@@ -0,0 +1,739 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/spa.h>
+#include <sys/stat.h>
+#include <sys/zfs_context.h>
+
+/*
+ * Block trace file.
+ *
+ *	header:	magic[8] version:u32 target_len:u32 era_shift:u64
+ *		era_time:u64[COMPHIST_ERAS + 1] ndatasets:u64 table_off:u64
+ *		target[target_len]
+ *	chunk:	objset:u64 nblocks:u32 len:u32 records[len]
+ *	table:	ndatasets x (objset:u64 traversal_errors:u64 name_len:u32
+ *		name[name_len], NUL included), in walk order
+ *
+ * Integers are stored in host byte order.  table_off stays 0 until the
+ * trace is complete, so an interrupted recording is never replayed.
+ *
+ * A record is a tag byte followed by varints:
+ *
+ *	tag:	bits 0-2 block flags, bits 3-6 bookmark level + 2,
+ *		bit 7 set when type and comp bytes follow
+ *	object:	zigzag delta from the previous record
+ *	sizes:	lsize, psize, asize in 512-byte units (embedded blocks:
+ *		bytes); absent for holes and redacted blocks
+ *	birth:	zigzag delta from the previous record; absent with sizes
+ *
+ * Delta state starts from zero in every chunk, so chunks decode on their
+ * own.  Typical data blocks take 6-8 bytes.
+ */
+
+#define COMPHIST_TRACE_MAGIC	"ZCHTRACE"
+#define COMPHIST_TRACE_VERSION	1
+
+#define COMPHIST_TRACE_CHUNK	(1 << 20)
+#define COMPHIST_TRACE_MAXREC	64
+
+#define COMPHIST_TRACE_TYPECOMP	0x80
+#define COMPHIST_TRACE_FLAGS	0x07
+#define COMPHIST_TRACE_LEVEL_SHIFT	3
+#define COMPHIST_TRACE_LEVEL_MAX	15
+
+struct comphist_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t target_len;
+	uint64_t era_shift;
+	uint64_t era_time[COMPHIST_ERAS + 1];
+	uint64_t ndatasets;
+	uint64_t table_off;
+};
+
+struct comphist_trace_chunk {
+	uint64_t objset;
+	uint32_t nblocks;
+	uint32_t len;
+};
+
+struct comphist_trace_ds {
+	char *name;
+	uint64_t objset;
+	uint64_t traversal_errors;
+};
+
+struct comphist_trace {
+	char *path;
+	int fd;
+	int err;
+	kmutex_t lock;
+	uint64_t off;
+	struct comphist_trace_header hdr;
+	struct comphist_trace_ds *ds;
+};
+
+/*
+ * Delta state for the chunk being built.  One per traversal thread.
+ */
+struct comphist_trace_buf {
+	struct comphist_trace *trace;
+	uint64_t objset;
+	uint64_t object;
+	uint64_t birth;
+	uint8_t type;
+	uint8_t comp;
+	uint32_t nblocks;
+	size_t len;
+	uint8_t data[COMPHIST_TRACE_CHUNK];
+};
+
+static int
+comphist_trace_write(struct comphist_trace *trace, const void *buf,
+    size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0 && trace->err == 0) {
+		ssize_t n = write(trace->fd, p, len);
+
+		if (n < 0) {
+			if (errno != EINTR)
+				trace->err = errno;
+			continue;
+		}
+		p += n;
+		len -= (size_t)n;
+		trace->off += (uint64_t)n;
+	}
+
+	return (trace->err);
+}
+
+int
+comphist_trace_create(const char *path, const char *target,
+    char *const *names, size_t count, uint64_t era_shift,
+    const uint64_t *era_time, struct comphist_trace **tracep)
+{
+	struct comphist_trace *trace;
+	int err;
+
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL)
+		return (ENOMEM);
+
+	trace->path = strdup(path);
+	trace->ds = calloc(count + 1, sizeof(*trace->ds));
+	if (trace->path == NULL || trace->ds == NULL) {
+		err = ENOMEM;
+		goto fail;
+	}
+	for (size_t i = 0; i < count; i++) {
+		trace->ds[i].name = strdup(names[i]);
+		if (trace->ds[i].name == NULL) {
+			err = ENOMEM;
+			goto fail;
+		}
+	}
+
+	memcpy(trace->hdr.magic, COMPHIST_TRACE_MAGIC,
+	    sizeof(trace->hdr.magic));
+	trace->hdr.version = COMPHIST_TRACE_VERSION;
+	trace->hdr.target_len = (uint32_t)strlen(target);
+	trace->hdr.era_shift = era_shift;
+	memcpy(trace->hdr.era_time, era_time, sizeof(trace->hdr.era_time));
+	trace->hdr.ndatasets = count;
+
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		err = errno;
+		goto fail;
+	}
+	mutex_init(&trace->lock, NULL, MUTEX_DEFAULT, NULL);
+
+	(void)comphist_trace_write(trace, &trace->hdr, sizeof(trace->hdr));
+	(void)comphist_trace_write(trace, target, trace->hdr.target_len);
+	if (trace->err != 0) {
+		err = trace->err;
+		(void)comphist_trace_close(trace, false);
+		return (err);
+	}
+
+	*tracep = trace;
+	return (0);
+
+fail:
+	if (trace->ds != NULL) {
+		for (size_t i = 0; i < count; i++)
+			free(trace->ds[i].name);
+	}
+	free(trace->ds);
+	free(trace->path);
+	free(trace);
+	return (err);
+}
+
+/*
+ * Record which objset the idx'th dataset of the walk turned out to be, and
+ * how many traversal errors --best-effort let through.
+ */
+void
+comphist_trace_dataset(struct comphist_trace *trace, size_t idx,
+    uint64_t objset, uint64_t traversal_errors)
+{
+	mutex_enter(&trace->lock);
+	trace->ds[idx].objset = objset;
+	trace->ds[idx].traversal_errors = traversal_errors;
+	mutex_exit(&trace->lock);
+}
+
+/*
+ * Complete traces get their dataset table and a header pointing at it;
+ * anything else is removed.
+ */
+int
+comphist_trace_close(struct comphist_trace *trace, bool complete)
+{
+	int err;
+
+	mutex_enter(&trace->lock);
+	if (complete && trace->err == 0) {
+		trace->hdr.table_off = trace->off;
+		for (uint64_t i = 0; i < trace->hdr.ndatasets; i++) {
+			const struct comphist_trace_ds *ds = &trace->ds[i];
+			uint32_t name_len = (uint32_t)strlen(ds->name) + 1;
+
+			(void)comphist_trace_write(trace, &ds->objset,
+			    sizeof(ds->objset));
+			(void)comphist_trace_write(trace,
+			    &ds->traversal_errors,
+			    sizeof(ds->traversal_errors));
+			(void)comphist_trace_write(trace, &name_len,
+			    sizeof(name_len));
+			(void)comphist_trace_write(trace, ds->name, name_len);
+		}
+		if (trace->err == 0 && pwrite(trace->fd, &trace->hdr,
+		    sizeof(trace->hdr), 0) != (ssize_t)sizeof(trace->hdr))
+			trace->err = errno != 0 ? errno : EIO;
+	}
+	mutex_exit(&trace->lock);
+
+	if (close(trace->fd) != 0 && trace->err == 0)
+		trace->err = errno;
+	err = complete ? trace->err : 0;
+	if (!complete || trace->err != 0)
+		(void)unlink(trace->path);
+
+	for (uint64_t i = 0; i < trace->hdr.ndatasets; i++)
+		free(trace->ds[i].name);
+	free(trace->ds);
+	free(trace->path);
+	mutex_destroy(&trace->lock);
+	free(trace);
+
+	return (err);
+}
+
+static void
+comphist_trace_buf_reset(struct comphist_trace_buf *buf)
+{
+	buf->object = 0;
+	buf->birth = 0;
+	buf->type = 0;
+	buf->comp = 0;
+	buf->nblocks = 0;
+	buf->len = 0;
+}
+
+static void
+comphist_trace_flush(struct comphist_trace_buf *buf)
+{
+	struct comphist_trace *trace = buf->trace;
+	struct comphist_trace_chunk chunk = {
+		.objset = buf->objset,
+		.nblocks = buf->nblocks,
+		.len = (uint32_t)buf->len,
+	};
+
+	if (buf->nblocks == 0)
+		return;
+
+	mutex_enter(&trace->lock);
+	(void)comphist_trace_write(trace, &chunk, sizeof(chunk));
+	(void)comphist_trace_write(trace, buf->data, buf->len);
+	mutex_exit(&trace->lock);
+
+	comphist_trace_buf_reset(buf);
+}
+
+struct comphist_trace_buf *
+comphist_trace_buf_create(struct comphist_trace *trace, uint64_t objset)
+{
+	struct comphist_trace_buf *buf = malloc(sizeof(*buf));
+
+	if (buf == NULL)
+		return (NULL);
+
+	buf->trace = trace;
+	buf->objset = objset;
+	comphist_trace_buf_reset(buf);
+	return (buf);
+}
+
+void
+comphist_trace_buf_destroy(struct comphist_trace_buf *buf)
+{
+	comphist_trace_flush(buf);
+	free(buf);
+}
+
+static uint8_t *
+comphist_trace_put(uint8_t *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (uint8_t)val;
+	return (p);
+}
+
+static uint64_t
+comphist_trace_zigzag(uint64_t cur, uint64_t prev)
+{
+	int64_t delta = (int64_t)(cur - prev);
+
+	return (((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+/*
+ * Append one block.  level is the bookmark level, so the objset root
+ * (ZB_ROOT_LEVEL) and ZIL blocks (ZB_ZIL_LEVEL) stay distinguishable.
+ */
+void
+comphist_trace_add(struct comphist_trace_buf *buf, uint64_t object,
+    int64_t level, const struct comphist_block *blk)
+{
+	uint8_t *start, *p;
+	uint8_t tag;
+
+	if (buf->len + COMPHIST_TRACE_MAXREC > sizeof(buf->data))
+		comphist_trace_flush(buf);
+
+	start = p = buf->data + buf->len;
+	tag = (blk->flags & COMPHIST_TRACE_FLAGS) |
+	    (uint8_t)(MIN(MAX(level + 2, 0), COMPHIST_TRACE_LEVEL_MAX) <<
+	    COMPHIST_TRACE_LEVEL_SHIFT);
+	p++;
+
+	if (!(blk->flags & (COMPHIST_BLK_HOLE | COMPHIST_BLK_REDACTED)) &&
+	    (blk->type != buf->type || blk->comp != buf->comp)) {
+		tag |= COMPHIST_TRACE_TYPECOMP;
+		*p++ = blk->type;
+		*p++ = blk->comp;
+		buf->type = blk->type;
+		buf->comp = blk->comp;
+	}
+	*start = tag;
+
+	p = comphist_trace_put(p, comphist_trace_zigzag(object, buf->object));
+	buf->object = object;
+
+	if (!(blk->flags & (COMPHIST_BLK_HOLE | COMPHIST_BLK_REDACTED))) {
+		int shift = (blk->flags & COMPHIST_BLK_EMBEDDED) ? 0 :
+		    SPA_MINBLOCKSHIFT;
+
+		p = comphist_trace_put(p, blk->lsize >> shift);
+		p = comphist_trace_put(p, blk->psize >> shift);
+		p = comphist_trace_put(p, blk->asize >> shift);
+		p = comphist_trace_put(p,
+		    comphist_trace_zigzag(blk->birth, buf->birth));
+		buf->birth = blk->birth;
+	}
+
+	buf->len = (size_t)(p - buf->data);
+	buf->nblocks++;
+}
+
+/*
+ * Replay.
+ */
+
+struct comphist_trace_map {
+	const uint8_t *base;
+	size_t size;
+	struct comphist_trace_header hdr;
+	size_t data_off;
+};
+
+static int
+comphist_trace_map(const char *path, struct comphist_trace_map *map)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (errno);
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+
+		(void)close(fd);
+		return (err);
+	}
+	if ((size_t)st.st_size < sizeof(map->hdr)) {
+		(void)close(fd);
+		return (EINVAL);
+	}
+
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (base == MAP_FAILED)
+		return (errno);
+	(void)madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	map->base = base;
+	map->size = (size_t)st.st_size;
+	memcpy(&map->hdr, base, sizeof(map->hdr));
+	map->data_off = sizeof(map->hdr) + map->hdr.target_len;
+
+	if (memcmp(map->hdr.magic, COMPHIST_TRACE_MAGIC,
+	    sizeof(map->hdr.magic)) != 0 ||
+	    map->hdr.version != COMPHIST_TRACE_VERSION ||
+	    map->hdr.era_shift >= 64 || map->hdr.table_off == 0 ||
+	    map->hdr.table_off < map->data_off ||
+	    map->hdr.table_off > map->size) {
+		(void)munmap(base, map->size);
+		return (EINVAL);
+	}
+
+	return (0);
+}
+
+static void
+comphist_trace_unmap(struct comphist_trace_map *map)
+{
+	(void)munmap((void *)map->base, map->size);
+}
+
+int
+comphist_trace_target(const char *path, char *target, size_t len)
+{
+	struct comphist_trace_map map;
+	int err;
+
+	err = comphist_trace_map(path, &map);
+	if (err != 0)
+		return (err);
+
+	if (map.hdr.target_len >= len) {
+		comphist_trace_unmap(&map);
+		return (ENAMETOOLONG);
+	}
+	memcpy(target, map.base + sizeof(map.hdr), map.hdr.target_len);
+	target[map.hdr.target_len] = '\0';
+
+	comphist_trace_unmap(&map);
+	return (0);
+}
+
+static const uint8_t *
+comphist_trace_get(const uint8_t *p, const uint8_t *end, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*val = v;
+			return (p);
+		}
+	}
+
+	return (NULL);
+}
+
+static uint64_t
+comphist_trace_unzigzag(uint64_t zz, uint64_t prev)
+{
+	return (prev + ((zz >> 1) ^ (0 - (zz & 1))));
+}
+
+/*
+ * Account every block of the chunk at off.  Eras are recomputed from the
+ * birth txg with the recording's era shift.
+ */
+static int
+comphist_trace_replay_chunk(const struct comphist_trace_map *map, size_t off,
+    struct comphist_stats *stats)
+{
+	struct comphist_trace_chunk chunk;
+	const uint8_t *p, *end;
+	uint64_t object = 0, birth = 0;
+	uint8_t type = 0, comp = 0;
+
+	memcpy(&chunk, map->base + off, sizeof(chunk));
+	p = map->base + off + sizeof(chunk);
+	end = p + chunk.len;
+
+	for (uint32_t i = 0; i < chunk.nblocks; i++) {
+		struct comphist_block blk = {0};
+		uint64_t zz, level;
+		uint8_t tag;
+		int shift;
+
+		if (p >= end)
+			return (EINVAL);
+		tag = *p++;
+		blk.flags = tag & COMPHIST_TRACE_FLAGS;
+		level = (tag & 0x7f) >> COMPHIST_TRACE_LEVEL_SHIFT;
+
+		if (tag & COMPHIST_TRACE_TYPECOMP) {
+			if (end - p < 2)
+				return (EINVAL);
+			type = *p++;
+			comp = *p++;
+		}
+
+		if ((p = comphist_trace_get(p, end, &zz)) == NULL)
+			return (EINVAL);
+		object = comphist_trace_unzigzag(zz, object);
+
+		if (blk.flags & (COMPHIST_BLK_HOLE | COMPHIST_BLK_REDACTED)) {
+			comphist_stats_account(stats, &blk);
+			continue;
+		}
+
+		shift = (blk.flags & COMPHIST_BLK_EMBEDDED) ? 0 :
+		    SPA_MINBLOCKSHIFT;
+		if ((p = comphist_trace_get(p, end, &blk.lsize)) == NULL ||
+		    (p = comphist_trace_get(p, end, &blk.psize)) == NULL ||
+		    (p = comphist_trace_get(p, end, &blk.asize)) == NULL ||
+		    (p = comphist_trace_get(p, end, &zz)) == NULL ||
+		    comp >= ZIO_COMPRESS_FUNCTIONS)
+			return (EINVAL);
+		blk.lsize <<= shift;
+		blk.psize <<= shift;
+		blk.asize <<= shift;
+		birth = comphist_trace_unzigzag(zz, birth);
+
+		/* The objset root and ZIL blocks are level 0 block pointers. */
+		blk.comp = comp;
+		blk.type = type;
+		blk.level = level < 2 ? 0 : (uint8_t)(level - 2);
+		blk.birth = birth;
+		blk.era = MIN(birth >> map->hdr.era_shift, COMPHIST_ERAS - 1);
+		comphist_stats_account(stats, &blk);
+	}
+
+	return (p == end ? 0 : EINVAL);
+}
+
+struct comphist_trace_key {
+	uint64_t objset;
+	size_t idx;
+};
+
+/*
+ * Walk the chunk headers, calling fn for each chunk with its dataset's
+ * position in the table.
+ */
+static int
+comphist_trace_chunks(const struct comphist_trace_map *map,
+    const struct comphist_trace_key *keys,
+    void (*fn)(size_t ds, size_t off, void *), void *arg)
+{
+	size_t off = map->data_off;
+
+	while (off < map->hdr.table_off) {
+		struct comphist_trace_chunk chunk;
+		size_t lo = 0, hi = map->hdr.ndatasets;
+
+		if (map->hdr.table_off - off < sizeof(chunk))
+			return (EINVAL);
+		memcpy(&chunk, map->base + off, sizeof(chunk));
+		if (map->hdr.table_off - off - sizeof(chunk) < chunk.len)
+			return (EINVAL);
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (keys[mid].objset < chunk.objset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == map->hdr.ndatasets || keys[lo].objset != chunk.objset)
+			return (EINVAL);
+
+		fn(keys[lo].idx, off, arg);
+		off += sizeof(chunk) + chunk.len;
+	}
+
+	return (0);
+}
+
+static int
+comphist_trace_key_compare(const void *a, const void *b)
+{
+	const struct comphist_trace_key *ka = a;
+	const struct comphist_trace_key *kb = b;
+
+	return (ka->objset < kb->objset ? -1 : ka->objset > kb->objset);
+}
+
+struct comphist_trace_index {
+	size_t *first;
+	size_t *offs;
+};
+
+static void
+comphist_trace_count_cb(size_t ds, size_t off, void *arg)
+{
+	struct comphist_trace_index *index = arg;
+
+	(void)off;
+	index->first[ds + 1]++;
+}
+
+static void
+comphist_trace_fill_cb(size_t ds, size_t off, void *arg)
+{
+	struct comphist_trace_index *index = arg;
+
+	index->offs[index->first[ds]++] = off;
+}
+
+/*
+ * Produce the stats a walk would have produced from a complete trace,
+ * without importing the pool.  Aggregate replays decode the file in one
+ * sequential pass; per-dataset replays group the chunks of each dataset
+ * first so results come out in walk order.
+ */
+int
+comphist_trace_replay(const char *path, struct comphist_stats *total,
+    int (*cb)(const char *, const struct comphist_stats *, void *),
+    void *arg)
+{
+	struct comphist_trace_map map;
+	struct comphist_trace_index index = {0};
+	struct comphist_stats *stats = NULL;
+	struct comphist_trace_key *keys = NULL;
+	const char **names = NULL;
+	uint64_t *errors = NULL;
+	size_t n, off;
+	int err;
+
+	err = comphist_trace_map(path, &map);
+	if (err != 0)
+		return (err);
+	n = map.hdr.ndatasets;
+
+	names = calloc(n + 1, sizeof(*names));
+	errors = calloc(n + 1, sizeof(*errors));
+	keys = calloc(n + 1, sizeof(*keys));
+	if (names == NULL || errors == NULL || keys == NULL) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	off = map.hdr.table_off;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t name_len;
+
+		if (map.size - off < 2 * sizeof(uint64_t) + sizeof(name_len)) {
+			err = EINVAL;
+			goto out;
+		}
+		memcpy(&keys[i].objset, map.base + off, sizeof(uint64_t));
+		memcpy(&errors[i], map.base + off + 8, sizeof(uint64_t));
+		memcpy(&name_len, map.base + off + 16, sizeof(name_len));
+		off += 2 * sizeof(uint64_t) + sizeof(name_len);
+		if (name_len == 0 || map.size - off < name_len ||
+		    map.base[off + name_len - 1] != '\0') {
+			err = EINVAL;
+			goto out;
+		}
+		names[i] = (const char *)map.base + off;
+		off += name_len;
+		keys[i].idx = i;
+	}
+	qsort(keys, n, sizeof(*keys), comphist_trace_key_compare);
+
+	stats = malloc(sizeof(*stats));
+	index.first = calloc(n + 1, sizeof(*index.first));
+	if (stats == NULL || index.first == NULL) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* Chunk offsets grouped by dataset: count, prefix sum, fill. */
+	err = comphist_trace_chunks(&map, keys,
+	    comphist_trace_count_cb, &index);
+	if (err != 0)
+		goto out;
+	for (size_t i = 0; i < n; i++)
+		index.first[i + 1] += index.first[i];
+	index.offs = malloc((index.first[n] + 1) * sizeof(*index.offs));
+	if (index.offs == NULL) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (cb == NULL) {
+		off = map.data_off;
+		for (size_t c = 0; c < index.first[n] && err == 0; c++) {
+			struct comphist_trace_chunk chunk;
+
+			memcpy(&chunk, map.base + off, sizeof(chunk));
+			err = comphist_trace_replay_chunk(&map, off, total);
+			off += sizeof(chunk) + chunk.len;
+		}
+		for (size_t i = 0; i < n; i++)
+			total->traversal_errors += errors[i];
+		total->era_shift = map.hdr.era_shift;
+		memcpy(total->era_time, map.hdr.era_time,
+		    sizeof(total->era_time));
+		goto out;
+	}
+
+	(void)comphist_trace_chunks(&map, keys,
+	    comphist_trace_fill_cb, &index);
+	/* fill advanced each first[i] to the start of dataset i + 1. */
+	for (size_t i = 0; i < n && err == 0; i++) {
+		size_t c = i == 0 ? 0 : index.first[i - 1];
+
+		comphist_stats_init(stats);
+		for (; c < index.first[i] && err == 0; c++)
+			err = comphist_trace_replay_chunk(&map, index.offs[c],
+			    stats);
+		if (err != 0)
+			break;
+		stats->traversal_errors = errors[i];
+		stats->era_shift = map.hdr.era_shift;
+		memcpy(stats->era_time, map.hdr.era_time,
+		    sizeof(stats->era_time));
+		err = cb(names[i], stats, arg);
+	}
+
+out:
+	free(index.offs);
+	free(index.first);
+	free(stats);
+	free(keys);
+	free(errors);
+	free(names);
+	comphist_trace_unmap(&map);
+	return (err);
+}
@@ -0,0 +1,41 @@
+#ifndef COMPHIST_TRACE_H
+#define COMPHIST_TRACE_H
+
+#include "libcomphist.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block traces for --record and --replay.
+ *
+ * A trace holds what comphist_blkptr_cb() accounts for every block of every
+ * dataset walked, so any report can be produced again from the file without
+ * the pool.  Traversal threads encode blocks into private buffers and append
+ * them to the file as chunks tagged with their objset; the dataset table
+ * that maps objsets back to names in walk order is written when the trace
+ * is closed.
+ */
+struct comphist_trace;
+struct comphist_trace_buf;
+
+int comphist_trace_create(const char *path, const char *target,
+    char *const *names, size_t count, uint64_t era_shift,
+    const uint64_t *era_time, struct comphist_trace **tracep);
+void comphist_trace_dataset(struct comphist_trace *trace, size_t idx,
+    uint64_t objset, uint64_t traversal_errors);
+int comphist_trace_close(struct comphist_trace *trace, bool complete);
+
+struct comphist_trace_buf *comphist_trace_buf_create(
+    struct comphist_trace *trace, uint64_t objset);
+void comphist_trace_buf_destroy(struct comphist_trace_buf *buf);
+void comphist_trace_add(struct comphist_trace_buf *buf, uint64_t object,
+    int64_t level, const struct comphist_block *blk);
+
+int comphist_trace_replay(const char *path, struct comphist_stats *total,
+    int (*cb)(const char *, const struct comphist_stats *, void *),
+    void *arg);
+
+#endif
@@ -1,247 +1,2556 @@
 #include "walker.h"
 
+#include "cache.h"
+#include "checkpoint.h"
+#include "dedup.h"
+#include "dvaset.h"
+#include "entropy.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "reader.h"
+#include "simulate.h"
+#include "subtree.h"
+#include "top.h"
+#include "trace.h"
+
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/arc_impl.h>
+#include <sys/dmu.h>
+#include <sys/dmu_objset.h>
+#include <sys/dmu_traverse.h>
+#include <sys/dnode.h>
+#include <sys/dsl_dataset.h>
+#include <sys/dsl_dir.h>
+#include <sys/dsl_pool.h>
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/vdev_impl.h>
+#include <sys/zfs_context.h>
+#include <sys/zfs_znode.h>
+#include <sys/zio.h>
+
+static const char *const comphist_tag = "zfs-comphist";
+
+#define COMPHIST_UNIQUE_MAX_PASSES	4096
+#define COMPHIST_UNIQUE_DEFAULT_MEM	(1ULL << 30)
+
+#define COMPHIST_SIM_DEFAULT_SAMPLES	4096
+
+/* Reads kept in flight per dataset by --entropy and --zstd-levels. */
+#define COMPHIST_ENTROPY_DEPTH		64
+#define COMPHIST_ZSTD_DEPTH		256
+
+/*
+ * Low byte of the cache feature word holds the era shift; the --entropy
+ * algorithm mask starts at bit 16.
+ */
+#define COMPHIST_CACHE_F_ERAS		(1ULL << 8)
+#define COMPHIST_CACHE_F_VDEVS		(1ULL << 9)
+#define COMPHIST_CACHE_F_ZSTD		(1ULL << 10)
+#define COMPHIST_CACHE_ENTROPY_SHIFT	16
+
+struct comphist_dslist {
+	char **names;
+	size_t count;
+	size_t cap;
+};
+
+struct comphist_slot {
+	struct comphist_stats *stats;
+	int error;
+	bool done;
+};
+
+/*
+ * --unique state for one pass.  Each pass owns the DVAs whose hash falls in
+ * its partition, so a set too small for the whole pool can still produce
+ * exact results over several passes.
+ */
+struct comphist_unique {
+	struct comphist_dvaset *set;
+	uint64_t pass;
+	uint64_t npasses;
+};
+
+struct comphist_walk_ctx {
+	const struct comphist_options *opts;
+	struct comphist_unique unique;
+	struct comphist_dslist list;
+	struct comphist_stats *total;
+	comphist_dataset_cb_t cb;
+	void *arg;
+	struct comphist_slot *slots;
+	struct comphist_cache *cache;
+	struct comphist_sim *sim;
+	struct comphist_ckpt *ckpt;
+	bool ckpt_objects;
+	struct comphist_trace *trace;
+	struct comphist_top *top;
+	struct comphist_dedup_set *dedup;
+	uint8_t *vdev_class;
+	uint64_t nvdevs;
+	bool progress;
+	uint64_t sample_seed;
+	uint64_t era_shift;
+	uint64_t era_time[COMPHIST_ERAS + 1];
+	kmutex_t lock;
+	kcondvar_t cv;
+	size_t next;
+	int error;
+};
+
+struct comphist_worker {
+	struct comphist_walk_ctx *ctx;
+	struct comphist_stats stats;
+};
+
+/*
+ * Read-back state for one dataset, shared by all of its shards.  --entropy
+ * reads blocks back decompressed through "reader"; --zstd-levels reads the
+ * first sector of zstd blocks through "hdr_reader" to find the level in
+ * their header.  Results are written from the readers' threads and folded
+ * into the dataset's stats once every read has completed.
+ */
+struct comphist_read_scan {
+	struct comphist_reader *reader;
+	struct comphist_reader *hdr_reader;
+	uint32_t mask;
+	kmutex_t lock;
+	struct comphist_entropy_cell cells[ZIO_COMPRESS_FUNCTIONS];
+	struct comphist_cell zstd[COMPHIST_ZSTD_LEVELS];
+	uint64_t zstd_unread;
+};
+
+/*
+ * Per-object totals for the --sample variance estimate.  Traversal visits
+ * each object's block tree in one piece, so only the current object needs
+ * to be held.
+ */
+struct comphist_sample_obj {
+	uint64_t object;
+	bool active;
+	uint64_t y[ZIO_COMPRESS_FUNCTIONS + 1][COMPHIST_METRICS];
+};
+
+/*
+ * State for one traverse_dataset_resume() pass.  Unsharded walks cover the
+ * whole object space; shards only account for blocks owned by objects in
+ * [obj_lo, obj_hi).  With --sample, blocks of sampled objects go to
+ * "sampled" and are scaled up once the pass is complete.  With --top, the
+ * pass ranks its own objects in "top" and merges them into the walk's list
+ * at the end; --dedup blocks are collected in "dedup" and --simulate
+ * samples in "sim" the same way.
+ * --path passes set objects_only and account nothing but the block trees
+ * of the objects in their range.
+ */
+struct comphist_trav {
+	struct comphist_walk_ctx *ctx;
+	struct comphist_stats *stats;
+	struct comphist_stats *sampled;
+	struct comphist_sample_obj obj;
+	struct comphist_pipeline *pipe;
+	struct comphist_read_scan *scan;
+	struct comphist_trace_buf *trace;
+	struct comphist_top *top;
+	struct comphist_top_entry top_obj;
+	struct comphist_dedup_set *dedup;
+	struct comphist_sim_local *sim;
+	uint64_t obj_lo;
+	uint64_t obj_hi;
+	uint64_t prog_blocks;
+	uint64_t prog_bytes;
+	struct comphist_ckpt *ckpt;
+	uint64_t ckpt_guid;
+	uint64_t ckpt_align;
+	uint64_t last_object;
+	bool skip_zil;
+	bool objects_only;
+};
+
+struct comphist_shard {
+	dsl_dataset_t *ds;
+	struct comphist_trav trav;
+	struct comphist_stats stats;
+	int error;
+};
+
+/*
+ * Return the object number a block is attributed to for sharding.  Blocks of
+ * the meta-dnode are attributed to the first dnode they cover, so every
+ * meta-dnode block has exactly one owning shard; the objset root and ZIL
+ * headers belong to object 0.
+ */
+static uint64_t
+comphist_block_owner(const zbookmark_phys_t *zb, const dnode_phys_t *dnp)
+{
+	uint64_t per_block;
+	int shift;
+
+	if (zb->zb_object != DMU_META_DNODE_OBJECT || zb->zb_level < 0 ||
+	    dnp == NULL)
+		return (zb->zb_object);
+
+	per_block = ((uint64_t)dnp->dn_datablkszsec << SPA_MINBLOCKSHIFT) >>
+	    DNODE_SHIFT;
+	shift = (dnp->dn_indblkshift - SPA_BLKPTRSHIFT) * zb->zb_level;
+
+	return ((zb->zb_blkid * per_block) << shift);
+}
+
+/*
+ * Decide whether the current --unique pass accounts this block.  Blocks
+ * without an address (holes, embedded and redacted blocks) are accounted in
+ * the first pass only; addressed blocks in the pass owning their DVA, and
+ * only the first time the DVA is seen.
+ */
+static int
+comphist_unique_filter(const struct comphist_unique *unique,
+    const blkptr_t *bp, bool *account)
+{
+	uint64_t hash;
+	int ret;
+
+	*account = false;
+
+	if (BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp) || BP_IS_REDACTED(bp)) {
+		*account = unique->pass == 0;
+		return (0);
+	}
+
+	hash = comphist_dvaset_hash(&bp->blk_dva[0]);
+	if ((hash >> 40) % unique->npasses != unique->pass)
+		return (0);
+
+	ret = comphist_dvaset_insert(unique->set, hash, &bp->blk_dva[0]);
+	if (ret < 0)
+		return (-ret);
+
+	*account = ret == 1;
+	return (0);
+}
+
+static uint64_t
+comphist_splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+/*
+ * Classify a block for --sample.  Returns 1 if it belongs to a sampled
+ * object, 0 if it is outside any object's block tree (objset root,
+ * meta-dnode, special objects and the ZIL) and always accounted in full,
+ * and -1 if its object is not in the sample.  The choice is a hash of the
+ * object, so every block of an object gets the same answer and pruning at
+ * the top-level block pointers skips the whole tree.
+ */
+static int
+comphist_sample_pick(struct comphist_trav *trav, const zbookmark_phys_t *zb,
+    const dnode_phys_t *dnp)
+{
+	struct comphist_walk_ctx *ctx = trav->ctx;
+	uint64_t h;
+	bool in;
+
+	if (zb->zb_level < 0 || DMU_OBJECT_IS_SPECIAL(zb->zb_object))
+		return (0);
+
+	h = comphist_splitmix64(ctx->sample_seed ^ comphist_splitmix64(
+	    zb->zb_objset ^ comphist_splitmix64(zb->zb_object)));
+	in = (double)h < ctx->opts->sample * 18446744073709551616.0;
+
+	/* Count each object once, at its first top-level block pointer. */
+	if (dnp != NULL && zb->zb_blkid == 0 &&
+	    zb->zb_level == dnp->dn_nlevels - 1) {
+		trav->stats->sample.objects++;
+		if (in)
+			trav->stats->sample.sampled_objects++;
+	}
+
+	return (in ? 1 : -1);
+}
+
+/*
+ * Fold the finished object's totals into the Horvitz-Thompson variance:
+ * with inclusion probability p, each sampled object contributes
+ * (1 - p) / p^2 * y^2.
+ */
+static void
+comphist_sample_flush(struct comphist_trav *trav)
+{
+	struct comphist_sample_obj *obj = &trav->obj;
+	double p = trav->ctx->opts->sample;
+	double w = (1.0 - p) / (p * p);
+
+	if (!obj->active)
+		return;
+
+	for (int i = 0; i <= ZIO_COMPRESS_FUNCTIONS; i++) {
+		for (int m = 0; m < COMPHIST_METRICS; m++) {
+			double y = (double)obj->y[i][m];
+
+			trav->stats->sample.var[i][m] += w * y * y;
+		}
+	}
+	memset(obj, 0, sizeof(*obj));
+}
+
+static inline void
+comphist_sample_add_row(uint64_t *y, const struct comphist_block *blk)
+{
+	y[COMPHIST_M_BLOCKS]++;
+	y[COMPHIST_M_LSIZE] += blk->lsize;
+	y[COMPHIST_M_PSIZE] += blk->psize;
+	y[COMPHIST_M_ASIZE] += blk->asize;
+}
+
+static void
+comphist_sample_add(struct comphist_trav *trav, const zbookmark_phys_t *zb,
+    const struct comphist_block *blk)
+{
+	struct comphist_sample_obj *obj = &trav->obj;
+	int idx = blk->comp < ZIO_COMPRESS_FUNCTIONS ? blk->comp :
+	    ZIO_COMPRESS_INHERIT;
+
+	if (obj->active && obj->object != zb->zb_object)
+		comphist_sample_flush(trav);
+	obj->active = true;
+	obj->object = zb->zb_object;
+
+	if (blk->flags & (COMPHIST_BLK_HOLE | COMPHIST_BLK_REDACTED))
+		return;
+
+	comphist_sample_add_row(obj->y[idx], blk);
+	comphist_sample_add_row(obj->y[ZIO_COMPRESS_FUNCTIONS], blk);
+}
+
+static void
+comphist_top_flush(struct comphist_trav *trav)
+{
+	struct comphist_top_entry *obj = &trav->top_obj;
+
+	comphist_top_offer(trav->top, obj);
+	obj->object = 0;
+	obj->blocks = obj->lsize = obj->asize = 0;
+	obj->legacy_blocks = obj->legacy_lsize = obj->legacy_asize = 0;
+}
+
+/*
+ * Total the blocks of the current object for --top.  Object 0 is the
+ * meta-dnode, whose blocks are visited between the objects they describe.
+ */
+static void
+comphist_top_add(struct comphist_trav *trav, const zbookmark_phys_t *zb,
+    const struct comphist_block *blk)
+{
+	struct comphist_top_entry *obj = &trav->top_obj;
+
+	if (zb->zb_level < 0 || zb->zb_object == DMU_META_DNODE_OBJECT ||
+	    DMU_OBJECT_IS_SPECIAL(zb->zb_object) ||
+	    (blk->flags & (COMPHIST_BLK_HOLE | COMPHIST_BLK_REDACTED)))
+		return;
+
+	if (obj->object != zb->zb_object) {
+		if (obj->object != 0)
+			comphist_top_flush(trav);
+		obj->object = zb->zb_object;
+	}
+
+	obj->blocks++;
+	obj->lsize += blk->lsize;
+	obj->asize += blk->asize;
+	if (!(blk->flags & COMPHIST_BLK_EMBEDDED) &&
+	    (blk->comp == ZIO_COMPRESS_OFF || blk->comp == ZIO_COMPRESS_LZJB)) {
+		obj->legacy_blocks++;
+		obj->legacy_lsize += blk->lsize;
+		obj->legacy_asize += blk->asize;
+	}
+}
+
+static void
+comphist_entropy_done(void *arg, const blkptr_t *bp, const void *buf,
+    uint64_t size, int err)
+{
+	struct comphist_read_scan *scan = arg;
+	struct comphist_entropy_cell *cell = &scan->cells[BP_GET_COMPRESS(bp)];
+	double bits = 0.0;
+
+	if (err == 0)
+		bits = comphist_entropy(buf, size);
+
+	mutex_enter(&scan->lock);
+	if (err != 0) {
+		cell->unread_blocks++;
+	} else if (bits < COMPHIST_ENTROPY_THRESHOLD) {
+		cell->low_blocks++;
+		cell->low_lsize += size;
+	} else {
+		cell->high_blocks++;
+		cell->high_lsize += size;
+	}
+	mutex_exit(&scan->lock);
+}
+
+/*
+ * Queue an L0 block for --entropy if its compression algorithm was asked
+ * for.  Encrypted blocks cannot be read without the key and are counted as
+ * unread.
+ */
+static void
+comphist_entropy_offer(struct comphist_read_scan *scan,
+    const blkptr_t *bp, const zbookmark_phys_t *zb)
+{
+	enum zio_compress comp;
+
+	if (zb->zb_level != 0 || BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp) ||
+	    BP_IS_REDACTED(bp))
+		return;
+
+	comp = BP_GET_COMPRESS(bp);
+	if (comp >= ZIO_COMPRESS_FUNCTIONS || !(scan->mask & (1U << comp)))
+		return;
+
+	if (BP_IS_ENCRYPTED(bp)) {
+		mutex_enter(&scan->lock);
+		scan->cells[comp].unread_blocks++;
+		mutex_exit(&scan->lock);
+		return;
+	}
+
+	comphist_reader_read(scan->reader, bp, zb);
+}
+
+/*
+ * The zstd header is the big-endian compressed length followed by a word
+ * holding the version and level; the level is its first byte.  Big-endian
+ * systems once wrote the level as the last byte instead, so that is tried
+ * when the first does not hold a valid level.
+ */
+static bool
+comphist_zstd_level_valid(unsigned level)
+{
+	return ((level >= 1 && level <= 19) || (level >= 102 && level <= 123));
+}
+
+static int
+comphist_zstd_level(const uint8_t *buf, uint64_t size, uint64_t psize)
+{
+	uint64_t c_len;
+
+	if (size < 8 || psize < 8)
+		return (-1);
+	c_len = (uint64_t)buf[0] << 24 | (uint64_t)buf[1] << 16 |
+	    (uint64_t)buf[2] << 8 | buf[3];
+	if (c_len > psize - 8)
+		return (-1);
+
+	if (!comphist_zstd_level_valid(buf[4]) &&
+	    comphist_zstd_level_valid(buf[7]))
+		return (buf[7]);
+	return (buf[4]);
+}
+
+static void
+comphist_zstd_done(void *arg, const blkptr_t *bp, const void *buf,
+    uint64_t size, int err)
+{
+	struct comphist_read_scan *scan = arg;
+	int level = err == 0 ? comphist_zstd_level(buf, size,
+	    BP_IS_EMBEDDED(bp) ? BPE_GET_PSIZE(bp) : BP_GET_PSIZE(bp)) : -1;
+
+	mutex_enter(&scan->lock);
+	if (level < 0) {
+		scan->zstd_unread++;
+	} else {
+		struct comphist_cell *cell = &scan->zstd[level];
+
+		cell->blocks++;
+		cell->lsize += BP_GET_LSIZE(bp);
+		cell->psize += BP_GET_PSIZE(bp);
+		cell->asize += BP_GET_ASIZE(bp);
+	}
+	mutex_exit(&scan->lock);
+}
+
+/*
+ * Queue a header read for a zstd block.  Embedded blocks carry their
+ * header in the block pointer and are decoded on the spot.
+ */
+static void
+comphist_zstd_offer(struct comphist_read_scan *scan, const blkptr_t *bp,
+    const zbookmark_phys_t *zb)
+{
+	if (BP_IS_HOLE(bp) || BP_IS_REDACTED(bp) ||
+	    BP_GET_COMPRESS(bp) != ZIO_COMPRESS_ZSTD)
+		return;
+
+	if (BP_IS_EMBEDDED(bp)) {
+		uint8_t buf[BPE_PAYLOAD_SIZE];
+
+		decode_embedded_bp_compressed(bp, buf);
+		comphist_zstd_done(scan, bp, buf, BPE_GET_PSIZE(bp), 0);
+		return;
+	}
+
+	if (BP_IS_ENCRYPTED(bp)) {
+		mutex_enter(&scan->lock);
+		scan->zstd_unread++;
+		mutex_exit(&scan->lock);
+		return;
+	}
+
+	comphist_reader_read_head(scan->hdr_reader, bp, zb);
+}
+
+static void
+comphist_trav_progress(struct comphist_trav *trav)
+{
+	if (trav->ctx->progress)
+		comphist_progress_add(trav->prog_blocks, trav->prog_bytes);
+	trav->prog_blocks = 0;
+	trav->prog_bytes = 0;
+}
+
+/*
+ * Called at the first block of each object during a checkpointed serial
+ * traversal.  Every block owned by an earlier object has been accounted by
+ * then, except that the dnode block holding the first object of each dnode
+ * block is owned by that object and is visited just before it.  Checkpoints
+ * are therefore only taken before objects that are not first in their
+ * dnode block.
+ */
+static int
+comphist_trav_checkpoint(struct comphist_trav *trav, uint64_t object)
+{
+	trav->last_object = object;
+	if (object % trav->ckpt_align == 0 || !comphist_ckpt_due(trav->ckpt))
+		return (0);
+
+	return (comphist_ckpt_progress(trav->ckpt, trav->ckpt_guid, object,
+	    trav->stats));
+}
+
+/*
+ * Record where each copy of a block is allocated for --vdevs.  DVAs on
+ * vdevs added after the walk started count as normal class.
+ */
+static void
+comphist_block_dvas(const struct comphist_walk_ctx *ctx, const blkptr_t *bp,
+    struct comphist_block *blk)
+{
+	for (int d = 0; d < SPA_DVAS_PER_BP; d++) {
+		const dva_t *dva = &bp->blk_dva[d];
+		uint64_t vdev = DVA_GET_VDEV(dva);
+		int n;
+
+		if (!DVA_IS_VALID(dva))
+			continue;
+
+		n = blk->ndvas++;
+		blk->dva_vdev[n] = (uint16_t)MIN(vdev, UINT16_MAX);
+		blk->dva_class[n] = vdev < ctx->nvdevs ?
+		    ctx->vdev_class[vdev] : COMPHIST_AC_NORMAL;
+		blk->dva_asize[n] =
+		    (uint32_t)(DVA_GET_ASIZE(dva) >> SPA_MINBLOCKSHIFT);
+		if (DVA_GET_GANG(dva))
+			blk->dva_gang |= 1U << n;
+	}
+}
+
+static int
+comphist_blkptr_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
+    const zbookmark_phys_t *zb, const struct dnode_phys *dnp, void *arg)
+{
+	struct comphist_trav *trav = arg;
+	struct comphist_block blk = {0};
+	int pick = 0;
+
+	(void)spa;
+	(void)zilog;
+
+	if (zb->zb_level == ZB_DNODE_LEVEL)
+		return (0);
+
+	/*
+	 * Objects are visited in ascending order, so the first data block past
+	 * the end of a shard means it is complete.  ZIL records carry
+	 * arbitrary object numbers and are skipped, and so are the meta-dnode
+	 * and the user accounting objects, which follow the last dnode and
+	 * have the highest numbers of all.
+	 */
+	if (zb->zb_level >= 0 && !DMU_OBJECT_IS_SPECIAL(zb->zb_object) &&
+	    zb->zb_object >= trav->obj_hi)
+		return (SET_ERROR(ECANCELED));
+
+	if (trav->ckpt != NULL && zb->zb_level >= 0 &&
+	    zb->zb_object != trav->last_object &&
+	    !DMU_OBJECT_IS_SPECIAL(zb->zb_object)) {
+		int err = comphist_trav_checkpoint(trav, zb->zb_object);
+
+		if (err != 0)
+			return (SET_ERROR(err));
+	}
+
+	/* A resumed traversal accounted the ZIL before it was interrupted. */
+	if (trav->skip_zil && zb->zb_level == ZB_ZIL_LEVEL)
+		return (0);
+
+	if (trav->sampled != NULL) {
+		pick = comphist_sample_pick(trav, zb, dnp);
+		if (pick < 0)
+			return (TRAVERSE_VISIT_NO_CHILDREN);
+	}
+
+	/* Blocks the traversal itself reads to find their children. */
+	if (!BP_IS_HOLE(bp) && !BP_IS_EMBEDDED(bp) && !BP_IS_REDACTED(bp) &&
+	    (BP_GET_LEVEL(bp) > 0 || BP_GET_TYPE(bp) == DMU_OT_DNODE ||
+	    BP_GET_TYPE(bp) == DMU_OT_OBJSET)) {
+		trav->stats->scan_meta_blocks++;
+		trav->stats->scan_meta_bytes += BP_GET_PSIZE(bp);
+	}
+
+	if (trav->objects_only && (zb->zb_level < 0 ||
+	    zb->zb_object == DMU_META_DNODE_OBJECT))
+		return (0);
+
+	/*
+	 * The user accounting objects are visited last, so they belong to the
+	 * range that ends at UINT64_MAX: the last shard or a resumed walk.
+	 */
+	if (trav->obj_lo != 0 || trav->obj_hi != UINT64_MAX) {
+		uint64_t owner = comphist_block_owner(zb, dnp);
+		bool accounting = owner != DMU_META_DNODE_OBJECT &&
+		    DMU_OBJECT_IS_SPECIAL(owner);
+
+		if (accounting ? trav->obj_hi != UINT64_MAX :
+		    owner < trav->obj_lo || owner >= trav->obj_hi)
+			return (0);
+	}
+
+	if (trav->ctx->unique.set != NULL) {
+		bool account;
+		int err = comphist_unique_filter(&trav->ctx->unique, bp,
+		    &account);
+
+		if (err != 0)
+			return (SET_ERROR(err));
+		if (!account)
+			return (0);
+	}
+
+	if (trav->sim != NULL)
+		comphist_sim_local_offer(trav->sim, bp, zb);
+	else if (trav->ctx->sim != NULL)
+		comphist_sim_offer(trav->ctx->sim, bp, zb);
+	if (trav->scan != NULL && trav->scan->reader != NULL)
+		comphist_entropy_offer(trav->scan, bp, zb);
+	if (trav->scan != NULL && trav->scan->hdr_reader != NULL)
+		comphist_zstd_offer(trav->scan, bp, zb);
+
+	if (BP_IS_HOLE(bp)) {
+		blk.flags = COMPHIST_BLK_HOLE;
+	} else if (BP_IS_REDACTED(bp)) {
+		blk.flags = COMPHIST_BLK_REDACTED;
+	} else {
+		blk.comp = BP_GET_COMPRESS(bp);
+		blk.lsize = BP_GET_LSIZE(bp);
+		blk.psize = BP_GET_PSIZE(bp);
+		blk.asize = BP_GET_ASIZE(bp);
+		blk.type = BP_GET_TYPE(bp);
+		blk.level = BP_GET_LEVEL(bp);
+		blk.birth = BP_GET_LOGICAL_BIRTH(bp);
+		blk.era = MIN(blk.birth >> trav->ctx->era_shift,
+		    COMPHIST_ERAS - 1);
+		if (BP_IS_EMBEDDED(bp))
+			blk.flags = COMPHIST_BLK_EMBEDDED;
+		else if (trav->ctx->vdev_class != NULL)
+			comphist_block_dvas(trav->ctx, bp, &blk);
+	}
+
+	if (trav->trace != NULL)
+		comphist_trace_add(trav->trace, zb->zb_object, zb->zb_level,
+		    &blk);
+	if (trav->top != NULL)
+		comphist_top_add(trav, zb, &blk);
+	if (trav->dedup != NULL && blk.flags == 0 && BP_GET_DEDUP(bp) &&
+	    comphist_dedup_set_add(trav->dedup, bp) != 0)
+		return (SET_ERROR(ENOMEM));
+
+	if (pick > 0) {
+		comphist_sample_add(trav, zb, &blk);
+		comphist_stats_account(trav->sampled, &blk);
+	} else if (trav->pipe != NULL) {
+		comphist_pipeline_push(trav->pipe, &blk);
+	} else {
+		comphist_stats_account(trav->stats, &blk);
+	}
+
+	trav->prog_blocks++;
+	trav->prog_bytes += blk.asize;
+	if (trav->prog_blocks == COMPHIST_PROGRESS_BATCH)
+		comphist_trav_progress(trav);
+
+	return (0);
+}
+
+/* CPU time of the calling thread. */
+static uint64_t
+comphist_thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return (0);
+
+	return ((uint64_t)ts.tv_sec * NANOSEC + (uint64_t)ts.tv_nsec);
+}
+
+static int
+comphist_traverse_dataset(struct dsl_dataset *ds, struct comphist_trav *trav)
+{
+	const struct comphist_options *opts = trav->ctx->opts;
+	int flags = TRAVERSE_PRE | TRAVERSE_PREFETCH_METADATA |
+	    TRAVERSE_NO_DECRYPT;
+	zbookmark_phys_t resume = {0};
+	zbookmark_phys_t *resume_ptr = NULL;
+	uint64_t cpu;
+	int err;
+
+	if (trav->obj_lo != 0) {
+		SET_BOOKMARK(&resume, ds->ds_object, trav->obj_lo, 0, 0);
+		resume_ptr = &resume;
+	}
+
+	if (opts->best_effort) {
+		flags |= TRAVERSE_HARD;
+		resume_ptr = &resume;
+	}
+
+	/*
+	 * Metadata prefetch reads ahead through the indirect blocks of objects
+	 * past the one being visited, which --path passes skip.
+	 */
+	if (trav->objects_only)
+		flags &= ~TRAVERSE_PREFETCH_METADATA;
+
+	/*
+	 * Metadata prefetch would read the top-level indirect blocks of every
+	 * object, sampled or not.
+	 */
+	if (opts->sample > 0.0) {
+		flags &= ~TRAVERSE_PREFETCH_METADATA;
+		trav->sampled = malloc(sizeof(*trav->sampled));
+		if (trav->sampled == NULL)
+			return (ENOMEM);
+		comphist_stats_init(trav->sampled);
+		memset(&trav->obj, 0, sizeof(trav->obj));
+		trav->stats->sample.rate = opts->sample;
+	}
+
+	if (opts->pipeline > 0) {
+		trav->pipe = comphist_pipeline_create(opts->pipeline);
+		if (trav->pipe == NULL) {
+			free(trav->sampled);
+			trav->sampled = NULL;
+			return (ENOMEM);
+		}
+	}
+
+	if (trav->ctx->trace != NULL) {
+		trav->trace = comphist_trace_buf_create(trav->ctx->trace,
+		    ds->ds_object);
+		if (trav->trace == NULL) {
+			if (trav->pipe != NULL)
+				comphist_pipeline_finish(trav->pipe,
+				    trav->stats);
+			trav->pipe = NULL;
+			free(trav->sampled);
+			trav->sampled = NULL;
+			return (ENOMEM);
+		}
+	}
+
+	if (trav->ctx->top != NULL)
+		trav->top = comphist_top_create(trav->ctx->top->limit);
+	if (trav->ctx->dedup != NULL)
+		trav->dedup = comphist_dedup_set_create();
+	if (trav->ctx->sim != NULL)
+		trav->sim = comphist_sim_local_create(trav->ctx->sim);
+	if ((trav->ctx->top != NULL && trav->top == NULL) ||
+	    (trav->ctx->dedup != NULL && trav->dedup == NULL) ||
+	    (trav->ctx->sim != NULL && trav->sim == NULL)) {
+		comphist_top_destroy(trav->top);
+		trav->top = NULL;
+		comphist_dedup_set_destroy(trav->dedup);
+		trav->dedup = NULL;
+		comphist_sim_local_destroy(trav->sim);
+		trav->sim = NULL;
+		if (trav->trace != NULL)
+			comphist_trace_buf_destroy(trav->trace);
+		trav->trace = NULL;
+		if (trav->pipe != NULL)
+			comphist_pipeline_finish(trav->pipe, trav->stats);
+		trav->pipe = NULL;
+		return (ENOMEM);
+	}
+	if (trav->top != NULL) {
+		memset(&trav->top_obj, 0, sizeof(trav->top_obj));
+		trav->top_obj.objset = ds->ds_object;
+		trav->top_obj.dir = dsl_dataset_phys(ds)->ds_dir_obj;
+	}
+
+	cpu = comphist_thread_cpu_ns();
+	for (;;) {
+		err = traverse_dataset_resume(ds, 0, resume_ptr, flags,
+		    comphist_blkptr_cb, trav);
+		if (err == 0 || err == ECANCELED) {
+			err = 0;
+			break;
+		}
+		if (!opts->best_effort)
+			break;
+
+		comphist_stats_note_traversal_error(trav->stats);
+		if ((err == EIO || err == ECKSUM || err == ENXIO) &&
+		    resume.zb_blkid != UINT64_MAX) {
+			trav->stats->scan_retries++;
+			resume.zb_blkid++;
+			continue;
+		}
+		break;
+	}
+	trav->stats->scan_cpu_ns += comphist_thread_cpu_ns() - cpu;
+
+	comphist_trav_progress(trav);
+
+	if (trav->top != NULL) {
+		comphist_top_flush(trav);
+		mutex_enter(&trav->ctx->lock);
+		comphist_top_merge(trav->ctx->top, trav->top);
+		mutex_exit(&trav->ctx->lock);
+		comphist_top_destroy(trav->top);
+		trav->top = NULL;
+	}
+
+	if (trav->dedup != NULL) {
+		int derr;
+
+		mutex_enter(&trav->ctx->lock);
+		derr = comphist_dedup_set_merge(trav->ctx->dedup, trav->dedup);
+		mutex_exit(&trav->ctx->lock);
+		if (err == 0)
+			err = derr;
+		comphist_dedup_set_destroy(trav->dedup);
+		trav->dedup = NULL;
+	}
+
+	if (trav->sim != NULL) {
+		comphist_sim_merge(trav->ctx->sim, trav->sim);
+		comphist_sim_local_destroy(trav->sim);
+		trav->sim = NULL;
+	}
+
+	if (trav->trace != NULL) {
+		comphist_trace_buf_destroy(trav->trace);
+		trav->trace = NULL;
+	}
+
+	if (trav->pipe != NULL) {
+		comphist_pipeline_finish(trav->pipe, trav->stats);
+		trav->pipe = NULL;
+	}
+
+	if (trav->sampled != NULL) {
+		comphist_sample_flush(trav);
+		comphist_stats_scale(trav->sampled, 1.0 / opts->sample);
+		comphist_stats_merge(trav->stats, trav->sampled);
+		free(trav->sampled);
+		trav->sampled = NULL;
+	}
+
+	return (err);
+}
+
+static void
+comphist_shard_task(void *arg)
+{
+	struct comphist_shard *shard = arg;
+
+	shard->error = comphist_traverse_dataset(shard->ds, &shard->trav);
+}
+
+/*
+ * Split the meta-dnode's object space into ranges aligned to dnode blocks
+ * and traverse each range on its own thread.  Every block has exactly one
+ * owning shard, so the merged totals match a serial traversal.
+ *
+ * A traversal resumed from a checkpoint at object next_obj is not sharded;
+ * it accounts the blocks owned by next_obj and later objects, like the
+ * last shard would.
+ */
+static int
+comphist_traverse_sharded(struct comphist_walk_ctx *ctx, objset_t *os,
+    struct comphist_read_scan *scan, uint64_t next_obj,
+    struct comphist_stats *stats)
+{
+	dnode_t *mdn = DMU_META_DNODE(os);
+	uint64_t per_block = 1ULL << (mdn->dn_datablkshift - DNODE_SHIFT);
+	uint64_t nblocks = mdn->dn_maxblkid + 1;
+	struct comphist_shard *shards;
+	int nshards = ctx->opts->shards;
+	taskq_t *tq;
+	int err = 0;
+
+	if ((uint64_t)nshards > nblocks)
+		nshards = (int)nblocks;
+	if (nshards <= 1 || next_obj != 0) {
+		struct comphist_trav trav = {
+			.ctx = ctx,
+			.stats = stats,
+			.scan = scan,
+			.obj_lo = next_obj,
+			.obj_hi = UINT64_MAX,
+			.skip_zil = next_obj != 0,
+		};
+
+		if (ctx->ckpt_objects) {
+			trav.ckpt = ctx->ckpt;
+			trav.ckpt_guid =
+			    dsl_dataset_phys(dmu_objset_ds(os))->ds_guid;
+			trav.ckpt_align = per_block;
+		}
+
+		return (comphist_traverse_dataset(dmu_objset_ds(os), &trav));
+	}
+
+	shards = calloc(nshards, sizeof(*shards));
+	if (shards == NULL)
+		return (ENOMEM);
+
+	tq = taskq_create("z_comphist_shard", nshards, defclsyspri, nshards,
+	    nshards, TASKQ_PREPOPULATE);
+
+	for (int i = 0; i < nshards; i++) {
+		struct comphist_shard *shard = &shards[i];
+
+		shard->ds = dmu_objset_ds(os);
+		comphist_stats_init(&shard->stats);
+		shard->trav.ctx = ctx;
+		shard->trav.stats = &shard->stats;
+		shard->trav.scan = scan;
+		shard->trav.obj_lo = (nblocks * i / nshards) * per_block;
+		shard->trav.obj_hi = i == nshards - 1 ? UINT64_MAX :
+		    (nblocks * (i + 1) / nshards) * per_block;
+		(void)taskq_dispatch(tq, comphist_shard_task, shard, TQ_SLEEP);
+	}
+
+	taskq_wait(tq);
+	taskq_destroy(tq);
+
+	for (int i = 0; i < nshards; i++) {
+		comphist_stats_merge(stats, &shards[i].stats);
+		if (err == 0)
+			err = shards[i].error;
+	}
+	free(shards);
+
+	return (err);
+}
+
+/*
+ * --path: traverse the block trees of one directory tree's objects only.
+ * Runs of consecutive object numbers are traversed as one range, each
+ * resumed at its first object so only the meta-dnode blocks leading to it
+ * are read.  With --shards, runs are dealt out to that many threads.
+ */
+struct comphist_path_task {
+	struct comphist_walk_ctx *ctx;
+	dsl_dataset_t *ds;
+	struct comphist_read_scan *scan;
+	const uint64_t *objs;
+	const size_t *runs;
+	size_t nruns;
+	size_t first;
+	size_t stride;
+	struct comphist_stats stats;
+	int error;
+};
+
+static void
+comphist_path_task(void *arg)
+{
+	struct comphist_path_task *task = arg;
+
+	for (size_t r = task->first; r < task->nruns; r += task->stride) {
+		struct comphist_trav trav = {
+			.ctx = task->ctx,
+			.stats = &task->stats,
+			.scan = task->scan,
+			.obj_lo = task->objs[task->runs[r]],
+			.obj_hi = task->objs[task->runs[r + 1] - 1] + 1,
+			.skip_zil = true,
+			.objects_only = true,
+		};
+
+		task->error = comphist_traverse_dataset(task->ds, &trav);
+		if (task->error != 0)
+			return;
+	}
+}
+
+static int
+comphist_traverse_path(struct comphist_walk_ctx *ctx, objset_t *os,
+    struct comphist_read_scan *scan, struct comphist_stats *stats)
+{
+	struct comphist_path_task *tasks;
+	uint64_t *objs;
+	size_t *runs;
+	size_t count, nruns = 0;
+	int ntasks = MAX(ctx->opts->shards, 1);
+	int err;
+
+	err = comphist_subtree_collect(os, ctx->opts->path, &objs, &count);
+	if (err != 0)
+		return (err);
+
+	/* runs[r] is the index of the first object of run r. */
+	runs = malloc((count + 1) * sizeof(*runs));
+	if (runs == NULL) {
+		free(objs);
+		return (ENOMEM);
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (i == 0 || objs[i] != objs[i - 1] + 1)
+			runs[nruns++] = i;
+	}
+	runs[nruns] = count;
+
+	if ((size_t)ntasks > nruns)
+		ntasks = MAX((int)nruns, 1);
+	tasks = calloc(ntasks, sizeof(*tasks));
+	if (tasks == NULL) {
+		free(runs);
+		free(objs);
+		return (ENOMEM);
+	}
+
+	for (int i = 0; i < ntasks; i++) {
+		struct comphist_path_task *task = &tasks[i];
+
+		task->ctx = ctx;
+		task->ds = dmu_objset_ds(os);
+		task->scan = scan;
+		task->objs = objs;
+		task->runs = runs;
+		task->nruns = nruns;
+		task->first = i;
+		task->stride = ntasks;
+		comphist_stats_init(&task->stats);
+	}
+
+	if (ntasks == 1) {
+		comphist_path_task(&tasks[0]);
+	} else {
+		taskq_t *tq = taskq_create("z_comphist_path", ntasks,
+		    defclsyspri, ntasks, ntasks, TASKQ_PREPOPULATE);
+
+		for (int i = 0; i < ntasks; i++)
+			(void)taskq_dispatch(tq, comphist_path_task,
+			    &tasks[i], TQ_SLEEP);
+		taskq_wait(tq);
+		taskq_destroy(tq);
+	}
+
+	for (int i = 0; i < ntasks; i++) {
+		comphist_stats_merge(stats, &tasks[i].stats);
+		if (err == 0)
+			err = tasks[i].error;
+	}
+	free(tasks);
+	free(runs);
+	free(objs);
+
+	return (err);
+}
+
+/*
+ * Pool-wide ARC counters, sampled before and after each dataset.  Hits on
+ * reads already in flight count as hits; metadata misses are the reads the
+ * traversal had to issue.
+ */
+struct comphist_arc_snap {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t meta_misses;
+};
+
+static void
+comphist_arc_snap(struct comphist_arc_snap *snap)
+{
+	snap->hits = wmsum_value(&arc_sums.arcstat_hits) +
+	    wmsum_value(&arc_sums.arcstat_iohits);
+	snap->misses = wmsum_value(&arc_sums.arcstat_misses);
+	snap->meta_misses =
+	    wmsum_value(&arc_sums.arcstat_demand_metadata_misses) +
+	    wmsum_value(&arc_sums.arcstat_prefetch_metadata_misses);
+}
+
+static void
+comphist_scan_begin(struct comphist_arc_snap *snap, hrtime_t *start)
+{
+	comphist_arc_snap(snap);
+	*start = gethrtime();
+}
+
+static void
+comphist_scan_end(const struct comphist_arc_snap *before, hrtime_t start,
+    struct comphist_stats *stats)
+{
+	struct comphist_arc_snap after;
+
+	stats->scan_ns += gethrtime() - start;
+	comphist_arc_snap(&after);
+	stats->scan_arc_hits += after.hits - before->hits;
+	stats->scan_arc_misses += after.misses - before->misses;
+	stats->scan_meta_reads += after.meta_misses - before->meta_misses;
+}
+
+/*
+ * Datasets walked concurrently (-j) overlap in time and see each other's
+ * ARC traffic, so the sum of their scan times and ARC deltas overstates
+ * an aggregate walk.  Its totals are instead measured once around the
+ * whole walk, on top of whatever a resumed checkpoint restored.
+ */
+struct comphist_scan_wall {
+	struct comphist_arc_snap arc;
+	hrtime_t start;
+	uint64_t ns;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t reads;
+};
+
+static void
+comphist_wall_begin(struct comphist_scan_wall *wall,
+    const struct comphist_stats *total)
+{
+	wall->ns = total->scan_ns;
+	wall->hits = total->scan_arc_hits;
+	wall->misses = total->scan_arc_misses;
+	wall->reads = total->scan_meta_reads;
+	comphist_scan_begin(&wall->arc, &wall->start);
+}
+
+static void
+comphist_wall_end(const struct comphist_scan_wall *wall,
+    struct comphist_stats *total)
+{
+	total->scan_ns = wall->ns;
+	total->scan_arc_hits = wall->hits;
+	total->scan_arc_misses = wall->misses;
+	total->scan_meta_reads = wall->reads;
+	comphist_scan_end(&wall->arc, wall->start, total);
+}
+
+/*
+ * Traverse one dataset, reading blocks back for --entropy alongside the
+ * traversal when requested.
+ */
+static int
+comphist_traverse_objset(struct comphist_walk_ctx *ctx, objset_t *os,
+    uint64_t next_obj, struct comphist_stats *stats)
+{
+	int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	struct comphist_read_scan *scan;
+	struct comphist_arc_snap arc;
+	hrtime_t start;
+	int err;
+
+	if (ctx->opts->entropy == 0 && !ctx->opts->zstd_levels) {
+		comphist_scan_begin(&arc, &start);
+		err = ctx->opts->path != NULL ?
+		    comphist_traverse_path(ctx, os, NULL, stats) :
+		    comphist_traverse_sharded(ctx, os, NULL, next_obj, stats);
+		comphist_scan_end(&arc, start, stats);
+		return (err);
+	}
+
+	scan = calloc(1, sizeof(*scan));
+	if (scan == NULL)
+		return (ENOMEM);
+
+	scan->mask = ctx->opts->entropy;
+	mutex_init(&scan->lock, NULL, MUTEX_DEFAULT, NULL);
+	if (ctx->opts->entropy != 0) {
+		scan->reader = comphist_reader_create(dmu_objset_spa(os),
+		    COMPHIST_ENTROPY_DEPTH, nthreads, comphist_entropy_done,
+		    scan);
+	}
+	if (ctx->opts->zstd_levels) {
+		scan->hdr_reader = comphist_reader_create(dmu_objset_spa(os),
+		    COMPHIST_ZSTD_DEPTH, nthreads, comphist_zstd_done, scan);
+	}
+	if ((ctx->opts->entropy != 0 && scan->reader == NULL) ||
+	    (ctx->opts->zstd_levels && scan->hdr_reader == NULL)) {
+		if (scan->reader != NULL)
+			comphist_reader_destroy(scan->reader);
+		if (scan->hdr_reader != NULL)
+			comphist_reader_destroy(scan->hdr_reader);
+		mutex_destroy(&scan->lock);
+		free(scan);
+		return (ENOMEM);
+	}
+
+	comphist_scan_begin(&arc, &start);
+	err = ctx->opts->path != NULL ?
+	    comphist_traverse_path(ctx, os, scan, stats) :
+	    comphist_traverse_sharded(ctx, os, scan, next_obj, stats);
+
+	/* Waits for every outstanding read before the objset is released. */
+	if (scan->reader != NULL)
+		comphist_reader_destroy(scan->reader);
+	if (scan->hdr_reader != NULL)
+		comphist_reader_destroy(scan->hdr_reader);
+	comphist_scan_end(&arc, start, stats);
+	for (int i = 0; i < ZIO_COMPRESS_FUNCTIONS; i++) {
+		struct comphist_entropy_cell *d = &stats->entropy[i];
+		const struct comphist_entropy_cell *s = &scan->cells[i];
+
+		d->low_blocks += s->low_blocks;
+		d->low_lsize += s->low_lsize;
+		d->high_blocks += s->high_blocks;
+		d->high_lsize += s->high_lsize;
+		d->unread_blocks += s->unread_blocks;
+	}
+	for (int l = 0; l < COMPHIST_ZSTD_LEVELS; l++) {
+		struct comphist_cell *d = &stats->zstd[l];
+		const struct comphist_cell *s = &scan->zstd[l];
+
+		d->blocks += s->blocks;
+		d->lsize += s->lsize;
+		d->psize += s->psize;
+		d->asize += s->asize;
+	}
+	stats->zstd_unread += scan->zstd_unread;
+	mutex_destroy(&scan->lock);
+	free(scan);
+
+	return (err);
+}
+
+/*
+ * Snapshots found in the result cache are merged without being traversed;
+ * snapshots that traverse cleanly are added to it.
+ */
+static int
+comphist_walk_snapshot_cached(struct comphist_walk_ctx *ctx, objset_t *os,
+    struct comphist_stats *stats)
+{
+	dsl_dataset_t *ds = dmu_objset_ds(os);
+	uint64_t guid = dsl_dataset_phys(ds)->ds_guid;
+	uint64_t txg = dsl_dataset_phys(ds)->ds_creation_txg;
+	struct comphist_stats *snap;
+	int err;
+
+	snap = malloc(sizeof(*snap));
+	if (snap == NULL)
+		return (ENOMEM);
+
+	if (comphist_cache_lookup(ctx->cache, guid, txg, snap)) {
+		comphist_stats_merge(stats, snap);
+		free(snap);
+		return (0);
+	}
+
+	comphist_stats_init(snap);
+	err = comphist_traverse_objset(ctx, os, 0, snap);
+	if (err == 0 && snap->traversal_errors == 0)
+		err = comphist_cache_insert(ctx->cache, guid, txg, snap);
+	comphist_stats_merge(stats, snap);
+	free(snap);
+
+	return (err);
+}
+
+/*
+ * Account one held dataset, from the result cache where possible.
+ */
+static int
+comphist_walk_objset(struct comphist_walk_ctx *ctx, objset_t *os,
+    uint64_t next_obj, struct comphist_stats *stats)
+{
+	if (ctx->cache != NULL && ctx->unique.set == NULL && ctx->sim == NULL &&
+	    ctx->opts->sample == 0.0 && next_obj == 0 &&
+	    dmu_objset_ds(os)->ds_is_snapshot)
+		return (comphist_walk_snapshot_cached(ctx, os, stats));
+
+	return (comphist_traverse_objset(ctx, os, next_obj, stats));
+}
+
+/*
+ * Checkpointed walk of one dataset.  Datasets finished before the
+ * interruption come from the checkpoint; an interrupted dataset continues
+ * where it stopped.  Each dataset is accounted on its own so it can be
+ * recorded as finished.
+ */
+static int
+comphist_walk_dataset_ckpt(struct comphist_walk_ctx *ctx, objset_t *os,
+    struct comphist_stats *stats)
+{
+	uint64_t guid = dsl_dataset_phys(dmu_objset_ds(os))->ds_guid;
+	struct comphist_stats *ds_stats;
+	uint64_t next_obj = 0;
+	int err;
+
+	ds_stats = malloc(sizeof(*ds_stats));
+	if (ds_stats == NULL)
+		return (ENOMEM);
+	comphist_stats_init(ds_stats);
+
+	if (comphist_ckpt_lookup(ctx->ckpt, guid, ds_stats)) {
+		comphist_stats_merge(stats, ds_stats);
+		free(ds_stats);
+		return (0);
+	}
+
+	(void)comphist_ckpt_partial(ctx->ckpt, guid, &next_obj, ds_stats);
+	err = comphist_walk_objset(ctx, os, next_obj, ds_stats);
+	ds_stats->era_shift = ctx->era_shift;
+	memcpy(ds_stats->era_time, ctx->era_time, sizeof(ds_stats->era_time));
+	if (err == 0)
+		err = comphist_ckpt_done(ctx->ckpt, guid, ds_stats);
+	comphist_stats_merge(stats, ds_stats);
+	free(ds_stats);
+
+	return (err);
+}
+
+/*
+ * Walk the idx'th dataset of the enumeration into stats.
+ */
+static int
+comphist_walk_dataset(struct comphist_walk_ctx *ctx, size_t idx,
+    struct comphist_stats *stats)
+{
+	const char *dsname = ctx->list.names[idx];
+	uint64_t errors = stats->traversal_errors;
+	objset_t *os = NULL;
+	int err;
+
+	err = dmu_objset_hold(dsname, comphist_tag, &os);
+	if (err != 0)
+		return (err);
+
+	if (ctx->progress)
+		comphist_progress_dataset_begin(dsname);
+	if (ctx->ckpt != NULL)
+		err = comphist_walk_dataset_ckpt(ctx, os, stats);
+	else
+		err = comphist_walk_objset(ctx, os, 0, stats);
+
+	stats->era_shift = ctx->era_shift;
+	memcpy(stats->era_time, ctx->era_time, sizeof(stats->era_time));
+	if (ctx->trace != NULL) {
+		comphist_trace_dataset(ctx->trace, idx, dmu_objset_id(os),
+		    stats->traversal_errors - errors);
+	}
+	if (ctx->progress) {
+		comphist_progress_dataset_done(
+		    dsl_dataset_phys(dmu_objset_ds(os))->ds_referenced_bytes);
+	}
+
+	dmu_objset_rele(os, comphist_tag);
+	return (err);
+}
+
+static int
+comphist_collect_cb(const char *dsname, void *arg)
+{
+	struct comphist_dslist *list = arg;
+	char *name;
+
+	if (list->count == list->cap) {
+		size_t cap = list->cap == 0 ? 64 : list->cap * 2;
+		char **names = realloc(list->names, cap * sizeof(*names));
+
+		if (names == NULL)
+			return (ENOMEM);
+		list->names = names;
+		list->cap = cap;
+	}
+
+	name = strdup(dsname);
+	if (name == NULL)
+		return (ENOMEM);
+
+	list->names[list->count++] = name;
+	return (0);
+}
+
+static void
+comphist_dslist_free(struct comphist_dslist *list)
+{
+	for (size_t i = 0; i < list->count; i++)
+		free(list->names[i]);
+	free(list->names);
+	memset(list, 0, sizeof(*list));
+}
+
+static bool
+comphist_target_is_pool(const char *target)
+{
+	return (strpbrk(target, "/@#") == NULL);
+}
+
+/*
+ * Resolve the target into the ordered list of datasets to traverse.  The
+ * order is the one dmu_objset_find() visits them in, so serial and parallel
+ * walks report datasets identically.
+ */
+static int
+comphist_enumerate(const char *target, const struct comphist_options *opts,
+    struct comphist_dslist *list)
+{
+	if (comphist_target_is_pool(target) || opts->recursive) {
+		if (strpbrk(target, "@#") != NULL)
+			return (EINVAL);
+		return (dmu_objset_find(target, comphist_collect_cb, list,
+		    DS_FIND_CHILDREN));
+	}
+
+	return (comphist_collect_cb(target, list));
+}
+
+struct comphist_anchor {
+	uint64_t txg;
+	uint64_t time;
+};
+
+struct comphist_anchors {
+	struct comphist_anchor *a;
+	size_t count;
+	size_t cap;
+};
+
+static int
+comphist_anchor_add(struct comphist_anchors *anchors, uint64_t txg,
+    uint64_t time)
+{
+	if (anchors->count == anchors->cap) {
+		size_t cap = anchors->cap != 0 ? anchors->cap * 2 : 64;
+		struct comphist_anchor *a;
+
+		a = realloc(anchors->a, cap * sizeof(*a));
+		if (a == NULL)
+			return (ENOMEM);
+		anchors->a = a;
+		anchors->cap = cap;
+	}
+
+	anchors->a[anchors->count].txg = txg;
+	anchors->a[anchors->count++].time = time;
+	return (0);
+}
+
+static int
+comphist_anchor_cb(const char *name, void *arg)
+{
+	dsl_dataset_phys_t *phys;
+	objset_t *os;
+	int err;
+
+	/* Datasets that cannot be held just leave a wider gap. */
+	if (dmu_objset_hold(name, FTAG, &os) != 0)
+		return (0);
+	phys = dsl_dataset_phys(dmu_objset_ds(os));
+	err = comphist_anchor_add(arg, phys->ds_creation_txg,
+	    phys->ds_creation_time);
+	dmu_objset_rele(os, FTAG);
+
+	return (err);
+}
+
+static int
+comphist_anchor_compare(const void *a, const void *b)
+{
+	const struct comphist_anchor *l = a, *r = b;
+
+	return ((l->txg > r->txg) - (l->txg < r->txg));
+}
+
+static uint64_t
+comphist_anchor_time(const struct comphist_anchor *anchors, size_t count,
+    uint64_t txg)
+{
+	size_t i = 0;
+
+	while (i < count && anchors[i].txg < txg)
+		i++;
+
+	/* Nothing is older than the pool, which is the first anchor. */
+	if (i == count)
+		return (anchors[count - 1].time);
+	if (anchors[i].txg == txg || i == 0)
+		return (anchors[i].time);
+
+	return (anchors[i - 1].time + (uint64_t)((double)(txg -
+	    anchors[i - 1].txg) * (double)(anchors[i].time -
+	    anchors[i - 1].time) / (double)(anchors[i].txg -
+	    anchors[i - 1].txg)));
+}
+
+/*
+ * Size the birth txg eras so the pool's txgs fit in COMPHIST_ERAS
+ * power-of-two buckets.  The width only changes when the pool's txg count
+ * doubles, which keeps cached snapshot results comparable between runs.
+ *
+ * With --eras the era boundaries are also mapped to wall-clock time by
+ * interpolating between the creation (txg, time) of every dataset and
+ * snapshot in the pool and the pool's last synced uberblock.  Datasets
+ * outside the walk still date the txgs their blocks were born in; the
+ * pool's root dataset, created with the pool, dates everything before.
+ */
+static int
+comphist_era_setup(struct comphist_walk_ctx *ctx, const char *target)
+{
+	char pool[ZFS_MAX_DATASET_NAME_LEN];
+	struct comphist_anchors anchors = {0};
+	uint64_t txg;
+	spa_t *spa;
+	int err;
+
+	(void)strlcpy(pool, target, sizeof(pool));
+	pool[strcspn(pool, "/@#")] = '\0';
+
+	err = spa_open(pool, &spa, FTAG);
+	if (err != 0)
+		return (err);
+
+	txg = spa_last_synced_txg(spa);
+	ctx->era_shift = 0;
+	while ((txg >> ctx->era_shift) >= COMPHIST_ERAS)
+		ctx->era_shift++;
+
+	/* Traces carry the dates so a replay can report --eras. */
+	if (!ctx->opts->eras && ctx->opts->record_path == NULL) {
+		spa_close(spa, FTAG);
+		return (0);
+	}
+
+	err = comphist_anchor_add(&anchors, spa->spa_uberblock.ub_txg,
+	    spa->spa_uberblock.ub_timestamp);
+	spa_close(spa, FTAG);
+	if (err == 0) {
+		err = dmu_objset_find(pool, comphist_anchor_cb, &anchors,
+		    DS_FIND_CHILDREN | DS_FIND_SNAPSHOTS);
+	}
+	if (err != 0) {
+		free(anchors.a);
+		return (err);
+	}
+
+	qsort(anchors.a, anchors.count, sizeof(*anchors.a),
+	    comphist_anchor_compare);
+	for (int e = 0; e <= COMPHIST_ERAS; e++) {
+		uint64_t boundary = MIN((uint64_t)e << ctx->era_shift,
+		    anchors.a[anchors.count - 1].txg);
+
+		ctx->era_time[e] = comphist_anchor_time(anchors.a,
+		    anchors.count, boundary);
+	}
+	free(anchors.a);
+
+	return (0);
+}
+
+/*
+ * Map each top-level vdev to its allocation class for --vdevs.
+ */
+static int
+comphist_vdev_setup(struct comphist_walk_ctx *ctx, const char *target)
+{
+	char pool[ZFS_MAX_DATASET_NAME_LEN];
+	vdev_t *rvd;
+	spa_t *spa;
+	int err;
+
+	(void)strlcpy(pool, target, sizeof(pool));
+	pool[strcspn(pool, "/@#")] = '\0';
+
+	err = spa_open(pool, &spa, FTAG);
+	if (err != 0)
+		return (err);
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	rvd = spa->spa_root_vdev;
+	ctx->vdev_class = calloc(rvd->vdev_children + 1,
+	    sizeof(*ctx->vdev_class));
+	if (ctx->vdev_class == NULL) {
+		spa_config_exit(spa, SCL_VDEV, FTAG);
+		spa_close(spa, FTAG);
+		return (ENOMEM);
+	}
+	ctx->nvdevs = rvd->vdev_children;
+
+	for (uint64_t c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *vd = rvd->vdev_child[c];
+		metaslab_class_t *mc = vd->vdev_mg != NULL ?
+		    vd->vdev_mg->mg_class : NULL;
+
+		if (vd->vdev_ops == &vdev_indirect_ops)
+			ctx->vdev_class[c] = COMPHIST_AC_REMOVED;
+		else if (mc == spa_special_class(spa))
+			ctx->vdev_class[c] = COMPHIST_AC_SPECIAL;
+		else if (mc == spa_dedup_class(spa))
+			ctx->vdev_class[c] = COMPHIST_AC_DEDUP;
+		else if (vd->vdev_islog || mc == spa_log_class(spa))
+			ctx->vdev_class[c] = COMPHIST_AC_LOG;
+		else
+			ctx->vdev_class[c] = COMPHIST_AC_NORMAL;
+	}
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+	spa_close(spa, FTAG);
+
+	return (0);
+}
+
+static void
+comphist_set_error(struct comphist_walk_ctx *ctx, int err)
+{
+	mutex_enter(&ctx->lock);
+	if (ctx->error == 0)
+		ctx->error = err;
+	cv_broadcast(&ctx->cv);
+	mutex_exit(&ctx->lock);
+}
+
+/*
+ * Worker task for parallel walks.  Each worker claims the next dataset in
+ * enumeration order.  Aggregate walks accumulate into the worker's private
+ * stats; per-dataset walks fill the dataset's slot so the caller can emit
+ * results in enumeration order.
+ */
+static void
+comphist_worker_task(void *arg)
+{
+	struct comphist_worker *worker = arg;
+	struct comphist_walk_ctx *ctx = worker->ctx;
+
+	for (;;) {
+		struct comphist_stats *stats = &worker->stats;
+		size_t idx;
+		int err;
+
+		mutex_enter(&ctx->lock);
+		if (ctx->error != 0 || ctx->next >= ctx->list.count) {
+			mutex_exit(&ctx->lock);
+			return;
+		}
+		idx = ctx->next++;
+		mutex_exit(&ctx->lock);
+
+		if (ctx->cb != NULL) {
+			stats = malloc(sizeof(*stats));
+			if (stats == NULL) {
+				comphist_set_error(ctx, ENOMEM);
+				return;
+			}
+			comphist_stats_init(stats);
+		}
+
+		err = comphist_walk_dataset(ctx, idx, stats);
+
+		if (ctx->cb == NULL) {
+			if (err != 0)
+				comphist_set_error(ctx, err);
+			continue;
+		}
+
+		mutex_enter(&ctx->lock);
+		ctx->slots[idx].stats = stats;
+		ctx->slots[idx].error = err;
+		ctx->slots[idx].done = true;
+		cv_broadcast(&ctx->cv);
+		mutex_exit(&ctx->lock);
+	}
+}
+
+static int
+comphist_walk_serial(struct comphist_walk_ctx *ctx)
+{
+	struct comphist_stats stats;
+
+	for (size_t i = 0; i < ctx->list.count; i++) {
+		const char *dsname = ctx->list.names[i];
+		int err;
+
+		if (ctx->cb == NULL) {
+			err = comphist_walk_dataset(ctx, i, ctx->total);
+			if (err != 0)
+				return (err);
+			continue;
+		}
+
+		comphist_stats_init(&stats);
+		err = comphist_walk_dataset(ctx, i, &stats);
+		if (err == 0)
+			err = ctx->cb(dsname, &stats, ctx->arg);
+		if (err != 0)
+			return (err);
+	}
+
+	return (0);
+}
+
+static int
+comphist_walk_parallel(struct comphist_walk_ctx *ctx, int nworkers)
+{
+	struct comphist_worker *workers;
+	taskq_t *tq;
+	int err = 0;
+
+	ctx->next = 0;
+	ctx->error = 0;
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (workers == NULL)
+		return (ENOMEM);
+
+	if (ctx->cb != NULL) {
+		ctx->slots = calloc(ctx->list.count, sizeof(*ctx->slots));
+		if (ctx->slots == NULL) {
+			free(workers);
+			return (ENOMEM);
+		}
+	}
+
+	tq = taskq_create("z_comphist", nworkers, defclsyspri, nworkers,
+	    nworkers, TASKQ_PREPOPULATE);
+
+	for (int i = 0; i < nworkers; i++) {
+		workers[i].ctx = ctx;
+		comphist_stats_init(&workers[i].stats);
+		(void)taskq_dispatch(tq, comphist_worker_task, &workers[i],
+		    TQ_SLEEP);
+	}
+
+	/*
+	 * Per-dataset results are handed to the callback strictly in
+	 * enumeration order, so output does not depend on scheduling.
+	 */
+	if (ctx->cb != NULL) {
+		for (size_t i = 0; i < ctx->list.count; i++) {
+			struct comphist_slot *slot = &ctx->slots[i];
+
+			mutex_enter(&ctx->lock);
+			while (!slot->done && ctx->error == 0)
+				cv_wait(&ctx->cv, &ctx->lock);
+			mutex_exit(&ctx->lock);
+			if (!slot->done)
+				break;
+
+			err = slot->error;
+			if (err == 0)
+				err = ctx->cb(ctx->list.names[i], slot->stats,
+				    ctx->arg);
+			free(slot->stats);
+			slot->stats = NULL;
+			if (err != 0) {
+				comphist_set_error(ctx, err);
+				break;
+			}
+		}
+	}
+
+	taskq_wait(tq);
+	taskq_destroy(tq);
+
+	if (ctx->cb == NULL) {
+		for (int i = 0; i < nworkers; i++)
+			comphist_stats_merge(ctx->total, &workers[i].stats);
+	} else {
+		for (size_t i = 0; i < ctx->list.count; i++)
+			free(ctx->slots[i].stats);
+		free(ctx->slots);
+		ctx->slots = NULL;
+	}
+	free(workers);
+
+	if (err == 0)
+		err = ctx->error;
+	return (err);
+}
+
+static int
+comphist_walk_list(struct comphist_walk_ctx *ctx)
+{
+	int nworkers = ctx->opts->jobs;
+
+	if ((size_t)nworkers > ctx->list.count)
+		nworkers = (int)ctx->list.count;
+	if (nworkers > 1)
+		return (comphist_walk_parallel(ctx, nworkers));
+
+	return (comphist_walk_serial(ctx));
+}
+
+/*
+ * Aggregate walk counting every block address once.  The walk starts as a
+ * single pass; whenever the DVA set overflows its memory budget the results
+ * are discarded and the walk restarts with the address space split over
+ * twice as many passes.
+ */
+static int
+comphist_walk_unique(struct comphist_walk_ctx *ctx)
+{
+	struct comphist_stats *total = ctx->total;
+	struct comphist_stats *acc, *pass_stats;
+	uint64_t mem = ctx->opts->unique_mem != 0 ?
+	    ctx->opts->unique_mem : COMPHIST_UNIQUE_DEFAULT_MEM;
+	uint64_t npasses = 1;
+	int err = 0;
+
+	acc = malloc(sizeof(*acc));
+	pass_stats = malloc(sizeof(*pass_stats));
+	if (acc == NULL || pass_stats == NULL) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (;;) {
+		bool overflow = false;
+
+		/* Blocks offered by an attempt that overflowed are dropped. */
+		comphist_stats_init(acc);
+		if (ctx->sim != NULL)
+			comphist_sim_reset(ctx->sim);
+		for (uint64_t pass = 0; pass < npasses; pass++) {
+			ctx->unique.set = comphist_dvaset_create(mem);
+			if (ctx->unique.set == NULL) {
+				err = ENOMEM;
+				goto out;
+			}
+			ctx->unique.pass = pass;
+			ctx->unique.npasses = npasses;
 
-#include <sys/dmu.h>
-#include <sys/dmu_traverse.h>
-#include <sys/spa.h>
-#include <sys/zfs_context.h>
-#include <sys/zio.h>
+			comphist_stats_init(pass_stats);
+			ctx->total = pass_stats;
+			err = comphist_walk_list(ctx);
+			overflow = comphist_dvaset_overflowed(ctx->unique.set);
+			comphist_dvaset_destroy(ctx->unique.set);
+			ctx->unique.set = NULL;
 
-static const char *const comphist_tag = "zfs-comphist";
+			if (overflow)
+				break;
+			if (err != 0)
+				goto out;
 
-struct comphist_find_ctx {
-	const struct comphist_options *opts;
-	struct comphist_stats *stats;
-	int error;
-};
+			/* Every pass sees the same traversal errors. */
+			if (pass > 0)
+				pass_stats->traversal_errors = 0;
+			comphist_stats_merge(acc, pass_stats);
+		}
 
-struct comphist_iter_ctx {
-	const struct comphist_options *opts;
-	comphist_dataset_cb_t cb;
-	void *arg;
+		if (!overflow)
+			break;
+
+		err = 0;
+		npasses *= 2;
+		if (npasses > COMPHIST_UNIQUE_MAX_PASSES) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	comphist_stats_merge(total, acc);
+out:
+	ctx->total = total;
+	free(pass_stats);
+	free(acc);
+	return (err);
+}
+
+/*
+ * --single-pass state.  traverse_pool() visits the MOS and then each objset
+ * in turn, every block once, under the dataset or snapshot it was born in.
+ * Each objset's blocks arrive in one contiguous run, so the per-objset table
+ * only ever holds the entry being filled; it is handed to the per-dataset
+ * callback as soon as the next objset starts.
+ */
+struct comphist_pool_pass {
+	struct comphist_walk_ctx *ctx;
+	spa_t *spa;
+	struct comphist_trav trav;
+	struct comphist_stats *cur;
+	struct comphist_arc_snap arc;
+	hrtime_t start;
+	uint64_t cpu;
+	uint64_t objset;
+	bool active;
 	int error;
 };
 
-static int
-comphist_blkptr_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
-    const zbookmark_phys_t *zb, const struct dnode_phys *dnp, void *arg)
+static void
+comphist_objset_name(spa_t *spa, uint64_t objset, char *name, size_t len)
 {
-	struct comphist_stats *stats = arg;
+	dsl_pool_t *dp = spa_get_dsl(spa);
+	dsl_dataset_t *ds;
 
-	(void)spa;
-	(void)zilog;
-	(void)dnp;
+	if (objset == DMU_META_OBJSET) {
+		(void)snprintf(name, len, "%s/$MOS", spa_name(spa));
+		return;
+	}
 
-	if (zb->zb_level == ZB_DNODE_LEVEL)
-		return (0);
+	dsl_pool_config_enter(dp, FTAG);
+	if (dsl_dataset_hold_obj(dp, objset, FTAG, &ds) == 0) {
+		dsl_dataset_name(ds, name);
+		dsl_dataset_rele(ds, FTAG);
+	} else {
+		(void)snprintf(name, len, "%s/<objset %llu>", spa_name(spa),
+		    (u_longlong_t)objset);
+	}
+	dsl_pool_config_exit(dp, FTAG);
+}
 
-	if (BP_IS_HOLE(bp)) {
-		comphist_stats_note_hole(stats);
-		return (0);
+/*
+ * Emit the current objset's entry to the per-dataset callback and reset it.
+ */
+static int
+comphist_pool_flush(struct comphist_pool_pass *pass)
+{
+	struct comphist_walk_ctx *ctx = pass->ctx;
+	char name[ZFS_MAX_DATASET_NAME_LEN];
+	int err;
+
+	if (pass->trav.pipe != NULL) {
+		comphist_pipeline_finish(pass->trav.pipe, pass->cur);
+		pass->trav.pipe = NULL;
 	}
 
-	if (BP_IS_REDACTED(bp)) {
-		comphist_stats_note_redacted(stats);
-		return (0);
+	comphist_scan_end(&pass->arc, pass->start, pass->cur);
+	pass->cur->scan_cpu_ns += comphist_thread_cpu_ns() - pass->cpu;
+	pass->cur->era_shift = ctx->era_shift;
+	memcpy(pass->cur->era_time, ctx->era_time, sizeof(ctx->era_time));
+	comphist_objset_name(pass->spa, pass->objset, name, sizeof(name));
+	err = ctx->cb(name, pass->cur, ctx->arg);
+	comphist_stats_init(pass->cur);
+	comphist_scan_begin(&pass->arc, &pass->start);
+	pass->cpu = comphist_thread_cpu_ns();
+
+	return (err);
+}
+
+static int
+comphist_pool_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
+    const zbookmark_phys_t *zb, const struct dnode_phys *dnp, void *arg)
+{
+	struct comphist_pool_pass *pass = arg;
+
+	if (pass->ctx->cb != NULL && pass->active &&
+	    zb->zb_objset != pass->objset) {
+		pass->error = comphist_pool_flush(pass);
+		if (pass->error != 0)
+			return (SET_ERROR(EINTR));
 	}
+	pass->active = true;
+	pass->objset = zb->zb_objset;
 
-	comphist_stats_add_block(stats, BP_GET_COMPRESS(bp),
-	    BP_GET_LSIZE(bp), BP_GET_PSIZE(bp), BP_GET_ASIZE(bp),
-	    BP_IS_EMBEDDED(bp));
+	if (pass->trav.pipe == NULL && pass->ctx->opts->pipeline > 0) {
+		pass->trav.pipe = comphist_pipeline_create(
+		    pass->ctx->opts->pipeline);
+		if (pass->trav.pipe == NULL) {
+			pass->error = ENOMEM;
+			return (SET_ERROR(EINTR));
+		}
+	}
 
-	return (0);
+	return (comphist_blkptr_cb(spa, zilog, bp, zb, dnp, &pass->trav));
 }
 
+/*
+ * Walk a whole pool with one traverse_pool() call.  Shared metadata and
+ * blocks referenced by several snapshots are read and counted once, so the
+ * totals describe what the pool has allocated rather than the sum of what
+ * each dataset references.
+ */
 static int
-comphist_traverse_dataset(struct dsl_dataset *ds,
-    const struct comphist_options *opts, struct comphist_stats *stats)
+comphist_walk_pool(struct comphist_walk_ctx *ctx, const char *target)
 {
+	struct comphist_pool_pass pass = {
+		.ctx = ctx,
+		.trav = {
+			.ctx = ctx,
+			.obj_lo = 0,
+			.obj_hi = UINT64_MAX,
+		},
+	};
 	int flags = TRAVERSE_PRE | TRAVERSE_PREFETCH_METADATA |
 	    TRAVERSE_NO_DECRYPT;
-	zbookmark_phys_t resume = {0};
-	zbookmark_phys_t *resume_ptr = NULL;
+	int err;
 
-	if (opts->best_effort) {
+	if (ctx->opts->best_effort)
 		flags |= TRAVERSE_HARD;
-		resume_ptr = &resume;
-	}
 
-	for (;;) {
-		int err = traverse_dataset_resume(ds, 0, resume_ptr, flags,
-		    comphist_blkptr_cb, stats);
-		if (err == 0)
-			return (0);
-		if (!opts->best_effort)
-			return (err);
+	pass.cur = ctx->total;
+	if (ctx->cb != NULL) {
+		pass.cur = malloc(sizeof(*pass.cur));
+		if (pass.cur == NULL)
+			return (ENOMEM);
+		comphist_stats_init(pass.cur);
+	}
+	pass.trav.stats = pass.cur;
 
-		comphist_stats_note_traversal_error(stats);
-		if (err == EIO || err == ECKSUM || err == ENXIO) {
-			if (resume.zb_blkid == UINT64_MAX)
-				return (err);
-			resume.zb_blkid++;
-			continue;
-		}
+	err = spa_open(target, &pass.spa, FTAG);
+	if (err != 0) {
+		if (ctx->cb != NULL)
+			free(pass.cur);
 		return (err);
 	}
+
+	comphist_scan_begin(&pass.arc, &pass.start);
+	pass.cpu = comphist_thread_cpu_ns();
+	err = traverse_pool(pass.spa, 0, flags, comphist_pool_cb, &pass);
+	if (pass.error != 0) {
+		err = pass.error;
+	} else if (err != 0 && ctx->opts->best_effort) {
+		/* TRAVERSE_HARD carries on past damage and reports it last. */
+		comphist_stats_note_traversal_error(pass.cur);
+		err = 0;
+	}
+
+	comphist_trav_progress(&pass.trav);
+	if (ctx->cb != NULL) {
+		if (err == 0 && pass.active)
+			err = comphist_pool_flush(&pass);
+		else if (pass.trav.pipe != NULL)
+			comphist_pipeline_finish(pass.trav.pipe, pass.cur);
+		free(pass.cur);
+	} else {
+		if (pass.trav.pipe != NULL)
+			comphist_pipeline_finish(pass.trav.pipe, pass.cur);
+		comphist_scan_end(&pass.arc, pass.start, pass.cur);
+		pass.cur->scan_cpu_ns += comphist_thread_cpu_ns() - pass.cpu;
+		pass.cur->era_shift = ctx->era_shift;
+		memcpy(pass.cur->era_time, ctx->era_time,
+		    sizeof(ctx->era_time));
+	}
+
+	spa_close(pass.spa, FTAG);
+	return (err);
 }
 
+/*
+ * Read and recompress the blocks sampled during the walk.
+ */
 static int
-comphist_walk_dataset(const char *dsname, const struct comphist_options *opts,
-    struct comphist_stats *stats)
+comphist_simulate(struct comphist_walk_ctx *ctx, const char *target)
 {
-	objset_t *os = NULL;
+	char pool[ZFS_MAX_DATASET_NAME_LEN];
+	int nthreads = ctx->opts->jobs > 1 ? ctx->opts->jobs :
+	    (int)sysconf(_SC_NPROCESSORS_ONLN);
+	spa_t *spa;
 	int err;
 
-	err = dmu_objset_hold(dsname, comphist_tag, &os);
+	(void)strlcpy(pool, target, sizeof(pool));
+	pool[strcspn(pool, "/@#")] = '\0';
+
+	err = spa_open(pool, &spa, FTAG);
 	if (err != 0)
 		return (err);
 
-	err = comphist_traverse_dataset(dmu_objset_ds(os), opts, stats);
+	err = comphist_sim_run(ctx->sim, spa, nthreads, &ctx->total->sim);
+	spa_close(spa, FTAG);
 
-	dmu_objset_rele(os, comphist_tag);
 	return (err);
 }
 
+/*
+ * Resolve the dedup blocks visited against the pool's dedup table.
+ */
 static int
-comphist_find_cb(const char *dsname, void *arg)
+comphist_dedup(struct comphist_walk_ctx *ctx, const char *target)
 {
-	struct comphist_find_ctx *ctx = arg;
-	int err = comphist_walk_dataset(dsname, ctx->opts, ctx->stats);
+	char pool[ZFS_MAX_DATASET_NAME_LEN];
+	spa_t *spa;
+	int err;
 
-	if (err != 0) {
-		ctx->error = err;
+	(void)strlcpy(pool, target, sizeof(pool));
+	pool[strcspn(pool, "/@#")] = '\0';
+
+	err = spa_open(pool, &spa, FTAG);
+	if (err != 0)
 		return (err);
-	}
 
-	return (0);
+	err = comphist_dedup_resolve(ctx->dedup, spa, &ctx->total->dedup);
+	spa_close(spa, FTAG);
+
+	return (err);
 }
 
+/*
+ * Sort the --top list and look up the dataset and path of each entry.
+ * Objects in datasets that are not filesystems, or that were removed from
+ * a live dataset since they were visited, keep their numbers only.
+ */
 static int
-comphist_iter_cb(const char *dsname, void *arg)
+comphist_top_resolve(struct comphist_walk_ctx *ctx, const char *target)
 {
-	struct comphist_iter_ctx *ctx = arg;
-	struct comphist_stats stats;
+	char pool[ZFS_MAX_DATASET_NAME_LEN];
+	char *name, *path;
+	dsl_pool_t *dp;
+	spa_t *spa;
 	int err;
 
-	comphist_stats_init(&stats);
-	err = comphist_walk_dataset(dsname, ctx->opts, &stats);
-	if (err != 0) {
-		ctx->error = err;
+	comphist_top_sort(ctx->top);
+
+	(void)strlcpy(pool, target, sizeof(pool));
+	pool[strcspn(pool, "/@#")] = '\0';
+
+	err = spa_open(pool, &spa, FTAG);
+	if (err != 0)
 		return (err);
+
+	name = malloc(ZFS_MAX_DATASET_NAME_LEN);
+	path = malloc(MAXPATHLEN);
+	if (name == NULL || path == NULL) {
+		free(name);
+		free(path);
+		spa_close(spa, FTAG);
+		return (ENOMEM);
 	}
 
-	err = ctx->cb(dsname, &stats, ctx->arg);
-	if (err != 0) {
-		ctx->error = err;
-		return (err);
+	dp = spa_get_dsl(spa);
+	dsl_pool_config_enter(dp, FTAG);
+	for (size_t i = 0; i < ctx->top->count; i++) {
+		struct comphist_top_entry *e = &ctx->top->heap[i];
+		dsl_dataset_t *ds;
+		objset_t *os;
+
+		if (dsl_dataset_hold_obj(dp, e->objset, FTAG, &ds) != 0)
+			continue;
+		dsl_dataset_name(ds, name);
+		e->dataset = strdup(name);
+		if (dmu_objset_from_ds(ds, &os) == 0 &&
+		    dmu_objset_type(os) == DMU_OST_ZFS &&
+		    zfs_obj_to_path(os, e->object, path, MAXPATHLEN) == 0)
+			e->path = strdup(path);
+		dsl_dataset_rele(ds, FTAG);
 	}
+	dsl_pool_config_exit(dp, FTAG);
+
+	free(path);
+	free(name);
+	spa_close(spa, FTAG);
 
 	return (0);
 }
 
-static bool
-comphist_target_is_pool(const char *target)
+/*
+ * Bytes the walk is expected to cover, for the progress ETA: the datasets'
+ * referenced bytes, or everything the pool has allocated for --single-pass.
+ */
+static uint64_t
+comphist_expected_bytes(struct comphist_walk_ctx *ctx, const char *target)
 {
-	return (strpbrk(target, "/@#") == NULL);
+	uint64_t expected = 0;
+
+	/* A subtree's size is not known until it has been walked. */
+	if (ctx->opts->path != NULL)
+		return (0);
+
+	if (ctx->opts->single_pass) {
+		dsl_pool_t *dp;
+		spa_t *spa;
+
+		if (spa_open(target, &spa, FTAG) != 0)
+			return (0);
+		dp = spa_get_dsl(spa);
+		dsl_pool_config_enter(dp, FTAG);
+		expected = dsl_dir_phys(dp->dp_root_dir)->dd_used_bytes;
+		dsl_pool_config_exit(dp, FTAG);
+		spa_close(spa, FTAG);
+		return (expected);
+	}
+
+	for (size_t i = 0; i < ctx->list.count; i++) {
+		objset_t *os;
+
+		if (dmu_objset_hold(ctx->list.names[i], FTAG, &os) != 0)
+			continue;
+		expected += dsl_dataset_phys(dmu_objset_ds(os))->
+		    ds_referenced_bytes;
+		dmu_objset_rele(os, FTAG);
+	}
+
+	return (expected);
 }
 
-int
-comphist_walk(const char *target, const struct comphist_options *opts,
-    struct comphist_stats *stats)
+/*
+ * Accounting choices that change what a cached snapshot result contains.
+ */
+static uint64_t
+comphist_cache_features(const struct comphist_walk_ctx *ctx)
 {
-	struct comphist_find_ctx ctx = {
+	uint64_t features = 0;
+
+	if (ctx->opts->eras)
+		features |= COMPHIST_CACHE_F_ERAS | ctx->era_shift;
+	if (ctx->opts->vdevs)
+		features |= COMPHIST_CACHE_F_VDEVS;
+	if (ctx->opts->zstd_levels)
+		features |= COMPHIST_CACHE_F_ZSTD;
+	features |= (uint64_t)ctx->opts->entropy << COMPHIST_CACHE_ENTROPY_SHIFT;
+
+	return (features);
+}
+
+static int
+comphist_walk_impl(const char *target, const struct comphist_options *opts,
+    struct comphist_stats *total, comphist_dataset_cb_t cb, void *arg)
+{
+	struct comphist_walk_ctx ctx = {
 		.opts = opts,
-		.stats = stats,
-		.error = 0,
+		.total = total,
+		.cb = cb,
+		.arg = arg,
 	};
-	bool kernel_ready = false;
-	int err = 0;
+	int err;
+
+	/* A replay reads everything it needs from the trace. */
+	if (opts->replay_path != NULL) {
+		err = comphist_trace_replay(opts->replay_path, total, cb, arg);
+		if (err != 0) {
+			errno = err;
+			return (-1);
+		}
+		return (0);
+	}
 
-	kernel_init(SPA_MODE_READ);
-	kernel_ready = true;
+	/* Like --simulate, --top describes the whole walk. */
+	if (cb == NULL)
+		ctx.top = opts->top;
+	ctx.sample_seed = (uint64_t)gethrtime();
+	mutex_init(&ctx.lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&ctx.cv, NULL, CV_DEFAULT, NULL);
 
-	if (comphist_target_is_pool(target)) {
-		err = dmu_objset_find(target, comphist_find_cb, &ctx,
-		    DS_FIND_CHILDREN);
-		if (err == 0)
-			err = ctx.error;
-	} else if (opts->recursive) {
-		if (strpbrk(target, "@#") != NULL) {
+	err = comphist_enumerate(target, opts, &ctx.list);
+	if (err == 0)
+		err = comphist_era_setup(&ctx, target);
+	if (err == 0 && opts->vdevs)
+		err = comphist_vdev_setup(&ctx, target);
+	if (err == 0 && opts->simulate != NULL && cb == NULL) {
+		ctx.sim = comphist_sim_create(opts->simulate,
+		    opts->sim_samples != 0 ? opts->sim_samples :
+		    COMPHIST_SIM_DEFAULT_SAMPLES, (uint64_t)gethrtime());
+		if (ctx.sim == NULL)
 			err = EINVAL;
-		} else {
-			err = dmu_objset_find(target, comphist_find_cb, &ctx,
-			    DS_FIND_CHILDREN);
-			if (err == 0)
-				err = ctx.error;
+	}
+	if (err == 0 && opts->dedup && cb == NULL) {
+		ctx.dedup = comphist_dedup_set_create();
+		if (ctx.dedup == NULL)
+			err = ENOMEM;
+	}
+	if (err == 0 && opts->cache_path != NULL) {
+		err = comphist_cache_open(opts->cache_path,
+		    comphist_cache_features(&ctx), &ctx.cache);
+	}
+	if (err == 0 && opts->record_path != NULL) {
+		err = comphist_trace_create(opts->record_path, target,
+		    ctx.list.names, ctx.list.count, ctx.era_shift, ctx.era_time,
+		    &ctx.trace);
+	}
+	if (err == 0 && opts->checkpoint_path != NULL) {
+		struct comphist_ckpt_id id = {
+			.target = target,
+			.features = comphist_cache_features(&ctx),
+			.sample = opts->sample,
+			.per_dataset = cb != NULL,
+		};
+
+		err = comphist_ckpt_open(opts->checkpoint_path,
+		    opts->resume_path, &id, &ctx.ckpt);
+		if (err == 0) {
+			/* Object-level checkpoints need a single traversal. */
+			ctx.ckpt_objects = opts->jobs <= 1 &&
+			    opts->shards <= 1 && opts->pipeline == 0 &&
+			    opts->entropy == 0 && !opts->zstd_levels &&
+			    opts->sample == 0.0;
+			ctx.sample_seed = comphist_ckpt_seed(ctx.ckpt,
+			    ctx.sample_seed);
+			if (cb == NULL)
+				comphist_ckpt_restore_total(ctx.ckpt, total);
 		}
-	} else {
-		err = comphist_walk_dataset(target, opts, stats);
 	}
+	if (err == 0) {
+		err = comphist_progress_start(opts->progress,
+		    opts->single_pass ? 0 : ctx.list.count,
+		    comphist_expected_bytes(&ctx, target));
+		ctx.progress = err == 0;
+		if (err == EBUSY)
+			err = 0;
+	}
+	if (err == 0) {
+		struct comphist_scan_wall wall;
+
+		if (cb == NULL)
+			comphist_wall_begin(&wall, total);
+		if (opts->single_pass)
+			err = comphist_walk_pool(&ctx, target);
+		else if (opts->unique && cb == NULL)
+			err = comphist_walk_unique(&ctx);
+		else
+			err = comphist_walk_list(&ctx);
+		if (cb == NULL)
+			comphist_wall_end(&wall, total);
+	}
+	if (err == 0 && ctx.sim != NULL)
+		err = comphist_simulate(&ctx, target);
+	if (err == 0 && ctx.dedup != NULL)
+		err = comphist_dedup(&ctx, target);
+	comphist_dedup_set_destroy(ctx.dedup);
+	if (err == 0 && ctx.top != NULL)
+		err = comphist_top_resolve(&ctx, target);
+	if (ctx.sim != NULL)
+		comphist_sim_destroy(ctx.sim);
+	if (ctx.progress)
+		comphist_progress_stop();
+
+	comphist_dslist_free(&ctx.list);
+	free(ctx.vdev_class);
+	cv_destroy(&ctx.cv);
+	mutex_destroy(&ctx.lock);
+
+	if (ctx.cache != NULL) {
+		int cerr = comphist_cache_close(ctx.cache);
+
+		if (err == 0)
+			err = cerr;
+	}
+	if (ctx.ckpt != NULL) {
+		int cerr = comphist_ckpt_close(ctx.ckpt, err == 0);
+
+		if (err == 0)
+			err = cerr;
+	}
+	if (ctx.trace != NULL) {
+		int terr = comphist_trace_close(ctx.trace, err == 0);
+
+		if (err == 0)
+			err = terr;
+	}
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Sessions.
+ *
+ * libzpool's kernel_init() and the pool imports behind the first
+ * spa_open() are process-wide, so sessions share them: the first session
+ * opened initializes libzpool and the last one closed tears it down.  Pools
+ * stay imported between walks, which is what makes repeated queries cheap.
+ * A read-only import does not follow later writes to the pool, so
+ * comphist_session_refresh() drops the imports and the next walk loads
+ * each pool again from its current uberblock.
+ *
+ * Walks take comphist_pools as readers and may run concurrently, on one
+ * session or several; refreshing takes it as a writer.
+ */
+struct comphist_session {
+	bool open;
+};
+
+static pthread_mutex_t comphist_kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int comphist_kernel_refs;
+static pthread_rwlock_t comphist_pools = PTHREAD_RWLOCK_INITIALIZER;
+
+int
+comphist_session_open(struct comphist_session **sessp)
+{
+	struct comphist_session *sess = malloc(sizeof(*sess));
+
+	if (sess == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	sess->open = true;
+
+	(void)pthread_mutex_lock(&comphist_kernel_lock);
+	if (comphist_kernel_refs++ == 0)
+		kernel_init(SPA_MODE_READ);
+	(void)pthread_mutex_unlock(&comphist_kernel_lock);
+
+	*sessp = sess;
+	return (0);
+}
+
+void
+comphist_session_close(struct comphist_session *sess)
+{
+	if (sess == NULL)
+		return;
+	sess->open = false;
 
-	if (kernel_ready)
+	(void)pthread_mutex_lock(&comphist_kernel_lock);
+	if (--comphist_kernel_refs == 0)
 		kernel_fini();
+	(void)pthread_mutex_unlock(&comphist_kernel_lock);
+
+	free(sess);
+}
+
+int
+comphist_session_refresh(struct comphist_session *sess)
+{
+	(void)sess;
+
+	(void)pthread_rwlock_wrlock(&comphist_pools);
+	spa_evict_all();
+	(void)pthread_rwlock_unlock(&comphist_pools);
+
+	return (0);
+}
+
+/*
+ * The root block pointer of a dataset is rewritten in every txg that
+ * changes it, so its birth txg identifies the dataset's contents.
+ */
+int
+comphist_session_dataset_info(struct comphist_session *sess,
+    const char *dsname, struct comphist_dataset_info *info)
+{
+	dsl_dataset_t *ds;
+	objset_t *os;
+	int err;
+
+	if (sess == NULL || !sess->open) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	(void)pthread_rwlock_rdlock(&comphist_pools);
+	err = dmu_objset_hold(dsname, FTAG, &os);
+	if (err == 0) {
+		ds = dmu_objset_ds(os);
+		info->guid = dsl_dataset_phys(ds)->ds_guid;
+		info->txg = BP_GET_LOGICAL_BIRTH(&dsl_dataset_phys(ds)->ds_bp);
+		info->snapshot = ds->ds_is_snapshot;
+		dmu_objset_rele(os, FTAG);
+	}
+	(void)pthread_rwlock_unlock(&comphist_pools);
 
 	if (err != 0) {
 		errno = err;
 		return (-1);
 	}
+	return (0);
+}
+
+int
+comphist_session_walk(struct comphist_session *sess, const char *target,
+    const struct comphist_options *opts, struct comphist_stats *stats)
+{
+	int err;
+
+	if (sess == NULL || !sess->open) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	(void)pthread_rwlock_rdlock(&comphist_pools);
+	err = comphist_walk_impl(target, opts, stats, NULL, NULL) != 0 ?
+	    errno : 0;
+	(void)pthread_rwlock_unlock(&comphist_pools);
 
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
 	return (0);
 }
 
+/*
+ * Results are streamed: cb is called once per dataset, in enumeration
+ * order, as soon as the dataset and every dataset before it are done.
+ * With -j it runs on the calling thread, never concurrently with itself.
+ */
 int
-comphist_walk_datasets(const char *target, const struct comphist_options *opts,
+comphist_session_walk_datasets(struct comphist_session *sess,
+    const char *target, const struct comphist_options *opts,
     comphist_dataset_cb_t cb, void *arg)
 {
-	struct comphist_iter_ctx ctx = {
-		.opts = opts,
-		.cb = cb,
-		.arg = arg,
-		.error = 0,
-	};
-	struct comphist_stats stats;
-	bool kernel_ready = false;
-	int err = 0;
+	int err;
 
-	if (cb == NULL) {
+	if (sess == NULL || !sess->open || cb == NULL) {
 		errno = EINVAL;
 		return (-1);
 	}
 
-	kernel_init(SPA_MODE_READ);
-	kernel_ready = true;
+	(void)pthread_rwlock_rdlock(&comphist_pools);
+	err = comphist_walk_impl(target, opts, NULL, cb, arg) != 0 ?
+	    errno : 0;
+	(void)pthread_rwlock_unlock(&comphist_pools);
 
-	if (comphist_target_is_pool(target)) {
-		err = dmu_objset_find(target, comphist_iter_cb, &ctx,
-		    DS_FIND_CHILDREN);
-		if (err == 0)
-			err = ctx.error;
-	} else if (opts->recursive) {
-		if (strpbrk(target, "@#") != NULL) {
-			err = EINVAL;
-		} else {
-			err = dmu_objset_find(target, comphist_iter_cb, &ctx,
-			    DS_FIND_CHILDREN);
-			if (err == 0)
-				err = ctx.error;
-		}
-	} else {
-		comphist_stats_init(&stats);
-		err = comphist_walk_dataset(target, opts, &stats);
-		if (err == 0)
-			err = cb(target, &stats, arg);
+	if (err != 0) {
+		errno = err;
+		return (-1);
 	}
+	return (0);
+}
 
-	if (kernel_ready)
-		kernel_fini();
+/*
+ * One-shot walks in a session of their own.
+ */
+int
+comphist_walk(const char *target, const struct comphist_options *opts,
+    struct comphist_stats *stats)
+{
+	struct comphist_session *sess;
+	int err;
+
+	if (comphist_session_open(&sess) != 0)
+		return (-1);
+	err = comphist_session_walk(sess, target, opts, stats) != 0 ? errno : 0;
+	comphist_session_close(sess);
 
 	if (err != 0) {
 		errno = err;
 		return (-1);
 	}
+	return (0);
+}
+
+int
+comphist_walk_datasets(const char *target, const struct comphist_options *opts,
+    comphist_dataset_cb_t cb, void *arg)
+{
+	struct comphist_session *sess;
+	int err;
+
+	if (comphist_session_open(&sess) != 0)
+		return (-1);
+	err = comphist_session_walk_datasets(sess, target, opts, cb, arg) != 0 ?
+	    errno : 0;
+	comphist_session_close(sess);
 
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
 	return (0);
 }
@@ -0,0 +1,32 @@
+#ifndef COMPHIST_TEST_H
+#define COMPHIST_TEST_H
+
+#include <stdio.h>
+
+/*
+ * Minimal harness for the unit tests.  Each test program is one
+ * translation unit: CHECK() reports a failed expression with its location
+ * and carries on, and TEST_EXIT() prints a summary and turns any failure
+ * into a non-zero exit status for `make check`.
+ */
+static int test_checks;
+static int test_failures;
+
+#define CHECK(cond)							\
+	do {								\
+		test_checks++;						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n",	\
+			    __FILE__, __LINE__, #cond);			\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+#define TEST_EXIT(name)							\
+	do {								\
+		printf("%s: %d checks, %d failed\n", (name),		\
+		    test_checks, test_failures);			\
+		return (test_failures == 0 ? 0 : 1);			\
+	} while (0)
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * --cache tests: results survive a round trip in a few hundred bytes each
+ * and new ones are added to those already cached; a cache whose record
+ * count disagrees with its size, or that was written with other accounting
+ * features, is ignored and rewritten, and a record that does not unpack is
+ * a miss and dropped.
+ */
+
+#include "cache.h"
+#include "test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define RECORDS		100
+
+/* Offsets of the record count and of the first record in the file. */
+#define CACHE_COUNT_OFF		24
+#define CACHE_RECORDS_OFF	40
+
+static void
+fill_stats(struct comphist_stats *stats, uint64_t seed)
+{
+	comphist_stats_init(stats);
+	for (uint64_t i = 0; i < 1 + seed % 7; i++) {
+		comphist_stats_add_block(stats, ZIO_COMPRESS_LZ4, 131072,
+		    512 * (1 + (seed + i) % 256), 4096 * (1 + i), false);
+	}
+	comphist_stats_add_block(stats, ZIO_COMPRESS_OFF, 512 * seed,
+	    512 * seed, 512 * seed, false);
+	if (seed % 3 == 0)
+		comphist_stats_note_hole(stats);
+}
+
+static off_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	return (stat(path, &st) == 0 ? st.st_size : -1);
+}
+
+static void
+patch_count(const char *path, off_t off, uint64_t count)
+{
+	int fd = open(path, O_WRONLY);
+
+	CHECK(fd >= 0);
+	if (fd < 0)
+		return;
+	CHECK(pwrite(fd, &count, sizeof(count), off) ==
+	    (ssize_t)sizeof(count));
+	(void)close(fd);
+}
+
+static void
+insert_range(const char *path, uint64_t first, uint64_t last)
+{
+	struct comphist_cache *cache = NULL;
+	struct comphist_stats *stats = comphist_stats_alloc();
+
+	CHECK(stats != NULL);
+	CHECK(comphist_cache_open(path, 1, &cache) == 0);
+	if (cache == NULL || stats == NULL) {
+		comphist_stats_free(stats);
+		return;
+	}
+	for (uint64_t g = first; g <= last; g++) {
+		fill_stats(stats, g);
+		CHECK(comphist_cache_insert(cache, g * 0x9e3779b97f4a7c15ULL,
+		    g, stats) == 0);
+	}
+	CHECK(comphist_cache_close(cache) == 0);
+	comphist_stats_free(stats);
+}
+
+/*
+ * Count the records of RECORDS that a cache opened from path still has.
+ */
+static int
+cache_hits(const char *path, uint64_t features)
+{
+	struct comphist_cache *cache = NULL;
+	struct comphist_stats *got = comphist_stats_alloc();
+	struct comphist_stats *expect = comphist_stats_alloc();
+	int hits = 0;
+
+	CHECK(got != NULL && expect != NULL);
+	CHECK(comphist_cache_open(path, features, &cache) == 0);
+	if (cache == NULL || got == NULL || expect == NULL)
+		goto out;
+
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		if (!comphist_cache_lookup(cache, g * 0x9e3779b97f4a7c15ULL,
+		    g, got))
+			continue;
+		fill_stats(expect, g);
+		CHECK(memcmp(got, expect, sizeof(*got)) == 0);
+		hits++;
+	}
+	CHECK(comphist_cache_close(cache) == 0);
+
+out:
+	comphist_stats_free(got);
+	comphist_stats_free(expect);
+	return (hits);
+}
+
+static void
+test_cache(const char *path)
+{
+	struct comphist_cache *cache = NULL;
+	struct comphist_stats *stats = comphist_stats_alloc();
+	uint8_t junk[16];
+	off_t size, corrupt;
+	int fd;
+
+	CHECK(stats != NULL);
+	if (stats == NULL)
+		return;
+
+	memset(junk, 0xff, sizeof(junk));
+
+	/* A missing cache is empty. */
+	(void)unlink(path);
+	CHECK(comphist_cache_open(path, 1, &cache) == 0);
+	if (cache == NULL)
+		goto out;
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		fill_stats(stats, g);
+		/* Run-specific counters are not cached. */
+		stats->scan_ns = 12345;
+		stats->pipeline_batches = 6;
+		CHECK(comphist_cache_insert(cache, g * 0x9e3779b97f4a7c15ULL,
+		    g, stats) == 0);
+	}
+	CHECK(!comphist_cache_lookup(cache, 0x9e3779b97f4a7c15ULL, 2, stats));
+	CHECK(comphist_cache_close(cache) == 0);
+
+	size = file_size(path);
+	CHECK(size > 0);
+	CHECK((size_t)size < RECORDS * 512);
+	CHECK(cache_hits(path, 1) == RECORDS);
+	/* Nothing changed, so nothing was rewritten. */
+	CHECK(file_size(path) == size);
+
+	/* Records added later are kept along with the loaded ones. */
+	insert_range(path, RECORDS + 1, RECORDS + 1);
+	CHECK(file_size(path) > size);
+	CHECK(cache_hits(path, 1) == RECORDS);
+	cache = NULL;
+	CHECK(comphist_cache_open(path, 1, &cache) == 0);
+	if (cache == NULL)
+		goto out;
+	CHECK(comphist_cache_lookup(cache,
+	    (RECORDS + 1) * 0x9e3779b97f4a7c15ULL, RECORDS + 1, stats));
+	CHECK(comphist_cache_close(cache) == 0);
+
+	/* A corrupt record is a miss and is dropped on the next save. */
+	fd = open(path, O_WRONLY);
+	CHECK(fd >= 0);
+	if (fd >= 0) {
+		CHECK(pwrite(fd, junk, sizeof(junk), CACHE_RECORDS_OFF) ==
+		    (ssize_t)sizeof(junk));
+		(void)close(fd);
+	}
+	CHECK(cache_hits(path, 1) == RECORDS - 1);
+	corrupt = file_size(path);
+	CHECK(cache_hits(path, 1) == RECORDS - 1);
+	CHECK(file_size(path) == corrupt);
+
+	/* A cache of other accounting features is ignored and replaced. */
+	CHECK(cache_hits(path, 2) == 0);
+	CHECK(file_size(path) < size);
+	CHECK(cache_hits(path, 1) == 0);
+
+	/* A count past the end of the file. */
+	cache = NULL;
+	CHECK(comphist_cache_open(path, 1, &cache) == 0);
+	if (cache == NULL)
+		goto out;
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		fill_stats(stats, g);
+		(void)comphist_cache_insert(cache, g * 0x9e3779b97f4a7c15ULL,
+		    g, stats);
+	}
+	CHECK(comphist_cache_close(cache) == 0);
+	CHECK(file_size(path) == size);
+	patch_count(path, CACHE_COUNT_OFF, UINT64_MAX / 2);
+	CHECK(cache_hits(path, 1) == 0);
+
+	/* A count short of the records in the file. */
+	cache = NULL;
+	CHECK(comphist_cache_open(path, 1, &cache) == 0);
+	if (cache == NULL)
+		goto out;
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		fill_stats(stats, g);
+		(void)comphist_cache_insert(cache, g * 0x9e3779b97f4a7c15ULL,
+		    g, stats);
+	}
+	CHECK(comphist_cache_close(cache) == 0);
+	patch_count(path, CACHE_COUNT_OFF, RECORDS - 1);
+	CHECK(cache_hits(path, 1) == 0);
+
+	/* A truncated file. */
+	cache = NULL;
+	CHECK(comphist_cache_open(path, 1, &cache) == 0);
+	if (cache == NULL)
+		goto out;
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		fill_stats(stats, g);
+		(void)comphist_cache_insert(cache, g * 0x9e3779b97f4a7c15ULL,
+		    g, stats);
+	}
+	CHECK(comphist_cache_close(cache) == 0);
+	CHECK(truncate(path, size - 100) == 0);
+	CHECK(cache_hits(path, 1) == 0);
+	CHECK(file_size(path) < size - 100);
+
+out:
+	(void)unlink(path);
+	comphist_stats_free(stats);
+}
+
+int
+main(void)
+{
+	char path[] = "/tmp/comphist-test-XXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if (fd >= 0) {
+		(void)close(fd);
+		test_cache(path);
+		(void)unlink(path);
+	}
+
+	TEST_EXIT("test-cache");
+}
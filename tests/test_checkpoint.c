@@ -0,0 +1,257 @@
+/*
+ * --checkpoint and --resume tests: finished and partial datasets survive a
+ * round trip in packed records, and a checkpoint that is truncated, has a
+ * record count that disagrees with its size, has a record that does not
+ * unpack or belongs to another scan refuses to resume and is left alone.
+ */
+
+#include "checkpoint.h"
+#include "test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define RECORDS		100
+
+/* Offset of the record count in the checkpoint header. */
+#define CKPT_COUNT_OFF	40
+
+static void
+fill_stats(struct comphist_stats *stats, uint64_t seed)
+{
+	comphist_stats_init(stats);
+	for (uint64_t i = 0; i < 1 + seed % 7; i++) {
+		comphist_stats_add_block(stats, ZIO_COMPRESS_LZ4, 131072,
+		    512 * (1 + (seed + i) % 256), 4096 * (1 + i), false);
+	}
+	comphist_stats_add_block(stats, ZIO_COMPRESS_OFF, 512 * seed,
+	    512 * seed, 512 * seed, false);
+	if (seed % 3 == 0)
+		comphist_stats_note_hole(stats);
+}
+
+static off_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	return (stat(path, &st) == 0 ? st.st_size : -1);
+}
+
+static void
+patch_count(const char *path, off_t off, uint64_t count)
+{
+	int fd = open(path, O_WRONLY);
+
+	CHECK(fd >= 0);
+	if (fd < 0)
+		return;
+	CHECK(pwrite(fd, &count, sizeof(count), off) ==
+	    (ssize_t)sizeof(count));
+	(void)close(fd);
+}
+
+static void
+append_bytes(const char *path, size_t len)
+{
+	static const char zeros[64];
+	FILE *fp = fopen(path, "ab");
+
+	CHECK(fp != NULL && len <= sizeof(zeros));
+	if (fp == NULL)
+		return;
+	CHECK(fwrite(zeros, 1, len, fp) == len);
+	(void)fclose(fp);
+}
+
+/*
+ * Write a checkpoint of RECORDS finished datasets, leaving it on disk as
+ * an interrupted scan would.
+ */
+static void
+write_ckpt(const char *path, const struct comphist_ckpt_id *id)
+{
+	struct comphist_ckpt *ckpt = NULL;
+	struct comphist_stats *stats = comphist_stats_alloc();
+
+	CHECK(stats != NULL);
+	CHECK(comphist_ckpt_open(path, NULL, id, &ckpt) == 0);
+	if (ckpt == NULL || stats == NULL) {
+		comphist_stats_free(stats);
+		return;
+	}
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		fill_stats(stats, g);
+		CHECK(comphist_ckpt_done(ckpt, g, stats) == 0);
+	}
+	fill_stats(stats, RECORDS + 1);
+	CHECK(comphist_ckpt_progress(ckpt, RECORDS + 1, 777, stats) == 0);
+	CHECK(comphist_ckpt_close(ckpt, false) == 0);
+	comphist_stats_free(stats);
+}
+
+static void
+test_ckpt_resume(const char *path, bool per_dataset)
+{
+	struct comphist_ckpt_id id = {
+		.target = "tank/home",
+		.features = 5,
+		.sample = 0.25,
+		.per_dataset = per_dataset,
+	};
+	struct comphist_ckpt *ckpt = NULL;
+	struct comphist_stats *got = comphist_stats_alloc();
+	struct comphist_stats *expect = comphist_stats_alloc();
+	struct comphist_stats *total = comphist_stats_alloc();
+	uint64_t next = 0;
+
+	CHECK(got != NULL && expect != NULL && total != NULL);
+	if (got == NULL || expect == NULL || total == NULL)
+		goto out;
+
+	write_ckpt(path, &id);
+	CHECK(comphist_ckpt_open(path, path, &id, &ckpt) == 0);
+	if (ckpt == NULL)
+		goto out;
+
+	for (uint64_t g = 1; g <= RECORDS; g++) {
+		comphist_stats_init(got);
+		CHECK(comphist_ckpt_lookup(ckpt, g, got));
+		fill_stats(expect, g);
+		if (per_dataset)
+			CHECK(memcmp(got, expect, sizeof(*got)) == 0);
+		else
+			comphist_stats_merge(total, expect);
+	}
+	CHECK(!comphist_ckpt_lookup(ckpt, RECORDS + 1, got));
+
+	/* The aggregate total comes back as one merged record. */
+	comphist_stats_init(got);
+	comphist_ckpt_restore_total(ckpt, got);
+	if (!per_dataset)
+		CHECK(memcmp(got, total, sizeof(*got)) == 0);
+	else
+		CHECK(got->total_blocks == 0);
+
+	CHECK(comphist_ckpt_partial(ckpt, RECORDS + 1, &next, got));
+	fill_stats(expect, RECORDS + 1);
+	CHECK(next == 777 && memcmp(got, expect, sizeof(*got)) == 0);
+	CHECK(!comphist_ckpt_partial(ckpt, RECORDS, &next, got));
+
+	/* Finishing the scan removes the checkpoint. */
+	CHECK(comphist_ckpt_close(ckpt, true) == 0);
+	CHECK(access(path, F_OK) != 0 && errno == ENOENT);
+
+out:
+	comphist_stats_free(got);
+	comphist_stats_free(expect);
+	comphist_stats_free(total);
+}
+
+static void
+check_refused(const char *path, const struct comphist_ckpt_id *id)
+{
+	struct comphist_ckpt *ckpt = NULL;
+	off_t size = file_size(path);
+
+	CHECK(comphist_ckpt_open(path, path, id, &ckpt) == EINVAL);
+	CHECK(ckpt == NULL);
+	/* The checkpoint is left as it was for another attempt. */
+	CHECK(file_size(path) == size);
+}
+
+static void
+test_ckpt_invalid(const char *path, bool per_dataset)
+{
+	struct comphist_ckpt_id id = {
+		.target = "tank/home",
+		.features = 5,
+		.per_dataset = per_dataset,
+	};
+	struct comphist_ckpt_id other = id;
+	struct comphist_ckpt *ckpt = NULL;
+	off_t size;
+
+	/* A missing checkpoint cannot be resumed. */
+	(void)unlink(path);
+	CHECK(comphist_ckpt_open(path, path, &id, &ckpt) == ENOENT);
+
+	write_ckpt(path, &id);
+	size = file_size(path);
+	CHECK(size > 0);
+	/* Records are packed, not whole stats structs. */
+	CHECK((size_t)size < RECORDS * 512);
+
+	/* Another scan's checkpoint. */
+	other.target = "tank/other";
+	check_refused(path, &other);
+	other = id;
+	other.features = 4;
+	check_refused(path, &other);
+	other = id;
+	other.per_dataset = !per_dataset;
+	check_refused(path, &other);
+
+	/* Truncated mid-record and by whole words. */
+	CHECK(truncate(path, size - 1) == 0);
+	check_refused(path, &id);
+	CHECK(truncate(path, size - 2 * (off_t)sizeof(uint64_t)) == 0);
+	check_refused(path, &id);
+
+	/* A record that does not unpack: its last bytes run on. */
+	if (per_dataset) {
+		write_ckpt(path, &id);
+		patch_count(path, size - (off_t)sizeof(uint64_t), UINT64_MAX);
+		check_refused(path, &id);
+	}
+
+	/* Trailing garbage. */
+	write_ckpt(path, &id);
+	append_bytes(path, sizeof(uint64_t));
+	check_refused(path, &id);
+
+	/* Counts that disagree with the file size. */
+	write_ckpt(path, &id);
+	patch_count(path, CKPT_COUNT_OFF, UINT64_MAX / 2);
+	check_refused(path, &id);
+	patch_count(path, CKPT_COUNT_OFF, RECORDS + 1);
+	check_refused(path, &id);
+
+	/* Restoring the count makes it usable again. */
+	patch_count(path, CKPT_COUNT_OFF, RECORDS);
+	CHECK(comphist_ckpt_open(path, path, &id, &ckpt) == 0);
+	if (ckpt != NULL) {
+		struct comphist_stats *stats = comphist_stats_alloc();
+
+		CHECK(stats != NULL && comphist_ckpt_lookup(ckpt, RECORDS,
+		    stats));
+		comphist_stats_free(stats);
+		CHECK(comphist_ckpt_close(ckpt, true) == 0);
+	}
+	(void)unlink(path);
+}
+
+int
+main(void)
+{
+	char path[] = "/tmp/comphist-test-XXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if (fd >= 0) {
+		(void)close(fd);
+		test_ckpt_resume(path, false);
+		test_ckpt_resume(path, true);
+		test_ckpt_invalid(path, false);
+		test_ckpt_invalid(path, true);
+		(void)unlink(path);
+	}
+
+	TEST_EXIT("test-checkpoint");
+}
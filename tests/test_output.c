@@ -0,0 +1,170 @@
+/*
+ * Buffered writer tests: JSON and CSV escaping, output larger than the
+ * buffer, and write errors surfacing from comphist_out_close().
+ */
+
+#include "output.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Run fn against a writer on a temporary file and return what it wrote.
+ */
+static char *
+capture(void (*fn)(struct comphist_out *, const void *), const void *arg,
+    size_t *lenp)
+{
+	char path[] = "/tmp/comphist-test-XXXXXX";
+	struct comphist_out *out;
+	char *buf = NULL;
+	off_t len;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return (NULL);
+	(void)unlink(path);
+
+	out = comphist_out_open(fd);
+	if (out == NULL)
+		goto out;
+	fn(out, arg);
+	if (comphist_out_close(out) != 0)
+		goto out;
+
+	len = lseek(fd, 0, SEEK_END);
+	buf = malloc((size_t)len + 1);
+	if (buf == NULL || pread(fd, buf, (size_t)len, 0) != len) {
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	buf[len] = '\0';
+	if (lenp != NULL)
+		*lenp = (size_t)len;
+
+out:
+	(void)close(fd);
+	return (buf);
+}
+
+static void
+write_json(struct comphist_out *out, const void *arg)
+{
+	comphist_out_json_string(out, arg);
+}
+
+static void
+write_csv(struct comphist_out *out, const void *arg)
+{
+	comphist_out_csv_field(out, arg);
+}
+
+static void
+check_json(const char *in, const char *expect)
+{
+	char *got = capture(write_json, in, NULL);
+
+	CHECK(got != NULL && strcmp(got, expect) == 0);
+	if (got != NULL && strcmp(got, expect) != 0)
+		fprintf(stderr, "  json: got %s, expected %s\n", got, expect);
+	free(got);
+}
+
+static void
+check_csv(const char *in, const char *expect)
+{
+	char *got = capture(write_csv, in, NULL);
+
+	CHECK(got != NULL && strcmp(got, expect) == 0);
+	if (got != NULL && strcmp(got, expect) != 0)
+		fprintf(stderr, "  csv: got %s, expected %s\n", got, expect);
+	free(got);
+}
+
+static void
+write_big(struct comphist_out *out, const void *arg)
+{
+	const char *s = arg;
+
+	/* Fill most of the buffer, then format more than a buffer's worth. */
+	for (int i = 0; i < 1000; i++)
+		comphist_out_puts(out, "0123456789abcdef");
+	comphist_out_printf(out, "%s|%s", s, s);
+}
+
+static void
+test_big(void)
+{
+	size_t half = COMPHIST_OUT_BUFSIZE;
+	char *s = malloc(half + 1);
+	char *got;
+	size_t len = 0;
+
+	if (s == NULL) {
+		CHECK(s != NULL);
+		return;
+	}
+	memset(s, 'x', half);
+	s[half] = '\0';
+
+	got = capture(write_big, s, &len);
+	CHECK(got != NULL);
+	CHECK(len == 16000 + 2 * half + 1);
+	if (got != NULL && len == 16000 + 2 * half + 1) {
+		CHECK(memcmp(got, "0123456789abcdef", 16) == 0);
+		CHECK(got[16000] == 'x' && got[16000 + half] == '|');
+		CHECK(got[len - 1] == 'x');
+	}
+	free(got);
+	free(s);
+}
+
+static void
+test_write_error(void)
+{
+	int fds[2];
+	struct comphist_out *out;
+
+	/* Writes to the read end of a pipe fail with EBADF. */
+	if (pipe(fds) != 0) {
+		CHECK(0);
+		return;
+	}
+	out = comphist_out_open(fds[0]);
+	CHECK(out != NULL);
+	if (out != NULL) {
+		comphist_out_puts(out, "lost");
+		CHECK(comphist_out_close(out) == EBADF);
+	}
+	(void)close(fds[0]);
+	(void)close(fds[1]);
+}
+
+int
+main(void)
+{
+	check_json("tank/home@daily", "\"tank/home@daily\"");
+	check_json("", "\"\"");
+	check_json(NULL, "null");
+	check_json("a\"b\\c", "\"a\\\"b\\\\c\"");
+	check_json("\b\f\n\r\t", "\"\\b\\f\\n\\r\\t\"");
+	check_json("\x01x\x1f", "\"\\u0001x\\u001f\"");
+	check_json("caf\xc3\xa9 \x7f", "\"caf\xc3\xa9 \x7f\"");
+
+	check_csv("tank/home", "tank/home");
+	check_csv("", "");
+	check_csv("a,b", "\"a,b\"");
+	check_csv("say \"hi\"", "\"say \"\"hi\"\"\"");
+	check_csv("two\nlines", "\"two\nlines\"");
+	check_csv("cr\r", "\"cr\r\"");
+
+	test_big();
+	test_write_error();
+
+	TEST_EXIT("test-output");
+}
@@ -0,0 +1,326 @@
+/*
+ * Walks of a small synthetic pool, the one bench-pool scans, built with
+ * user accounting so every dataset has USERUSED and GROUPUSED objects.
+ * A walk must account exactly the blocks a plain traverse_dataset() visits,
+ * the accounting objects' included, and single-pass walks of the pool
+ * must get past them.  Sharded and -j walks must give the same stats as
+ * serial ones, bit for bit, and -p must report datasets in the same order.
+ *
+ * Needs libzpool and room for a sparse vdev file in /tmp, but no pool of
+ * the host.
+ */
+
+#include "bench_build.h"
+#include "stats.h"
+#include "walker.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/dmu.h>
+#include <sys/dmu_traverse.h>
+#include <sys/dsl_dataset.h>
+#include <sys/dsl_pool.h>
+#include <sys/spa.h>
+#include <sys/zfs_context.h>
+
+struct ref_counts {
+	uint64_t blocks;
+	uint64_t holes;
+	uint64_t redacted;
+	uint64_t userused;
+};
+
+static int
+ref_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
+    const zbookmark_phys_t *zb, const struct dnode_phys *dnp, void *arg)
+{
+	struct ref_counts *ref = arg;
+
+	(void)spa;
+	(void)zilog;
+	(void)dnp;
+
+	if (zb->zb_level == ZB_DNODE_LEVEL)
+		return (0);
+	if (BP_IS_HOLE(bp)) {
+		ref->holes++;
+	} else if (BP_IS_REDACTED(bp)) {
+		ref->redacted++;
+	} else {
+		ref->blocks++;
+		if (zb->zb_object == DMU_USERUSED_OBJECT)
+			ref->userused++;
+	}
+	return (0);
+}
+
+/*
+ * Clear what only describes how a walk ran, so stats of different runs
+ * compare equal with memcmp().
+ */
+static void
+clear_run(struct comphist_stats *stats)
+{
+	stats->pipeline_batches = 0;
+	stats->pipeline_depth_sum = 0;
+	stats->pipeline_depth_max = 0;
+	stats->pipeline_stall_ns = 0;
+	stats->pipeline_idle_ns = 0;
+	stats->scan_ns = 0;
+	stats->scan_cpu_ns = 0;
+	stats->scan_meta_blocks = 0;
+	stats->scan_meta_bytes = 0;
+	stats->scan_meta_reads = 0;
+	stats->scan_arc_hits = 0;
+	stats->scan_arc_misses = 0;
+	stats->scan_retries = 0;
+}
+
+/*
+ * Count a dataset's blocks with traverse_dataset() alone.  Runs in a
+ * libzpool instance of its own, before or after the walks' sessions.
+ */
+static int
+ref_count(const char *dsname, struct ref_counts *ref)
+{
+	dsl_pool_t *dp;
+	dsl_dataset_t *ds;
+	int err;
+
+	memset(ref, 0, sizeof(*ref));
+	kernel_init(SPA_MODE_READ);
+	err = dsl_pool_hold(dsname, FTAG, &dp);
+	if (err == 0) {
+		err = dsl_dataset_hold(dp, dsname, FTAG, &ds);
+		if (err == 0) {
+			err = traverse_dataset(ds, 0, TRAVERSE_PRE |
+			    TRAVERSE_NO_DECRYPT, ref_cb, ref);
+			dsl_dataset_rele(ds, FTAG);
+		}
+		dsl_pool_rele(dp, FTAG);
+	}
+	kernel_fini();
+	return (err);
+}
+
+/*
+ * A walk must not stop at the first accounting object: all of their blocks
+ * are accounted, in plain, checkpointed and single-pass walks alike.
+ */
+static void
+test_userused(const struct bench_config *cfg)
+{
+	char snap[ZFS_MAX_DATASET_NAME_LEN];
+	char ckpt[] = "/tmp/comphist-ckpt-XXXXXX";
+	struct comphist_options opts = {0};
+	struct comphist_stats *stats = comphist_stats_alloc();
+	struct ref_counts ref;
+	int fd;
+
+	CHECK(stats != NULL);
+	if (stats == NULL)
+		return;
+
+	snprintf(snap, sizeof(snap), "%s/%s@gen0", cfg->pool,
+	    cfg->alg_names[0]);
+	CHECK(ref_count(snap, &ref) == 0);
+	CHECK(ref.userused > 0);
+
+	CHECK(comphist_walk(snap, &opts, stats) == 0);
+	CHECK(stats->total_blocks == ref.blocks);
+	CHECK(stats->total_holes == ref.holes);
+	CHECK(stats->total_redacted == ref.redacted);
+
+	fd = mkstemp(ckpt);
+	CHECK(fd >= 0);
+	if (fd >= 0) {
+		(void)close(fd);
+		(void)unlink(ckpt);
+		comphist_stats_init(stats);
+		opts.checkpoint_path = ckpt;
+		CHECK(comphist_walk(snap, &opts, stats) == 0);
+		CHECK(stats->total_blocks == ref.blocks);
+		opts.checkpoint_path = NULL;
+		(void)unlink(ckpt);
+	}
+
+	/* traverse_pool() used to fail with ECANCELED at USERUSED. */
+	opts.single_pass = true;
+	opts.allow_live = true;
+	comphist_stats_init(stats);
+	CHECK(comphist_walk(cfg->pool, &opts, stats) == 0);
+	opts.best_effort = true;
+	comphist_stats_init(stats);
+	CHECK(comphist_walk(cfg->pool, &opts, stats) == 0);
+	CHECK(stats->traversal_errors == 0);
+
+	comphist_stats_free(stats);
+}
+
+/*
+ * --shards splits a traversal by object ranges; the last range ends at
+ * UINT64_MAX and also owns the accounting objects.
+ */
+static void
+test_shards(const struct bench_config *cfg)
+{
+	static const int shards[] = { 2, 3, 7 };
+	struct comphist_options opts = {0};
+	struct comphist_stats *serial = comphist_stats_alloc();
+	struct comphist_stats *sharded = comphist_stats_alloc();
+
+	CHECK(serial != NULL && sharded != NULL);
+	if (serial == NULL || sharded == NULL)
+		goto out;
+
+	for (int a = 0; a < cfg->nalgs; a++) {
+		char snap[ZFS_MAX_DATASET_NAME_LEN];
+
+		snprintf(snap, sizeof(snap), "%s/%s@gen%d", cfg->pool,
+		    cfg->alg_names[a], a % cfg->snapshots);
+		opts.shards = 0;
+		comphist_stats_init(serial);
+		CHECK(comphist_walk(snap, &opts, serial) == 0);
+		clear_run(serial);
+		CHECK(serial->total_blocks > 0);
+
+		for (size_t i = 0; i < sizeof(shards) / sizeof(shards[0]);
+		    i++) {
+			opts.shards = shards[i];
+			comphist_stats_init(sharded);
+			CHECK(comphist_walk(snap, &opts, sharded) == 0);
+			clear_run(sharded);
+			CHECK(memcmp(serial, sharded, sizeof(*serial)) == 0);
+		}
+	}
+
+out:
+	comphist_stats_free(serial);
+	comphist_stats_free(sharded);
+}
+
+#define MAX_DATASETS	64
+
+struct dataset_list {
+	size_t count;
+	char *names[MAX_DATASETS];
+	struct comphist_stats *stats[MAX_DATASETS];
+};
+
+static int
+collect_cb(const char *dsname, const struct comphist_stats *stats,
+    void *arg)
+{
+	struct dataset_list *list = arg;
+	size_t i = list->count;
+
+	if (i == MAX_DATASETS)
+		return (ENOSPC);
+	list->names[i] = strdup(dsname);
+	list->stats[i] = malloc(sizeof(*stats));
+	if (list->names[i] == NULL || list->stats[i] == NULL) {
+		free(list->names[i]);
+		free(list->stats[i]);
+		return (ENOMEM);
+	}
+	memcpy(list->stats[i], stats, sizeof(*stats));
+	clear_run(list->stats[i]);
+	list->count++;
+	return (0);
+}
+
+static void
+free_list(struct dataset_list *list)
+{
+	for (size_t i = 0; i < list->count; i++) {
+		free(list->names[i]);
+		free(list->stats[i]);
+	}
+	list->count = 0;
+}
+
+/*
+ * -j N walks datasets on N threads and merges their totals; -p reports
+ * each dataset in enumeration order whichever thread finishes first.
+ */
+static void
+test_jobs(const struct bench_config *cfg)
+{
+	static const int jobs[] = { 2, 4, 16 };
+	struct comphist_options opts = {
+		.allow_live = true,
+		.jobs = 1,
+	};
+	struct comphist_stats *serial = comphist_stats_alloc();
+	struct comphist_stats *parallel = comphist_stats_alloc();
+	struct dataset_list one = {0}, many = {0};
+
+	CHECK(serial != NULL && parallel != NULL);
+	if (serial == NULL || parallel == NULL)
+		goto out;
+
+	CHECK(comphist_walk(cfg->pool, &opts, serial) == 0);
+	clear_run(serial);
+	CHECK(comphist_walk_datasets(cfg->pool, &opts, collect_cb, &one) ==
+	    0);
+	/* The pool's root dataset and one per algorithm, at least. */
+	CHECK(one.count >= (size_t)cfg->nalgs);
+
+	for (size_t j = 0; j < sizeof(jobs) / sizeof(jobs[0]); j++) {
+		opts.jobs = jobs[j];
+		comphist_stats_init(parallel);
+		CHECK(comphist_walk(cfg->pool, &opts, parallel) == 0);
+		clear_run(parallel);
+		CHECK(memcmp(serial, parallel, sizeof(*serial)) == 0);
+
+		CHECK(comphist_walk_datasets(cfg->pool, &opts, collect_cb,
+		    &many) == 0);
+		CHECK(many.count == one.count);
+		for (size_t i = 0; i < one.count && i < many.count; i++) {
+			CHECK(strcmp(one.names[i], many.names[i]) == 0);
+			CHECK(memcmp(one.stats[i], many.stats[i],
+			    sizeof(*one.stats[i])) == 0);
+		}
+		free_list(&many);
+	}
+
+out:
+	free_list(&one);
+	comphist_stats_free(serial);
+	comphist_stats_free(parallel);
+}
+
+int
+main(void)
+{
+	struct bench_config cfg = {
+		.dir = "/tmp",
+		.vdev_size = 256ULL << 20,
+		.objects = 256,
+		.blocks = 2,
+		.snapshots = 2,
+		.compressible = 50,
+		.seed = 1,
+		.userused = true,
+	};
+	int err;
+
+	(void)bench_parse_algs(&cfg, "off,lz4,zstd-3");
+	(void)bench_parse_sizes(&cfg, "4K,128K");
+	bench_name(&cfg, "comphist_test");
+
+	err = bench_build(&cfg);
+	CHECK(err == 0);
+	if (err == 0) {
+		test_userused(&cfg);
+		test_shards(&cfg);
+		test_jobs(&cfg);
+	}
+	bench_destroy(&cfg);
+
+	TEST_EXIT("test-pool");
+}
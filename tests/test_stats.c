@@ -0,0 +1,295 @@
+/*
+ * Accounting tests: histogram bucketing, the public accessors, merging
+ * partial stats into the same result as accounting every block in one, the
+ * --vdevs rows, and the packed records of the cache and checkpoint files.
+ */
+
+#include "stats.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/dmu.h>
+
+/*
+ * Bucket 0 counts sizes of zero; bucket b > 0 counts [2^(b-1), 2^b) and
+ * the last bucket everything larger.
+ */
+static void
+test_buckets(void)
+{
+	static const struct {
+		uint64_t size;
+		int bucket;
+	} cases[] = {
+		{ 0, 0 },
+		{ 1, 1 },
+		{ 2, 2 },
+		{ 3, 2 },
+		{ 4, 3 },
+		{ 511, 9 },
+		{ 512, 10 },
+		{ 4096, 13 },
+		{ 131071, 17 },
+		{ 131072, 18 },
+		{ 1ULL << 24, 25 },
+		{ (1ULL << 30) - 1, 30 },
+		{ 1ULL << 30, 31 },
+		{ 1ULL << 40, COMPHIST_HIST_BUCKETS - 1 },
+		{ UINT64_MAX, COMPHIST_HIST_BUCKETS - 1 },
+	};
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		struct comphist_stats *stats = comphist_stats_alloc();
+		const uint64_t *hist;
+
+		CHECK(stats != NULL);
+		if (stats == NULL)
+			return;
+
+		comphist_stats_add_block(stats, ZIO_COMPRESS_LZ4,
+		    cases[i].size, cases[i].size, cases[i].size, false);
+		hist = stats->hist[ZIO_COMPRESS_LZ4][COMPHIST_HIST_LSIZE];
+		for (int b = 0; b < COMPHIST_HIST_BUCKETS; b++)
+			CHECK(hist[b] == (b == cases[i].bucket ? 1U : 0U));
+		comphist_stats_free(stats);
+	}
+}
+
+static void
+test_accessors(void)
+{
+	struct comphist_stats *stats = comphist_stats_alloc();
+	struct comphist_stats *copy = comphist_stats_alloc();
+	struct comphist_totals t;
+	struct comphist_counts c;
+
+	CHECK(stats != NULL && copy != NULL);
+	if (stats == NULL) {
+		comphist_stats_free(copy);
+		return;
+	}
+
+	comphist_stats_add_block(stats, ZIO_COMPRESS_OFF, 4096, 4096, 4096,
+	    false);
+	comphist_stats_add_block(stats, ZIO_COMPRESS_LZ4, 131072, 8192, 12288,
+	    false);
+	comphist_stats_add_block(stats, ZIO_COMPRESS_LZ4, 512, 100, 0, true);
+	comphist_stats_note_hole(stats);
+	comphist_stats_note_hole(stats);
+	comphist_stats_note_traversal_error(stats);
+
+	CHECK(comphist_stats_algorithms() == ZIO_COMPRESS_FUNCTIONS);
+	CHECK(strcmp(comphist_stats_algorithm(ZIO_COMPRESS_LZ4), "lz4") == 0);
+	CHECK(comphist_stats_algorithm(-1) == NULL);
+	CHECK(comphist_stats_algorithm(ZIO_COMPRESS_FUNCTIONS) == NULL);
+
+	CHECK(comphist_stats_get(stats, ZIO_COMPRESS_LZ4, &t) == 0);
+	CHECK(t.blocks == 2 && t.lsize == 131584 && t.psize == 8292 &&
+	    t.asize == 12288);
+	CHECK(t.embedded_blocks == 1 && t.embedded_lsize == 512);
+
+	CHECK(comphist_stats_get(stats, COMPHIST_ALL, &t) == 0);
+	CHECK(t.blocks == 3 && t.lsize == 135680 && t.psize == 12388 &&
+	    t.asize == 16384);
+
+	errno = 0;
+	CHECK(comphist_stats_get(stats, ZIO_COMPRESS_FUNCTIONS, &t) == -1 &&
+	    errno == EINVAL);
+
+	comphist_stats_counts(stats, &c);
+	CHECK(c.holes == 2 && c.redacted == 0 && c.traversal_errors == 1);
+
+	CHECK(comphist_stats_size() == sizeof(*stats));
+	if (copy != NULL) {
+		comphist_stats_copy(copy, stats);
+		CHECK(memcmp(copy, stats, sizeof(*stats)) == 0);
+	}
+
+	comphist_stats_free(copy);
+	comphist_stats_free(stats);
+}
+
+/*
+ * A pseudo-random block with up to three DVAs.
+ */
+static void
+random_block(uint64_t *rng, struct comphist_block *blk)
+{
+	static const uint8_t types[] = {
+		DMU_OT_PLAIN_FILE_CONTENTS, DMU_OT_DIRECTORY_CONTENTS,
+		DMU_OT_DNODE, DMU_OT_OBJSET, DMU_OT_SA, DMU_OT_ZVOL,
+	};
+	uint64_t r;
+
+	*rng = *rng * 6364136223846793005ULL + 1442695040888963407ULL;
+	r = *rng >> 11;
+
+	memset(blk, 0, sizeof(*blk));
+	if (r % 17 == 0) {
+		blk->flags = COMPHIST_BLK_HOLE;
+		return;
+	}
+	blk->comp = (uint8_t)(r % ZIO_COMPRESS_FUNCTIONS);
+	blk->type = types[(r >> 5) % sizeof(types)];
+	blk->level = (uint8_t)((r >> 8) % 6);
+	blk->lsize = 512ULL << ((r >> 11) % 9);
+	blk->psize = blk->lsize >> ((r >> 15) % 3);
+	blk->asize = blk->psize + 4096;
+	blk->birth = (r >> 17) % 100000;
+	blk->era = (uint8_t)(blk->birth >> 12);
+	blk->ndvas = (uint8_t)(1 + (r >> 34) % COMPHIST_DVAS);
+	for (int d = 0; d < blk->ndvas; d++) {
+		blk->dva_class[d] = (uint8_t)((r >> (40 + d)) % 2);
+		blk->dva_vdev[d] = (uint16_t)((r >> (44 + 4 * d)) % 5);
+		blk->dva_asize[d] = (uint32_t)(blk->asize >> 9);
+	}
+}
+
+static void
+test_merge(void)
+{
+	struct comphist_stats *all = comphist_stats_alloc();
+	struct comphist_stats *part[3];
+	struct comphist_stats *merged = comphist_stats_alloc();
+	uint64_t rng = 42;
+	bool ok = all != NULL && merged != NULL;
+
+	for (int p = 0; p < 3; p++) {
+		part[p] = comphist_stats_alloc();
+		ok = ok && part[p] != NULL;
+	}
+	CHECK(ok);
+	if (!ok)
+		goto out;
+
+	for (int i = 0; i < 30000; i++) {
+		struct comphist_block blk;
+
+		random_block(&rng, &blk);
+		comphist_stats_account(all, &blk);
+		comphist_stats_account(part[i % 3], &blk);
+	}
+	for (int p = 0; p < 3; p++)
+		comphist_stats_merge(merged, part[p]);
+
+	CHECK(memcmp(all, merged, sizeof(*all)) == 0);
+	CHECK(all->total_holes > 0);
+
+out:
+	for (int p = 0; p < 3; p++)
+		comphist_stats_free(part[p]);
+	comphist_stats_free(all);
+	comphist_stats_free(merged);
+}
+
+/*
+ * --vdevs rows: a vdev allocated from two classes is labeled mixed, and
+ * vdevs past the last row share it.
+ */
+static void
+test_vdevs(void)
+{
+	struct comphist_stats *stats = comphist_stats_alloc();
+	struct comphist_stats *other = comphist_stats_alloc();
+	struct comphist_block blk = {
+		.comp = ZIO_COMPRESS_LZ4,
+		.type = DMU_OT_PLAIN_FILE_CONTENTS,
+		.lsize = 131072,
+		.psize = 65536,
+		.asize = 65536,
+		.ndvas = 1,
+		.dva_asize = { 128 },
+	};
+
+	CHECK(stats != NULL && other != NULL);
+	if (stats == NULL || other == NULL)
+		goto out;
+
+	blk.dva_class[0] = COMPHIST_AC_NORMAL;
+	blk.dva_vdev[0] = 3;
+	comphist_stats_account(stats, &blk);
+	CHECK(stats->vdev_class[3] == COMPHIST_AC_NORMAL);
+	blk.dva_class[0] = COMPHIST_AC_SPECIAL;
+	comphist_stats_account(stats, &blk);
+	CHECK(stats->vdev_class[3] == COMPHIST_AC_MIXED);
+	CHECK(stats->vdev[3].dvas == 2);
+
+	blk.dva_vdev[0] = COMPHIST_VDEVS + 10;
+	comphist_stats_account(stats, &blk);
+	CHECK(stats->vdev[COMPHIST_VDEVS - 1].dvas == 1);
+	CHECK(stats->vdev_class[COMPHIST_VDEVS - 1] == COMPHIST_AC_SPECIAL);
+
+	/* Merging a row of another class also makes it mixed. */
+	blk.dva_class[0] = COMPHIST_AC_DEDUP;
+	blk.dva_vdev[0] = 4;
+	comphist_stats_account(other, &blk);
+	blk.dva_class[0] = COMPHIST_AC_NORMAL;
+	comphist_stats_account(stats, &blk);
+	comphist_stats_merge(stats, other);
+	CHECK(stats->vdev_class[4] == COMPHIST_AC_MIXED);
+	CHECK(strcmp(comphist_alloc_class_name(COMPHIST_AC_MIXED),
+	    "mixed") == 0);
+
+out:
+	comphist_stats_free(stats);
+	comphist_stats_free(other);
+}
+
+static void
+test_pack(void)
+{
+	struct comphist_stats *stats = comphist_stats_alloc();
+	struct comphist_stats *got = comphist_stats_alloc();
+	uint8_t *buf = malloc(COMPHIST_STATS_PACKED_MAX);
+	uint64_t rng = 7;
+	size_t len;
+
+	CHECK(stats != NULL && got != NULL && buf != NULL);
+	if (stats == NULL || got == NULL || buf == NULL)
+		goto out;
+
+	/* Empty stats pack to nothing. */
+	CHECK(comphist_stats_pack(stats, buf) == 0);
+	CHECK(comphist_stats_unpack(buf, 0, got) == 0);
+	CHECK(memcmp(stats, got, sizeof(*got)) == 0);
+
+	for (int i = 0; i < 1000; i++) {
+		struct comphist_block blk;
+
+		random_block(&rng, &blk);
+		comphist_stats_account(stats, &blk);
+	}
+	stats->sample.rate = 0.25;
+	stats->traversal_errors = UINT64_MAX;
+	len = comphist_stats_pack(stats, buf);
+	CHECK(len > 0 && len < sizeof(*stats) / 4);
+	CHECK(comphist_stats_unpack(buf, len, got) == 0);
+	CHECK(memcmp(stats, got, sizeof(*got)) == 0);
+
+	/* Truncated records and a word past the end are refused. */
+	CHECK(comphist_stats_unpack(buf, len - 1, got) == EINVAL);
+	buf[0] = 0xff;
+	buf[1] = 0xff;
+	buf[2] = 0x7f;
+	CHECK(comphist_stats_unpack(buf, len, got) == EINVAL);
+
+out:
+	free(buf);
+	comphist_stats_free(stats);
+	comphist_stats_free(got);
+}
+
+int
+main(void)
+{
+	test_buckets();
+	test_accessors();
+	test_merge();
+	test_vdevs();
+	test_pack();
+
+	TEST_EXIT("test-stats");
+}
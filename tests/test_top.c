@@ -0,0 +1,170 @@
+/*
+ * --top heap tests: the heap keeps the "limit" objects with the most
+ * legacy bytes, lists an object seen through several snapshots once as its
+ * largest copy, and merges per-traversal heaps into the same result.
+ */
+
+#include "top.h"
+#include "test.h"
+
+#include <stdlib.h>
+
+#define KEYS	64
+
+static uint64_t
+rng_next(uint64_t *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (*state >> 33);
+}
+
+static void
+test_basic(void)
+{
+	struct comphist_top *top = comphist_top_create(3);
+	struct comphist_top_entry e = { .legacy_blocks = 1 };
+	static const uint64_t sizes[] = { 50, 10, 40, 30, 20, 60 };
+
+	CHECK(top != NULL);
+	if (top == NULL)
+		return;
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		e.object = i;
+		e.legacy_asize = sizes[i];
+		comphist_top_offer(top, &e);
+	}
+
+	/* Objects without legacy blocks are never listed. */
+	e.object = 100;
+	e.legacy_blocks = 0;
+	e.legacy_asize = 1000;
+	comphist_top_offer(top, &e);
+
+	comphist_top_sort(top);
+	CHECK(top->count == 3);
+	CHECK(top->heap[0].legacy_asize == 60 && top->heap[0].object == 5);
+	CHECK(top->heap[1].legacy_asize == 50 && top->heap[1].object == 0);
+	CHECK(top->heap[2].legacy_asize == 40 && top->heap[2].object == 2);
+	comphist_top_destroy(top);
+}
+
+static void
+test_snapshots(void)
+{
+	struct comphist_top *top = comphist_top_create(4);
+	struct comphist_top_entry e = { .dir = 7, .object = 3,
+	    .legacy_blocks = 1 };
+
+	CHECK(top != NULL);
+	if (top == NULL)
+		return;
+
+	/* One file in three snapshots (objsets) of the same filesystem. */
+	e.objset = 101;
+	e.legacy_asize = 300;
+	comphist_top_offer(top, &e);
+	e.objset = 102;
+	e.legacy_asize = 500;
+	comphist_top_offer(top, &e);
+	e.objset = 103;
+	e.legacy_asize = 200;
+	comphist_top_offer(top, &e);
+
+	/* The same object number in another filesystem is another file. */
+	e.dir = 8;
+	e.objset = 201;
+	e.legacy_asize = 100;
+	comphist_top_offer(top, &e);
+
+	comphist_top_sort(top);
+	CHECK(top->count == 2);
+	CHECK(top->heap[0].dir == 7 && top->heap[0].objset == 102 &&
+	    top->heap[0].legacy_asize == 500);
+	CHECK(top->heap[1].dir == 8 && top->heap[1].legacy_asize == 100);
+	comphist_top_destroy(top);
+}
+
+/*
+ * Random offers against a brute-force model: the largest copy of each key,
+ * best first, cut to the limit.  Heaps are merged into fresh ones now and
+ * then, as traversal threads do.
+ */
+static void
+test_random(void)
+{
+	uint64_t rng = 1;
+
+	for (int round = 0; round < 2000; round++) {
+		size_t limit = 1 + rng_next(&rng) % 20;
+		int nkeys = 1 + (int)(rng_next(&rng) % KEYS);
+		int noffers = (int)(rng_next(&rng) % 300);
+		uint64_t best[KEYS] = {0};
+		uint64_t expect[KEYS];
+		struct comphist_top *top = comphist_top_create(limit);
+		size_t n = 0;
+		bool ok = top != NULL;
+
+		for (int i = 0; ok && i < noffers; i++) {
+			int k = (int)(rng_next(&rng) % nkeys);
+			struct comphist_top_entry e = {
+				.objset = (uint64_t)i,
+				.dir = (uint64_t)k % 7,
+				.object = (uint64_t)k,
+				.legacy_blocks = 1,
+				.legacy_asize = rng_next(&rng) * 64 + i,
+			};
+
+			if (e.legacy_asize > best[k])
+				best[k] = e.legacy_asize;
+			comphist_top_offer(top, &e);
+
+			if (rng_next(&rng) % 50 == 0) {
+				struct comphist_top *copy;
+
+				copy = comphist_top_create(limit);
+				ok = copy != NULL;
+				if (ok)
+					comphist_top_merge(copy, top);
+				comphist_top_destroy(top);
+				top = copy;
+			}
+		}
+		CHECK(ok);
+		if (!ok)
+			return;
+
+		for (int k = 0; k < nkeys; k++) {
+			if (best[k] != 0)
+				expect[n++] = best[k];
+		}
+		for (size_t a = 0; a < n; a++) {
+			for (size_t b = a + 1; b < n; b++) {
+				if (expect[b] > expect[a]) {
+					uint64_t t = expect[a];
+
+					expect[a] = expect[b];
+					expect[b] = t;
+				}
+			}
+		}
+		if (n > limit)
+			n = limit;
+
+		comphist_top_sort(top);
+		CHECK(top->count == n);
+		for (size_t i = 0; i < n && i < top->count; i++)
+			CHECK(top->heap[i].legacy_asize == expect[i]);
+		comphist_top_destroy(top);
+	}
+}
+
+int
+main(void)
+{
+	test_basic();
+	test_snapshots();
+	test_random();
+
+	TEST_EXIT("test-top");
+}
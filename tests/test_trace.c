@@ -0,0 +1,283 @@
+/*
+ * --record/--replay tests: a recorded trace replays to the same stats as
+ * accounting its blocks directly.  Random objects, births and sizes cover
+ * multi-byte varints and negative deltas; datasets recorded through
+ * several buffers and many chunks come back whole and in walk order.
+ */
+
+#include "trace.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/dmu.h>
+#include <sys/zfs_context.h>
+
+#define DATASETS	3
+#define ERA_SHIFT	30
+
+static const char *names[DATASETS] = {
+	"tank/a", "tank/b@snap", "tank/c",
+};
+
+static uint64_t
+rng_next(uint64_t *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (*state >> 11);
+}
+
+/*
+ * A random block as a traversal callback would record it, and in *expect
+ * the block replay should account: no DVAs, the era recomputed from the
+ * birth txg, and the objset root and ZIL levels folded into level 0.
+ */
+static void
+random_block(uint64_t *rng, uint64_t *object, int64_t *level,
+    struct comphist_block *blk, struct comphist_block *expect)
+{
+	static const uint8_t types[] = {
+		DMU_OT_PLAIN_FILE_CONTENTS, DMU_OT_DIRECTORY_CONTENTS,
+		DMU_OT_DNODE, DMU_OT_OBJSET, DMU_OT_SA, DMU_OT_ZVOL,
+	};
+	uint64_t r = rng_next(rng);
+
+	memset(blk, 0, sizeof(*blk));
+	memset(expect, 0, sizeof(*expect));
+	*object = rng_next(rng) >> (r % 48);
+	*level = (int64_t)(r % 9) - 2;
+
+	switch ((r >> 4) % 16) {
+	case 0:
+		blk->flags = expect->flags = COMPHIST_BLK_HOLE;
+		return;
+	case 1:
+		blk->flags = expect->flags = COMPHIST_BLK_REDACTED;
+		return;
+	case 2:
+		blk->flags = COMPHIST_BLK_EMBEDDED;
+		blk->lsize = 1 + (r >> 8) % 1024;
+		blk->psize = 1 + (r >> 18) % 112;
+		blk->asize = 0;
+		break;
+	default:
+		blk->lsize = (uint64_t)(1 + (r >> 8) % 4096) << 9;
+		blk->psize = (uint64_t)(1 + (r >> 20) % 256) << 9;
+		blk->asize = ((r >> 28) % 5 == 0) ? rng_next(rng) << 9 :
+		    blk->psize + 4096;
+		break;
+	}
+	blk->comp = (uint8_t)((r >> 32) % ZIO_COMPRESS_FUNCTIONS);
+	blk->type = types[(r >> 36) % sizeof(types)];
+	blk->level = *level < 0 ? 0 : (uint8_t)*level;
+	blk->birth = rng_next(rng) >> (r % 32);
+	blk->era = 7;
+	blk->ndvas = 1;
+	blk->dva_asize[0] = (uint32_t)(blk->asize >> 9);
+
+	*expect = *blk;
+	expect->era = (uint8_t)MIN(blk->birth >> ERA_SHIFT, COMPHIST_ERAS - 1);
+	expect->ndvas = 0;
+	expect->dva_asize[0] = 0;
+}
+
+struct replay_state {
+	struct comphist_stats **expect;
+	size_t next;
+	int stop_at;
+};
+
+static int
+replay_cb(const char *dsname, const struct comphist_stats *stats, void *arg)
+{
+	struct replay_state *st = arg;
+
+	CHECK(st->next < DATASETS);
+	if (st->next >= DATASETS)
+		return (EINVAL);
+	CHECK(strcmp(dsname, names[st->next]) == 0);
+	CHECK(memcmp(stats, st->expect[st->next], sizeof(*stats)) == 0);
+	if ((int)++st->next == st->stop_at)
+		return (ECANCELED);
+	return (0);
+}
+
+static void
+test_round_trip(const char *path)
+{
+	struct comphist_stats *expect[DATASETS] = {0};
+	struct comphist_stats *all = comphist_stats_alloc();
+	struct comphist_stats *total = comphist_stats_alloc();
+	struct comphist_trace *trace = NULL;
+	struct comphist_trace_buf *bufs[DATASETS + 1] = {0};
+	struct replay_state st = { .expect = expect };
+	uint64_t era_time[COMPHIST_ERAS + 1];
+	uint64_t rng = 7;
+	char target[64];
+	bool ok = all != NULL && total != NULL;
+
+	for (int i = 0; i <= COMPHIST_ERAS; i++)
+		era_time[i] = 1600000000 + (uint64_t)i * 86400;
+	for (int d = 0; d < DATASETS; d++) {
+		expect[d] = comphist_stats_alloc();
+		ok = ok && expect[d] != NULL;
+	}
+	CHECK(ok);
+	if (!ok)
+		goto out;
+
+	CHECK(comphist_trace_create(path, "tank", (char *const *)names,
+	    DATASETS, ERA_SHIFT, era_time, &trace) == 0);
+	if (trace == NULL)
+		goto out;
+
+	/*
+	 * Datasets are walked in reverse so chunk order differs from table
+	 * order, and the first dataset is recorded through two buffers, as
+	 * --shards does.  The largest one spans several chunks.
+	 */
+	for (int b = 0; b <= DATASETS; b++) {
+		int d = b == DATASETS ? 0 : DATASETS - 1 - b;
+
+		bufs[b] = comphist_trace_buf_create(trace, 1000 + (uint64_t)d);
+		CHECK(bufs[b] != NULL);
+		if (bufs[b] == NULL)
+			goto out;
+	}
+	for (int i = 0; i < 300000; i++) {
+		int b = (int)(rng_next(&rng) % 8);
+		int d;
+		struct comphist_block blk, exp;
+		uint64_t object;
+		int64_t level;
+
+		/* Most blocks go to the first dataset's two buffers. */
+		if (b > DATASETS)
+			b = b % 2 == 0 ? DATASETS - 1 : DATASETS;
+		d = b == DATASETS ? 0 : DATASETS - 1 - b;
+		random_block(&rng, &object, &level, &blk, &exp);
+		comphist_trace_add(bufs[b], object, level, &blk);
+		comphist_stats_account(expect[d], &exp);
+	}
+	for (int b = 0; b <= DATASETS; b++) {
+		comphist_trace_buf_destroy(bufs[b]);
+		bufs[b] = NULL;
+	}
+	for (int d = 0; d < DATASETS; d++) {
+		comphist_trace_dataset(trace, (size_t)d, 1000 + (uint64_t)d,
+		    (uint64_t)d);
+		expect[d]->traversal_errors = (uint64_t)d;
+		expect[d]->era_shift = ERA_SHIFT;
+		memcpy(expect[d]->era_time, era_time,
+		    sizeof(expect[d]->era_time));
+		comphist_stats_merge(all, expect[d]);
+	}
+	all->era_shift = ERA_SHIFT;
+	memcpy(all->era_time, era_time, sizeof(all->era_time));
+	CHECK(comphist_trace_close(trace, true) == 0);
+	trace = NULL;
+
+	CHECK(comphist_trace_target(path, target, sizeof(target)) == 0 &&
+	    strcmp(target, "tank") == 0);
+	CHECK(comphist_trace_target(path, target, 4) == ENAMETOOLONG);
+
+	/* Aggregate replay. */
+	CHECK(comphist_trace_replay(path, total, NULL, NULL) == 0);
+	CHECK(memcmp(total, all, sizeof(*all)) == 0);
+	CHECK(total->total_holes > 0 && total->total_redacted > 0 &&
+	    total->total_embedded_blocks > 0);
+
+	/* Per-dataset replay, in walk order. */
+	CHECK(comphist_trace_replay(path, total, replay_cb, &st) == 0);
+	CHECK(st.next == DATASETS);
+
+	/* A callback error stops the replay. */
+	st.next = 0;
+	st.stop_at = 2;
+	CHECK(comphist_trace_replay(path, total, replay_cb, &st) ==
+	    ECANCELED);
+	CHECK(st.next == 2);
+
+out:
+	for (int b = 0; b <= DATASETS; b++) {
+		if (bufs[b] != NULL)
+			comphist_trace_buf_destroy(bufs[b]);
+	}
+	if (trace != NULL)
+		(void)comphist_trace_close(trace, false);
+	for (int d = 0; d < DATASETS; d++)
+		comphist_stats_free(expect[d]);
+	comphist_stats_free(all);
+	comphist_stats_free(total);
+}
+
+/*
+ * Interrupted recordings are removed and never replayed; files that are
+ * not traces are refused.
+ */
+static void
+test_incomplete(const char *path)
+{
+	struct comphist_stats *stats = comphist_stats_alloc();
+	struct comphist_trace *trace = NULL;
+	struct comphist_trace_buf *buf;
+	struct comphist_block blk = {
+		.lsize = 4096, .psize = 4096, .asize = 4096,
+	};
+	uint64_t era_time[COMPHIST_ERAS + 1] = {0};
+	char target[64];
+	FILE *fp;
+
+	CHECK(stats != NULL);
+	if (stats == NULL)
+		return;
+
+	CHECK(comphist_trace_create(path, "tank", (char *const *)names, 1,
+	    ERA_SHIFT, era_time, &trace) == 0);
+	if (trace != NULL) {
+		buf = comphist_trace_buf_create(trace, 1);
+		if (buf != NULL) {
+			comphist_trace_add(buf, 1, 0, &blk);
+			comphist_trace_buf_destroy(buf);
+		}
+		CHECK(comphist_trace_close(trace, false) == 0);
+	}
+	CHECK(access(path, F_OK) != 0 && errno == ENOENT);
+	CHECK(comphist_trace_replay(path, stats, NULL, NULL) == ENOENT);
+
+	fp = fopen(path, "w");
+	CHECK(fp != NULL);
+	if (fp != NULL) {
+		for (int i = 0; i < 100; i++)
+			fputs("not a trace\n", fp);
+		(void)fclose(fp);
+		CHECK(comphist_trace_target(path, target, sizeof(target)) ==
+		    EINVAL);
+		CHECK(comphist_trace_replay(path, stats, NULL, NULL) ==
+		    EINVAL);
+		(void)unlink(path);
+	}
+
+	comphist_stats_free(stats);
+}
+
+int
+main(void)
+{
+	char path[] = "/tmp/comphist-test-XXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if (fd >= 0) {
+		(void)close(fd);
+		test_round_trip(path);
+		test_incomplete(path);
+		(void)unlink(path);
+	}
+
+	TEST_EXIT("test-trace");
+}